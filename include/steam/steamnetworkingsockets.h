@@ -12,6 +12,65 @@
 
 #include "isteamnetworkingsockets.h"
 
+/// Process-wide counters, useful for tuning and benchmarking.  These
+/// are not tied to any particular interface or connection.
+struct SteamNetworkingGlobalStats_t
+{
+	/// Number of system calls made to read datagrams from UDP sockets,
+	/// including calls that found no data waiting.
+	int64 m_nRecvSyscalls;
+
+	/// Number of datagrams read from UDP sockets
+	int64 m_nRecvPackets;
+
+	/// Number of system calls made to send datagrams on UDP sockets
+	int64 m_nSendSyscalls;
+
+	/// Number of datagrams sent on UDP sockets.  When UDP segmentation
+	/// offload is used, each segment counts as a datagram.
+	int64 m_nSendPackets;
+
+	/// Number of those datagrams that were stamped with a transmit time
+	/// for the kernel to pace.  (See k_ESteamNetworkingConfig_SendTxTimeHorizon)
+	int64 m_nSendPacketsTxTime;
+
+	/// Number of message objects and small payload buffers requested
+	/// from the message pool.  (See k_ESteamNetworkingConfig_MessagePoolSize)
+	int64 m_nMessagePoolAllocs;
+
+	/// Number of those requests that were satisfied from the pool,
+	/// without going to the heap
+	int64 m_nMessagePoolHits;
+
+	/// Number of pooled blocks currently in use.  (Not cleared on reset)
+	int64 m_nMessagePoolBlocksInUse;
+
+	/// Number of free blocks currently held by the pool, in per-thread
+	/// caches and the shared pool.  (Not cleared on reset)
+	int64 m_nMessagePoolBlocksFree;
+
+	/// Number of CA-signed certs presented by peers that we had already
+	/// verified recently, so we didn't need to check the signature again
+	int64 m_nCertCacheHits;
+
+	/// Number of CA-signed certs that we had to verify from scratch
+	int64 m_nCertCacheMisses;
+
+	/// Number of connection requests, with a valid challenge, that a listen
+	/// socket dropped because the source IP address was sending them too
+	/// fast.  (See k_ESteamNetworkingConfig_IP_ConnectRateLimit)
+	int64 m_nConnectRequestsRateLimited;
+
+	/// Number of connection requests dropped because too many handshakes
+	/// were already pending, in total or from the same IP address.  (See
+	/// k_ESteamNetworkingConfig_MaxPendingHandshakes and
+	/// k_ESteamNetworkingConfig_MaxPendingHandshakesPerIP)
+	int64 m_nConnectRequestsOverBudget;
+
+	/// Number of handshakes currently pending.  (Not cleared on reset)
+	int64 m_nPendingHandshakes;
+};
+
 extern "C" {
 
 // Initialize the library.  Optionally, you can set an initial identity for the default
@@ -42,6 +101,31 @@ STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_SetLockWaitWarningT
 STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_SetLockAcquiredCallback( void (*callback)( const char *tags, SteamNetworkingMicroseconds usecWaited ) );
 STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_SetLockHeldCallback( void (*callback)( const char *tags, SteamNetworkingMicroseconds usecWaited ) );
 
+/// Fetch process-wide counters.  If bReset is true, the counters
+/// are cleared after they are read.
+STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_GetGlobalStats( SteamNetworkingGlobalStats_t *pStats, bool bReset );
+
+/// Send the same message to several connections.  This is equivalent
+/// to calling ISteamNetworkingSockets::SendMessageToConnection for each
+/// connection, but it's more efficient: the payload is copied once and
+/// shared by all of the connections, and the service thread is only woken
+/// once to send all of the resulting packets.  Use this, for example, to
+/// send the same snapshot to all clients of a server.
+///
+/// pOutMessageNumberOrResult is an optional array of nConnections
+/// entries that will receive, for each connection, the message number
+/// that was assigned if sending was successful, or a negative EResult
+/// value if sending failed.  See SendMessageToConnection for
+/// possible failure codes.
+STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_SendMessageToConnections( int nConnections, const HSteamNetConnection *pConnections, const void *pData, uint32 cbData, int nSendFlags, int64 *pOutMessageNumberOrResult );
+
+/// Send the same message to every connection in a poll group.
+/// See SteamNetworkingSockets_SendMessageToConnections.
+///
+/// Returns the number of connections that the message was queued on,
+/// or -1 if the poll group handle is invalid.
+STEAMNETWORKINGSOCKETS_INTERFACE int SteamNetworkingSockets_SendMessageToPollGroup( HSteamNetPollGroup hPollGroup, const void *pData, uint32 cbData, int nSendFlags );
+
 /// Called from the service thread at initialization time.
 /// Use this to customize its priority / affinity, etc
 STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_SetServiceThreadInitCallback( void (*callback)() );
@@ -788,8 +788,14 @@ struct SteamNetConnectionRealTimeStatus_t
 	/// Nagle delay is ignored for the purposes of this calculation.
 	SteamNetworkingMicroseconds m_usecQueueTime;
 
+	/// When we notice that a packet is missing, how long we will wait for it
+	/// to arrive out of order before reporting it to the peer as dropped.
+	/// This is learned from the reordering that we have observed on this
+	/// connection.  See k_ESteamNetworkingConfig_NackDelayPercentile
+	SteamNetworkingMicroseconds m_usecNackDelay;
+
 	// Internal stuff, room to change API easily
-	uint32 reserved[16];
+	uint32 reserved[14];
 };
 
 /// Quick status of a particular lane
@@ -876,6 +882,13 @@ struct SteamNetworkingMessage_t
 	/// usually be something like:
 	///
 	/// free( pMsg->m_pData );
+	///
+	/// To send the same payload to many connections without copying it,
+	/// allocate one message per connection, point them all at the same
+	/// immutable buffer, and have this function decrement your own reference
+	/// count on that buffer.  Reliable data is encrypted directly out of
+	/// m_pData, so the buffer must not be modified until all messages that
+	/// reference it have been freed.
 	void (*m_pfnFreeData)( SteamNetworkingMessage_t *pMsg );
 
 	/// Function to used to decrement the internal reference count and, if
@@ -1207,11 +1220,13 @@ enum ESteamNetworkingConfigValue
 	k_ESteamNetworkingConfig_ConnectionUserData = 40,
 
 	/// [connection int32] Minimum/maximum send rate clamp, in bytes/sec.
-	/// At the time of this writing these two options should always be set to
-	/// the same value, to manually configure a specific send rate.  The default
-	/// value is 256K.  Eventually we hope to have the library estimate the bandwidth
-	/// of the channel and set the send rate to that estimated bandwidth, and these
-	/// values will only set limits on that send rate.
+	/// If these are different, the library estimates the bandwidth of the
+	/// channel from the delivery rate and round trip time measured from acks,
+	/// and sets the send rate to that estimated bandwidth.  Data in flight is
+	/// also capped to about twice the estimated bandwidth delay product.
+	/// These values are limits on that estimate.  If they are set to the same value, estimation
+	/// is disabled and the send rate is fixed.  The default value for both
+	/// is 256K.
 	k_ESteamNetworkingConfig_SendRateMin = 10,
 	k_ESteamNetworkingConfig_SendRateMax = 11,
 
@@ -1224,6 +1239,28 @@ enum ESteamNetworkingConfigValue
 	/// Default is 5000us (5ms).
 	k_ESteamNetworkingConfig_NagleTime = 12,
 
+	/// [connection int32] When we detect that packets are missing, we wait
+	/// a bit before reporting them to the peer as dropped, since they might
+	/// just be arriving out of order.  We track how long it actually takes
+	/// for late packets to arrive, and wait long enough for this percentage
+	/// of them.  Higher values avoid retransmitting packets that were only
+	/// reordered, at the cost of slower recovery from real loss.  0 disables
+	/// learning, and always uses a fixed 3ms delay, which is also what we use
+	/// until we have seen enough reordering.  Default is 90.
+	k_ESteamNetworkingConfig_NackDelayPercentile = 55,
+
+	/// [connection int32] Forward error correction for unreliable messages.
+	/// Bitmask of lanes (bit N = lane N, lanes 0-30) where it is enabled.  When an unreliable
+	/// message on one of these lanes is too large to fit in one packet, we send
+	/// an extra XOR parity segment after it, and the receiver can use it to
+	/// rebuild any one missing segment without waiting for a retransmit.  (Which
+	/// would never happen, since the message is unreliable.)  This costs about
+	/// one extra packet per fragmented message.  Messages that fit in a single
+	/// packet are not affected.  Parity is not sent to peers using an older
+	/// protocol version that does not understand it.  Default is 0 (disabled
+	/// on all lanes).
+	k_ESteamNetworkingConfig_UnreliableFECLanes = 56,
+
 	/// [connection int32] Don't automatically fail IP connections that don't have
 	/// strong auth.  On clients, this means we will attempt the connection even if
 	/// we don't know our identity or can't get a cert.  On the server, it means that
@@ -1234,6 +1271,30 @@ enum ESteamNetworkingConfigValue
 	/// production.
 	k_ESteamNetworkingConfig_IP_AllowWithoutAuth = 23,
 
+	/// [connection int32] Max rate, in connection requests per second, that a
+	/// listen socket created with CreateListenSocketIP will process from
+	/// any single IP address.  (Ports are ignored.)  Only requests that echo a
+	/// valid challenge are counted, so a spoofed source address can't use up
+	/// somebody else's allowance.  Requests over the limit are dropped before
+	/// any crypto is done or any connection is created.  0 means no limit,
+	/// which is the default.  Set this on the listen socket.
+	k_ESteamNetworkingConfig_IP_ConnectRateLimit = 63,
+
+	/// [connection int32] Number of connection requests that a single IP
+	/// address may send in a burst, on top of
+	/// k_ESteamNetworkingConfig_IP_ConnectRateLimit.  Default is 8.
+	k_ESteamNetworkingConfig_IP_ConnectRateLimitBurst = 64,
+
+	/// [connection int32] If nonzero, a listen socket created with
+	/// CreateListenSocketIP doesn't create a connection for a request until
+	/// the signature on the client's session info has been checked on a
+	/// crypto worker thread.  (See k_ESteamNetworkingConfig_CryptoWorkerThreads.)
+	/// Requests with bad crypto then cost no memory beyond the request itself,
+	/// and retries of a request that is being checked are ignored.  The
+	/// app cannot tell the difference.  Default is 0.  Set this on the
+	/// listen socket.
+	k_ESteamNetworkingConfig_IP_DeferConnectionAlloc = 65,
+
 	/// [connection int32] Do not send UDP packets with a payload of
 	/// larger than N bytes.  If you set this, k_ESteamNetworkingConfig_MTU_DataSize
 	/// is automatically adjusted
@@ -1569,6 +1630,147 @@ enum ESteamNetworkingConfigValue
 	/// in production.
 	k_ESteamNetworkingConfig_SDRClient_FakeClusterPing = 36,
 
+//
+// Low level tuning.  These are global, because they apply to raw UDP
+// sockets, which may be shared by many connections, or to other
+// process-wide resources.
+//
+
+	/// [global int32] Max number of datagrams to read from a UDP socket
+	/// with a single system call, on platforms that support batched
+	/// receive (Linux recvmmsg).  1 disables batching, and we will read
+	/// one datagram per call.
+	k_ESteamNetworkingConfig_RecvBatchSize = 51,
+
+	/// [global int32] Controls how datagrams that are sent in a burst
+	/// (e.g. several packets for one connection in one think) are
+	/// handed to the operating system.  Only Linux currently supports
+	/// batching; on other platforms all values behave like 0.
+	/// 0: One system call per datagram
+	/// 1: Queue the burst and flush it with sendmmsg.
+	/// 2: (Default) Like 1, but also use UDP generic segmentation offload
+	///    (UDP_SEGMENT) to send runs of equal-sized datagrams to the same
+	///    peer with a single call.  If the kernel rejects this, we fall
+	///    back to 1 for that socket.
+	k_ESteamNetworkingConfig_SendBatchMode = 52,
+
+	/// [global int32] Message objects and small payload buffers are
+	/// recycled through a pool.  Each thread caches a few free blocks of
+	/// each size, and this sets the max number of additional free blocks
+	/// of each size that are kept in a shared pool, rather than returned
+	/// to the heap.  0 disables pooling.  See SteamNetworkingGlobalStats_t
+	/// for the counters you can use to tune this.
+	k_ESteamNetworkingConfig_MessagePoolSize = 53,
+
+	/// [global int32] Number of threads that wait on and read from raw
+	/// UDP sockets.  The default, 1, means all sockets are read by the
+	/// single background service thread.  Larger values start additional
+	/// receive threads, and each new socket is assigned to one of them.
+	/// These threads only move the recv system calls off the service
+	/// thread.  All packet processing, including decryption, thinkers,
+	/// and the crypto handshake, still happens one packet at a time
+	/// while holding the global lock, so this does not spread that work
+	/// across CPU cores.
+	///
+	/// When this is greater than 1, all of the threads read from each
+	/// listen socket, so that its incoming traffic is spread across them.
+	/// (Each datagram is read by one thread.  Two packets from the same
+	/// peer may be read by different threads, and so be processed out of
+	/// order.)  The port is not shared with any other socket.
+	/// This is only read when the library is initialized, and is ignored
+	/// in manual poll mode and on platforms other than Linux.
+	k_ESteamNetworkingConfig_RecvThreads = 54,
+
+	/// [global int32] Let the kernel pace outgoing packets.  If nonzero,
+	/// UDP sockets are opened with SO_TXTIME, and when a connection is
+	/// limited by its send rate, it will hand packets to the OS up to
+	/// this many microseconds ahead of when the token bucket would allow
+	/// them to go out, each stamped with its transmit time.  The qdisc
+	/// holds them until then, so the service thread wakes up once per
+	/// batch instead of once per packet, and packets go out evenly
+	/// spaced rather than in bursts.  0 (the default) disables this.
+	/// This only has an effect on Linux, and only if the interface uses
+	/// the fq (or etf) queueing discipline; other qdiscs ignore the
+	/// transmit time and send the packets right away.  Sockets check
+	/// this value when they are opened.  Keep it small (a few ms),
+	/// since packets held by the kernel cannot be pulled back if the
+	/// send rate drops.
+	k_ESteamNetworkingConfig_SendTxTimeHorizon = 57,
+
+	/// [global int32] If 1 (the default), the service thread sleeps
+	/// until exactly the next time it has work scheduled (e.g. a Nagle
+	/// timer, ack, or pacing deadline), on platforms that support
+	/// waiting with a microsecond resolution timeout (currently Linux
+	/// 5.11 and later, using epoll_pwait2).  If 0, or if the platform
+	/// does not support it, waits are rounded to the nearest
+	/// millisecond, with a minimum of 1ms, which can add up to about
+	/// 1ms of latency to each of those deadlines.
+	k_ESteamNetworkingConfig_PreciseServiceWait = 58,
+
+	/// [global int32] Spin budget for the service threads, in microseconds.
+	/// Before going to sleep to wait for packets, a service thread will
+	/// spin for up to this long, checking its sockets without blocking,
+	/// so that it can respond to a packet without waiting for the OS to
+	/// wake it up.  Each time it finds work, the budget starts over, so
+	/// under steady traffic the thread never sleeps.  This burns a CPU
+	/// core, so it only makes sense when the service thread has a core
+	/// to itself.  (See k_ESteamNetworkingConfig_ServiceThreadCPU.)
+	/// 0 (the default) disables spinning.  Only used on platforms that
+	/// use epoll, and not in manual poll mode.
+	k_ESteamNetworkingConfig_ServiceThreadSpinTime = 59,
+
+	/// [global int32] If nonzero, UDP sockets are opened with SO_BUSY_POLL
+	/// set to this many microseconds, so that the kernel will busy poll
+	/// the device receive queue when we read from the socket.  (Linux
+	/// only.  Raising it above net.core.busy_read requires CAP_NET_ADMIN.)
+	/// Sockets check this value when they are opened.
+	k_ESteamNetworkingConfig_SocketBusyPoll = 60,
+
+	/// [global int32] If >= 0, pin the service thread to this CPU.  Extra
+	/// receive threads (k_ESteamNetworkingConfig_RecvThreads) are
+	/// pinned to the CPUs that follow it.  -1 (the default) leaves
+	/// scheduling to the OS.  This is read when each thread starts, and
+	/// is supported on Linux and Windows.
+	k_ESteamNetworkingConfig_ServiceThreadCPU = 61,
+
+	/// [global int32] Number of worker threads used to do the expensive
+	/// part of the crypto handshake when accepting a connection: checking
+	/// the signature on the client's session info, generating our key
+	/// exchange key, and doing the key exchange.  While that happens, the
+	/// connection is not visible to the app, and the service thread is
+	/// free to keep servicing other connections, so a burst of incoming
+	/// connections doesn't stall traffic on the ones that are already
+	/// established.  Handshakes that arrive together are handed off
+	/// together, so their signatures can be checked as a batch, which
+	/// is much cheaper.  0 does all of this inline on the service thread,
+	/// one connection at a time.  The threads are started the first time
+	/// they are needed, so this must be set before that to have any
+	/// effect.  Currently only used for connections accepted on a listen
+	/// socket created with CreateListenSocketIP.  Default is 2.
+	k_ESteamNetworkingConfig_CryptoWorkerThreads = 62,
+
+	/// [global int32] Max number of connection requests received on listen
+	/// sockets created with CreateListenSocketIP that can be in the middle of
+	/// the handshake at once.  A request counts against this budget from the
+	/// time we accept it, while its crypto is being checked and while we wait
+	/// for the app to accept the connection, until the connection is accepted
+	/// or closed.  Requests that arrive when the budget is used up are dropped
+	/// before we spend any CPU or memory on them.  (The client will retry.)
+	/// Unless you also set k_ESteamNetworkingConfig_IP_ConnectRateLimit or
+	/// k_ESteamNetworkingConfig_MaxPendingHandshakesPerIP, a single host
+	/// can use up the whole budget.  0 means no limit.  Default is 1024.
+	k_ESteamNetworkingConfig_MaxPendingHandshakes = 66,
+
+	/// [global int32] Max number of pending handshakes (as counted by
+	/// k_ESteamNetworkingConfig_MaxPendingHandshakes) from any single IP
+	/// address.  (Ports are ignored.)  This keeps one host from using up the
+	/// whole budget, even if k_ESteamNetworkingConfig_IP_ConnectRateLimit
+	/// is not set.  Requests over the limit are dropped the same way.  Be
+	/// careful with this if lots of your players might connect at the same
+	/// time from behind the same NAT or carrier-grade NAT.  0 means no
+	/// limit, which is the default.
+	k_ESteamNetworkingConfig_MaxPendingHandshakesPerIP = 67,
+
 //
 // Log levels for debugging information of various subsystems.
 // Higher numeric values will cause more stuff to be printed.
@@ -1,6 +1,7 @@
 //========= Copyright Valve LLC, All rights reserved. ========================
 
 #include "crypto.h"
+#include <vector>
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -98,6 +99,41 @@ uint64_t CCrypto::SipHash( const void *data, size_t inlen, const CCrypto::SipHas
   return b;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Default implementation of gathered encryption.  Copy the pieces
+//			into a temporary buffer and encrypt that.
+//-----------------------------------------------------------------------------
+bool ISymmetricEncryptContext::EncryptGather(
+	const SymmetricCryptGatherPiece_t *pPieces, int nPieces,
+	const void *pIV,
+	void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
+) {
+
+	// A single piece doesn't need to be gathered
+	if ( nPieces == 1 )
+		return Encrypt( pPieces[0].m_pData, pPieces[0].m_cbData, pIV, pEncryptedDataAndTag, pcbEncryptedDataAndTag, pAdditionalAuthenticationData, cbAuthenticationData );
+
+	size_t cbTotal = 0;
+	for ( int i = 0 ; i < nPieces ; ++i )
+		cbTotal += pPieces[i].m_cbData;
+
+	// Gather into a temporary buffer.  This path is only used by backends
+	// that cannot encrypt incrementally, so don't bother trying to avoid
+	// the allocation.
+	std::vector<uint8> vecGather( cbTotal );
+	size_t ofs = 0;
+	for ( int i = 0 ; i < nPieces ; ++i )
+	{
+		if ( pPieces[i].m_cbData == 0 )
+			continue;
+		memcpy( &vecGather[ofs], pPieces[i].m_pData, pPieces[i].m_cbData );
+		ofs += pPieces[i].m_cbData;
+	}
+
+	return Encrypt( vecGather.data(), cbTotal, pIV, pEncryptedDataAndTag, pcbEncryptedDataAndTag, pAdditionalAuthenticationData, cbAuthenticationData );
+}
+
 #ifdef DBGFLAG_VALIDATE
 //-----------------------------------------------------------------------------
 // Purpose: validates memory structures
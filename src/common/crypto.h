@@ -32,6 +32,14 @@ protected:
 	uint32 m_cbIV, m_cbTag;
 };
 
+/// A piece of plaintext that is scattered in memory.
+/// See ISymmetricEncryptContext::EncryptGather
+struct SymmetricCryptGatherPiece_t
+{
+	const void *m_pData;
+	size_t m_cbData;
+};
+
 /// Abstract interface for symmetric encryption.
 struct ISymmetricEncryptContext
 {
@@ -44,6 +52,18 @@ struct ISymmetricEncryptContext
 		void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
 		const void *pAdditionalAuthenticationData, size_t cbAuthenticationData // Optional additional authentication data.  Not encrypted, but will be included in the tag, so it can be authenticated.
 	) = 0;
+
+	// Encrypt plaintext that is scattered across several pieces, exactly as if
+	// the pieces were concatenated into one buffer.  This lets the caller encrypt
+	// directly from where the data lives, without gathering it into a temporary
+	// buffer first.  The default implementation does gather it into a temporary
+	// buffer and call Encrypt.
+	virtual bool EncryptGather(
+		const SymmetricCryptGatherPiece_t *pPieces, int nPieces,
+		const void *pIV,
+		void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+		const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
+	);
 };
 
 /// Abstract interface for symmetric decryption
@@ -58,6 +78,7 @@ struct ISymmetricDecryptContext
 		void *pPlaintextData, uint32 *pcbPlaintextData,
 		const void *pAdditionalAuthenticationData, size_t cbAuthenticationData // Optional additional authentication data.  Not encrypted, but will be included in the tag, so it can be authenticated.
 	) = 0;
+
 };
 
 
@@ -88,6 +109,12 @@ public:
 		void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
 		const void *pAdditionalAuthenticationData, size_t cbAuthenticationData // Optional additional authentication data.  Not encrypted, but will be included in the tag, so it can be authenticated.
 	) override;
+	virtual bool EncryptGather(
+		const SymmetricCryptGatherPiece_t *pPieces, int nPieces,
+		const void *pIV,
+		void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+		const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
+	) override;
 };
 
 /// Decryption context for AES-GCM
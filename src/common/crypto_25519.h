@@ -146,6 +146,51 @@ public:
 	bool VerifySignature( const void *pData, size_t cbData, const CryptoSignature_t &signature ) const;
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: Accumulates ed25519 signatures so that they can be checked
+//			together, which is much cheaper per signature than checking
+//			them one at a time.  If the batch check fails, the signatures
+//			are checked individually to find out which ones are bad.
+//			The keys and signatures are copied, but the signed data is
+//			not, and must remain valid until Verify() is called.
+//-----------------------------------------------------------------------------
+class CECSigningBatchVerifier
+{
+public:
+	enum { k_nMaxBatch = 64 };
+
+	CECSigningBatchVerifier() : m_nCount( 0 ) {}
+
+	inline int Count() const { return m_nCount; }
+	inline bool IsFull() const { return m_nCount >= k_nMaxBatch; }
+	inline void Clear() { m_nCount = 0; }
+
+	// Add a signature to the batch.  Returns the index of the signature,
+	// used to locate its result, or -1 if the batch is full or the key is
+	// not valid.
+	int Add( const CECSigningPublicKey &publicKey, const void *pData, size_t cbData, const CryptoSignature_t &signature )
+	{
+		if ( IsFull() || publicKey.GetRawData( m_publicKey[ m_nCount ] ) != k_cb25519KeySize )
+			return -1;
+		m_pData[ m_nCount ] = pData;
+		m_cbData[ m_nCount ] = cbData;
+		memcpy( m_signature[ m_nCount ], signature, sizeof(CryptoSignature_t) );
+		return m_nCount++;
+	}
+
+	// Check all of the signatures in the batch.  Returns true if they
+	// are all valid.  If pbValid is not NULL, it receives the result
+	// for each signature.  The batch is not cleared.
+	bool Verify( bool *pbValid ) const;
+
+private:
+	int m_nCount;
+	const void *m_pData[ k_nMaxBatch ];
+	size_t m_cbData[ k_nMaxBatch ];
+	uint8 m_publicKey[ k_nMaxBatch ][ k_cb25519KeySize ];
+	CryptoSignature_t m_signature[ k_nMaxBatch ];
+};
+
 #ifdef VALVE_CRYPTO_ENABLE_25519
 
 namespace CCrypto
@@ -26,6 +26,7 @@ void curve25519_donna_basepoint_sse2( curve25519_key mypublic, const curve25519_
 void curved25519_scalarmult_basepoint_sse2( curved25519_key pk, const curved25519_key e );
 void ed25519_publickey_sse2( const ed25519_secret_key sk, ed25519_public_key pk );
 int ed25519_sign_open_sse2( const unsigned char *m, size_t mlen, const ed25519_public_key pk, const ed25519_signature RS );
+int ed25519_sign_open_batch_sse2( const unsigned char **m, size_t *mlen, const unsigned char **pk, const unsigned char **RS, size_t num, int *valid );
 void ed25519_sign_sse2( const unsigned char *m, size_t mlen, const ed25519_secret_key sk, const ed25519_public_key pk, ed25519_signature RS );
 
 #ifdef OSX // We can assume SSE2 for all Intel macs running 32-bit code
@@ -125,6 +126,12 @@ static bool CheckSSE2Technology()
 #ifndef CHOOSE_25519_IMPL
 #define CHOOSE_25519_IMPL( func ) func
 #endif
+
+// Used by ed25519_sign_open_batch to pick the random scalars
+void ed25519_randombytes_unsafe( void *p, size_t len )
+{
+	CCrypto::GenerateRandomBlock( p, (int)len );
+}
 }
 
 //-----------------------------------------------------------------------------
@@ -181,6 +188,31 @@ bool CECSigningPublicKey::VerifySignature( const void *pData, size_t cbData, con
 	return ret;
 }
 
+bool CECSigningBatchVerifier::Verify( bool *pbValid ) const
+{
+	const unsigned char *pm[ k_nMaxBatch ];
+	size_t mlen[ k_nMaxBatch ];
+	const unsigned char *pk[ k_nMaxBatch ];
+	const unsigned char *RS[ k_nMaxBatch ];
+	int valid[ k_nMaxBatch ];
+	for ( int i = 0 ; i < m_nCount ; ++i )
+	{
+		pm[i] = (const unsigned char *)m_pData[i];
+		mlen[i] = m_cbData[i];
+		pk[i] = m_publicKey[i];
+		RS[i] = m_signature[i];
+	}
+
+	// This falls back to checking them one at a time if the batch fails
+	bool bAllValid = CHOOSE_25519_IMPL( ed25519_sign_open_batch )( pm, mlen, pk, RS, m_nCount, valid ) == 0;
+	if ( pbValid )
+	{
+		for ( int i = 0 ; i < m_nCount ; ++i )
+			pbValid[i] = valid[i] != 0;
+	}
+	return bAllValid;
+}
+
 bool CEC25519KeyBase::SetRawData( const void *pData, size_t cbData )
 {
 	if ( cbData != 32 )
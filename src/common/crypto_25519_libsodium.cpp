@@ -108,6 +108,20 @@ bool CECSigningPublicKey::VerifySignature( const void *pData, size_t cbData, con
 	return crypto_sign_ed25519_verify_detached( signature, static_cast<const unsigned char*>( pData ), cbData, CCryptoKeyBase_RawBuffer::GetRawDataPtr() ) == 0;
 }
 
+bool CECSigningBatchVerifier::Verify( bool *pbValid ) const
+{
+	// libsodium doesn't have batch verification, just check them one at a time
+	bool bAllValid = true;
+	for ( int i = 0 ; i < m_nCount ; ++i )
+	{
+		bool bValid = crypto_sign_ed25519_verify_detached( m_signature[i], static_cast<const unsigned char*>( m_pData[i] ), m_cbData[i], m_publicKey[i] ) == 0;
+		if ( pbValid )
+			pbValid[i] = bValid;
+		bAllValid = bAllValid && bValid;
+	}
+	return bAllValid;
+}
+
 bool CEC25519PrivateKeyBase::CachePublicKey()
 {
 	// Need to convert the private key into a public key here
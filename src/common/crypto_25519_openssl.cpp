@@ -7,6 +7,17 @@
 
 #include <openssl/evp.h>
 
+// OpenSSL can't check a batch of ed25519 signatures at once, so we use donna for that
+extern "C" {
+#include "../external/ed25519-donna/ed25519.h"
+
+// Used by ed25519_sign_open_batch to pick the random scalars
+void ed25519_randombytes_unsafe( void *p, size_t len )
+{
+	CCrypto::GenerateRandomBlock( p, (int)len );
+}
+}
+
 #if OPENSSL_VERSION_NUMBER < 0x10101000
 // https://www.openssl.org/docs/man1.1.1/man3/EVP_PKEY_get_raw_private_key.html
 #error "Raw access to 25519 keys requires OpenSSL 1.1.1"
@@ -189,6 +200,31 @@ bool CECSigningPublicKey::VerifySignature( const void *pData, size_t cbData, con
 	return r == 1;
 }
 
+bool CECSigningBatchVerifier::Verify( bool *pbValid ) const
+{
+	const unsigned char *pm[ k_nMaxBatch ];
+	size_t mlen[ k_nMaxBatch ];
+	const unsigned char *pk[ k_nMaxBatch ];
+	const unsigned char *RS[ k_nMaxBatch ];
+	int valid[ k_nMaxBatch ];
+	for ( int i = 0 ; i < m_nCount ; ++i )
+	{
+		pm[i] = (const unsigned char *)m_pData[i];
+		mlen[i] = m_cbData[i];
+		pk[i] = m_publicKey[i];
+		RS[i] = m_signature[i];
+	}
+
+	// This falls back to checking them one at a time if the batch fails
+	bool bAllValid = ed25519_sign_open_batch( pm, mlen, pk, RS, m_nCount, valid ) == 0;
+	if ( pbValid )
+	{
+		for ( int i = 0 ; i < m_nCount ; ++i )
+			pbValid[i] = valid[i] != 0;
+	}
+	return bAllValid;
+}
+
 bool CEC25519PrivateKeyBase::CachePublicKey()
 {
 	EVP_PKEY *pkey = (EVP_PKEY*)m_evp_pkey;
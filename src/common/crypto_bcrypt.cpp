@@ -218,6 +218,16 @@ bool AES_GCM_DecryptContext::Decrypt(
 	return NT_SUCCESS(status);
 }
 
+bool AES_GCM_EncryptContext::EncryptGather(
+	const SymmetricCryptGatherPiece_t *pPieces, int nPieces,
+	const void *pIV,
+	void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
+) {
+	// Just gather it.  (BCrypt can chain calls, but it requires block-sized pieces)
+	return ISymmetricEncryptContext::EncryptGather( pPieces, nPieces, pIV, pEncryptedDataAndTag, pcbEncryptedDataAndTag, pAdditionalAuthenticationData, cbAuthenticationData );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Generate a SHA256 hash
 // Input:	pchInput -			Plaintext string of item to hash (null terminated)
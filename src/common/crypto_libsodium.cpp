@@ -133,6 +133,16 @@ bool AES_GCM_DecryptContext::Decrypt(
 	return nDecryptResult == 0;
 }
 
+bool AES_GCM_EncryptContext::EncryptGather(
+	const SymmetricCryptGatherPiece_t *pPieces, int nPieces,
+	const void *pIV,
+	void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
+) {
+	// libsodium has no incremental AES-GCM interface, so just gather it
+	return ISymmetricEncryptContext::EncryptGather( pPieces, nPieces, pIV, pEncryptedDataAndTag, pcbEncryptedDataAndTag, pAdditionalAuthenticationData, cbAuthenticationData );
+}
+
 void CCrypto::Init()
 {
 	// sodium_init is safe to call multiple times from multiple threads
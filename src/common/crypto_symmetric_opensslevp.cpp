@@ -96,23 +96,22 @@ bool AES_GCM_CipherContext::InitCipher( const void *pKey, size_t cbKey, size_t c
 	return true;
 }
 
-bool AES_GCM_EncryptContext::Encrypt(
-	const void *pPlaintextData, size_t cbPlaintextData,
+// Encrypt one buffer with a context that has already been set up with the key.
+// Only the IV changes from buffer to buffer.
+static bool AESGCMEncryptGather(
+	EVP_CIPHER_CTX *ctx, uint32 cbTag,
+	const SymmetricCryptGatherPiece_t *pPieces, int nPieces,
 	const void *pIV,
 	void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
-	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData // Optional additional authentication data.  Not encrypted, but will be included in the tag, so it can be authenticated.
+	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
 ) {
-	EVP_CIPHER_CTX *ctx = (EVP_CIPHER_CTX*)m_ctx;
-	if ( !ctx )
-	{
-		AssertMsg( false, "Not initialized!" );
-		*pcbEncryptedDataAndTag = 0;
-		return false;
-	}
 
 	// Calculate size of encrypted data.  Note that GCM does not use padding.
+	size_t cbPlaintextData = 0;
+	for ( int i = 0 ; i < nPieces ; ++i )
+		cbPlaintextData += pPieces[i].m_cbData;
 	uint32 cbEncryptedWithoutTag = (uint32)cbPlaintextData;
-	uint32 cbEncryptedTotal = cbEncryptedWithoutTag + m_cbTag;
+	uint32 cbEncryptedTotal = cbEncryptedWithoutTag + cbTag;
 
 	// Make sure their buffer is big enough
 	if ( cbEncryptedTotal > *pcbEncryptedDataAndTag )
@@ -141,10 +140,16 @@ bool AES_GCM_EncryptContext::Encrypt(
 		Assert( cbAuthenticationData == 0 );
 	}
 
-	// Now the actual plaintext to be encrypted
+	// Now the actual plaintext to be encrypted.  GCM is a stream
+	// mode, so we can feed it the pieces one by one
 	uint8 *pOut = (uint8 *)pEncryptedDataAndTag;
-	VerifyFatal( EVP_EncryptUpdate( ctx, pOut, &nBytesWritten, (const uint8*)pPlaintextData, (int)cbPlaintextData ) == 1 );
-	pOut += nBytesWritten;
+	for ( int i = 0 ; i < nPieces ; ++i )
+	{
+		if ( pPieces[i].m_cbData == 0 )
+			continue;
+		VerifyFatal( EVP_EncryptUpdate( ctx, pOut, &nBytesWritten, (const uint8*)pPieces[i].m_pData, (int)pPieces[i].m_cbData ) == 1 );
+		pOut += nBytesWritten;
+	}
 
 	// Finish up
 	VerifyFatal( EVP_EncryptFinal_ex( ctx, pOut, &nBytesWritten ) == 1 );
@@ -154,7 +159,7 @@ bool AES_GCM_EncryptContext::Encrypt(
 	VerifyFatal( (uint8 *)pEncryptedDataAndTag + cbEncryptedWithoutTag == pOut );
 
 	// Append the tag
-	if ( EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_GCM_GET_TAG, (int)m_cbTag, pOut ) != 1 )
+	if ( EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_GCM_GET_TAG, (int)cbTag, pOut ) != 1 )
 	{
 		AssertMsg( false, "Bad tag size" );
 		return false;
@@ -167,6 +172,19 @@ bool AES_GCM_EncryptContext::Encrypt(
 	return true;
 }
 
+static inline bool AESGCMEncryptOne(
+	EVP_CIPHER_CTX *ctx, uint32 cbTag,
+	const void *pPlaintextData, size_t cbPlaintextData,
+	const void *pIV,
+	void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
+) {
+	SymmetricCryptGatherPiece_t piece;
+	piece.m_pData = pPlaintextData;
+	piece.m_cbData = cbPlaintextData;
+	return AESGCMEncryptGather( ctx, cbTag, &piece, 1, pIV, pEncryptedDataAndTag, pcbEncryptedDataAndTag, pAdditionalAuthenticationData, cbAuthenticationData );
+}
+
 bool AES_GCM_DecryptContext::Decrypt(
 	const void *pEncryptedDataAndTag, size_t cbEncryptedDataAndTag,
 	const void *pIV,
@@ -255,6 +273,39 @@ bool AES_GCM_DecryptContext::Decrypt(
 	return true;
 }
 
+bool AES_GCM_EncryptContext::Encrypt(
+	const void *pPlaintextData, size_t cbPlaintextData,
+	const void *pIV,
+	void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData // Optional additional authentication data.  Not encrypted, but will be included in the tag, so it can be authenticated.
+) {
+	EVP_CIPHER_CTX *ctx = (EVP_CIPHER_CTX*)m_ctx;
+	if ( !ctx )
+	{
+		AssertMsg( false, "Not initialized!" );
+		*pcbEncryptedDataAndTag = 0;
+		return false;
+	}
+
+	return AESGCMEncryptOne( ctx, m_cbTag, pPlaintextData, cbPlaintextData, pIV, pEncryptedDataAndTag, pcbEncryptedDataAndTag, pAdditionalAuthenticationData, cbAuthenticationData );
+}
+
+bool AES_GCM_EncryptContext::EncryptGather(
+	const SymmetricCryptGatherPiece_t *pPieces, int nPieces,
+	const void *pIV,
+	void *pEncryptedDataAndTag, uint32 *pcbEncryptedDataAndTag,
+	const void *pAdditionalAuthenticationData, size_t cbAuthenticationData
+) {
+	EVP_CIPHER_CTX *ctx = (EVP_CIPHER_CTX*)m_ctx;
+	if ( !ctx )
+	{
+		AssertMsg( false, "Not initialized!" );
+		*pcbEncryptedDataAndTag = 0;
+		return false;
+	}
+
+	return AESGCMEncryptGather( ctx, m_cbTag, pPieces, nPieces, pIV, pEncryptedDataAndTag, pcbEncryptedDataAndTag, pAdditionalAuthenticationData, cbAuthenticationData );
+}
 
 //
 // !KLUDGE! This is not specific to OpenSSL, and I'd like to put it in crypto.cpp.
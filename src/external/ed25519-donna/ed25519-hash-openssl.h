@@ -1,23 +1,41 @@
-#include <openssl/sha.h>
+/* @VALVE Use the EVP interface.  The low level SHA512_xxx functions are deprecated in OpenSSL 3 */
+#include <stdlib.h>
+#include <openssl/evp.h>
 
-typedef SHA512_CTX ed25519_hash_context;
+typedef struct ed25519_hash_context_t {
+	EVP_MD_CTX *ctx;
+} ed25519_hash_context;
+
+/* @VALVE There's no way to return an error through the hash interface,
+   and going ahead with a bogus hash could let a forged signature verify.
+   These "should never happen" (other than out of memory), so treat them
+   as fatal. */
+static void
+ed25519_hash_check(int ok) {
+	if (!ok)
+		abort();
+}
 
 static void
 ed25519_hash_init(ed25519_hash_context *ctx) {
-	SHA512_Init(ctx);
+	ctx->ctx = EVP_MD_CTX_new();
+	ed25519_hash_check(ctx->ctx != NULL);
+	ed25519_hash_check(EVP_DigestInit_ex(ctx->ctx, EVP_sha512(), NULL) == 1);
 }
 
 static void
 ed25519_hash_update(ed25519_hash_context *ctx, const uint8_t *in, size_t inlen) {
-	SHA512_Update(ctx, in, inlen);
+	ed25519_hash_check(EVP_DigestUpdate(ctx->ctx, in, inlen) == 1);
 }
 
 static void
 ed25519_hash_final(ed25519_hash_context *ctx, uint8_t *hash) {
-	SHA512_Final(hash, ctx);
+	ed25519_hash_check(EVP_DigestFinal_ex(ctx->ctx, hash, NULL) == 1);
+	EVP_MD_CTX_free(ctx->ctx);
+	ctx->ctx = NULL;
 }
 
 static void
 ed25519_hash(uint8_t *hash, const uint8_t *in, size_t inlen) {
-	SHA512(in, inlen, hash);
-}
\ No newline at end of file
+	ed25519_hash_check(EVP_Digest(in, inlen, hash, NULL, EVP_sha512(), NULL) == 1);
+}
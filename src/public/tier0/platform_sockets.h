@@ -15,10 +15,21 @@
 // USE_EPOLL or USE_POLL
 // If USE_EPOLL:
 //		EPollHandle, INVALID_EPOLL_HANDLE, EPollCreate()
+//		USE_EPOLL_PWAIT2, if we can try to wait with a timeout
+//		that has better than millisecond resolution
 //
 // WAKE_THREAD_USING_EVENT or WAKE_THREAD_USING_SOCKET_PAIR
 // If WAKE_THREAD_USING_EVENT:
 //		ThreadWakeEvent, INVALID_THREAD_WAKE_EVENT, SetWakeThreadEvent()
+//
+// USE_RECVMMSG, if the platform can read multiple datagrams
+// in a single system call
+//
+// USE_SENDMMSG, if the platform can send multiple datagrams
+// in a single system call.  (Also implies UDP_SEGMENT is available.)
+//
+// USE_SO_TXTIME, if datagrams can be stamped with a transmit time
+// (SCM_TXTIME), and the queueing discipline will hold them until then
 
 #ifndef TIER0_PLATFORM_SOCKETS_H
 #define TIER0_PLATFORM_SOCKETS_H
@@ -130,10 +141,40 @@ typedef char SteamNetworkingErrMsg[ 1024 ];
 
 		#define EPollClose(x) close(x)
 
+		// epoll_pwait2 takes a timespec timeout (Linux 5.11+).  Older
+		// glibc doesn't have a wrapper, so we make the syscall ourselves.
+		// If the kernel is too old, it will fail with ENOSYS.
+		#if IsLinux()
+			#include <sys/syscall.h>
+			#if !defined( SYS_epoll_pwait2 ) && ( defined( __x86_64__ ) || defined( __i386__ ) || defined( __aarch64__ ) || defined( __arm__ ) )
+				#define SYS_epoll_pwait2 441
+			#endif
+			#ifdef SYS_epoll_pwait2
+				#define USE_EPOLL_PWAIT2
+			#endif
+		#endif
+
 		// FIXME - should we try to use eventfd() here
 		// instead of a socket pair?
 
 	#endif
+
+	// Linux can read and write a batch of datagrams with one system call
+	#if IsLinux()
+		#define USE_RECVMMSG
+		#define USE_SENDMMSG
+		#include <netinet/udp.h>
+		#ifndef UDP_SEGMENT
+			#define UDP_SEGMENT 103
+		#endif
+
+		// Kernel pacing.  (Needs the fq or etf qdisc to have any effect)
+		#define USE_SO_TXTIME
+		#ifndef SO_TXTIME
+			#define SO_TXTIME 61
+			#define SCM_TXTIME SO_TXTIME
+		#endif
+	#endif
 #else
 	#error "How do?"
 #endif
@@ -0,0 +1,368 @@
+//====== Copyright Valve Corporation, All rights reserved. ====================
+//
+// Hierarchical timing wheel.  Intrusive container of objects keyed by an
+// int64 timestamp, with O(1) insert and remove, and batch expiry.
+//
+//=============================================================================
+
+#ifndef UTLTIMINGWHEEL_H
+#define UTLTIMINGWHEEL_H
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <tier0/basetypes.h>
+#include <tier0/dbg.h>
+#include "utlvector.h"
+
+/// Link fields that must be embedded in each object stored in a
+/// CUtlTimingWheel.  The wheel owns these; don't touch them.
+template <typename T>
+struct CUtlTimingWheelLinks
+{
+	T *m_pPrev = nullptr;
+	T *m_pNext = nullptr;
+	int m_nList = -1; // Which list are we in?  -1 if not in the wheel
+};
+
+/// Hierarchical timing wheel.
+///
+/// Times are bucketed into ticks of 2^nTickBits units.  Each level of the
+/// wheel has 64 slots, and each slot in level N covers 64 times as many ticks
+/// as a slot in level N-1.  Elements are stored in intrusive doubly-linked lists,
+/// so inserting and removing an element is O(1), regardless of how many elements
+/// are in the wheel.  As time advances, elements in coarse slots are cascaded
+/// down into finer slots.
+///
+/// TTraits must provide:
+///   static CUtlTimingWheelLinks<T> &Links( T *p );
+///   static int64 Time( const T *p );
+///
+/// The time of an element must not change while it is in the wheel.  (Remove
+/// it, change the time, and re-insert it.)
+template <typename T, typename TTraits, int nTickBits = 10>
+class CUtlTimingWheel
+{
+public:
+	CUtlTimingWheel();
+
+	/// Add an element to the wheel.  It must not already be in the wheel.
+	void Insert( T *p );
+
+	/// Remove an element from the wheel.  It must be in the wheel.
+	void Remove( T *p );
+
+	/// Return true if the element is in the wheel (including the expired list)
+	static bool IsInWheel( T *p ) { return TTraits::Links( p ).m_nList >= 0; }
+
+	/// Total number of elements in the wheel, including the expired list
+	int Count() const { return m_nCount; }
+
+	/// Advance the wheel, and append all elements with a time strictly less than
+	/// nNow to the expired list, sorted by time.  Elements remain in the wheel
+	/// while they are in the expired list, and can be removed or re-inserted
+	/// normally.  Returns the number of elements that were appended.
+	int CollectExpired( int64 nNow );
+
+	/// Earliest element in the expired list, or NULL if the list is empty
+	T *GetExpiredHead() const { return m_pListHead[ k_nListExpired ]; }
+
+	/// Return the earliest time of any element in the wheel.  This scans the
+	/// list with the earliest elements, which is usually short.  (The earliest
+	/// occupied slot in the lowest occupied level.)  Returns INT64_MAX if the
+	/// wheel is empty.
+	int64 GetNextTime() const;
+
+	/// Remove everything
+	void RemoveAll();
+
+	#ifdef DBGFLAG_VALIDATE
+	void Validate( CValidator &validator, const char *pchName ) { m_vecCollect.Validate( validator, pchName ); }
+	#endif
+
+private:
+	enum
+	{
+		k_nSlotBits = 6,
+		k_nSlotsPerLevel = 1 << k_nSlotBits,
+		k_nLevels = 6,
+		k_nLevelSlots = k_nLevels * k_nSlotsPerLevel,
+
+		// Special lists
+		k_nListCurrent = k_nLevelSlots, // Time is in the current tick or earlier
+		k_nListExpired, // Collected by CollectExpired, sorted by time
+		k_nListOverflow, // Too far in the future to fit in the wheel
+		k_nLists
+	};
+
+	int64 m_nCurTick;
+	int m_nCount;
+	uint64 m_bitsOccupied[ k_nLevels ];
+	T *m_pListHead[ k_nLists ];
+	T *m_pExpiredTail; // Only the expired list needs to be appended in order
+	CUtlVector<T *> m_vecCollect;
+
+	static int64 TickForTime( int64 nTime ) { return nTime >> nTickBits; }
+	int ListForTick( int64 nTick ) const;
+	void LinkHead( T *p, int nList );
+	void LinkTail( T *p, int nList );
+	void Unlink( T *p );
+	void Advance( int64 nNewTick );
+	void MoveListTo( int nList, CUtlVector<T *> &vecOut );
+};
+
+template <typename T, typename TTraits, int nTickBits>
+CUtlTimingWheel<T, TTraits, nTickBits>::CUtlTimingWheel()
+: m_nCurTick( 0 )
+, m_nCount( 0 )
+, m_pExpiredTail( nullptr )
+{
+	memset( m_bitsOccupied, 0, sizeof(m_bitsOccupied) );
+	memset( m_pListHead, 0, sizeof(m_pListHead) );
+}
+
+template <typename T, typename TTraits, int nTickBits>
+int CUtlTimingWheel<T, TTraits, nTickBits>::ListForTick( int64 nTick ) const
+{
+	if ( nTick <= m_nCurTick )
+		return k_nListCurrent;
+
+	// The level is determined by the highest bit that differs from the current
+	// tick.  All elements in a level share all higher bits with the current tick,
+	// so an occupied slot in a lower level is always earlier than any occupied
+	// slot in a higher level.
+	int nLevel = FindMostSignificantBit64( (uint64)( nTick ^ m_nCurTick ) ) / k_nSlotBits;
+	if ( nLevel >= k_nLevels )
+		return k_nListOverflow;
+	int nSlot = (int)( nTick >> ( nLevel*k_nSlotBits ) ) & ( k_nSlotsPerLevel-1 );
+	return nLevel*k_nSlotsPerLevel + nSlot;
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::LinkHead( T *p, int nList )
+{
+	CUtlTimingWheelLinks<T> &links = TTraits::Links( p );
+	Assert( links.m_nList < 0 );
+	links.m_nList = nList;
+	links.m_pPrev = nullptr;
+	links.m_pNext = m_pListHead[ nList ];
+	if ( links.m_pNext )
+	{
+		TTraits::Links( links.m_pNext ).m_pPrev = p;
+	}
+	else if ( nList < k_nLevelSlots )
+	{
+		m_bitsOccupied[ nList >> k_nSlotBits ] |= 1ull << ( nList & ( k_nSlotsPerLevel-1 ) );
+	}
+	m_pListHead[ nList ] = p;
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::LinkTail( T *p, int nList )
+{
+	Assert( nList == k_nListExpired );
+	CUtlTimingWheelLinks<T> &links = TTraits::Links( p );
+	Assert( links.m_nList < 0 );
+	links.m_nList = nList;
+	links.m_pNext = nullptr;
+	links.m_pPrev = m_pExpiredTail;
+	if ( links.m_pPrev )
+		TTraits::Links( links.m_pPrev ).m_pNext = p;
+	else
+		m_pListHead[ nList ] = p;
+	m_pExpiredTail = p;
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::Unlink( T *p )
+{
+	CUtlTimingWheelLinks<T> &links = TTraits::Links( p );
+	int nList = links.m_nList;
+	Assert( nList >= 0 && nList < k_nLists );
+	if ( links.m_pPrev )
+	{
+		TTraits::Links( links.m_pPrev ).m_pNext = links.m_pNext;
+	}
+	else
+	{
+		Assert( m_pListHead[ nList ] == p );
+		m_pListHead[ nList ] = links.m_pNext;
+		if ( !links.m_pNext && nList < k_nLevelSlots )
+			m_bitsOccupied[ nList >> k_nSlotBits ] &= ~( 1ull << ( nList & ( k_nSlotsPerLevel-1 ) ) );
+	}
+	if ( links.m_pNext )
+	{
+		TTraits::Links( links.m_pNext ).m_pPrev = links.m_pPrev;
+	}
+	else if ( nList == k_nListExpired )
+	{
+		Assert( m_pExpiredTail == p );
+		m_pExpiredTail = links.m_pPrev;
+	}
+	links.m_pPrev = nullptr;
+	links.m_pNext = nullptr;
+	links.m_nList = -1;
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::Insert( T *p )
+{
+	LinkHead( p, ListForTick( TickForTime( TTraits::Time( p ) ) ) );
+	++m_nCount;
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::Remove( T *p )
+{
+	Unlink( p );
+	Assert( m_nCount > 0 );
+	--m_nCount;
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::MoveListTo( int nList, CUtlVector<T *> &vecOut )
+{
+	while ( T *p = m_pListHead[ nList ] )
+	{
+		Unlink( p );
+		vecOut.AddToTail( p );
+	}
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::Advance( int64 nNewTick )
+{
+	if ( nNewTick <= m_nCurTick )
+		return;
+
+	// Nothing in the wheel?  Just jump ahead
+	if ( m_nCount == 0 )
+	{
+		m_nCurTick = nNewTick;
+		return;
+	}
+
+	// Gather up all the slots that the current tick moves past,
+	// at each level.
+	m_vecCollect.RemoveAll();
+	int nLevel = 0;
+	for ( ; nLevel < k_nLevels; ++nLevel )
+	{
+		int nShift = nLevel*k_nSlotBits;
+		int64 nOldDigits = m_nCurTick >> nShift;
+		int64 nNewDigits = nNewTick >> nShift;
+
+		// If we didn't move to a new slot at this level, then
+		// we didn't at any higher level, either
+		if ( nOldDigits == nNewDigits )
+			break;
+
+		// Bits for the slots in the range (old,new], wrapping around
+		uint64 bitsElapsed;
+		int64 nElapsed = nNewDigits - nOldDigits;
+		if ( nElapsed >= k_nSlotsPerLevel )
+		{
+			bitsElapsed = ~(uint64)0;
+		}
+		else
+		{
+			bitsElapsed = ( 1ull << nElapsed ) - 1;
+			int nRotate = (int)( ( nOldDigits + 1 ) & ( k_nSlotsPerLevel-1 ) );
+			if ( nRotate )
+				bitsElapsed = ( bitsElapsed << nRotate ) | ( bitsElapsed >> ( k_nSlotsPerLevel - nRotate ) );
+		}
+
+		uint64 bitsPending = m_bitsOccupied[ nLevel ] & bitsElapsed;
+		while ( bitsPending )
+		{
+			int nSlot = FindLeastSignificantBit64( bitsPending );
+			bitsPending &= bitsPending-1;
+			MoveListTo( nLevel*k_nSlotsPerLevel + nSlot, m_vecCollect );
+		}
+	}
+
+	// If the top level moved, then check if anything in the overflow list
+	// is now close enough to fit in the wheel
+	if ( nLevel >= k_nLevels )
+		MoveListTo( k_nListOverflow, m_vecCollect );
+
+	// Re-insert everything relative to the new current tick.  These will
+	// either land in a finer slot, or in the current list.
+	m_nCurTick = nNewTick;
+	for ( T *p: m_vecCollect )
+		LinkHead( p, ListForTick( TickForTime( TTraits::Time( p ) ) ) );
+}
+
+template <typename T, typename TTraits, int nTickBits>
+int CUtlTimingWheel<T, TTraits, nTickBits>::CollectExpired( int64 nNow )
+{
+	Advance( TickForTime( nNow ) );
+
+	// Scan the current list for anything that is due.  Only elements in the
+	// current tick can be in here and not yet due.
+	m_vecCollect.RemoveAll();
+	T *p = m_pListHead[ k_nListCurrent ];
+	while ( p )
+	{
+		T *pNext = TTraits::Links( p ).m_pNext;
+		if ( TTraits::Time( p ) < nNow )
+		{
+			Unlink( p );
+			m_vecCollect.AddToTail( p );
+		}
+		p = pNext;
+	}
+
+	// Append them to the expired list, in order
+	if ( m_vecCollect.Count() > 1 )
+	{
+		m_vecCollect.SortPredicate( []( const T *a, const T *b ) { return TTraits::Time( a ) < TTraits::Time( b ); } );
+	}
+	for ( T *pExpired: m_vecCollect )
+		LinkTail( pExpired, k_nListExpired );
+	return m_vecCollect.Count();
+}
+
+template <typename T, typename TTraits, int nTickBits>
+int64 CUtlTimingWheel<T, TTraits, nTickBits>::GetNextTime() const
+{
+	// Anything already expired?  That list is sorted.  Also scan
+	// anything in the current tick.
+	int64 nResult = INT64_MAX;
+	if ( m_pListHead[ k_nListExpired ] )
+		nResult = TTraits::Time( m_pListHead[ k_nListExpired ] );
+	for ( T *p = m_pListHead[ k_nListCurrent ] ; p ; p = TTraits::Links( p ).m_pNext )
+		nResult = std::min( nResult, TTraits::Time( p ) );
+	if ( nResult < INT64_MAX )
+		return nResult;
+
+	// Otherwise, the earliest element is in the first occupied slot in the
+	// lowest occupied level.  (See ListForTick.)  If there aren't any,
+	// it's in the overflow list, which should basically never happen.
+	int nList = k_nListOverflow;
+	for ( int nLevel = 0 ; nLevel < k_nLevels ; ++nLevel )
+	{
+		if ( m_bitsOccupied[ nLevel ] != 0 )
+		{
+			nList = nLevel*k_nSlotsPerLevel + FindLeastSignificantBit64( m_bitsOccupied[ nLevel ] );
+			break;
+		}
+	}
+	for ( T *p = m_pListHead[ nList ] ; p ; p = TTraits::Links( p ).m_pNext )
+		nResult = std::min( nResult, TTraits::Time( p ) );
+	return nResult;
+}
+
+template <typename T, typename TTraits, int nTickBits>
+void CUtlTimingWheel<T, TTraits, nTickBits>::RemoveAll()
+{
+	for ( int nList = 0 ; nList < k_nLists ; ++nList )
+	{
+		while ( T *p = m_pListHead[ nList ] )
+			Unlink( p );
+	}
+	m_nCount = 0;
+}
+
+#endif // UTLTIMINGWHEEL_H
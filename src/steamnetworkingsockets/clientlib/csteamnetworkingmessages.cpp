@@ -344,15 +344,14 @@ void CMessagesEndPointSession::ClearActiveConnection()
 //
 /////////////////////////////////////////////////////////////////////////////
 
-CSteamNetworkingMessages::Channel::Channel()
+CSteamNetworkingMessages::Channel::Channel( ShortDurationLock &lockRecvMessages )
 {
-	m_queueRecvMessages.m_pRequiredLock = &g_lockAllRecvMessageQueues;
-		
+	m_queueRecvMessages.m_pRequiredLock = &lockRecvMessages;
 }
 
 CSteamNetworkingMessages::Channel::~Channel()
 {
-	ShortDurationScopeLock scopeLock( g_lockAllRecvMessageQueues );
+	ShortDurationScopeLock scopeLock( *m_queueRecvMessages.m_pRequiredLock );
 
 	// Should be empty!
 	Assert( m_queueRecvMessages.empty() );
@@ -363,6 +362,7 @@ CSteamNetworkingMessages::Channel::~Channel()
 
 CSteamNetworkingMessages::CSteamNetworkingMessages( CSteamNetworkingSockets &steamNetworkingSockets )
 : CMessagesEndPoint( steamNetworkingSockets, k_nVirtualPort_Messages )
+, m_lockRecvMessages( "messages_recv_msg_queue" )
 {
 }
 
@@ -516,7 +516,7 @@ int CSteamNetworkingMessages::ReceiveMessagesOnChannel( int nLocalChannel, Steam
 
 	Channel *pChan = FindOrCreateChannel( nLocalChannel );
 
-	ShortDurationScopeLock lockMessageQueues( g_lockAllRecvMessageQueues );
+	ShortDurationScopeLock lockMessageQueues( m_lockRecvMessages );
 
 	return pChan->m_queueRecvMessages.RemoveMessages( ppOutMessages, nMaxMessages );
 }
@@ -570,7 +570,7 @@ bool CSteamNetworkingMessages::CloseChannelWithUser( const SteamNetworkingIdenti
 	pSession->m_mapOpenChannels.RemoveAt(h);
 
 	// Destroy all unread messages on this channel from this user
-	g_lockAllRecvMessageQueues.lock();
+	m_lockRecvMessages.lock();
 	CSteamNetworkingMessage **ppMsg = &pSession->m_queueRecvMessages.m_pFirst;
 	for (;;)
 	{
@@ -589,7 +589,7 @@ bool CSteamNetworkingMessages::CloseChannelWithUser( const SteamNetworkingIdenti
 			ppMsg = &pMsg->m_links.m_pPrev;
 		}
 	}
-	g_lockAllRecvMessageQueues.unlock();
+	m_lockRecvMessages.unlock();
 
 	// No more open channels?
 	if ( pSession->m_mapOpenChannels.Count() == 0 )
@@ -657,7 +657,7 @@ CSteamNetworkingMessages::Channel *CSteamNetworkingMessages::FindOrCreateChannel
 	int h = m_mapChannels.Find( nChannel );
 	if ( h != m_mapChannels.InvalidIndex() )
 		return m_mapChannels[h];
-	Channel *pChan = new Channel;
+	Channel *pChan = new Channel( m_lockRecvMessages );
 	m_mapChannels.Insert( nChannel, pChan );
 	return pChan;
 }
@@ -738,15 +738,15 @@ SteamNetworkingMessagesSession::SteamNetworkingMessagesSession( const SteamNetwo
 	memset( &m_lastConnectionInfo, 0, sizeof(m_lastConnectionInfo) );
 	memset( &m_lastQuickStatus, 0, sizeof(m_lastQuickStatus) );
 
-	m_queueRecvMessages.m_pRequiredLock = &g_lockAllRecvMessageQueues;
+	m_queueRecvMessages.m_pRequiredLock = &steamNetworkingMessages.m_lockRecvMessages;
 }
 
 SteamNetworkingMessagesSession::~SteamNetworkingMessagesSession()
 {
 	// Discard messages
-	g_lockAllRecvMessageQueues.lock();
+	m_queueRecvMessages.m_pRequiredLock->lock();
 	m_queueRecvMessages.PurgeMessages();
-	g_lockAllRecvMessageQueues.unlock();
+	m_queueRecvMessages.m_pRequiredLock->unlock();
 
 	// If we have a connection, then nuke it now
 	CloseConnection( k_ESteamNetConnectionEnd_P2P_SessionClosed, "P2PSession destroyed" );
@@ -900,7 +900,7 @@ void SteamNetworkingMessagesSession::Think( SteamNetworkingMicroseconds usecNow
 static void FreeMessageDataWithP2PMessageHeader( SteamNetworkingMessage_t *pMsg )
 {
 	void *hdr = static_cast<P2PMessageHeader *>( pMsg->m_pData ) - 1;
-	::free( hdr );
+	CSteamNetworkingMessage::FreeBuffer( hdr );
 }
 
 void SteamNetworkingMessagesSession::ReceivedMessage( CSteamNetworkingMessage *pMsg, CSteamNetworkConnectionBase *pConn )
@@ -930,7 +930,7 @@ void SteamNetworkingMessagesSession::ReceivedMessage( CSteamNetworkingMessage *p
 	CSteamNetworkingMessages::Channel *pChannel = MessagesOwner().FindOrCreateChannel( pMsg->m_nChannel );
 
 	// Grab the lock while we insert into the proper queues
-	ShortDurationScopeLock lockMessageQueues( g_lockAllRecvMessageQueues );
+	ShortDurationScopeLock lockMessageQueues( MessagesOwner().m_lockRecvMessages );
 
 	// Add to the session
 	pMsg->LinkToQueueTail( &CSteamNetworkingMessage::m_links, &m_queueRecvMessages );
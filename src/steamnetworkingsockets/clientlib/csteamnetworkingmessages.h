@@ -155,9 +155,13 @@ public:
 
 	virtual bool BHandleNewIncomingConnection( CSteamNetworkConnectionBase *pConn, ConnectionScopeLock &connectionLock ) override;
 
+	/// Protects the message queues of all of our channels and sessions.
+	/// (Messages are linked into both.)
+	ShortDurationLock m_lockRecvMessages;
+
 	struct Channel
 	{
-		Channel();
+		Channel( ShortDurationLock &lockRecvMessages );
 		~Channel();
 
 		SteamNetworkingMessageQueue m_queueRecvMessages;
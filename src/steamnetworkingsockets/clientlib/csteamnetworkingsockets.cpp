@@ -55,6 +55,18 @@ DEFINE_GLOBAL_CONFIGVAL( int32, FakeRateLimit_Send_Rate, 0, 0, 1024*1024*1024 );
 DEFINE_GLOBAL_CONFIGVAL( int32, FakeRateLimit_Send_Burst, 16*1024, 0, 1024*1024 );
 DEFINE_GLOBAL_CONFIGVAL( int32, FakeRateLimit_Recv_Rate, 0, 0, 1024*1024*1024 );
 DEFINE_GLOBAL_CONFIGVAL( int32, FakeRateLimit_Recv_Burst, 16*1024, 0, 1024*1024 );
+DEFINE_GLOBAL_CONFIGVAL( int32, RecvBatchSize, 32, 1, k_nMaxUDPRecvBatchSize );
+DEFINE_GLOBAL_CONFIGVAL( int32, SendBatchMode, 2, 0, 2 );
+DEFINE_GLOBAL_CONFIGVAL( int32, MessagePoolSize, 1024, 0, 1024*1024 );
+DEFINE_GLOBAL_CONFIGVAL( int32, RecvThreads, 1, 1, k_nMaxRecvThreads );
+DEFINE_GLOBAL_CONFIGVAL( int32, SendTxTimeHorizon, 0, 0, 100000 );
+DEFINE_GLOBAL_CONFIGVAL( int32, PreciseServiceWait, 1, 0, 1 );
+DEFINE_GLOBAL_CONFIGVAL( int32, ServiceThreadSpinTime, 0, 0, 1000000 );
+DEFINE_GLOBAL_CONFIGVAL( int32, SocketBusyPoll, 0, 0, 1000000 );
+DEFINE_GLOBAL_CONFIGVAL( int32, ServiceThreadCPU, -1, -1, 1023 );
+DEFINE_GLOBAL_CONFIGVAL( int32, CryptoWorkerThreads, 2, 0, 16 );
+DEFINE_GLOBAL_CONFIGVAL( int32, MaxPendingHandshakes, 1024, 0, 0x10000000 );
+DEFINE_GLOBAL_CONFIGVAL( int32, MaxPendingHandshakesPerIP, 0, 0, 0x10000000 );
 
 DEFINE_GLOBAL_CONFIGVAL( void *, Callback_AuthStatusChanged, nullptr );
 #ifdef STEAMNETWORKINGSOCKETS_ENABLE_STEAMNETWORKINGMESSAGES
@@ -77,6 +89,8 @@ DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int64, ConnectionUserData, -1 ); // no limit
 DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, SendRateMin, 256*1024, 1024, 0x10000000 );
 DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, SendRateMax, 256*1024, 1024, 0x10000000 );
 DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, NagleTime, 5000, 0, 20000 );
+DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, NackDelayPercentile, 90, 0, 100 );
+DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, UnreliableFECLanes, 0, 0, INT32_MAX );
 DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, MTU_PacketSize, 1300, k_cbSteamNetworkingSocketsMinMTUPacketSize, k_cbSteamNetworkingSocketsMaxUDPMsgLen );
 #ifdef STEAMNETWORKINGSOCKETS_OPENSOURCE
 	// We don't have a trusted third party, so allow this by default,
@@ -85,6 +99,9 @@ DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, MTU_PacketSize, 1300, k_cbSteamNetwor
 #else
 	DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, IP_AllowWithoutAuth, 0, 0, 2 );
 #endif
+DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, IP_ConnectRateLimit, 0, 0, 1000000 );
+DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, IP_ConnectRateLimitBurst, 8, 1, 1000000 );
+DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, IP_DeferConnectionAlloc, 0, 0, 1 );
 DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, Unencrypted, 0, 0, 3 );
 DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, SymmetricConnect, 0, 0, 1 );
 DEFINE_CONNECTON_DEFAULT_CONFIGVAL( int32, LocalVirtualPort, -1, -1, INT32_MAX );
@@ -1356,6 +1373,119 @@ void CSteamNetworkingSockets::SendMessages( int nMessages, SteamNetworkingMessag
 		pConn->CheckConnectionStateOrScheduleWakeUp( usecNow );
 }
 
+// Send the same payload to a list of connections.  The payload is copied
+// once into a refcounted buffer, and each connection gets a message object
+// that references it.  Returns the number of connections that the message
+// was successfully queued on
+static int SendSharedMessageToConnections( int nConnections, const HSteamNetConnection *pConnections, const void *pData, uint32 cbData, int nSendFlags, int64 *pOutMessageNumberOrResult )
+{
+	auto SetAllResults = [=]( int64 result ) {
+		if ( pOutMessageNumberOrResult )
+		{
+			for ( int i = 0 ; i < nConnections ; ++i )
+				pOutMessageNumberOrResult[i] = result;
+		}
+	};
+
+	if ( cbData > k_cbMaxSteamNetworkingSocketsMessageSizeSend || ( cbData > 0 && !pData ) )
+	{
+		AssertMsg2( cbData <= k_cbMaxSteamNetworkingSocketsMessageSizeSend, "Message size %d is too big.  Max is %d", cbData, k_cbMaxSteamNetworkingSocketsMessageSizeSend );
+		SetAllResults( -k_EResultInvalidParam );
+		return 0;
+	}
+
+	// Copy in the payload, once
+	void *pSharedBuffer = nullptr;
+	if ( cbData > 0 )
+	{
+		pSharedBuffer = CSteamNetworkingMessage::AllocSharedBuffer( cbData );
+		if ( !pSharedBuffer )
+		{
+			SetAllResults( -k_EResultFail );
+			return 0;
+		}
+		memcpy( pSharedBuffer, pData, cbData );
+	}
+
+	// Don't let the service thread start working on the first
+	// connection until we've queued the message on all of them
+	ThinkerDeferServiceThreadWakeScope deferWake;
+
+	// SteamNetworkingGlobalLock scopeLock( "SendMessageToConnections" ); // NO, not necessary!
+	SteamNetworkingMicroseconds usecNow = SteamNetworkingSockets_GetLocalTimestamp();
+	int nQueued = 0;
+	for ( int i = 0 ; i < nConnections ; ++i )
+	{
+		int64 result;
+		ConnectionScopeLock connectionLock;
+		CSteamNetworkConnectionBase *pConn = GetConnectionByHandleForAPI( pConnections[i], connectionLock, "SendMessageToConnections" );
+		if ( !pConn )
+		{
+			result = -k_EResultInvalidParam;
+		}
+		else
+		{
+			CSteamNetworkingMessage *pMsg = CSteamNetworkingMessage::New( 0 );
+			if ( !pMsg )
+			{
+				result = -k_EResultFail;
+			}
+			else
+			{
+				pMsg->m_conn = pConnections[i];
+				pMsg->m_nFlags = nSendFlags;
+				if ( pSharedBuffer )
+					pMsg->SetSharedBufferData( pSharedBuffer, pSharedBuffer, cbData );
+
+				bool bThinkImmediately = false;
+				result = pConn->APISendMessageToConnection( pMsg, usecNow, &bThinkImmediately );
+				if ( bThinkImmediately )
+					pConn->CheckConnectionStateOrScheduleWakeUp( usecNow );
+				if ( result > 0 )
+					++nQueued;
+			}
+		}
+
+		if ( pOutMessageNumberOrResult )
+			pOutMessageNumberOrResult[i] = result;
+	}
+
+	// Release our reference.  The messages hold their own
+	if ( pSharedBuffer )
+		CSteamNetworkingMessage::ReleaseSharedBuffer( pSharedBuffer );
+
+	return nQueued;
+}
+
+STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_SendMessageToConnections( int nConnections, const HSteamNetConnection *pConnections, const void *pData, uint32 cbData, int nSendFlags, int64 *pOutMessageNumberOrResult )
+{
+	if ( nConnections <= 0 || !pConnections )
+		return;
+	SendSharedMessageToConnections( nConnections, pConnections, pData, cbData, nSendFlags, pOutMessageNumberOrResult );
+}
+
+STEAMNETWORKINGSOCKETS_INTERFACE int SteamNetworkingSockets_SendMessageToPollGroup( HSteamNetPollGroup hPollGroup, const void *pData, uint32 cbData, int nSendFlags )
+{
+
+	// Grab a list of connections in the poll group.  We can't hold
+	// the poll group lock while we lock the connections.
+	vstd::small_vector<HSteamNetConnection, 64> vecConnections;
+	{
+		//SteamNetworkingGlobalLock scopeLock( "SendMessageToPollGroup" ); // NO, not necessary!
+		PollGroupScopeLock pollGroupLock;
+		CSteamNetworkPollGroup *pPollGroup = GetPollGroupByHandle( hPollGroup, pollGroupLock, "SendMessageToPollGroup" );
+		if ( !pPollGroup )
+			return -1;
+		vecConnections.reserve( pPollGroup->m_vecConnections.Count() );
+		FOR_EACH_VEC( pPollGroup->m_vecConnections, i )
+			vecConnections.push_back( pPollGroup->m_vecConnections[i]->m_hConnectionSelf );
+	}
+
+	if ( vecConnections.empty() )
+		return 0;
+	return SendSharedMessageToConnections( len( vecConnections ), vecConnections.begin(), pData, cbData, nSendFlags, nullptr );
+}
+
 EResult CSteamNetworkingSockets::FlushMessagesOnConnection( HSteamNetConnection hConn )
 {
 	//SteamNetworkingGlobalLock scopeLock( "FlushMessagesOnConnection" ); // NO, not necessary!
@@ -1443,9 +1573,9 @@ int CSteamNetworkingSockets::ReceiveMessagesOnPollGroup( HSteamNetPollGroup hPol
 	CSteamNetworkPollGroup *pPollGroup = GetPollGroupByHandle( hPollGroup, pollGroupLock, "ReceiveMessagesOnPollGroup" );
 	if ( !pPollGroup )
 		return -1;
-	g_lockAllRecvMessageQueues.lock();
+	pPollGroup->m_lockRecvMessages.lock();
 	int nMessagesReceived = pPollGroup->m_queueRecvMessages.RemoveMessages( ppOutMessages, nMaxMessages );
-	g_lockAllRecvMessageQueues.unlock();
+	pPollGroup->m_lockRecvMessages.unlock();
 	return nMessagesReceived;
 }
 
@@ -1458,9 +1588,9 @@ int CSteamNetworkingSockets::ReceiveMessagesOnListenSocketLegacyPollGroup( HStea
 		return -1;
 	if ( !pSock->m_pLegacyPollGroup )
 		return 0;
-	g_lockAllRecvMessageQueues.lock();
+	pSock->m_pLegacyPollGroup->m_lockRecvMessages.lock();
 	int nMessagesReceived = pSock->m_pLegacyPollGroup->m_queueRecvMessages.RemoveMessages( ppOutMessages, nMaxMessages );
-	g_lockAllRecvMessageQueues.unlock();
+	pSock->m_pLegacyPollGroup->m_lockRecvMessages.unlock();
 	return nMessagesReceived;
 }
 #endif
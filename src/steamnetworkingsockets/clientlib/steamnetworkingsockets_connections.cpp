@@ -1,6 +1,8 @@
 //====== Copyright Valve Corporation, All rights reserved. ====================
 
 #include <time.h>
+#include <atomic>
+#include <new>
 
 #include <steam/isteamnetworkingsockets.h>
 #include "steamnetworkingsockets_connections.h"
@@ -23,6 +25,10 @@
 	#include <steam/steamnetworkingfakeip.h>
 #endif
 
+#ifdef STEAMNETWORKINGSOCKETS_STANDALONELIB
+	#include <steam/steamnetworkingsockets.h>
+#endif
+
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
@@ -75,9 +81,407 @@ bool BCheckGlobalSpamReplyRateLimit( SteamNetworkingMicroseconds usecNow )
 //
 /////////////////////////////////////////////////////////////////////////////
 
+// Message objects and small payload buffers are recycled through a pool
+// with one free list per size class.  Each thread keeps a small cache of
+// free blocks, so that the common case of allocating and freeing messages
+// on the same thread doesn't touch any lock or the heap.  When a thread's
+// cache runs dry or overflows, we move a batch of blocks to or from a
+// depot that is shared by all threads.
+
+// Size class 0 holds message objects.  Classes 1..N hold payload
+// buffers of 64, 128, ... bytes.  Anything bigger goes to the heap.
+constexpr int k_nMessagePoolClass_Message = 0;
+constexpr int k_nMessagePoolBufferClasses = 6;
+constexpr int k_nMessagePoolClasses = 1 + k_nMessagePoolBufferClasses;
+constexpr uint32 k_cbMessagePoolMinBuffer = 64;
+constexpr uint32 k_cbMessagePoolMaxBuffer = k_cbMessagePoolMinBuffer << ( k_nMessagePoolBufferClasses-1 );
+constexpr uint32 k_nMessagePoolClass_Unpooled = 0xffffffff;
+
+// Max number of free blocks of each class that a thread may keep
+// for itself, and the number we move to/from the depot at once.
+constexpr int k_nMessagePoolThreadCacheMax = 64;
+constexpr int k_nMessagePoolTransferBatch = 32;
+
+// Received messages at least this big may point directly into the buffer
+// holding the decrypted packet, rather than being copied into their own buffer.
+// A message that points into the buffer keeps the whole thing alive, so only
+// do it when the message fills at least half of the buffer.  Smaller messages
+// are copied into a buffer of their own size.
+constexpr int k_cbMinSharedBufferRecvMessage = k_cbSteamNetworkingSocketsMaxPlaintextPayloadRecv/2;
+
+/// Prefix on each buffer returned by AllocBuffer, so we know how to free it.
+struct MessageBufferHeader_t
+{
+	uint32 m_nSizeClass;
+	std::atomic<uint32> m_nRefCount; // Only used for shared buffers
+	uint32 m_pad[2]; // Keep the payload 16-byte aligned
+};
+COMPILE_TIME_ASSERT( sizeof(MessageBufferHeader_t) == 16 );
+
+/// A block that is sitting in a free list
+struct MessagePoolFreeBlock_t
+{
+	MessagePoolFreeBlock_t *m_pNext;
+};
+
+struct MessagePoolFreeList_t
+{
+	MessagePoolFreeBlock_t *m_pHead;
+	int m_nCount;
+
+	inline void Push( MessagePoolFreeBlock_t *p ) { p->m_pNext = m_pHead; m_pHead = p; ++m_nCount; }
+	inline MessagePoolFreeBlock_t *Pop()
+	{
+		MessagePoolFreeBlock_t *p = m_pHead;
+		if ( p )
+		{
+			m_pHead = p->m_pNext;
+			--m_nCount;
+		}
+		return p;
+	}
+};
+
+struct MessagePoolCounters_t
+{
+	int64 m_nAllocs;
+	int64 m_nHits;
+	int64 m_nFrees;
+};
+
+struct MessagePoolThreadCache;
+
+// The shared depot.  NOTE: This is protected by a raw mutex, not one of
+// our debug Lock objects, because messages are freed while holding all
+// sorts of locks (including short duration locks).  This is always
+// the innermost lock and is never held for more than a few pointer
+// operations.
+static ShortDurationMutexImpl s_mutexMessagePool;
+static MessagePoolFreeList_t s_messagePoolDepot[ k_nMessagePoolClasses ];
+static MessagePoolThreadCache *s_pMessagePoolThreadCaches; // All live thread caches
+static MessagePoolCounters_t s_messagePoolRetiredCounters; // Counters from threads that have exited
+static MessagePoolCounters_t s_messagePoolStatsBaseline; // Values at last stats reset
+
+/// Per-thread cache of free blocks.  The counters are only ever written
+/// by the owning thread, but they are read by GetPoolStats, so they are
+/// atomic.  (Relaxed load+store, not read-modify-write, so they are
+/// as cheap as ordinary integers.)
+struct MessagePoolThreadCache
+{
+	MessagePoolFreeList_t m_free[ k_nMessagePoolClasses ];
+	std::atomic<int64> m_nAllocs;
+	std::atomic<int64> m_nHits;
+	std::atomic<int64> m_nFrees;
+	std::atomic<int> m_nCachedBlocks;
+	MessagePoolThreadCache *m_pNextCache;
+
+	MessagePoolThreadCache();
+	~MessagePoolThreadCache();
+
+	static inline void Bump( std::atomic<int64> &x ) { x.store( x.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed ); }
+	inline void AdjustCachedBlocks( int d ) { m_nCachedBlocks.store( m_nCachedBlocks.load( std::memory_order_relaxed ) + d, std::memory_order_relaxed ); }
+
+	void RefillFromDepot( int nClass );
+	void SpillToDepot( int nClass, int nBlocks );
+};
+
+static size_t MessagePoolBlockSize( int nClass )
+{
+	if ( nClass == k_nMessagePoolClass_Message )
+		return sizeof(CSteamNetworkingMessage);
+	return sizeof(MessageBufferHeader_t) + ( k_cbMessagePoolMinBuffer << ( nClass-1 ) );
+}
+
+/// Return the pool class for a payload buffer of the specified size,
+/// or -1 if it's too big to pool
+static int MessagePoolBufferClass( uint32 cbSize )
+{
+	if ( cbSize > k_cbMessagePoolMaxBuffer )
+		return -1;
+	int nClass = 1;
+	for ( uint32 cbClass = k_cbMessagePoolMinBuffer ; cbClass < cbSize ; cbClass <<= 1 )
+		++nClass;
+	return nClass;
+}
+
+MessagePoolThreadCache::MessagePoolThreadCache()
+: m_nAllocs( 0 ), m_nHits( 0 ), m_nFrees( 0 ), m_nCachedBlocks( 0 )
+{
+	memset( m_free, 0, sizeof(m_free) );
+
+	std::lock_guard<ShortDurationMutexImpl> lock( s_mutexMessagePool );
+	m_pNextCache = s_pMessagePoolThreadCaches;
+	s_pMessagePoolThreadCaches = this;
+}
+
+MessagePoolThreadCache::~MessagePoolThreadCache()
+{
+	for ( int nClass = 0 ; nClass < k_nMessagePoolClasses ; ++nClass )
+		SpillToDepot( nClass, m_free[nClass].m_nCount );
+
+	std::lock_guard<ShortDurationMutexImpl> lock( s_mutexMessagePool );
+	s_messagePoolRetiredCounters.m_nAllocs += m_nAllocs.load( std::memory_order_relaxed );
+	s_messagePoolRetiredCounters.m_nHits += m_nHits.load( std::memory_order_relaxed );
+	s_messagePoolRetiredCounters.m_nFrees += m_nFrees.load( std::memory_order_relaxed );
+	for ( MessagePoolThreadCache **pp = &s_pMessagePoolThreadCaches ; *pp ; pp = &(*pp)->m_pNextCache )
+	{
+		if ( *pp == this )
+		{
+			*pp = m_pNextCache;
+			break;
+		}
+	}
+}
+
+void MessagePoolThreadCache::RefillFromDepot( int nClass )
+{
+	MessagePoolFreeList_t &depot = s_messagePoolDepot[ nClass ];
+	MessagePoolFreeList_t &mine = m_free[ nClass ];
+	int nMoved = 0;
+	{
+		std::lock_guard<ShortDurationMutexImpl> lock( s_mutexMessagePool );
+		while ( nMoved < k_nMessagePoolTransferBatch )
+		{
+			MessagePoolFreeBlock_t *p = depot.Pop();
+			if ( !p )
+				break;
+			mine.Push( p );
+			++nMoved;
+		}
+	}
+	AdjustCachedBlocks( nMoved );
+}
+
+void MessagePoolThreadCache::SpillToDepot( int nClass, int nBlocks )
+{
+	MessagePoolFreeList_t &depot = s_messagePoolDepot[ nClass ];
+	MessagePoolFreeList_t &mine = m_free[ nClass ];
+	const int nDepotMax = GlobalConfig::MessagePoolSize.Get();
+	MessagePoolFreeBlock_t *pExcess = nullptr;
+	int nMoved = 0;
+	{
+		std::lock_guard<ShortDurationMutexImpl> lock( s_mutexMessagePool );
+		while ( nMoved < nBlocks )
+		{
+			MessagePoolFreeBlock_t *p = mine.Pop();
+			if ( !p )
+				break;
+			++nMoved;
+			if ( depot.m_nCount < nDepotMax )
+			{
+				depot.Push( p );
+			}
+			else
+			{
+				p->m_pNext = pExcess;
+				pExcess = p;
+			}
+		}
+	}
+	AdjustCachedBlocks( -nMoved );
+
+	// Depot is full.  Give these back to the heap, outside the lock
+	while ( pExcess )
+	{
+		MessagePoolFreeBlock_t *p = pExcess;
+		pExcess = p->m_pNext;
+		free( p );
+	}
+}
+
+static MessagePoolThreadCache &GetMessagePoolThreadCache()
+{
+	thread_local MessagePoolThreadCache tls_messagePoolCache;
+	return tls_messagePoolCache;
+}
+
+static void *MessagePoolAlloc( int nClass )
+{
+	MessagePoolThreadCache &cache = GetMessagePoolThreadCache();
+	MessagePoolThreadCache::Bump( cache.m_nAllocs );
+
+	MessagePoolFreeBlock_t *p = cache.m_free[ nClass ].Pop();
+	if ( !p )
+	{
+		cache.RefillFromDepot( nClass );
+		p = cache.m_free[ nClass ].Pop();
+		if ( !p )
+			return malloc( MessagePoolBlockSize( nClass ) );
+	}
+	cache.AdjustCachedBlocks( -1 );
+	MessagePoolThreadCache::Bump( cache.m_nHits );
+	return p;
+}
+
+static void MessagePoolFree( void *pBlock, int nClass )
+{
+	MessagePoolThreadCache &cache = GetMessagePoolThreadCache();
+	MessagePoolThreadCache::Bump( cache.m_nFrees );
+
+	// Pooling disabled?
+	if ( GlobalConfig::MessagePoolSize.Get() <= 0 )
+	{
+		free( pBlock );
+		return;
+	}
+
+	MessagePoolFreeList_t &mine = cache.m_free[ nClass ];
+	mine.Push( static_cast<MessagePoolFreeBlock_t *>( pBlock ) );
+	cache.AdjustCachedBlocks( 1 );
+	if ( mine.m_nCount > k_nMessagePoolThreadCacheMax )
+		cache.SpillToDepot( nClass, k_nMessagePoolTransferBatch );
+}
+
+void *CSteamNetworkingMessage::AllocBuffer( uint32 cbSize )
+{
+	MessageBufferHeader_t *pHdr;
+	int nClass = MessagePoolBufferClass( cbSize );
+	if ( nClass > 0 )
+	{
+		pHdr = static_cast<MessageBufferHeader_t *>( MessagePoolAlloc( nClass ) );
+		if ( !pHdr )
+			return nullptr;
+		pHdr->m_nSizeClass = nClass;
+	}
+	else
+	{
+		pHdr = static_cast<MessageBufferHeader_t *>( malloc( sizeof(MessageBufferHeader_t) + cbSize ) );
+		if ( !pHdr )
+			return nullptr;
+		pHdr->m_nSizeClass = k_nMessagePoolClass_Unpooled;
+	}
+	return pHdr+1;
+}
+
+void CSteamNetworkingMessage::FreeBuffer( void *pData )
+{
+	MessageBufferHeader_t *pHdr = static_cast<MessageBufferHeader_t *>( pData ) - 1;
+	if ( pHdr->m_nSizeClass == k_nMessagePoolClass_Unpooled )
+	{
+		free( pHdr );
+		return;
+	}
+	Assert( pHdr->m_nSizeClass > 0 && pHdr->m_nSizeClass < (uint32)k_nMessagePoolClasses );
+	MessagePoolFree( pHdr, (int)pHdr->m_nSizeClass );
+}
+
+#ifdef STEAMNETWORKINGSOCKETS_STANDALONELIB
+void CSteamNetworkingMessage::GetPoolStats( SteamNetworkingGlobalStats_t *pStats, bool bReset )
+{
+	std::lock_guard<ShortDurationMutexImpl> lock( s_mutexMessagePool );
+
+	MessagePoolCounters_t total = s_messagePoolRetiredCounters;
+	int64 nFreeBlocks = 0;
+	for ( const MessagePoolFreeList_t &depot: s_messagePoolDepot )
+		nFreeBlocks += depot.m_nCount;
+	for ( MessagePoolThreadCache *pCache = s_pMessagePoolThreadCaches ; pCache ; pCache = pCache->m_pNextCache )
+	{
+		total.m_nAllocs += pCache->m_nAllocs.load( std::memory_order_relaxed );
+		total.m_nHits += pCache->m_nHits.load( std::memory_order_relaxed );
+		total.m_nFrees += pCache->m_nFrees.load( std::memory_order_relaxed );
+		nFreeBlocks += pCache->m_nCachedBlocks.load( std::memory_order_relaxed );
+	}
+
+	pStats->m_nMessagePoolAllocs = total.m_nAllocs - s_messagePoolStatsBaseline.m_nAllocs;
+	pStats->m_nMessagePoolHits = total.m_nHits - s_messagePoolStatsBaseline.m_nHits;
+	pStats->m_nMessagePoolBlocksInUse = total.m_nAllocs - total.m_nFrees;
+	pStats->m_nMessagePoolBlocksFree = nFreeBlocks;
+	if ( bReset )
+		s_messagePoolStatsBaseline = total;
+}
+#endif
+
+void CSteamNetworkingMessage::TrimPool()
+{
+	MessagePoolFreeBlock_t *pFree = nullptr;
+	{
+		std::lock_guard<ShortDurationMutexImpl> lock( s_mutexMessagePool );
+		for ( MessagePoolFreeList_t &depot: s_messagePoolDepot )
+		{
+			while ( MessagePoolFreeBlock_t *p = depot.Pop() )
+			{
+				p->m_pNext = pFree;
+				pFree = p;
+			}
+		}
+	}
+	while ( pFree )
+	{
+		MessagePoolFreeBlock_t *p = pFree;
+		pFree = p->m_pNext;
+		free( p );
+	}
+}
+
 void CSteamNetworkingMessage::DefaultFreeData( SteamNetworkingMessage_t *pMsg )
 {
-	free( pMsg->m_pData );
+	FreeBuffer( pMsg->m_pData );
+}
+
+void *CSteamNetworkingMessage::AllocSharedBuffer( uint32 cbSize )
+{
+	void *pBuf = AllocBuffer( cbSize );
+	if ( pBuf )
+	{
+		MessageBufferHeader_t *pHdr = static_cast<MessageBufferHeader_t *>( pBuf ) - 1;
+		pHdr->m_nRefCount.store( 1, std::memory_order_relaxed );
+	}
+	return pBuf;
+}
+
+void CSteamNetworkingMessage::AddRefSharedBuffer( void *pBuf )
+{
+	MessageBufferHeader_t *pHdr = static_cast<MessageBufferHeader_t *>( pBuf ) - 1;
+	DbgAssert( pHdr->m_nRefCount.load( std::memory_order_relaxed ) > 0 );
+	pHdr->m_nRefCount.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void CSteamNetworkingMessage::ReleaseSharedBuffer( void *pBuf )
+{
+	// Messages might be released on any thread
+	MessageBufferHeader_t *pHdr = static_cast<MessageBufferHeader_t *>( pBuf ) - 1;
+	uint32 nOldRefCount = pHdr->m_nRefCount.fetch_sub( 1, std::memory_order_acq_rel );
+	Assert( nOldRefCount > 0 );
+	if ( nOldRefCount == 1 )
+		FreeBuffer( pBuf );
+}
+
+static void FreeSharedBufferData( SteamNetworkingMessage_t *pIMsg )
+{
+	CSteamNetworkingMessage *pMsg = static_cast<CSteamNetworkingMessage *>( pIMsg );
+	CSteamNetworkingMessage::ReleaseSharedBuffer( pMsg->m_pSharedBuffer );
+	pMsg->m_pSharedBuffer = nullptr;
+}
+
+void *RecvPacketContext_t::GetPlainTextSharedBuffer( const void **ppData )
+{
+	// Only decrypted data can be shared.  Otherwise the
+	// plaintext belongs to the caller.
+	const uint8 *pData = static_cast<const uint8 *>( *ppData );
+	if ( m_pPlainText != m_decrypted || pData < m_decrypted || pData >= m_decrypted + m_cbPlainText )
+		return nullptr;
+
+	// First message that wants it?  Copy the packet into a shared buffer.
+	if ( !m_pPlainTextSharedBuffer )
+	{
+		m_pPlainTextSharedBuffer = CSteamNetworkingMessage::AllocSharedBuffer( m_cbPlainText );
+		if ( !m_pPlainTextSharedBuffer )
+			return nullptr;
+		memcpy( m_pPlainTextSharedBuffer, m_decrypted, m_cbPlainText );
+	}
+
+	*ppData = static_cast<const uint8 *>( m_pPlainTextSharedBuffer ) + ( pData - m_decrypted );
+	return m_pPlainTextSharedBuffer;
+}
+
+void CSteamNetworkingMessage::SetSharedBufferData( void *pSharedBuffer, void *pData, uint32 cbSize )
+{
+	Assert( m_pData == nullptr && m_pSharedBuffer == nullptr );
+	AddRefSharedBuffer( pSharedBuffer );
+	m_pSharedBuffer = pSharedBuffer;
+	m_pData = pData;
+	m_cbSize = cbSize;
+	m_pfnFreeData = FreeSharedBufferData;
 }
 
 
@@ -99,15 +503,21 @@ void CSteamNetworkingMessage::ReleaseFunc( SteamNetworkingMessage_t *pIMsg )
 	Assert( !pMsg->m_linksSecondaryQueue.m_pPrev );
 	Assert( !pMsg->m_linksSecondaryQueue.m_pNext );
 
-	// Self destruct
-	// FIXME Should avoid this dynamic memory call with some sort of pooling
-	delete pMsg;
+	// Self destruct, returning the memory to the pool
+	pMsg->~CSteamNetworkingMessage();
+	MessagePoolFree( pMsg, k_nMessagePoolClass_Message );
 }
 
 CSteamNetworkingMessage *CSteamNetworkingMessage::New( uint32 cbSize )
 {
-	// FIXME Should avoid this dynamic memory call with some sort of pooling
-	CSteamNetworkingMessage *pMsg = new CSteamNetworkingMessage;
+	void *pMem = MessagePoolAlloc( k_nMessagePoolClass_Message );
+	if ( !pMem )
+	{
+		SpewError( "Failed to allocate message" );
+		return nullptr;
+	}
+	CSteamNetworkingMessage *pMsg = ::new( pMem ) CSteamNetworkingMessage;
+	pMsg->m_pSharedBuffer = nullptr;
 
 	// NOTE: Intentionally not memsetting the whole thing;
 	// this struct is pretty big.
@@ -115,10 +525,11 @@ CSteamNetworkingMessage *CSteamNetworkingMessage::New( uint32 cbSize )
 	// Allocate buffer if requested
 	if ( cbSize )
 	{
-		pMsg->m_pData = malloc( cbSize );
+		pMsg->m_pData = AllocBuffer( cbSize );
 		if ( pMsg->m_pData == nullptr )
 		{
-			delete pMsg;
+			pMsg->~CSteamNetworkingMessage();
+			MessagePoolFree( pMsg, k_nMessagePoolClass_Message );
 			SpewError( "Failed to allocate %d-byte message buffer", cbSize );
 			return nullptr;
 		}
@@ -160,8 +571,6 @@ void CSteamNetworkingMessage::Unlink()
 	UnlinkFromQueue( &CSteamNetworkingMessage::m_linksSecondaryQueue );
 }
 
-ShortDurationLock g_lockAllRecvMessageQueues( "all_recv_msg_queue" );
-
 void SteamNetworkingMessageQueue::AssertLockHeld() const
 {
 	if ( m_pRequiredLock )
@@ -210,12 +619,13 @@ int SteamNetworkingMessageQueue::RemoveMessages( SteamNetworkingMessage_t **ppOu
 
 CSteamNetworkPollGroup::CSteamNetworkPollGroup( CSteamNetworkingSockets *pInterface )
 : m_pSteamNetworkingSocketsInterface( pInterface )
+, m_lockRecvMessages( "pollgroup_recv_msg_queue" )
 , m_hPollGroupSelf( k_HSteamListenSocket_Invalid )
 {
 	// Object creation is rare; to keep things simple we require the global lock
 	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
 
-	m_queueRecvMessages.m_pRequiredLock = &g_lockAllRecvMessageQueues;
+	m_queueRecvMessages.m_pRequiredLock = &m_lockRecvMessages;
 }
 
 CSteamNetworkPollGroup::~CSteamNetworkPollGroup()
@@ -235,7 +645,7 @@ CSteamNetworkPollGroup::~CSteamNetworkPollGroup()
 
 	// We should not have any messages now!  but if we do, unlink them
 	{
-		ShortDurationScopeLock lockMessageQueues( g_lockAllRecvMessageQueues );
+		ShortDurationScopeLock lockMessageQueues( m_lockRecvMessages );
 		Assert( m_queueRecvMessages.empty() );
 
 		// But if we do, unlink them but leave them in the main queue.
@@ -545,6 +955,7 @@ void CSteamNetworkListenSocketBase::AboutToDestroyChildConnection( CSteamNetwork
 CSteamNetworkConnectionBase::CSteamNetworkConnectionBase( CSteamNetworkingSockets *pSteamNetworkingSocketsInterface, ConnectionScopeLock &scopeLock )
 : ILockableThinker( m_defaultLock )
 , m_pSteamNetworkingSocketsInterface( pSteamNetworkingSocketsInterface )
+, m_lockRecvMessages( "connection_recv_msg_queue" )
 {
 	m_hConnectionSelf = k_HSteamNetConnection_Invalid;
 	m_eConnectionState = k_ESteamNetworkingConnectionState_None;
@@ -570,11 +981,14 @@ CSteamNetworkConnectionBase::CSteamNetworkConnectionBase( CSteamNetworkingSocket
 	m_bCryptKeysValid = false;
 	m_eNegotiatedCipher = k_ESteamNetworkingSocketsCipher_INVALID;
 	m_cbEncryptionOverhead = k_cbAESGCMTagSize;
+	m_pCryptoHandshakeVerifyJob = nullptr;
+	m_bPremasterSecretValid = false;
 	memset( m_szAppName, 0, sizeof( m_szAppName ) );
 	memset( m_szDescription, 0, sizeof( m_szDescription ) );
 	m_bConnectionInitiatedRemotely = false;
 	m_pTransport = nullptr;
 	m_nSupressStateChangeCallbacks = 0;
+	m_queueRecvMessages.m_pRequiredLock = &m_lockRecvMessages;
  
 	// Initialize configuration using parent interface for now.
 	m_connectionConfig.Init( &m_pSteamNetworkingSocketsInterface->m_connectionConfig );
@@ -717,9 +1131,9 @@ void CSteamNetworkConnectionBase::FreeResources()
 	#endif
 
 	// Discard any messages that weren't retrieved
-	g_lockAllRecvMessageQueues.lock();
+	m_queueRecvMessages.m_pRequiredLock->lock();
 	m_queueRecvMessages.PurgeMessages();
-	g_lockAllRecvMessageQueues.unlock();
+	m_queueRecvMessages.m_pRequiredLock->unlock();
 
 	// If we are in a poll group, remove us from the group
 	RemoveFromPollGroup();
@@ -754,7 +1168,8 @@ void CSteamNetworkConnectionBase::RemoveFromPollGroup()
 
 	// Scan all of our messages, and make sure they are not in the secondary queue
 	{
-		ShortDurationScopeLock lockMessageQueues( g_lockAllRecvMessageQueues );
+		ShortDurationScopeLock lockMessageQueues( m_pPollGroup->m_lockRecvMessages );
+		Assert( m_queueRecvMessages.m_pRequiredLock == &m_pPollGroup->m_lockRecvMessages );
 		for ( CSteamNetworkingMessage *pMsg = m_queueRecvMessages.m_pFirst ; pMsg ; pMsg = pMsg->m_links.m_pNext )
 		{
 			Assert( pMsg->m_links.m_pQueue == &m_queueRecvMessages );
@@ -765,6 +1180,11 @@ void CSteamNetworkConnectionBase::RemoveFromPollGroup()
 			// OK, do the work
 			pMsg->UnlinkFromQueue( &CSteamNetworkingMessage::m_linksSecondaryQueue );
 		}
+
+		// Our queue is now protected by our own lock.  Nobody else can be
+		// looking at the queue right now, since we hold our lock and the
+		// poll group lock.
+		m_queueRecvMessages.m_pRequiredLock = &m_lockRecvMessages;
 	}
 
 	// Remove us from the poll group's list.  DbgVerify because we should be in the list!
@@ -796,6 +1216,23 @@ void CSteamNetworkConnectionBase::SetPollGroup( CSteamNetworkPollGroup *pPollGro
 	if ( m_pPollGroup )
 		pollGroupLockOld.Lock( m_pPollGroup->m_lock );
 
+	// Unlink all of our messages from the old poll group queue, if any.
+	// Each poll group has its own queue lock, and we may not hold two of
+	// them at once.  But since we hold the connection lock and both poll group
+	// locks, nobody else can access our queue while the messages are only
+	// linked into it.
+	if ( m_pPollGroup )
+	{
+		ShortDurationScopeLock lockMessageQueues( m_pPollGroup->m_lockRecvMessages );
+		Assert( m_queueRecvMessages.m_pRequiredLock == &m_pPollGroup->m_lockRecvMessages );
+		for ( CSteamNetworkingMessage *pMsg = m_queueRecvMessages.m_pFirst ; pMsg ; pMsg = pMsg->m_links.m_pNext )
+		{
+			Assert( pMsg->m_links.m_pQueue == &m_queueRecvMessages );
+			Assert( pMsg->m_linksSecondaryQueue.m_pQueue == &m_pPollGroup->m_queueRecvMessages );
+			pMsg->UnlinkFromQueue( &CSteamNetworkingMessage::m_linksSecondaryQueue );
+		}
+	}
+
 	// Scan all messages that are already queued for this connection,
 	// and insert them into the poll groups queue in the (approximate)
 	// appropriate spot.  Using local timestamps should be really close
@@ -805,22 +1242,12 @@ void CSteamNetworkConnectionBase::SetPollGroup( CSteamNetworkPollGroup *pPollGro
 	// really anybody who is expecting or relying on such guarantees
 	// is probably doing something wrong.
 	{
-		ShortDurationScopeLock lockMessageQueues( g_lockAllRecvMessageQueues );
+		ShortDurationScopeLock lockMessageQueues( pPollGroup->m_lockRecvMessages );
 		CSteamNetworkingMessage *pInsertBefore = pPollGroup->m_queueRecvMessages.m_pFirst;
 		for ( CSteamNetworkingMessage *pMsg = m_queueRecvMessages.m_pFirst ; pMsg ; pMsg = pMsg->m_links.m_pNext )
 		{
 			Assert( pMsg->m_links.m_pQueue == &m_queueRecvMessages );
-
-			// Unlink it from existing poll group queue, if any
-			if ( pMsg->m_linksSecondaryQueue.m_pQueue )
-			{
-				Assert( m_pPollGroup && pMsg->m_linksSecondaryQueue.m_pQueue == &m_pPollGroup->m_queueRecvMessages );
-				pMsg->UnlinkFromQueue( &CSteamNetworkingMessage::m_linksSecondaryQueue );
-			}
-			else
-			{
-				Assert( !m_pPollGroup );
-			}
+			Assert( pMsg->m_linksSecondaryQueue.m_pQueue == nullptr );
 
 			// Scan forward in the poll group message queue, until we find the insertion point
 			for (;;)
@@ -843,6 +1270,9 @@ void CSteamNetworkConnectionBase::SetPollGroup( CSteamNetworkPollGroup *pPollGro
 				pInsertBefore = pInsertBefore->m_linksSecondaryQueue.m_pNext;
 			}
 		}
+
+		// From now on, our queue is protected by the poll group's lock
+		m_queueRecvMessages.m_pRequiredLock = &pPollGroup->m_lockRecvMessages;
 	}
 
 	// Tell previous poll group, if any, that we are no longer with them
@@ -1032,6 +1462,7 @@ void CSteamNetworkConnectionBase::ClearCrypto()
 	m_bCertHasIdentity = false;
 	m_bRemoteCertHasTrustedCASignature = false;
 	m_keyPrivate.Wipe();
+	m_pCryptoHandshakeVerifyJob = nullptr;
 	ClearLocalCrypto();
 }
 
@@ -1041,6 +1472,8 @@ void CSteamNetworkConnectionBase::ClearLocalCrypto()
 	m_eNegotiatedCipher = k_ESteamNetworkingSocketsCipher_INVALID;
 	m_cbEncryptionOverhead = k_cbAESGCMTagSize;
 	m_keyExchangePrivateKeyLocal.Wipe();
+	m_premasterSecret.Wipe();
+	m_bPremasterSecretValid = false;
 	m_msgCryptLocal.Clear();
 	m_msgSignedCryptLocal.Clear();
 	m_bCryptKeysValid = false;
@@ -1259,11 +1692,16 @@ void CSteamNetworkConnectionBase::FinalizeLocalCrypto()
 	// Set protocol version
 	m_msgCryptLocal.set_protocol_version( k_nCurrentProtocolVersion );
 
-	// Generate a keypair for key exchange
-	CECKeyExchangePublicKey publicKeyLocal;
-	CCrypto::GenerateKeyExchangeKeyPair( &publicKeyLocal, &m_keyExchangePrivateKeyLocal );
-	m_msgCryptLocal.set_key_type( CMsgSteamDatagramSessionCryptInfo_EKeyType_CURVE25519 );
-	publicKeyLocal.GetRawDataAsStdString( m_msgCryptLocal.mutable_key_data() );
+	// Generate a keypair for key exchange.  If a crypto worker thread already
+	// did the key exchange, it generated the keypair, too.
+	if ( !m_bPremasterSecretValid )
+	{
+		CECKeyExchangePublicKey publicKeyLocal;
+		CCrypto::GenerateKeyExchangeKeyPair( &publicKeyLocal, &m_keyExchangePrivateKeyLocal );
+		m_msgCryptLocal.set_key_type( CMsgSteamDatagramSessionCryptInfo_EKeyType_CURVE25519 );
+		publicKeyLocal.GetRawDataAsStdString( m_msgCryptLocal.mutable_key_data() );
+	}
+	Assert( m_msgCryptLocal.has_key_data() );
 
 	// Generate some more randomness for the secret key
 	uint64 crypt_nonce;
@@ -1356,7 +1794,9 @@ ESteamNetConnectionEnd CSteamNetworkConnectionBase::RecvCryptoHandshake(
 	const CMsgSteamDatagramCertificateSigned &msgCert,
 	const CMsgSteamDatagramSessionCryptInfoSigned &msgSessionInfo,
 	bool bServer,
-	SteamNetworkingErrMsg &errMsg )
+	SteamNetworkingErrMsg &errMsg,
+	bool bAllowDeferVerify,
+	const CryptoHandshakeVerifyJob_t *pVerifiedJob )
 {
 	AssertLocksHeldByCurrentThread( "BRecvCryptoHandshake" );
 	SteamNetworkingErrMsg tmpErrMsg;
@@ -1477,14 +1917,47 @@ ESteamNetConnectionEnd CSteamNetworkConnectionBase::RecvCryptoHandshake(
 	if ( eRemoteCertFailure )
 		return eRemoteCertFailure;
 
+	// Remember if we they were authenticated
+	m_bRemoteCertHasTrustedCASignature = ( pCACertAuthScope != nullptr );
+
+	// Did a worker thread already check the signature, before we were created?
+	// Make sure it checked exactly what we were sent.
+	if (
+		pVerifiedJob
+		&& pVerifiedJob->m_sCryptRemote == m_sCryptRemote
+		&& pVerifiedJob->m_eKeyType == m_msgCertRemote.key_type()
+		&& pVerifiedJob->m_sPublicKey == m_msgCertRemote.key_data()
+		&& pVerifiedJob->m_sSignature == msgSessionInfo.signature()
+	) {
+		if ( !pVerifiedJob->m_bSignatureOK )
+		{
+			V_strcpy_safe( errMsg, pVerifiedJob->m_errMsg );
+			return k_ESteamNetConnectionEnd_Remote_BadCrypt;
+		}
+		TakeCryptoHandshakeVerifyKeyExchange( *pVerifiedJob );
+		return RecvCryptoHandshakeVerified( bServer, errMsg );
+	}
+
+	// On the server, hand the rest of the expensive work off to a worker thread,
+	// if we can.  It will finish up in CryptoHandshakeVerifyFinished
+	if ( bAllowDeferVerify && m_bConnectionInitiatedRemotely && GlobalConfig::CryptoWorkerThreads.Get() > 0 )
+	{
+		QueueCryptoHandshakeVerify( msgSessionInfo, bServer );
+		return k_ESteamNetConnectionEnd_Invalid;
+	}
+
 	// Check the signature of the crypt info
 	if ( !BCheckSignature( m_sCryptRemote, m_msgCertRemote.key_type(), m_msgCertRemote.key_data(), msgSessionInfo.signature(), errMsg ) )
 	{
 		return k_ESteamNetConnectionEnd_Remote_BadCrypt;
 	}
 
-	// Remember if we they were authenticated
-	m_bRemoteCertHasTrustedCASignature = ( pCACertAuthScope != nullptr );
+	return RecvCryptoHandshakeVerified( bServer, errMsg );
+}
+
+ESteamNetConnectionEnd CSteamNetworkConnectionBase::RecvCryptoHandshakeVerified( bool bServer, SteamNetworkingErrMsg &errMsg )
+{
+	AssertLocksHeldByCurrentThread( "RecvCryptoHandshakeVerified" );
 
 	// Deserialize crypt info
 	if ( !m_msgCryptRemote.ParseFromString( m_sCryptRemote ) )
@@ -1570,6 +2043,227 @@ ESteamNetConnectionEnd CSteamNetworkConnectionBase::RecvCryptoHandshake(
 	return k_ESteamNetConnectionEnd_Invalid;
 }
 
+int CryptoHandshakeVerifyJob_t::AddSignatureToBatch( CECSigningBatchVerifier &batch ) const
+{
+	// Anything unusual, just let BCheckSignature deal with it and
+	// report the problem
+	CECSigningPublicKey keyPublic;
+	if (
+		m_eKeyType != CMsgSteamDatagramCertificate_EKeyType_ED25519
+		|| m_sSignature.length() != sizeof(CryptoSignature_t)
+		|| !keyPublic.SetRawDataWithoutWipingInput( m_sPublicKey.c_str(), m_sPublicKey.length() )
+	) {
+		return -1;
+	}
+	return batch.Add( keyPublic, m_sCryptRemote.c_str(), m_sCryptRemote.length(), *(const CryptoSignature_t *)m_sSignature.c_str() );
+}
+
+void CryptoHandshakeVerifyJob_t::Run()
+{
+	if ( !m_bSignatureOK )
+		return;
+
+	// Go ahead and do the key exchange now, too.  If anything is wrong
+	// with their key, just skip it, and FinishCryptoHandshake will do it
+	// the slow way and report the problem.
+	CMsgSteamDatagramSessionCryptInfo msgCryptRemote;
+	CECKeyExchangePublicKey keyExchangePublicKeyRemote;
+	if (
+		!msgCryptRemote.ParseFromString( m_sCryptRemote )
+		|| msgCryptRemote.key_type() != CMsgSteamDatagramSessionCryptInfo_EKeyType_CURVE25519
+		|| !keyExchangePublicKeyRemote.SetRawDataWithoutWipingInput( msgCryptRemote.key_data().c_str(), msgCryptRemote.key_data().length() )
+	) {
+		return;
+	}
+	CECKeyExchangePublicKey keyExchangePublicKeyLocal;
+	CECKeyExchangePrivateKey keyExchangePrivateKeyLocal;
+	CCrypto::GenerateKeyExchangeKeyPair( &keyExchangePublicKeyLocal, &keyExchangePrivateKeyLocal );
+	if ( !CCrypto::PerformKeyExchange( keyExchangePrivateKeyLocal, keyExchangePublicKeyRemote, &m_premasterSecret.m_buf ) )
+		return;
+	keyExchangePublicKeyLocal.GetRawDataAsStdString( &m_sKeyExchangePublicKeyLocal );
+	m_bPremasterSecretValid = true;
+}
+
+void CryptoHandshakeVerifyJob_t::Finished()
+{
+	// Connection might have been destroyed in the meantime
+	ConnectionScopeLock connectionLock;
+	CSteamNetworkConnectionBase *pConn = FindConnectionByLocalID( m_unConnectionIDLocal, connectionLock );
+	if ( pConn )
+		pConn->CryptoHandshakeVerifyFinished( *this );
+}
+
+typedef std::vector< std::unique_ptr<CryptoHandshakeVerifyJob_t> > CryptoHandshakeVerifyJobList_t;
+
+/// Handshakes received during this poll iteration.  Their signatures
+/// will be checked together at the end of the iteration.  Protected
+/// by the global lock
+static CryptoHandshakeVerifyJobList_t s_vecPendingCryptoHandshakeVerify;
+
+/// Runs with the global lock held, once a worker thread has finished a batch
+struct CryptoHandshakeVerifyFinishedTask : CQueuedTask
+{
+	CryptoHandshakeVerifyJobList_t m_vecJobs;
+	virtual void Run()
+	{
+		for ( std::unique_ptr<CryptoHandshakeVerifyJob_t> &pJob: m_vecJobs )
+			pJob->Finished();
+	}
+};
+
+/// Runs on a crypto worker thread, with no locks held
+struct CryptoHandshakeVerifyTask : CQueuedTask
+{
+	CryptoHandshakeVerifyJobList_t m_vecJobs;
+	virtual void Run()
+	{
+		// Check all the signatures at once
+		Assert( len( m_vecJobs ) <= CECSigningBatchVerifier::k_nMaxBatch );
+		CECSigningBatchVerifier batch;
+		int idxBatch[ CECSigningBatchVerifier::k_nMaxBatch ];
+		bool bValid[ CECSigningBatchVerifier::k_nMaxBatch ];
+		for ( int i = 0 ; i < len( m_vecJobs ) ; ++i )
+		{
+			CryptoHandshakeVerifyJob_t &job = *m_vecJobs[i];
+			idxBatch[i] = job.AddSignatureToBatch( batch );
+			if ( idxBatch[i] < 0 )
+				job.m_bSignatureOK = BCheckSignature( job.m_sCryptRemote, job.m_eKeyType, job.m_sPublicKey, job.m_sSignature, job.m_errMsg );
+		}
+		if ( batch.Count() > 0 )
+			batch.Verify( bValid );
+
+		for ( int i = 0 ; i < len( m_vecJobs ) ; ++i )
+		{
+			CryptoHandshakeVerifyJob_t &job = *m_vecJobs[i];
+			if ( idxBatch[i] >= 0 )
+			{
+				job.m_bSignatureOK = bValid[ idxBatch[i] ];
+				if ( !job.m_bSignatureOK )
+					V_strcpy_safe( job.m_errMsg, "Invalid signature" );
+			}
+			job.Run();
+		}
+
+		// Hand the results back
+		CryptoHandshakeVerifyFinishedTask *pTask = new CryptoHandshakeVerifyFinishedTask;
+		pTask->m_vecJobs = std::move( m_vecJobs );
+		pTask->QueueToRunWithGlobalLock( "CryptoHandshakeVerifyFinished" );
+	}
+};
+
+/// Send the handshakes we have accumulated off to a worker thread
+static void FlushPendingCryptoHandshakeVerify()
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+	if ( s_vecPendingCryptoHandshakeVerify.empty() )
+		return;
+
+	CryptoHandshakeVerifyTask *pTask = new CryptoHandshakeVerifyTask;
+	pTask->m_vecJobs = std::move( s_vecPendingCryptoHandshakeVerify );
+	s_vecPendingCryptoHandshakeVerify.clear();
+	pTask->QueueToRunOnWorkerThread();
+}
+
+/// Runs with the global lock held, at the end of the poll iteration
+/// in which we started accumulating handshakes
+struct CryptoHandshakeVerifyFlushTask : CQueuedTask
+{
+	virtual void Run()
+	{
+		FlushPendingCryptoHandshakeVerify();
+	}
+};
+
+void QueueCryptoHandshakeVerifyJob( CryptoHandshakeVerifyJob_t *pJob )
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+	Assert( GlobalConfig::CryptoWorkerThreads.Get() > 0 );
+
+	// Add it to the batch for this poll iteration.  When the first one
+	// arrives, schedule the batch to be sent off once we've processed
+	// all the packets we received.  If the batch fills up, don't wait.
+	s_vecPendingCryptoHandshakeVerify.emplace_back( pJob );
+	if ( len( s_vecPendingCryptoHandshakeVerify ) >= CECSigningBatchVerifier::k_nMaxBatch )
+	{
+		FlushPendingCryptoHandshakeVerify();
+	}
+	else if ( len( s_vecPendingCryptoHandshakeVerify ) == 1 )
+	{
+		CryptoHandshakeVerifyFlushTask *pFlushTask = new CryptoHandshakeVerifyFlushTask;
+		pFlushTask->QueueToRunWithGlobalLock( "CryptoHandshakeVerifyFlush" );
+	}
+}
+
+void CSteamNetworkConnectionBase::QueueCryptoHandshakeVerify( const CMsgSteamDatagramSessionCryptInfoSigned &msgSessionInfo, bool bServer )
+{
+	AssertLocksHeldByCurrentThread( "QueueCryptoHandshakeVerify" );
+	Assert( !m_pCryptoHandshakeVerifyJob );
+
+	CryptoHandshakeVerifyJob_t *pJob = new CryptoHandshakeVerifyJob_t;
+	CryptoHandshakeVerifyJob_t &job = *pJob;
+	job.m_unConnectionIDLocal = m_unConnectionIDLocal;
+	job.m_bServer = bServer;
+	job.m_sCryptRemote = m_sCryptRemote;
+	job.m_eKeyType = m_msgCertRemote.key_type();
+	job.m_sPublicKey = m_msgCertRemote.key_data();
+	job.m_sSignature = msgSessionInfo.signature();
+
+	// From now until the job is finished, the app doesn't know about us
+	m_pCryptoHandshakeVerifyJob = &job;
+	QueueCryptoHandshakeVerifyJob( pJob );
+}
+
+void CSteamNetworkConnectionBase::TakeCryptoHandshakeVerifyKeyExchange( const CryptoHandshakeVerifyJob_t &job )
+{
+	if ( !job.m_bPremasterSecretValid )
+		return;
+	m_msgCryptLocal.set_key_type( CMsgSteamDatagramSessionCryptInfo_EKeyType_CURVE25519 );
+	m_msgCryptLocal.set_key_data( job.m_sKeyExchangePublicKeyLocal );
+	memcpy( m_premasterSecret.m_buf, job.m_premasterSecret.m_buf, m_premasterSecret.k_nSize );
+	m_bPremasterSecretValid = true;
+}
+
+void CSteamNetworkConnectionBase::CryptoHandshakeVerifyFinished( CryptoHandshakeVerifyJob_t &job )
+{
+	AssertLocksHeldByCurrentThread( "CryptoHandshakeVerifyFinished" );
+	if ( m_pCryptoHandshakeVerifyJob != &job )
+		return;
+
+	SteamNetworkingErrMsg errMsg;
+	ESteamNetConnectionEnd eFailure;
+	if ( GetState() != k_ESteamNetworkingConnectionState_Connecting )
+	{
+		// Timed out, or something else went wrong while we were waiting
+		V_sprintf_safe( errMsg, "Connection entered state %d while verifying handshake", (int)GetState() );
+		eFailure = k_ESteamNetConnectionEnd_Misc_Generic;
+	}
+	else if ( !job.m_bSignatureOK )
+	{
+		V_strcpy_safe( errMsg, job.m_errMsg );
+		eFailure = k_ESteamNetConnectionEnd_Remote_BadCrypt;
+	}
+	else
+	{
+		TakeCryptoHandshakeVerifyKeyExchange( job );
+		eFailure = RecvCryptoHandshakeVerified( job.m_bServer, errMsg );
+	}
+
+	// If it didn't work out, just quietly discard the connection, the same
+	// as if we had failed to accept it in the first place.  The app never
+	// knew about it.  (We're still marked as verifying, so no callbacks
+	// will be posted.)
+	if ( eFailure != k_ESteamNetConnectionEnd_Invalid )
+	{
+		SpewWarning( "[%s] Failed to accept connection.  %s\n", GetDescription(), errMsg );
+		ConnectionQueueDestroy();
+		return;
+	}
+
+	// Now we can tell the app about it
+	m_pCryptoHandshakeVerifyJob = nullptr;
+	PostConnectionStateChangedCallback( k_ESteamNetworkingConnectionState_None, k_ESteamNetworkingConnectionState_Connecting );
+}
+
 ESteamNetConnectionEnd CSteamNetworkConnectionBase::FinishCryptoHandshake( bool bServer, SteamNetworkingErrMsg &errMsg )
 {
 	AssertLocksHeldByCurrentThread( "BFinishCryptoHandshake" );
@@ -1643,8 +2337,15 @@ ESteamNetConnectionEnd CSteamNetworkConnectionBase::FinishCryptoHandshake( bool
 	}
 
 	// DiffieHellman key exchange to get "premaster secret"
+	// (Unless a crypto worker thread already did it.)
 	AutoWipeFixedSizeBuffer<sizeof(SHA256Digest_t)> premasterSecret;
-	if ( !CCrypto::PerformKeyExchange( m_keyExchangePrivateKeyLocal, keyExchangePublicKeyRemote, &premasterSecret.m_buf ) )
+	if ( m_bPremasterSecretValid )
+	{
+		memcpy( premasterSecret.m_buf, m_premasterSecret.m_buf, premasterSecret.k_nSize );
+		m_premasterSecret.Wipe();
+		m_bPremasterSecretValid = false;
+	}
+	else if ( !CCrypto::PerformKeyExchange( m_keyExchangePrivateKeyLocal, keyExchangePublicKeyRemote, &premasterSecret.m_buf ) )
 	{
 		V_strcpy_safe( errMsg, "Key exchange failed" );
 		return k_ESteamNetConnectionEnd_Remote_BadCrypt;
@@ -1831,13 +2532,12 @@ void CSteamNetworkConnectionBase::SetUserData( int64 nUserData )
 	// of the queue yet.  This way we don't expose the client to weird
 	// race conditions where they create a connection, and before they
 	// are able to install their user data, some messages come in
-	g_lockAllRecvMessageQueues.lock();
+	ShortDurationScopeLock lockMessageQueues( *m_queueRecvMessages.m_pRequiredLock );
 	for ( CSteamNetworkingMessage *m = m_queueRecvMessages.m_pFirst ; m ; m = m->m_links.m_pNext )
 	{
 		Assert( m->m_conn == m_hConnectionSelf );
 		m->m_nConnUserData = nUserData;
 	}
-	g_lockAllRecvMessageQueues.unlock();
 }
 
 void CConnectionTransport::TransportConnectionStateChanged( ESteamNetworkingConnectionState eOldState )
@@ -1852,6 +2552,11 @@ bool CConnectionTransport::BCanSendEndToEndConnectRequest() const
 	return false;
 }
 
+bool CConnectionTransport::BSupportsTxTime() const
+{
+	return false;
+}
+
 void CConnectionTransport::SendEndToEndConnectRequest( SteamNetworkingMicroseconds usecNow )
 {
 	// You should override this, or your connection should not call it!
@@ -2115,10 +2820,12 @@ int CSteamNetworkConnectionBase::APIReceiveMessages( SteamNetworkingMessage_t **
 	// Connection must be locked, but we don't require the global lock here!
 	m_pLock->AssertHeldByCurrentThread();
 
-	g_lockAllRecvMessageQueues.lock();
-	
+	// Our lock keeps us from being moved to a different poll group while
+	// we're doing this, so it's safe to look at m_pRequiredLock
+	ShortDurationLock &lockRecvMessages = *m_queueRecvMessages.m_pRequiredLock;
+	lockRecvMessages.lock();
 	int result = m_queueRecvMessages.RemoveMessages( ppOutMessages, nMaxMessages );
-	g_lockAllRecvMessageQueues.unlock();
+	lockRecvMessages.unlock();
 
 	return result;
 }
@@ -2265,6 +2972,13 @@ EResult CSteamNetworkConnectionBase::APIAcceptConnection()
 		return k_EResultInvalidParam;
 	}
 
+	// We haven't told the app about this connection yet!
+	if ( BCryptoHandshakeVerifying() )
+	{
+		SpewError( "[%s] Cannot accept connection, still verifying handshake.\n", GetDescription() );
+		return k_EResultInvalidState;
+	}
+
 	// Select the cipher.  We needed to wait until now to do it, because the app
 	// might have set connection options on a new connection.
 	Assert( m_eNegotiatedCipher == k_ESteamNetworkingSocketsCipher_INVALID );
@@ -2509,9 +3223,10 @@ void CSteamNetworkConnectionBase::SetState( ESteamNetworkingConnectionState eNew
 	const ESteamNetworkingConnectionState eOldAPIState = CollapseConnectionStateToAPIState( eOldState );
 	const ESteamNetworkingConnectionState eNewAPIState = CollapseConnectionStateToAPIState( GetState() );
 
-	// Callbacks temporarily suppressed?
+	// Callbacks temporarily suppressed?  Or the app doesn't know
+	// about us yet, because we are still verifying the handshake?
 	Assert( m_nSupressStateChangeCallbacks >= 0 );
-	if ( m_nSupressStateChangeCallbacks == 0 )
+	if ( m_nSupressStateChangeCallbacks == 0 && !BCryptoHandshakeVerifying() )
 	{
 		// If connection is associated with an ad-hoc-style messages endpoint,
 		// let them process the state change
@@ -2538,9 +3253,9 @@ void CSteamNetworkConnectionBase::SetState( ESteamNetworkingConnectionState eNew
 	// discard any unread received messages
 	if ( eNewAPIState == k_ESteamNetworkingConnectionState_None )
 	{
-		g_lockAllRecvMessageQueues.lock();
+		m_queueRecvMessages.m_pRequiredLock->lock();
 		m_queueRecvMessages.PurgeMessages();
-		g_lockAllRecvMessageQueues.unlock();
+		m_queueRecvMessages.m_pRequiredLock->unlock();
 	}
 
 	// Slam some stuff when we are in various states
@@ -2617,7 +3332,7 @@ void CSteamNetworkConnectionBase::ConnectionStateChanged( ESteamNetworkingConnec
 		m_pTransport->TransportConnectionStateChanged( eOldState );
 }
 
-CSteamNetworkingMessage *CSteamNetworkConnectionBase::AllocateNewRecvMessage( uint32 cbSize, int nFlags, SteamNetworkingMicroseconds usecNow )
+CSteamNetworkingMessage *CSteamNetworkConnectionBase::AllocateNewRecvMessage( uint32 cbSize, int nFlags, SteamNetworkingMicroseconds usecNow, bool bAllocBuffer )
 {
 	//
 	// Check limits
@@ -2638,7 +3353,7 @@ CSteamNetworkingMessage *CSteamNetworkConnectionBase::AllocateNewRecvMessage( ui
 		return nullptr;
 	}
 
-	CSteamNetworkingMessage *pMsg = CSteamNetworkingMessage::New( cbSize );
+	CSteamNetworkingMessage *pMsg = CSteamNetworkingMessage::New( bAllocBuffer ? cbSize : 0 );
 
 	if ( !pMsg )
 	{
@@ -2654,11 +3369,27 @@ CSteamNetworkingMessage *CSteamNetworkConnectionBase::AllocateNewRecvMessage( ui
 	return pMsg;
 }
 
-bool CSteamNetworkConnectionBase::ReceivedMessageData( const void *pData, int cbData, int idxLane, int64 nMsgNum, int nFlags, SteamNetworkingMicroseconds usecNow )
+bool CSteamNetworkConnectionBase::ReceivedMessageData( const void *pData, int cbData, int idxLane, int64 nMsgNum, int nFlags, SteamNetworkingMicroseconds usecNow, RecvPacketContext_t *pCtx )
 {
 
+	// If the data came from a decrypted packet, we can point the message at a
+	// shared copy of the packet, instead of copying.  Small messages are cheap to
+	// copy, and we don't want them to pin an entire packet buffer, so only do
+	// this for big ones.
+	if ( cbData < k_cbMinSharedBufferRecvMessage )
+		pCtx = nullptr;
+
+	// Messages for a SteamNetworkingMessages session have their header
+	// stripped off, and are expected to own their buffer
+	#ifdef STEAMNETWORKINGSOCKETS_ENABLE_STEAMNETWORKINGMESSAGES
+		if ( m_pMessagesEndPointSessionOwner )
+			pCtx = nullptr;
+	#endif
+
+	void *pSharedBuffer = pCtx ? pCtx->GetPlainTextSharedBuffer( &pData ) : nullptr;
+
 	// Create a message
-	CSteamNetworkingMessage *pMsg = AllocateNewRecvMessage( cbData, nFlags, usecNow );
+	CSteamNetworkingMessage *pMsg = AllocateNewRecvMessage( cbData, nFlags, usecNow, pSharedBuffer == nullptr );
 	if ( !pMsg )
 	{
 		// Hm.  this failure really is probably a sign that we are in a pretty bad state,
@@ -2670,8 +3401,11 @@ bool CSteamNetworkConnectionBase::ReceivedMessageData( const void *pData, int cb
 	pMsg->m_idxLane = idxLane;
 	pMsg->m_nMessageNumber = nMsgNum;
 
-	// Copy the data
-	memcpy( pMsg->m_pData, pData, cbData );
+	// Copy the data, or reference the shared buffer
+	if ( pSharedBuffer )
+		pMsg->SetSharedBufferData( pSharedBuffer, const_cast<void *>( pData ), cbData );
+	else
+		memcpy( pMsg->m_pData, pData, cbData );
 
 	// Receive it
 	return ReceivedMessage( pMsg );
@@ -2700,14 +3434,16 @@ bool CSteamNetworkConnectionBase::ReceivedMessage( CSteamNetworkingMessage *pMsg
 	pMsg->m_conn = m_hConnectionSelf;
 	pMsg->m_nConnUserData = GetUserData();
 
-	// We use the same lock to protect *all* recv queues, for both connections and poll groups,
-	// which keeps this really simple.
-	g_lockAllRecvMessageQueues.lock();
+	// Our queue shares a lock with our poll group's queue, if any.  (The
+	// connection lock keeps us from changing poll groups while we do this.)
+	// Other connections and poll groups are not blocked.
+	ShortDurationLock &lockRecvMessages = *m_queueRecvMessages.m_pRequiredLock;
+	lockRecvMessages.lock();
 
 	Assert( pMsg->m_cbSize >= 0 );
 	if ( m_queueRecvMessages.m_nMessageCount >= m_connectionConfig.RecvBufferMessages.Get() )
 	{
-		g_lockAllRecvMessageQueues.unlock();
+		lockRecvMessages.unlock();
 		SpewWarningRateLimited ( SteamNetworkingSockets_GetLocalTimestamp(), "[%s] recv queue overflow %d messages already queued.\n", GetDescription(), m_queueRecvMessages.m_nMessageCount );
 		pMsg->Release();
 		return false;
@@ -2715,7 +3451,7 @@ bool CSteamNetworkConnectionBase::ReceivedMessage( CSteamNetworkingMessage *pMsg
 
 	if ( m_queueRecvMessages.m_nMessageSize + pMsg->m_cbSize > m_connectionConfig.RecvBufferSize.Get() )
 	{
-		g_lockAllRecvMessageQueues.unlock();
+		lockRecvMessages.unlock();
 		SpewWarningRateLimited ( SteamNetworkingSockets_GetLocalTimestamp(), "[%s] recv queue overflow %d + %d bytes exceeds limit of %d.\n", GetDescription(), m_queueRecvMessages.m_nMessageSize, pMsg->m_cbSize, m_connectionConfig.RecvBufferSize.Get() );
 		pMsg->Release();
 		return false;
@@ -2765,7 +3501,7 @@ bool CSteamNetworkConnectionBase::ReceivedMessage( CSteamNetworkingMessage *pMsg
 		}
 
 		// Unlock before we spew
-		g_lockAllRecvMessageQueues.unlock();
+		lockRecvMessages.unlock();
 
 		// NOTE - message could have been pulled out of the queue
 		// and consumed by the app already here
@@ -2789,7 +3525,7 @@ bool CSteamNetworkConnectionBase::ReceivedMessage( CSteamNetworkingMessage *pMsg
 			pMsg->LinkToQueueTail( &CSteamNetworkingMessage::m_linksSecondaryQueue, &m_pPollGroup->m_queueRecvMessages );\
 
 		// Each if() branch has its own unlock, so we can spew in the branch above
-		g_lockAllRecvMessageQueues.unlock();
+		lockRecvMessages.unlock();
 	}
 
 	return true;
@@ -72,6 +72,47 @@ public:
 	inline ~AutoWipeFixedSizeBuffer() { Wipe(); }
 };
 
+/// Handshake work that the server hands off to a crypto worker thread.
+/// The worker only touches this, never the connection, which might be
+/// destroyed while the work is in progress.
+struct CryptoHandshakeVerifyJob_t
+{
+	virtual ~CryptoHandshakeVerifyJob_t() {}
+
+	// Inputs
+	uint32 m_unConnectionIDLocal = 0;
+	bool m_bServer = false;
+	std::string m_sCryptRemote;
+	CMsgSteamDatagramCertificate_EKeyType m_eKeyType = CMsgSteamDatagramCertificate_EKeyType_INVALID;
+	std::string m_sPublicKey;
+	std::string m_sSignature;
+
+	// Outputs
+	bool m_bSignatureOK = false;
+	SteamNetworkingErrMsg m_errMsg;
+	std::string m_sKeyExchangePublicKeyLocal;
+	AutoWipeFixedSizeBuffer<sizeof(SHA256Digest_t)> m_premasterSecret;
+	bool m_bPremasterSecretValid = false;
+
+	// Add the signature of the crypt info to a batch to be checked.
+	// Returns the index in the batch, or -1 if it needs to be checked
+	// the slow way
+	int AddSignatureToBatch( CECSigningBatchVerifier &batch ) const;
+
+	// Finish up on the worker thread, once we know if the signature is good
+	void Run();
+
+	// Called with the global lock held, once the worker is done.  By default,
+	// the results are handed to the connection that queued the job, if it
+	// still exists.
+	virtual void Finished();
+};
+
+/// Hand a job off to a crypto worker thread.  Jobs queued during the same
+/// poll iteration are batched together.  Takes ownership of the job.
+/// The global lock must be held.
+extern void QueueCryptoHandshakeVerifyJob( CryptoHandshakeVerifyJob_t *pJob );
+
 /// In various places, we need a key in a map of remote connections.
 struct RemoteConnectionKey_t
 {
@@ -135,8 +176,29 @@ struct RecvPacketContext_t
 	/// Size of plaintext
 	int m_cbPlainText;
 
-	// Temporary buffer to hold decrypted data, if we were actually encrypted
+	/// Temporary buffer to hold decrypted data, if we were actually encrypted
 	uint8 m_decrypted[ k_cbSteamNetworkingSocketsMaxPlaintextPayloadRecv ];
+
+	/// Copy of m_decrypted in a shared message buffer (see
+	/// CSteamNetworkingMessage::AllocSharedBuffer), so that received messages
+	/// can point into it.  Only made if a message asks for it.  We hold a
+	/// reference, which is released when the context goes out of scope.
+	void *m_pPlainTextSharedBuffer = nullptr;
+
+	/// Locate data from the decrypted packet in a shared message buffer,
+	/// copying the packet into one the first time this is called.  Returns
+	/// the shared buffer, and sets ppData to point to the same data in it.
+	/// Returns nullptr if the data is not in m_decrypted, or we fail.
+	void *GetPlainTextSharedBuffer( const void **ppData );
+
+	RecvPacketContext_t() = default;
+	RecvPacketContext_t( const RecvPacketContext_t & ) = delete;
+	RecvPacketContext_t &operator=( const RecvPacketContext_t & ) = delete;
+	inline ~RecvPacketContext_t()
+	{
+		if ( m_pPlainTextSharedBuffer )
+			CSteamNetworkingMessage::ReleaseSharedBuffer( m_pPlainTextSharedBuffer );
+	}
 };
 
 template<typename TStatsMsg>
@@ -198,10 +260,6 @@ inline ESteamNetworkingConnectionState CollapseConnectionStateToAPIState( ESteam
 	return eState;
 }
 
-/// We use one global lock to protect all queues of
-/// received messages.  (On connections and poll groups!)
-extern ShortDurationLock g_lockAllRecvMessageQueues;
-
 #ifdef STEAMNETWORKINGSOCKETS_ENABLE_FAKEIP
 
 struct FakeIPKey;
@@ -266,6 +324,11 @@ public:
 	/// Linked list of messages received through any connection on this listen socket
 	SteamNetworkingMessageQueue m_queueRecvMessages;
 
+	/// Protects m_queueRecvMessages.  Messages are linked into both our queue
+	/// and the queue of the connection they were received on, so this lock
+	/// also protects the queues of all connections in this poll group.
+	ShortDurationLock m_lockRecvMessages;
+
 	/// Index into the global list
 	HSteamNetPollGroup m_hPollGroupSelf;
 
@@ -509,8 +572,11 @@ public:
 	/// Our handle in our parent's m_listAcceptedConnections (if we were accepted on a listen socket)
 	int m_hSelfInParentListenSocketMap;
 
-	// Linked list of received messages
+	// Linked list of received messages.  The lock that protects it is
+	// m_queueRecvMessages.m_pRequiredLock, which is our m_lockRecvMessages
+	// or, if we are in a poll group, the poll group's lock.
 	SteamNetworkingMessageQueue m_queueRecvMessages;
+	ShortDurationLock m_lockRecvMessages;
 
 	/// The unique 64-bit end-to-end connection ID.  Each side picks 32 bits
 	uint32 m_unConnectionIDLocal;
@@ -652,10 +718,21 @@ public:
 	inline bool BSymmetricMode() const { return m_connectionConfig.SymmetricConnect.Get() != 0; }
 	virtual bool BSupportsSymmetricMode();
 
-	// Check the certs, save keys, etc
-	ESteamNetConnectionEnd RecvCryptoHandshake( const CMsgSteamDatagramCertificateSigned &msgCert, const CMsgSteamDatagramSessionCryptInfoSigned &msgSessionInfo, bool bServer, SteamNetworkingErrMsg &errMsg );
+	// Check the certs, save keys, etc.  If bAllowDeferVerify is set, the server
+	// may hand the signature check and key exchange off to a crypto worker thread.
+	// In that case, we return success now, and the connection is "verifying" until
+	// the worker is done: the caller should carry on and put it into the connecting
+	// state as usual, but the app isn't told about it until it has been verified.
+	// If pVerifiedJob is not NULL, a worker already checked this same handshake
+	// before the connection was created, and we use its results.
+	ESteamNetConnectionEnd RecvCryptoHandshake( const CMsgSteamDatagramCertificateSigned &msgCert, const CMsgSteamDatagramSessionCryptInfoSigned &msgSessionInfo, bool bServer, SteamNetworkingErrMsg &errMsg, bool bAllowDeferVerify = false, const CryptoHandshakeVerifyJob_t *pVerifiedJob = nullptr );
 	ESteamNetConnectionEnd FinishCryptoHandshake( bool bServer, SteamNetworkingErrMsg &errMsg );
 
+	/// Called with the global lock held when a crypto worker thread has finished
+	/// verifying our handshake.  Ignored if the job doesn't belong to us.
+	void CryptoHandshakeVerifyFinished( CryptoHandshakeVerifyJob_t &job );
+	inline bool BCryptoHandshakeVerifying() const { return m_pCryptoHandshakeVerifyJob != nullptr; }
+
 	// Process crypto handshake, and terminate the connection if it fails
 	bool BRecvCryptoHandshake( const CMsgSteamDatagramCertificateSigned &msgCert, const CMsgSteamDatagramSessionCryptInfoSigned &msgSessionInfo, bool bServer );
 
@@ -756,9 +833,9 @@ protected:
 	virtual void ConnectionGuessTimeoutReason( ESteamNetConnectionEnd &nReasonCode, ConnectionEndDebugMsg &msg, SteamNetworkingMicroseconds usecNow );
 
 	/// Called when we receive a complete message.  Should allocate a message object and put it into the proper queues
-	bool ReceivedMessageData( const void *pData, int cbData, int idxLane, int64 nMsgNum, int nFlags, SteamNetworkingMicroseconds usecNow );
+	bool ReceivedMessageData( const void *pData, int cbData, int idxLane, int64 nMsgNum, int nFlags, SteamNetworkingMicroseconds usecNow, RecvPacketContext_t *pCtx = nullptr );
 	bool ReceivedMessage( CSteamNetworkingMessage *pMsg );
-	CSteamNetworkingMessage *AllocateNewRecvMessage( uint32 cbSize, int nFlags, SteamNetworkingMicroseconds usecNow );
+	CSteamNetworkingMessage *AllocateNewRecvMessage( uint32 cbSize, int nFlags, SteamNetworkingMicroseconds usecNow, bool bAllocBuffer = true );
 
 	/// Timestamp when we last sent an end-to-end connection request packet
 	SteamNetworkingMicroseconds m_usecWhenSentConnectRequest;
@@ -790,6 +867,25 @@ protected:
 	bool m_bCertHasIdentity; // Does the cert contain the identity we will use for this connection?
 	ESteamNetworkingSocketsCipher m_eNegotiatedCipher;
 
+	// Handshake work we've handed off to a crypto worker thread, if any.
+	// While this is set, we don't post state change callbacks.  This is
+	// only used to identify the job; it's owned by the worker.
+	CryptoHandshakeVerifyJob_t *m_pCryptoHandshakeVerifyJob;
+
+	// Key exchange result, if a worker thread already did it for us.
+	// (In that case m_msgCryptLocal already has our key exchange public key.)
+	AutoWipeFixedSizeBuffer<sizeof(SHA256Digest_t)> m_premasterSecret;
+	bool m_bPremasterSecretValid;
+
+	// Hand the signature check and key exchange off to a crypto worker thread
+	void QueueCryptoHandshakeVerify( const CMsgSteamDatagramSessionCryptInfoSigned &msgSessionInfo, bool bServer );
+
+	// The part of RecvCryptoHandshake after the signature on the crypt info has been checked
+	ESteamNetConnectionEnd RecvCryptoHandshakeVerified( bool bServer, SteamNetworkingErrMsg &errMsg );
+
+	// Take the key exchange result from a worker, if it was able to do it
+	void TakeCryptoHandshakeVerifyKeyExchange( const CryptoHandshakeVerifyJob_t &job );
+
 	// Encryption/decryption contexts.  This has the negotiated key
 	bool m_bCryptKeysValid;
 	std::unique_ptr<ISymmetricEncryptContext> m_pCryptContextSend;
@@ -828,7 +924,8 @@ protected:
 	SteamNetworkingMicroseconds SNP_GetNextThinkTime( SteamNetworkingMicroseconds usecNow );
 	SteamNetworkingMicroseconds SNP_TimeWhenWantToSendNextPacket() const;
 	void SNP_PrepareFeedback( SteamNetworkingMicroseconds usecNow );
-	bool SNP_ReceiveUnreliableSegment( int64 nMsgNum, int nOffset, const void *pSegmentData, int cbSegmentSize, bool bLastSegmentInMessage, int idxLane, SteamNetworkingMicroseconds usecNow );
+	bool SNP_ReceiveUnreliableSegment( int64 nMsgNum, int nOffset, const void *pSegmentData, int cbSegmentSize, bool bLastSegmentInMessage, int idxLane, SteamNetworkingMicroseconds usecNow, RecvPacketContext_t *pCtx = nullptr );
+	bool SNP_ReceiveUnreliableParity( int64 nMsgNum, int nSegments, int cbMsgSize, const void *pParityData, int cbParity, int idxLane, SteamNetworkingMicroseconds usecNow );
 	bool SNP_ReceiveReliableSegment( int64 nPktNum, int64 nSegBegin, const uint8 *pSegmentData, int cbSegmentSize, int idxLane, SteamNetworkingMicroseconds usecNow );
 	int SNP_ClampSendRate();
 	void SNP_PopulateDetailedStats( SteamDatagramLinkStats &info );
@@ -839,6 +936,11 @@ protected:
 	/// Accumulate "tokens" into our bucket base on the current calculated send rate
 	void SNP_TokenBucket_Accumulate( SteamNetworkingMicroseconds usecNow );
 
+	/// How far ahead of the token bucket we may hand packets to the transport,
+	/// because the kernel will hold them until their transmit time.  0 if
+	/// we must wait until we actually have the tokens.
+	SteamNetworkingMicroseconds SNP_GetSendAheadHorizon() const;
+
 	/// Mark a packet as dropped
 	void SNP_SenderProcessPacketNack( int64 nPktNum, SNPInFlightPacket_t &pkt, const char *pszDebug );
 
@@ -873,6 +975,9 @@ private:
 
 	uint8 *SNP_SerializeAckBlocks( const SNPPacketSerializeHelper &helper, uint8 *pOut, const uint8 *pOutEnd );
 	uint8 *SNP_SerializeStopWaitingFrame( SNPPacketSerializeHelper &helper, uint8 *pOut );
+	uint8 *SNP_SerializeFECParityFrames( uint8 *pOut, const uint8 *pOutEnd );
+	void SNP_AccumulateFECParity( int idxLane, const CSteamNetworkingMessage *pMsg, int nOffset, int cbSegSize );
+	bool SNP_ReassembleUnreliableMessage( int64 nMsgNum, int idxLane, SteamNetworkingMicroseconds usecNow );
 	void SNP_QueueReliableSegmentsForRetry( SNPInFlightPacket_t &pkt, int64 nPktNumForDebug, const char *pszDebug );
 
 	void SetState( ESteamNetworkingConnectionState eNewState, SteamNetworkingMicroseconds usecNow );
@@ -989,6 +1094,11 @@ public:
 	virtual void SendEndToEndConnectRequest( SteamNetworkingMicroseconds usecNow );
 	virtual void SendEndToEndStatsMsg( EStatsReplyRequest eRequest, SteamNetworkingMicroseconds usecNow, const char *pszReason ) = 0;
 	virtual void TransportPopulateConnectionInfo( SteamNetConnectionInfo_t &info ) const;
+
+	/// Return true if packets we send inside a RawUDPSendTxTimeScope
+	/// will actually be held by the kernel until their transmit time.
+	/// If so, the SNP layer may hand packets to us a little bit early.
+	virtual bool BSupportsTxTime() const;
 	virtual void GetDetailedConnectionStatus( SteamNetworkingDetailedConnectionStatus &stats, SteamNetworkingMicroseconds usecNow );
 	#ifdef STEAMNETWORKINGSOCKETS_ENABLE_DIAGNOSTICSUI
 		virtual void TransportPopulateDiagnostics( CGameNetworkingUI_ConnectionState &msgConnectionState, SteamNetworkingMicroseconds usecNow );
@@ -1,6 +1,7 @@
 //====== Copyright Valve Corporation, All rights reserved. ====================
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 
 #include "steamnetworkingsockets_lowlevel.h"
@@ -8,11 +9,17 @@
 #include "../steamnetworkingsockets_internal.h"
 #include "../steamnetworkingsockets_thinker.h"
 #include "steamnetworkingsockets_connections.h"
+#include "steamnetworkingsockets_udp.h"
+#include "../steamnetworkingsockets_certstore.h"
 #include <vstdlib/random.h>
 #include <tier1/utlpriorityqueue.h>
 #include <tier1/utllinkedlist.h>
 #include "crypto.h"
 
+#ifdef STEAMNETWORKINGSOCKETS_STANDALONELIB
+#include <steam/steamnetworkingsockets.h>
+#endif
+
 #if IsPosix()
 	#include <pthread.h>
 	#include <sched.h>
@@ -638,8 +645,36 @@ void CTaskList::RunTasks()
 	}
 }
 
+bool CTaskList::RunOneTask()
+{
+	// Detach the first task
+	s_lockTaskQueue.lock();
+	CQueuedTask *pTask = m_pFirstTask;
+	if ( pTask )
+	{
+		m_pFirstTask = pTask->m_pNextTaskInQueue;
+		if ( !m_pFirstTask )
+			m_pLastTask = nullptr;
+		pTask->m_pNextTaskInQueue = nullptr;
+	}
+	s_lockTaskQueue.unlock();
+	if ( !pTask )
+		return false;
+
+	// We don't have any way to lock the target, so we can't allow one
+	Assert( pTask->m_eTaskState == CQueuedTask::k_ETaskState_Queued );
+	Assert( !pTask->m_pTarget );
+
+	pTask->m_eTaskState = CQueuedTask::k_ETaskState_Running;
+	pTask->Run();
+	pTask->m_eTaskState = CQueuedTask::k_ETaskState_ReadyToDelete;
+	delete pTask;
+	return true;
+}
+
 CTaskList g_taskListRunWithGlobalLock;
 CTaskList g_taskListRunInBackground;
+CTaskList g_taskListRunOnWorkerThread;
 
 CQueuedTask::~CQueuedTask()
 {
@@ -907,6 +942,49 @@ bool sendto_gather( int sockfd, int nChunks, const iovec *pChunks, sockaddr *pAd
 }
 #endif
 
+/// Counters for batched send/receive tuning.  Only touched while holding the global lock.
+static int64 s_nRecvSyscalls;
+static int64 s_nRecvPackets;
+static int64 s_nSendSyscalls;
+static int64 s_nSendPackets;
+static int64 s_nSendPacketsTxTime;
+
+// Extra receive threads, each of which waits on and reads from some of the
+// raw sockets.  They do not process packets; that still happens with the
+// global lock held.
+// See k_ESteamNetworkingConfig_RecvThreads
+#if defined( USE_EPOLL ) && defined( USE_RECVMMSG ) && defined( WAKE_THREAD_USING_SOCKET_PAIR )
+	#define USE_RECV_THREADS
+	#include <fcntl.h>
+#endif
+
+#ifdef USE_SO_TXTIME
+/// Transmit time (CLOCK_MONOTONIC, nanoseconds) to stamp on datagrams
+/// we send right now, or 0 if they should not be stamped.  Set by
+/// RawUDPSendTxTimeScope
+static uint64 s_nSendTxTimeNanos;
+
+/// Fill in an SCM_TXTIME control message
+static inline void FillTxTimeCMsg( cmsghdr *cmsg, uint64 nTxTimeNanos )
+{
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN( sizeof(nTxTimeNanos) );
+	memcpy( CMSG_DATA( cmsg ), &nTxTimeNanos, sizeof(nTxTimeNanos) );
+}
+#endif
+
+#ifdef USE_SENDMMSG
+class CRawUDPSocketImpl;
+
+/// Number of RawUDPSendBatchScope objects currently alive
+static int s_nSendBatchScopeDepth;
+
+/// Add a packet to the pending send batch.  Returns false if the packet
+/// should just be sent right now.
+static bool BQueueToSendBatch( const CRawUDPSocketImpl *pSock, int nChunks, const iovec *pChunks, const netadr_t &adrTo, const sockaddr_storage &destAddress, socklen_t addrSize );
+#endif
+
 class CRawUDPSocketImpl final : public IRawUDPSocket
 {
 public:
@@ -927,6 +1005,18 @@ public:
 	/// This is set to null when we are asked to close the socket.
 	CRecvPacketCallback m_callback;
 
+	#ifdef USE_SENDMMSG
+		/// Set if the kernel rejected a UDP_SEGMENT send on this socket,
+		/// and we should not try it again
+		mutable bool m_bGSORejected = false;
+	#endif
+
+	#ifdef USE_RECV_THREADS
+		/// Which service thread waits on and reads from this socket.
+		/// 0 is the main service thread.
+		int m_nRecvThread = 0;
+	#endif
+
 
 	// Implements IRawUDPSocket
 	virtual bool BSendRawPacketGather( int nChunks, const iovec *pChunks, const netadr_t &adrTo ) const override;
@@ -974,10 +1064,19 @@ public:
 			TracePkt( true, adrTo, nChunks, pChunks );
 		}
 
+		// Defer it, if we are batching sends
+		#ifdef USE_SENDMMSG
+			if ( s_nSendBatchScopeDepth > 0 && BQueueToSendBatch( this, nChunks, pChunks, adrTo, destAddress, addrSize ) )
+				return true;
+		#endif
+
 		#ifdef STEAMNETWORKINGSOCKETS_LOWLEVEL_TIME_SOCKET_CALLS
 			SteamNetworkingMicroseconds usecSendStart = SteamNetworkingSockets_GetLocalTimestamp();
 		#endif
 
+		++s_nSendSyscalls;
+		++s_nSendPackets;
+
 		#ifdef _WIN32
 			// Confirm that iovec and WSABUF are indeed bitwise equivalent
 			COMPILE_TIME_ASSERT( sizeof( iovec ) == sizeof( WSABUF ) );
@@ -1041,7 +1140,12 @@ public:
 			#endif
 		#else
 			bool bResult;
-			if ( nChunks == 1 )
+			#ifdef USE_SO_TXTIME
+				const uint64 nTxTimeNanos = m_bTxTime ? s_nSendTxTimeNanos : 0;
+			#else
+				const uint64 nTxTimeNanos = 0;
+			#endif
+			if ( nChunks == 1 && nTxTimeNanos == 0 )
 			{
 				ssize_t r = sendto( m_socket, pChunks->iov_base, pChunks->iov_len, 0, (sockaddr *)&destAddress, addrSize );
 				bResult = ( r == (ssize_t)pChunks->iov_len );
@@ -1060,6 +1164,18 @@ public:
 					msg.msg_controllen = 0;
 					msg.msg_flags = 0;
 
+					#ifdef USE_SO_TXTIME
+						char control[ CMSG_SPACE( sizeof(uint64) ) ];
+						if ( nTxTimeNanos )
+						{
+							memset( control, 0, sizeof(control) );
+							msg.msg_control = control;
+							msg.msg_controllen = sizeof(control);
+							FillTxTimeCMsg( CMSG_FIRSTHDR( &msg ), nTxTimeNanos );
+							++s_nSendPacketsTxTime;
+						}
+					#endif
+
 					ssize_t r = sendmsg( m_socket, &msg, 0 );
 					bResult = ( r >= 0 ); // just check for -1 for error, since we don't want to take the time here to scan the iovec and sum up the expected total number of bytes sent
 				#endif
@@ -1150,6 +1266,21 @@ private:
 	void InternalAddToCleanupQueue();
 };
 
+#ifdef USE_RECV_THREADS
+
+/// Total number of threads that read from raw sockets, including the main
+/// service thread
+static int s_nRecvThreads = 1;
+
+/// Assign a new socket to a receive thread and start waiting on it.
+/// If nThread is negative, we pick one round robin.
+static bool BAddSocketToRecvThread( CRawUDPSocketImpl *pSock, int nThread, SteamNetworkingErrMsg &errMsg );
+
+/// Stop waiting on a socket, and make sure the thread that owns it will
+/// not touch it again.
+static void RemoveSocketFromRecvThread( CRawUDPSocketImpl *pSock );
+#endif
+
 /// We don't expect to have enough sockets, and open and close them frequently
 /// enough, such that an occasional linear search will kill us.
 static CUtlVector<CRawUDPSocketImpl *> s_vecRawSockets;
@@ -1157,6 +1288,352 @@ static CUtlVector<CRawUDPSocketImpl *> s_vecRawSockets;
 /// Are any sockets pending destruction?
 static bool s_bRawSocketPendingDestruction;
 
+#ifdef USE_SENDMMSG
+
+/// Max number of datagrams we will queue before we flush the send batch
+constexpr int k_nMaxUDPSendBatchSize = 64;
+
+/// Max number of segments we will send in one UDP_SEGMENT call.  The kernel
+/// limit is 64 (UDP_MAX_SEGMENTS) and the total must fit in one IP datagram.
+constexpr int k_nMaxUDPGSOSegments = 64;
+constexpr int k_cbMaxUDPGSOTotal = 63*1024;
+
+/// Datagrams queued while a RawUDPSendBatchScope is open.  Payloads are
+/// packed end to end in m_data, in the order they were sent, so a run of
+/// packets to the same peer is contiguous in memory and can be handed to
+/// the kernel as a single buffer for segmentation.
+struct SendBatch_t
+{
+	struct Pkt_t
+	{
+		const CRawUDPSocketImpl *m_pSock;
+		netadr_t m_adrTo;
+		sockaddr_storage m_sockadrTo;
+		socklen_t m_cbSockadrTo;
+		int m_ofsData;
+		int m_cbData;
+		#ifdef USE_SO_TXTIME
+			uint64 m_nTxTimeNanos;
+		#endif
+	};
+
+	int m_nPkts = 0;
+	int m_cbData = 0;
+	Pkt_t m_arPkts[ k_nMaxUDPSendBatchSize ];
+	mmsghdr m_msgs[ k_nMaxUDPSendBatchSize ];
+	iovec m_iov[ k_nMaxUDPSendBatchSize ];
+	#ifdef USE_SO_TXTIME
+		char m_control[ k_nMaxUDPSendBatchSize ][ CMSG_SPACE( sizeof(uint64) ) ];
+	#endif
+	char m_data[ k_nMaxUDPSendBatchSize * k_cbSteamNetworkingSocketsMaxUDPMsgLen ];
+};
+static SendBatch_t *s_pSendBatch;
+
+static void FlushSendBatch();
+
+static bool BQueueToSendBatch( const CRawUDPSocketImpl *pSock, int nChunks, const iovec *pChunks, const netadr_t &adrTo, const sockaddr_storage &destAddress, socklen_t addrSize )
+{
+	if ( !s_pSendBatch || GlobalConfig::SendBatchMode.Get() <= 0 )
+		return false;
+	SendBatch_t &b = *s_pSendBatch;
+
+	int cbPkt = 0;
+	for ( int i = 0 ; i < nChunks ; ++i )
+		cbPkt += (int)pChunks[i].iov_len;
+	if ( cbPkt > k_cbSteamNetworkingSocketsMaxUDPMsgLen )
+	{
+		AssertMsg( false, "Tried to batch a packet that was too big!" );
+		return false;
+	}
+
+	// Make room
+	if ( b.m_nPkts >= k_nMaxUDPSendBatchSize || b.m_cbData + cbPkt > (int)sizeof(b.m_data) )
+		FlushSendBatch();
+
+	SendBatch_t::Pkt_t &pkt = b.m_arPkts[ b.m_nPkts++ ];
+	pkt.m_pSock = pSock;
+	pkt.m_adrTo = adrTo;
+	memcpy( &pkt.m_sockadrTo, &destAddress, addrSize );
+	pkt.m_cbSockadrTo = addrSize;
+	pkt.m_ofsData = b.m_cbData;
+	pkt.m_cbData = cbPkt;
+	#ifdef USE_SO_TXTIME
+		pkt.m_nTxTimeNanos = pSock->m_bTxTime ? s_nSendTxTimeNanos : 0;
+	#endif
+
+	// Gather it into the buffer
+	char *d = b.m_data + b.m_cbData;
+	for ( int i = 0 ; i < nChunks ; ++i )
+	{
+		memcpy( d, pChunks[i].iov_base, pChunks[i].iov_len );
+		d += pChunks[i].iov_len;
+	}
+	b.m_cbData += cbPkt;
+	return true;
+}
+
+/// Return the number of packets, starting at idx, that could be sent
+/// using a single UDP_SEGMENT call.  They must all go to the same
+/// address on the same socket, and have the same size, except that the
+/// last one may be shorter.  They must also have the same transmit time,
+/// since the whole run is released at once.
+static int GetSendBatchGSORunLength( int idx )
+{
+	SendBatch_t &b = *s_pSendBatch;
+	const SendBatch_t::Pkt_t &first = b.m_arPkts[ idx ];
+	if ( first.m_pSock->m_bGSORejected )
+		return 1;
+	int cbTotal = first.m_cbData;
+	int n = 1;
+	while ( idx+n < b.m_nPkts && n < k_nMaxUDPGSOSegments )
+	{
+		const SendBatch_t::Pkt_t &pkt = b.m_arPkts[ idx+n ];
+		if ( b.m_arPkts[ idx+n-1 ].m_cbData != first.m_cbData ) // Only the final segment may be short
+			break;
+		if ( pkt.m_pSock != first.m_pSock || pkt.m_cbData > first.m_cbData || !( pkt.m_adrTo == first.m_adrTo ) )
+			break;
+		#ifdef USE_SO_TXTIME
+			if ( pkt.m_nTxTimeNanos != first.m_nTxTimeNanos )
+				break;
+		#endif
+		if ( cbTotal + pkt.m_cbData > k_cbMaxUDPGSOTotal )
+			break;
+		cbTotal += pkt.m_cbData;
+		++n;
+	}
+	return n;
+}
+
+/// Send a run of packets with one sendmsg, letting the kernel split
+/// them up.  Returns false if the kernel did not like it.
+static bool BSendBatchGSO( int idx, int n )
+{
+	SendBatch_t &b = *s_pSendBatch;
+	const SendBatch_t::Pkt_t &first = b.m_arPkts[ idx ];
+	const SendBatch_t::Pkt_t &last = b.m_arPkts[ idx+n-1 ];
+
+	iovec iov;
+	iov.iov_base = b.m_data + first.m_ofsData;
+	iov.iov_len = last.m_ofsData + last.m_cbData - first.m_ofsData;
+
+	#ifdef USE_SO_TXTIME
+		char control[ CMSG_SPACE( sizeof(uint16_t) ) + CMSG_SPACE( sizeof(uint64) ) ];
+	#else
+		char control[ CMSG_SPACE( sizeof(uint16_t) ) ];
+	#endif
+	memset( control, 0, sizeof(control) );
+
+	msghdr msg;
+	msg.msg_name = (sockaddr *)&first.m_sockadrTo;
+	msg.msg_namelen = first.m_cbSockadrTo;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE( sizeof(uint16_t) );
+	msg.msg_flags = 0;
+
+	cmsghdr *cmsg = CMSG_FIRSTHDR( &msg );
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN( sizeof(uint16_t) );
+	uint16_t cbSegment = (uint16_t)first.m_cbData;
+	memcpy( CMSG_DATA( cmsg ), &cbSegment, sizeof(cbSegment) );
+
+	#ifdef USE_SO_TXTIME
+		if ( first.m_nTxTimeNanos )
+		{
+			msg.msg_controllen = sizeof(control);
+			FillTxTimeCMsg( CMSG_NXTHDR( &msg, cmsg ), first.m_nTxTimeNanos );
+		}
+	#endif
+
+	ssize_t r;
+	do
+	{
+		++s_nSendSyscalls;
+		r = sendmsg( first.m_pSock->m_socket, &msg, 0 );
+	} while ( r < 0 && errno == EINTR );
+	if ( r >= 0 )
+	{
+		s_nSendPackets += n;
+		#ifdef USE_SO_TXTIME
+			if ( first.m_nTxTimeNanos )
+				s_nSendPacketsTxTime += n;
+		#endif
+		return true;
+	}
+
+	// If the socket buffer is full, then the packets are just dropped.
+	// That's not a GSO problem.
+	int e = errno;
+	if ( e == EAGAIN || e == EWOULDBLOCK || e == ENOBUFS )
+		return true;
+
+	// Kernel or device doesn't support it.  Don't try again on this socket
+	SpewVerbose( "UDP_SEGMENT send on %s failed, errno=%d.  Disabling segmentation offload for this socket.\n",
+		SteamNetworkingIPAddrRender( first.m_pSock->m_boundAddr ).c_str(), e );
+	first.m_pSock->m_bGSORejected = true;
+	return false;
+}
+
+/// Send n packets with sendmmsg.  They must all be on the same socket.
+static void SendBatchMMsg( int idx, int n )
+{
+	SendBatch_t &b = *s_pSendBatch;
+	const CRawUDPSocketImpl *pSock = b.m_arPkts[ idx ].m_pSock;
+	for ( int i = 0 ; i < n ; ++i )
+	{
+		SendBatch_t::Pkt_t &pkt = b.m_arPkts[ idx+i ];
+		Assert( pkt.m_pSock == pSock );
+		iovec &iov = b.m_iov[ i ];
+		iov.iov_base = b.m_data + pkt.m_ofsData;
+		iov.iov_len = pkt.m_cbData;
+		msghdr &msg = b.m_msgs[ i ].msg_hdr;
+		msg.msg_name = &pkt.m_sockadrTo;
+		msg.msg_namelen = pkt.m_cbSockadrTo;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = nullptr;
+		msg.msg_controllen = 0;
+		msg.msg_flags = 0;
+		#ifdef USE_SO_TXTIME
+			if ( pkt.m_nTxTimeNanos )
+			{
+				memset( b.m_control[ i ], 0, sizeof( b.m_control[ i ] ) );
+				msg.msg_control = b.m_control[ i ];
+				msg.msg_controllen = sizeof( b.m_control[ i ] );
+				FillTxTimeCMsg( CMSG_FIRSTHDR( &msg ), pkt.m_nTxTimeNanos );
+				++s_nSendPacketsTxTime;
+			}
+		#endif
+	}
+
+	// The kernel stops at the first datagram that fails
+	int nDone = 0;
+	while ( nDone < n )
+	{
+		++s_nSendSyscalls;
+		int r = sendmmsg( pSock->m_socket, b.m_msgs + nDone, n - nDone, 0 );
+		if ( r > 0 )
+		{
+			s_nSendPackets += r;
+			nDone += r;
+			continue;
+		}
+		if ( r < 0 )
+		{
+			int e = errno;
+			if ( e == EINTR )
+				continue;
+
+			// Socket buffer is full.  The rest would just fail the same
+			// way, so stop here.  Those packets are dropped, the same as
+			// if we had sent them one at a time.
+			if ( e == EAGAIN || e == EWOULDBLOCK || e == ENOBUFS )
+				break;
+		}
+
+		// Something is wrong with this particular datagram (e.g. the
+		// destination is unreachable).  Drop it and keep going with the rest.
+		++nDone;
+	}
+}
+
+/// Hand everything in the send batch to the OS
+static void FlushSendBatch()
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+	SendBatch_t &b = *s_pSendBatch;
+	const bool bGSO = GlobalConfig::SendBatchMode.Get() >= 2;
+
+	int idx = 0;
+	while ( idx < b.m_nPkts )
+	{
+
+		// Can we send a run of packets with segmentation offload?
+		if ( bGSO )
+		{
+			int nRun = GetSendBatchGSORunLength( idx );
+			if ( nRun > 1 && BSendBatchGSO( idx, nRun ) )
+			{
+				idx += nRun;
+				continue;
+			}
+		}
+
+		// Gather up packets on this socket, stopping at the start
+		// of the next run we could send with GSO
+		const CRawUDPSocketImpl *pSock = b.m_arPkts[ idx ].m_pSock;
+		int n = 1;
+		while ( idx+n < b.m_nPkts && b.m_arPkts[ idx+n ].m_pSock == pSock )
+		{
+			if ( bGSO && GetSendBatchGSORunLength( idx+n ) > 1 )
+				break;
+			++n;
+		}
+		SendBatchMMsg( idx, n );
+		idx += n;
+	}
+
+	b.m_nPkts = 0;
+	b.m_cbData = 0;
+}
+
+#endif // #ifdef USE_SENDMMSG
+
+RawUDPSendBatchScope::RawUDPSendBatchScope()
+{
+	#ifdef USE_SENDMMSG
+		SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+		++s_nSendBatchScopeDepth;
+	#endif
+}
+
+RawUDPSendBatchScope::~RawUDPSendBatchScope()
+{
+	#ifdef USE_SENDMMSG
+		Assert( s_nSendBatchScopeDepth > 0 );
+		if ( --s_nSendBatchScopeDepth == 0 && s_pSendBatch && s_pSendBatch->m_nPkts > 0 )
+			FlushSendBatch();
+	#endif
+}
+
+RawUDPSendTxTimeScope::RawUDPSendTxTimeScope()
+: m_nBaseNanos( 0 )
+{
+	#ifdef USE_SO_TXTIME
+		SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+		Assert( s_nSendTxTimeNanos == 0 );
+	#endif
+}
+
+RawUDPSendTxTimeScope::~RawUDPSendTxTimeScope()
+{
+	#ifdef USE_SO_TXTIME
+		s_nSendTxTimeNanos = 0;
+	#endif
+}
+
+void RawUDPSendTxTimeScope::SetDelay( SteamNetworkingMicroseconds usecDelay )
+{
+	#ifdef USE_SO_TXTIME
+		if ( usecDelay <= 0 )
+		{
+			s_nSendTxTimeNanos = 0;
+			return;
+		}
+
+		// This must be the same clock we gave to SO_TXTIME
+		if ( m_nBaseNanos == 0 )
+		{
+			timespec ts;
+			clock_gettime( CLOCK_MONOTONIC, &ts );
+			m_nBaseNanos = uint64( ts.tv_sec )*1000000000 + uint64( ts.tv_nsec );
+		}
+		s_nSendTxTimeNanos = m_nBaseNanos + uint64( usecDelay )*1000;
+	#endif
+}
+
 /// Track packets that have fake lag applied and are pending to be sent/received
 class CPacketLagger : private IThinker
 {
@@ -1361,14 +1838,14 @@ static bool s_bRecreatePollList = true;
 #ifdef USE_EPOLL
 static EPollHandle s_epollfd = INVALID_EPOLL_HANDLE;
 
-static bool AddFDToEPoll( int fd, CRawUDPSocketImpl *pSock, SteamNetworkingErrMsg &errMsg )
+static bool AddFDToEPoll( EPollHandle epollfd, int fd, CRawUDPSocketImpl *pSock, SteamNetworkingErrMsg &errMsg )
 {
 	struct epoll_event ev = {};
 
 	ev.events = EPOLLIN; // We only care about sockets with data ready read
 	ev.data.ptr = pSock; // epoll can give us back some userdata.
 
-	if ( epoll_ctl( s_epollfd, EPOLL_CTL_ADD, fd, &ev) != 0 )
+	if ( epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &ev) != 0 )
 	{
 		V_sprintf_safe( errMsg, "epoll_ctl failed, error 0x%x", GetLastSocketError() );
 		return false;
@@ -1385,6 +1862,91 @@ bool IsServiceThreadRunning()
 	return ( s_pServiceThread != nullptr );
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// Crypto worker threads
+//
+/////////////////////////////////////////////////////////////////////////////
+
+/// Protects the list of threads and the exit flag, and is used with
+/// s_condWorkerThreads to wait for work.  The queue itself is protected
+/// by s_lockTaskQueue, like the other task lists.
+static std::mutex s_mutexWorkerThreads;
+static std::condition_variable s_condWorkerThreads;
+static std::vector<std::thread *> s_vecWorkerThreads;
+static bool s_bWorkerThreadsExit;
+
+static void WorkerThreadProc()
+{
+
+	// Invoke user callback, if any
+	if ( s_fnServiceThreadInitCallback )
+		(*s_fnServiceThreadInitCallback)();
+
+	// Random number generator may be per thread
+	SeedWeakRandomGenerator();
+
+	// Keep going until we are asked to exit.  Finish any queued
+	// work first, so that nobody waiting on it is left hanging
+	std::unique_lock<std::mutex> lock( s_mutexWorkerThreads );
+	for (;;)
+	{
+		if ( !g_taskListRunOnWorkerThread.empty() )
+		{
+			lock.unlock();
+			g_taskListRunOnWorkerThread.RunOneTask();
+			lock.lock();
+		}
+		else if ( s_bWorkerThreadsExit )
+		{
+			break;
+		}
+		else
+		{
+			s_condWorkerThreads.wait( lock );
+		}
+	}
+}
+
+void CQueuedTask::QueueToRunOnWorkerThread()
+{
+	Assert( !m_pTarget );
+	g_taskListRunOnWorkerThread.QueueTask( this );
+
+	// NOTE: At this point we are subject to being run or deleted at any time!
+
+	std::lock_guard<std::mutex> lock( s_mutexWorkerThreads );
+
+	// Start the threads the first time we need them
+	if ( s_vecWorkerThreads.empty() )
+	{
+		s_bWorkerThreadsExit = false;
+		int nThreads = std::max( 1, GlobalConfig::CryptoWorkerThreads.Get() );
+		for ( int i = 0 ; i < nThreads ; ++i )
+			s_vecWorkerThreads.push_back( new std::thread( WorkerThreadProc ) );
+		SpewVerbose( "Started %d crypto worker threads.\n", nThreads );
+	}
+
+	s_condWorkerThreads.notify_one();
+}
+
+static void StopWorkerThreads()
+{
+	std::vector<std::thread *> vecThreads;
+	{
+		std::lock_guard<std::mutex> lock( s_mutexWorkerThreads );
+		s_bWorkerThreadsExit = true;
+		vecThreads.swap( s_vecWorkerThreads );
+	}
+	s_condWorkerThreads.notify_all();
+
+	for ( std::thread *pThread: vecThreads )
+	{
+		pThread->join();
+		delete pThread;
+	}
+}
+
 void WakeServiceThread()
 {
 	#if defined( WAKE_THREAD_USING_EVENT )
@@ -1481,13 +2043,21 @@ void CRawUDPSocketImpl::InternalAddToCleanupQueue()
 	// Set global flag to remember that at least once socket needs to be cleaned up
 	s_bRawSocketPendingDestruction = true;
 
+	// Don't leave any queued sends pointing at us
+	#ifdef USE_SENDMMSG
+		if ( s_pSendBatch && s_pSendBatch->m_nPkts > 0 )
+			FlushSendBatch();
+	#endif
+
 	// Clean up lagged packets, if any
 	s_packetLagQueueSend.AboutToDestroySocket( this );
 	s_packetLagQueueRecv.AboutToDestroySocket( this );
 
 	// We can immediately remove from the epoll, even if some other
 	// thread is polling on it.
-	#ifdef USE_EPOLL
+	#if defined( USE_RECV_THREADS )
+		RemoveSocketFromRecvThread( this );
+	#elif defined( USE_EPOLL )
 		int r = epoll_ctl( s_epollfd, EPOLL_CTL_DEL, m_socket, nullptr );
 		(void)r;
 		AssertMsg( r == 0, "epoll_ctl failed with errno=%d", errno );
@@ -1742,150 +2312,776 @@ static CRawUDPSocketImpl *OpenRawUDPSocketInternal( CRecvPacketCallback callback
 		}
 	}
 
-	// Try IPv6?
-	SOCKET sock = INVALID_SOCKET;
-	#ifndef PLATFORM_NO_IPV6
-		if ( nAddressFamilies & k_nAddressFamily_IPv6 )
-		{
-			sockaddr_in6 address6;
-			memset( &address6, 0, sizeof(address6) );
-			address6.sin6_family = AF_INET6;
-			memcpy( address6.sin6_addr.s6_addr, addrLocal.m_ipv6, 16 );
-			address6.sin6_port = BigWord( addrLocal.m_port );
+	// Try IPv6?
+	SOCKET sock = INVALID_SOCKET;
+	#ifndef PLATFORM_NO_IPV6
+		if ( nAddressFamilies & k_nAddressFamily_IPv6 )
+		{
+			sockaddr_in6 address6;
+			memset( &address6, 0, sizeof(address6) );
+			address6.sin6_family = AF_INET6;
+			memcpy( address6.sin6_addr.s6_addr, addrLocal.m_ipv6, 16 );
+			address6.sin6_port = BigWord( addrLocal.m_port );
+
+			// Try to get socket
+			int nIPv6AddressFamilies = nAddressFamilies;
+			sock = OpenUDPSocketBoundToSockAddr( &address6, sizeof(address6), errMsg, &nIPv6AddressFamilies, nBindInterface );
+
+			if ( sock == INVALID_SOCKET )
+			{
+				// Allowing fallback to IPv4?
+				if ( nAddressFamilies != k_nAddressFamily_Auto )
+					return nullptr;
+
+				// Continue below, we'll try IPv4
+			}
+			else
+			{
+				nAddressFamilies = nIPv6AddressFamilies;
+			}
+		}
+	#endif
+
+	// Try IPv4?
+	if ( sock == INVALID_SOCKET )
+	{
+		Assert( nAddressFamilies & k_nAddressFamily_IPv4 ); // Otherwise, we should have already failed above
+
+		sockaddr_in address4;
+		memset( &address4, 0, sizeof(address4) );
+		address4.sin_family = AF_INET;
+		address4.sin_addr.s_addr = BigDWord( addrLocal.GetIPv4() );
+		address4.sin_port = BigWord( addrLocal.m_port );
+
+		// Try to get socket
+		sock = OpenUDPSocketBoundToSockAddr( &address4, sizeof(address4), errMsg, nullptr, nBindInterface );
+
+		// If we failed, well, we have no other options left to try.
+		if ( sock == INVALID_SOCKET )
+			return nullptr;
+
+		// We re IPv4 only
+		nAddressFamilies = k_nAddressFamily_IPv4;
+	}
+
+	// Read back address we actually bound to.
+	sockaddr_storage addrBound;
+	socklen_t cbAddress = sizeof(addrBound);
+	if ( getsockname( sock, (struct sockaddr *)&addrBound, &cbAddress ) != 0 )
+	{
+		V_sprintf_safe( errMsg, "getsockname failed.  Error code 0x%08X.", GetLastSocketError() );
+		closesocket( sock );
+		return nullptr;
+	}
+	if ( addrBound.ss_family == AF_INET )
+	{
+		const sockaddr_in *boundaddr4 = (const sockaddr_in *)&addrBound;
+		addrLocal.SetIPv4( BigDWord( boundaddr4->sin_addr.s_addr ), BigWord( boundaddr4->sin_port ) );
+	}
+	#ifndef PLATFORM_NO_IPV6
+	else if ( addrBound.ss_family == AF_INET6 )
+	{
+		const sockaddr_in6 *boundaddr6 = (const sockaddr_in6 *)&addrBound;
+		addrLocal.SetIPv6( boundaddr6->sin6_addr.s6_addr, BigWord( boundaddr6->sin6_port ) );
+	}
+	#endif
+	else
+	{
+		Assert( false );
+		V_sprintf_safe( errMsg, "getsockname returned address with unexpected family %d", addrBound.ss_family );
+		closesocket( sock );
+		return nullptr;
+	}
+
+	// Allocate a bookkeeping structure
+	CRawUDPSocketImpl *pSock = new CRawUDPSocketImpl;
+	pSock->m_socket = sock;
+	pSock->m_boundAddr = addrLocal;
+	pSock->m_callback = callback;
+	pSock->m_nAddressFamilies = nAddressFamilies;
+
+	// Ask the kernel to hold our datagrams until their transmit time?
+	#ifdef USE_SO_TXTIME
+		if ( GlobalConfig::SendTxTimeHorizon.Get() > 0 )
+		{
+			struct { clockid_t m_clockid; uint32 m_flags; } txtime = { CLOCK_MONOTONIC, 0 };
+			if ( setsockopt( sock, SOL_SOCKET, SO_TXTIME, (char *)&txtime, sizeof(txtime) ) == 0 )
+				pSock->m_bTxTime = true;
+			else
+				SpewVerbose( "Failed to set SO_TXTIME on %s, errno=%d.  Packets will not be paced by the kernel.\n", SteamNetworkingIPAddrRender( addrLocal ).c_str(), errno );
+		}
+	#endif
+
+	// Have the kernel busy poll the device when we read?
+	#if IsLinux() && defined( SO_BUSY_POLL )
+		if ( GlobalConfig::SocketBusyPoll.Get() > 0 )
+		{
+			int usecBusyPoll = GlobalConfig::SocketBusyPoll.Get();
+			if ( setsockopt( sock, SOL_SOCKET, SO_BUSY_POLL, (char *)&usecBusyPoll, sizeof(usecBusyPoll) ) != 0 )
+				SpewVerbose( "Failed to set SO_BUSY_POLL on %s, errno=%d\n", SteamNetworkingIPAddrRender( addrLocal ).c_str(), errno );
+		}
+	#endif
+
+	// How will we wait efficiently for this socket?
+	#if defined( USE_RECV_THREADS )
+		if ( !BAddSocketToRecvThread( pSock, -1, errMsg ) )
+		{
+			delete pSock;
+			return nullptr;
+		}
+	#elif defined( USE_EPOLL )
+		if ( !AddFDToEPoll( s_epollfd, sock, pSock, errMsg ) )
+		{
+			delete pSock;
+			return nullptr;
+		}
+	#elif defined( _WIN32 )
+		// On windows, tell the socket to set our global "wake" event whenever there is data to read
+		Assert( s_hEventWakeThread != INVALID_HANDLE_VALUE );
+		if ( WSAEventSelect( pSock->m_socket, s_hEventWakeThread, FD_READ ) != 0 )
+		{
+			delete pSock;
+			V_sprintf_safe( errMsg, "WSAEventSelect() failed.  Error code 0x%08X.", GetLastSocketError() );
+			return nullptr;
+		}
+	#elif defined( USE_POLL )
+		// Rebuild our pollfd list next time
+		s_bRecreatePollList = true;
+	#else
+		#error "How will we poll this socket?"
+	#endif
+
+	// Add to master list.  (Hopefully we usually won't have that many.)
+	s_vecRawSockets.AddToTail( pSock );
+
+
+	// Wake up background thread so we can start receiving packets on this socket immediately
+	WakeServiceThread();
+
+	// Give back info on address families
+	if ( pnAddressFamilies )
+		*pnAddressFamilies = nAddressFamilies;
+
+	// Give them something they can use
+	return pSock;
+}
+
+IRawUDPSocket *OpenRawUDPSocket( CRecvPacketCallback callback, SteamNetworkingErrMsg &errMsg, SteamNetworkingIPAddr *pAddrLocal, int *pnAddressFamilies )
+{
+	return OpenRawUDPSocketInternal( callback, errMsg, pAddrLocal, pnAddressFamilies );
+}
+
+#ifdef USE_RECV_THREADS
+/// Open another descriptor for an existing socket, to be read by the
+/// specified receive thread.  This is the same socket in the kernel, so
+/// each datagram is read by exactly one of the threads, and nobody else
+/// can bind to the port.  All sends should use the original.
+static CRawUDPSocketImpl *DupRawUDPSocketForRecvThread( const CRawUDPSocketImpl *pOrig, CRecvPacketCallback callback, int nRecvThread, SteamNetworkingErrMsg &errMsg )
+{
+	SOCKET sock = fcntl( pOrig->m_socket, F_DUPFD_CLOEXEC, 0 );
+	if ( sock == INVALID_SOCKET )
+	{
+		V_sprintf_safe( errMsg, "Failed to duplicate socket descriptor.  Error code 0x%08X.", GetLastSocketError() );
+		return nullptr;
+	}
+
+	CRawUDPSocketImpl *pSock = new CRawUDPSocketImpl;
+	pSock->m_socket = sock;
+	pSock->m_boundAddr = pOrig->m_boundAddr;
+	pSock->m_callback = callback;
+	pSock->m_nAddressFamilies = pOrig->m_nAddressFamilies;
+	if ( !BAddSocketToRecvThread( pSock, nRecvThread, errMsg ) )
+	{
+		delete pSock;
+		return nullptr;
+	}
+
+	s_vecRawSockets.AddToTail( pSock );
+	return pSock;
+}
+#endif
+
+static inline void AssertGlobalLockHeldExactlyOnce()
+{
+	#if STEAMNETWORKINGSOCKETS_LOCK_DEBUG_LEVEL > 0
+		ThreadLockDebugInfo &t = GetThreadDebugInfo();
+		Assert( t.m_nHeldLocks == 1 && t.m_arHeldLocks[0] == &s_mutexGlobalLock );
+	#endif
+}
+
+/// Process a single datagram that we read from a socket.  This is where we
+/// apply simulated network conditions, and then dispatch it to the callback
+static void ProcessRecvPacket( CRawUDPSocketImpl *pSock, char *pPkt, int cbPkt, const sockaddr_storage &from, SteamNetworkingMicroseconds usecNow )
+{
+
+	// Add a tag.  If we end up holding the lock for a long time, this tag
+	// will tell us how many packets were processed
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread( "RecvUDPPacket" );
+
+	// Check simulated global rate limit.  Make sure this is fast
+	// when the limit is not in use
+	if ( unlikely( GlobalConfig::FakeRateLimit_Recv_Rate.Get() > 0 ) )
+	{
+
+		// Check if bucket already has tokens in it, which
+		// will be common.  If so, we can avoid reading the
+		// timer
+		if ( s_flFakeRateLimit_Recv_tokens <= 0.0f )
+		{
+
+			// Update bucket with tokens
+			UpdateFakeRateLimitTokenBuckets( usecNow );
+
+			// Still empty?
+			if ( s_flFakeRateLimit_Recv_tokens <= 0.0f )
+				return;
+		}
+
+		// Spend tokens
+		s_flFakeRateLimit_Recv_tokens -= cbPkt;
+	}
+
+	// Check for simulating random packet loss
+	if ( RandomBoolWithOdds( GlobalConfig::FakePacketLoss_Recv.Get() ) )
+		return;
+
+	RecvPktInfo_t info;
+	info.m_adrFrom.SetFromSockadr( &from );
+
+	// If we're dual stack, convert mapped IPv4 back to ordinary IPv4
+	if ( pSock->m_nAddressFamilies == k_nAddressFamily_DualStack )
+		info.m_adrFrom.BConvertMappedToIPv4();
+
+	// Check for tracing
+	if ( GlobalConfig::PacketTraceMaxBytes.Get() >= 0 )
+	{
+		iovec tmp;
+		tmp.iov_base = pPkt;
+		tmp.iov_len = cbPkt;
+		pSock->TracePkt( false, info.m_adrFrom, 1, &tmp );
+	}
+
+	int32 nPacketFakeLagTotal = GlobalConfig::FakePacketLag_Recv.Get();
+
+	// Check for simulating random packet reordering
+	if ( RandomBoolWithOdds( GlobalConfig::FakePacketReorder_Recv.Get() ) )
+	{
+		nPacketFakeLagTotal += GlobalConfig::FakePacketReorder_Time.Get();
+	}
+
+	// Check for simulating random packet duplication
+	if ( RandomBoolWithOdds( GlobalConfig::FakePacketDup_Recv.Get() ) )
+	{
+		int32 nDupLag = nPacketFakeLagTotal + WeakRandomInt( 0, GlobalConfig::FakePacketDup_TimeMax.Get() );
+		nDupLag = std::max( 1, nDupLag );
+		iovec temp;
+		temp.iov_len = cbPkt;
+		temp.iov_base = pPkt;
+		s_packetLagQueueRecv.LagPacket( pSock, info.m_adrFrom, nDupLag, 1, &temp );
+	}
+
+	// Check for simulating lag
+	if ( nPacketFakeLagTotal > 0 )
+	{
+		iovec temp;
+		temp.iov_len = cbPkt;
+		temp.iov_base = pPkt;
+		s_packetLagQueueRecv.LagPacket( pSock, info.m_adrFrom, nPacketFakeLagTotal, 1, &temp );
+	}
+	else
+	{
+		ETW_UDPRecvPacket( info.m_adrFrom, cbPkt );
+
+		info.m_pPkt = pPkt;
+		info.m_cbPkt = cbPkt;
+		info.m_usecNow = usecNow;
+		info.m_pSock = pSock;
+		pSock->m_callback( info );
+	}
+
+	#ifdef STEAMNETWORKINGSOCKETS_LOWLEVEL_TIME_SOCKET_CALLS
+		SteamNetworkingMicroseconds usecProcessPacketEnd = SteamNetworkingSockets_GetLocalTimestamp();
+		if ( usecProcessPacketEnd > s_usecIgnoreLongLockWaitTimeUntil )
+		{
+			SteamNetworkingMicroseconds usecProcessPacketElapsed = usecProcessPacketEnd - usecNow;
+			if ( usecProcessPacketElapsed > 1000 )
+			{
+				SpewWarning( "process packet took %.1fms\n", usecProcessPacketElapsed*1e-3 );
+				ETW_LongOp( "process packet", usecProcessPacketElapsed );
+			}
+		}
+	#endif
+}
+
+#ifdef USE_RECVMMSG
+
+/// Buffers used for batched receive.  The main service thread only drains
+/// sockets while holding the global lock, so one set of buffers is shared
+/// by all of its sockets.  Allocated when we initialize low level support.
+/// (Extra receive threads each have their own.)
+struct RecvBatchBuffers_t
+{
+	mmsghdr m_msgs[ k_nMaxUDPRecvBatchSize ];
+	iovec m_iov[ k_nMaxUDPRecvBatchSize ];
+	sockaddr_storage m_from[ k_nMaxUDPRecvBatchSize ];
+	char m_buf[ k_nMaxUDPRecvBatchSize ][ k_cbSteamNetworkingSocketsMaxUDPMsgLen + 1024 ];
+
+	RecvBatchBuffers_t()
+	{
+		memset( m_msgs, 0, sizeof(m_msgs) );
+		for ( int i = 0 ; i < k_nMaxUDPRecvBatchSize ; ++i )
+		{
+			m_iov[i].iov_base = m_buf[i];
+			m_iov[i].iov_len = sizeof( m_buf[i] );
+			m_msgs[i].msg_hdr.msg_iov = &m_iov[i];
+			m_msgs[i].msg_hdr.msg_iovlen = 1;
+			m_msgs[i].msg_hdr.msg_name = &m_from[i];
+		}
+	}
+};
+static RecvBatchBuffers_t *s_pRecvBatchBuffers;
+
+/// Drain a socket, reading up to nBatchSize datagrams per system call.
+static bool DrainSocketBatched( CRawUDPSocketImpl *pSock, int nBatchSize )
+{
+	Assert( nBatchSize > 1 && nBatchSize <= k_nMaxUDPRecvBatchSize );
+	RecvBatchBuffers_t &b = *s_pRecvBatchBuffers;
+
+	while ( pSock->m_callback.m_fnCallback )
+	{
+		if ( s_nLowLevelSupportRefCount.load(std::memory_order_acquire) <= 0 )
+			return true; // Abort
+
+		// Kernel overwrites the address length, so we must reset it each time
+		for ( int i = 0 ; i < nBatchSize ; ++i )
+			b.m_msgs[i].msg_hdr.msg_namelen = sizeof( b.m_from[i] );
+
+		int nRecv = ::recvmmsg( pSock->m_socket, b.m_msgs, nBatchSize, MSG_DONTWAIT, nullptr );
+		SteamNetworkingMicroseconds usecRecvEnd = SteamNetworkingSockets_GetLocalTimestamp();
+		++s_nRecvSyscalls;
+
+		// Nothing more to read?  See the notes in DrainSocket about errors
+		if ( nRecv <= 0 )
+			break;
+		s_nRecvPackets += nRecv;
+
+		for ( int i = 0 ; i < nRecv ; ++i )
+		{
+			// Socket closed by a callback?  Discard the rest of the batch
+			if ( !pSock->m_callback.m_fnCallback )
+				break;
+			ProcessRecvPacket( pSock, b.m_buf[i], (int)b.m_msgs[i].msg_len, b.m_from[i], usecRecvEnd );
+		}
+		if ( !pSock->m_callback.m_fnCallback )
+			return true;
+
+		// If we got a partial batch, then the socket is empty.  Don't make
+		// another call just to find that out.  If something arrives
+		// in the meantime, epoll will tell us about it.
+		if ( nRecv < nBatchSize )
+			break;
+	}
+
+	// Continue normal operations
+	return true;
+}
+
+#endif // #ifdef USE_RECVMMSG
+
+#ifdef USE_EPOLL_PWAIT2
+/// Set if the kernel doesn't have epoll_pwait2
+static bool s_bEPollPWait2Unsupported;
+#endif
+
+/// Most APIs only take a timeout in milliseconds.  We assume the scheduler
+/// only has 1ms precision, so we round to the nearest ms, so that we don't
+/// always wake up exactly 1ms early, go to sleep and wait for 1ms.  But if
+/// we are going to sleep at all, we must wait at least 1 ms.
+///
+/// NOTE: On windows, we could use an alertable timer, and presumably when
+/// we set the we could use a high precision relative time, and Windows could do
+/// smart stuff.
+static inline int RoundWaitToMS( SteamNetworkingMicroseconds usecTimeout )
+{
+	if ( usecTimeout <= 0 )
+		return 0;
+	return std::max( 1, int( ( usecTimeout + 500 ) / 1000 ) );
+}
+
+/// Wait on an epoll set with a timeout in microseconds, if we can.
+/// Otherwise, round to milliseconds the same way as everybody else
+#ifdef USE_EPOLL
+static int EPollWait( EPollHandle epfd, epoll_event *pEvents, int nMaxEvents, SteamNetworkingMicroseconds usecTimeout )
+{
+	#ifdef USE_EPOLL_PWAIT2
+		if ( usecTimeout > 0 && GlobalConfig::PreciseServiceWait.Get() && !s_bEPollPWait2Unsupported )
+		{
+			// The kernel wants a __kernel_timespec, which is 64-bit on all
+			// targets.  (On 32-bit targets, libc's timespec might not be.)
+			struct { int64 tv_sec; int64 tv_nsec; } ts;
+			ts.tv_sec = usecTimeout / k_nMillion;
+			ts.tv_nsec = ( usecTimeout % k_nMillion ) * 1000;
+			int r = (int)syscall( SYS_epoll_pwait2, epfd, pEvents, nMaxEvents, &ts, nullptr, 0 );
+			if ( r >= 0 || errno != ENOSYS )
+				return r;
+			SpewVerbose( "epoll_pwait2 not supported by the kernel.  Service thread timeouts will be rounded to milliseconds.\n" );
+			s_bEPollPWait2Unsupported = true;
+		}
+	#endif
+	return epoll_wait( epfd, pEvents, nMaxEvents, RoundWaitToMS( usecTimeout ) );
+}
+
+/// Check an epoll set without blocking, over and over, for up to
+/// usecSpin.  Returns as soon as there is anything to do, or 0 if
+/// we used up the budget.  See k_ESteamNetworkingConfig_ServiceThreadSpinTime
+static int EPollSpin( EPollHandle epfd, epoll_event *pEvents, int nMaxEvents, SteamNetworkingMicroseconds usecSpin )
+{
+	const uint64 usecStop = Plat_USTime() + usecSpin;
+	for (;;)
+	{
+		int r = epoll_wait( epfd, pEvents, nMaxEvents, 0 );
+		if ( r != 0 || Plat_USTime() >= usecStop )
+			return r;
+	}
+}
+
+/// Spin for a bit (if configured), and then wait on an epoll set.
+static int EPollSpinThenWait( EPollHandle epfd, epoll_event *pEvents, int nMaxEvents, SteamNetworkingMicroseconds usecTimeout )
+{
+	const SteamNetworkingMicroseconds usecSpin = std::min( usecTimeout, (SteamNetworkingMicroseconds)GlobalConfig::ServiceThreadSpinTime.Get() );
+	if ( usecSpin > 0 )
+	{
+		const uint64 usecSpinStart = Plat_USTime();
+		int r = EPollSpin( epfd, pEvents, nMaxEvents, usecSpin );
+		if ( r != 0 )
+			return r;
+		usecTimeout -= SteamNetworkingMicroseconds( Plat_USTime() - usecSpinStart );
+	}
+	return EPollWait( epfd, pEvents, nMaxEvents, usecTimeout );
+}
+#endif
+
+/// Pin the calling service thread to a CPU, if the app asked us to.
+/// idxThread is 0 for the main service thread.
+/// See k_ESteamNetworkingConfig_ServiceThreadCPU
+static void SetServiceThreadAffinity( int idxThread )
+{
+	const int nFirstCPU = GlobalConfig::ServiceThreadCPU.Get();
+	if ( nFirstCPU < 0 )
+		return;
+	const int nCPU = nFirstCPU + idxThread;
+
+	#if IsLinux()
+		cpu_set_t cpus;
+		CPU_ZERO( &cpus );
+		CPU_SET( nCPU, &cpus );
+		int r = pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus );
+		if ( r != 0 )
+			SpewWarning( "Failed to pin service thread %d to CPU %d, error %d\n", idxThread, nCPU, r );
+	#elif defined( _WIN32 ) && !IsXbox()
+		if ( nCPU >= (int)sizeof(DWORD_PTR)*8 || SetThreadAffinityMask( GetCurrentThread(), DWORD_PTR(1) << nCPU ) == 0 )
+			SpewWarning( "Failed to pin service thread %d to CPU %d\n", idxThread, nCPU );
+	#else
+		SpewWarning( "Service thread CPU affinity is not supported on this platform\n" );
+	#endif
+}
+
+#ifdef USE_RECV_THREADS
+
+/// An extra receive thread.  It owns some of the raw sockets, and waits on
+/// them and reads from them without holding the global lock.  It takes the
+/// global lock to dispatch the packets it has read, so all packet processing
+/// is still serialized.  Thinkers, tasks, and everything else are still
+/// handled by the main service thread.
+struct RecvThread_t
+{
+	RecvThread_t() : m_lock( "recv_thread" ) {}
+	~RecvThread_t()
+	{
+		Assert( !m_pThread );
+		if ( m_epollfd != INVALID_EPOLL_HANDLE )
+			EPollClose( m_epollfd );
+		if ( m_hSockWakeRead != INVALID_SOCKET )
+			closesocket( m_hSockWakeRead );
+		if ( m_hSockWakeWrite != INVALID_SOCKET )
+			closesocket( m_hSockWakeWrite );
+	}
+
+	/// Protects m_vecSockets, and the packets we have read but not yet
+	/// dispatched.  The thread holds this while it reads from its sockets.
+	/// To remove a socket, you must hold the global lock and this lock.
+	ShortDurationLock m_lock;
 
-			// Try to get socket
-			int nIPv6AddressFamilies = nAddressFamilies;
-			sock = OpenUDPSocketBoundToSockAddr( &address6, sizeof(address6), errMsg, &nIPv6AddressFamilies, nBindInterface );
+	/// Sockets owned by this thread
+	CUtlVector<CRawUDPSocketImpl *> m_vecSockets;
 
-			if ( sock == INVALID_SOCKET )
-			{
-				// Allowing fallback to IPv4?
-				if ( nAddressFamilies != k_nAddressFamily_Auto )
-					return nullptr;
+	EPollHandle m_epollfd = INVALID_EPOLL_HANDLE;
+	SOCKET m_hSockWakeRead = INVALID_SOCKET;
+	SOCKET m_hSockWakeWrite = INVALID_SOCKET;
+	std::thread *m_pThread = nullptr;
 
-				// Continue below, we'll try IPv4
-			}
-			else
-			{
-				nAddressFamilies = nIPv6AddressFamilies;
-			}
-		}
-	#endif
+	/// Our slot in s_arpRecvThreads
+	int m_idxThread = 0;
 
-	// Try IPv4?
-	if ( sock == INVALID_SOCKET )
-	{
-		Assert( nAddressFamilies & k_nAddressFamily_IPv4 ); // Otherwise, we should have already failed above
+	/// Set when we want the thread to exit
+	std::atomic<bool> m_bStopRequested{ false };
 
-		sockaddr_in address4;
-		memset( &address4, 0, sizeof(address4) );
-		address4.sin_family = AF_INET;
-		address4.sin_addr.s_addr = BigDWord( addrLocal.GetIPv4() );
-		address4.sin_port = BigWord( addrLocal.m_port );
+	/// Packets read, but not yet dispatched, and the socket each one was
+	/// read from.  If a socket is closed, its entries are cleared.
+	RecvBatchBuffers_t m_recvBuffers;
+	CRawUDPSocketImpl *m_arpRecvSock[ k_nMaxUDPRecvBatchSize ];
+	int m_nRecvPkts = 0;
+};
 
-		// Try to get socket
-		sock = OpenUDPSocketBoundToSockAddr( &address4, sizeof(address4), errMsg, nullptr, nBindInterface );
+/// Extra receive threads.  Slot 0 is the main service thread, which
+/// uses s_epollfd and is not in this table.
+static RecvThread_t *s_arpRecvThreads[ k_nMaxRecvThreads ];
+static int s_nNextRecvThread;
 
-		// If we failed, well, we have no other options left to try.
-		if ( sock == INVALID_SOCKET )
-			return nullptr;
+static bool BAddSocketToRecvThread( CRawUDPSocketImpl *pSock, int nThread, SteamNetworkingErrMsg &errMsg )
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
 
-		// We re IPv4 only
-		nAddressFamilies = k_nAddressFamily_IPv4;
+	if ( nThread < 0 )
+	{
+		nThread = s_nNextRecvThread;
+		s_nNextRecvThread = ( s_nNextRecvThread + 1 ) % s_nRecvThreads;
 	}
-
-	// Read back address we actually bound to.
-	sockaddr_storage addrBound;
-	socklen_t cbAddress = sizeof(addrBound);
-	if ( getsockname( sock, (struct sockaddr *)&addrBound, &cbAddress ) != 0 )
+	else
 	{
-		V_sprintf_safe( errMsg, "getsockname failed.  Error code 0x%08X.", GetLastSocketError() );
-		closesocket( sock );
-		return nullptr;
+		Assert( nThread < s_nRecvThreads );
+		nThread %= s_nRecvThreads;
 	}
-	if ( addrBound.ss_family == AF_INET )
+	pSock->m_nRecvThread = nThread;
+	if ( nThread == 0 )
+		return AddFDToEPoll( s_epollfd, pSock->m_socket, pSock, errMsg );
+
+	RecvThread_t *pRecvThread = s_arpRecvThreads[ nThread ];
+	pRecvThread->m_lock.lock();
+	pRecvThread->m_vecSockets.AddToTail( pSock );
+	pRecvThread->m_lock.unlock();
+
+	if ( !AddFDToEPoll( pRecvThread->m_epollfd, pSock->m_socket, pSock, errMsg ) )
 	{
-		const sockaddr_in *boundaddr4 = (const sockaddr_in *)&addrBound;
-		addrLocal.SetIPv4( BigDWord( boundaddr4->sin_addr.s_addr ), BigWord( boundaddr4->sin_port ) );
+		pRecvThread->m_lock.lock();
+		pRecvThread->m_vecSockets.FindAndFastRemove( pSock );
+		pRecvThread->m_lock.unlock();
+		return false;
 	}
-	#ifndef PLATFORM_NO_IPV6
-	else if ( addrBound.ss_family == AF_INET6 )
+	return true;
+}
+
+static void RemoveSocketFromRecvThread( CRawUDPSocketImpl *pSock )
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+
+	if ( pSock->m_nRecvThread == 0 )
 	{
-		const sockaddr_in6 *boundaddr6 = (const sockaddr_in6 *)&addrBound;
-		addrLocal.SetIPv6( boundaddr6->sin6_addr.s6_addr, BigWord( boundaddr6->sin6_port ) );
+		int r = epoll_ctl( s_epollfd, EPOLL_CTL_DEL, pSock->m_socket, nullptr );
+		(void)r;
+		AssertMsg( r == 0, "epoll_ctl failed with errno=%d", errno );
+		return;
 	}
-	#endif
-	else
+
+	RecvThread_t *pRecvThread = s_arpRecvThreads[ pSock->m_nRecvThread ];
+	int r = epoll_ctl( pRecvThread->m_epollfd, EPOLL_CTL_DEL, pSock->m_socket, nullptr );
+	(void)r;
+	AssertMsg( r == 0, "epoll_ctl failed with errno=%d", errno );
+
+	// The thread might have already been told that this socket is ready,
+	// or have read packets from it that it is waiting to dispatch.  Once
+	// we hold its lock and the socket is gone from the list, it won't
+	// read from it again.
+	pRecvThread->m_lock.lock();
+	pRecvThread->m_vecSockets.FindAndFastRemove( pSock );
+	for ( int i = 0 ; i < pRecvThread->m_nRecvPkts ; ++i )
 	{
-		Assert( false );
-		V_sprintf_safe( errMsg, "getsockname returned address with unexpected family %d", addrBound.ss_family );
-		closesocket( sock );
-		return nullptr;
+		if ( pRecvThread->m_arpRecvSock[ i ] == pSock )
+			pRecvThread->m_arpRecvSock[ i ] = nullptr;
 	}
+	pRecvThread->m_lock.unlock();
+}
 
-	// Allocate a bookkeeping structure
-	CRawUDPSocketImpl *pSock = new CRawUDPSocketImpl;
-	pSock->m_socket = sock;
-	pSock->m_boundAddr = addrLocal;
-	pSock->m_callback = callback;
-	pSock->m_nAddressFamilies = nAddressFamilies;
+static void RecvThreadProc( RecvThread_t *pRecvThread )
+{
 
-	// How will we wait efficiently for this socket?
-	#ifdef USE_EPOLL
-		if ( !AddFDToEPoll( sock, pSock, errMsg ) )
+	// Invoke user callback, if any
+	if ( s_fnServiceThreadInitCallback )
+		(*s_fnServiceThreadInitCallback)();
+
+	// Random number generator may be per thread
+	SeedWeakRandomGenerator();
+
+	SetServiceThreadAffinity( pRecvThread->m_idxThread );
+
+	RecvBatchBuffers_t &b = pRecvThread->m_recvBuffers;
+	while ( !pRecvThread->m_bStopRequested.load(std::memory_order_acquire) )
+	{
+		struct epoll_event epoll_events[ 32 ];
+		int num_epoll_events = EPollSpinThenWait( pRecvThread->m_epollfd, epoll_events, V_ARRAYSIZE( epoll_events ), SteamNetworkingMicroseconds( k_msMaxPollWait ) * 1000 );
+		if ( num_epoll_events <= 0 )
+			continue;
+
+		// Read a batch from each socket that has data.  This only needs
+		// our own lock.  Since epoll is level triggered, anything we
+		// don't get to now will be reported again.
+		const int nBatchSize = GlobalConfig::RecvBatchSize.Get();
+		int nRecvSyscalls = 0;
+		pRecvThread->m_lock.lock();
+		Assert( pRecvThread->m_nRecvPkts == 0 );
+		for ( int i = 0 ; i < num_epoll_events && pRecvThread->m_nRecvPkts < k_nMaxUDPRecvBatchSize ; ++i )
 		{
-			delete pSock;
-			return nullptr;
+			auto pSock = (CRawUDPSocketImpl *)epoll_events[ i ].data.ptr;
+			if ( !pSock )
+			{
+				// Wake request
+				char buf[8];
+				::recv( pRecvThread->m_hSockWakeRead, buf, sizeof(buf), 0 );
+				continue;
+			}
+
+			// Socket closed since epoll_wait returned?
+			if ( !pRecvThread->m_vecSockets.HasElement( pSock ) )
+				continue;
+
+			const int nMaxRecv = std::min( nBatchSize, k_nMaxUDPRecvBatchSize - pRecvThread->m_nRecvPkts );
+			mmsghdr *pMsgs = &b.m_msgs[ pRecvThread->m_nRecvPkts ];
+			for ( int j = 0 ; j < nMaxRecv ; ++j )
+				pMsgs[j].msg_hdr.msg_namelen = sizeof( b.m_from[0] );
+			int nRecv = ::recvmmsg( pSock->m_socket, pMsgs, nMaxRecv, MSG_DONTWAIT, nullptr );
+			++nRecvSyscalls;
+			for ( int j = 0 ; j < nRecv ; ++j )
+				pRecvThread->m_arpRecvSock[ pRecvThread->m_nRecvPkts++ ] = pSock;
 		}
-	#elif defined( _WIN32 )
-		// On windows, tell the socket to set our global "wake" event whenever there is data to read
-		Assert( s_hEventWakeThread != INVALID_HANDLE_VALUE );
-		if ( WSAEventSelect( pSock->m_socket, s_hEventWakeThread, FD_READ ) != 0 )
+		pRecvThread->m_lock.unlock();
+		if ( pRecvThread->m_nRecvPkts == 0 )
+			continue;
+		SteamNetworkingMicroseconds usecRecvEnd = SteamNetworkingSockets_GetLocalTimestamp();
+
+		// Now dispatch them.  Don't wait forever for the global lock,
+		// in case somebody holds it while shutting us down.
+		for (;;)
 		{
-			delete pSock;
-			V_sprintf_safe( errMsg, "WSAEventSelect() failed.  Error code 0x%08X.", GetLastSocketError() );
-			return nullptr;
+			if ( pRecvThread->m_bStopRequested.load(std::memory_order_acquire) )
+				return;
+			if ( SteamNetworkingGlobalLock::TryLock( "RecvThread", 20 ) )
+				break;
 		}
-	#elif defined( USE_POLL )
-		// Rebuild our pollfd list next time
-		s_bRecreatePollList = true;
-	#else
-		#error "How will we poll this socket?"
-	#endif
 
-	// Add to master list.  (Hopefully we usually won't have that many.)
-	s_vecRawSockets.AddToTail( pSock );
+		s_nRecvSyscalls += nRecvSyscalls;
+		s_nRecvPackets += pRecvThread->m_nRecvPkts;
+		for ( int i = 0 ; i < pRecvThread->m_nRecvPkts ; ++i )
+		{
+			// Socket closed since we read this?  (Possibly by a
+			// callback for an earlier packet.)
+			CRawUDPSocketImpl *pSock = pRecvThread->m_arpRecvSock[ i ];
+			if ( !pSock || !pSock->m_callback.m_fnCallback )
+				continue;
+			ProcessRecvPacket( pSock, b.m_buf[i], (int)b.m_msgs[i].msg_len, b.m_from[i], usecRecvEnd );
+		}
+		pRecvThread->m_nRecvPkts = 0;
 
+		SteamNetworkingGlobalLock::Unlock();
+	}
+}
 
-	// Wake up background thread so we can start receiving packets on this socket immediately
-	WakeServiceThread();
+/// Start extra receive threads, if requested.  If we fail to start one, we
+/// just run with fewer.
+static void StartRecvThreads()
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+	Assert( s_nRecvThreads == 1 );
 
-	// Give back info on address families
-	if ( pnAddressFamilies )
-		*pnAddressFamilies = nAddressFamilies;
+	const int nThreads = s_bManualPollMode ? 1 : GlobalConfig::RecvThreads.Get();
+	for ( int i = 1 ; i < nThreads ; ++i )
+	{
+		RecvThread_t *pRecvThread = new RecvThread_t;
 
-	// Give them something they can use
-	return pSock;
-}
+		SteamNetworkingErrMsg errMsg;
+		pRecvThread->m_epollfd = EPollCreate( errMsg );
+		if ( pRecvThread->m_epollfd == INVALID_EPOLL_HANDLE )
+		{
+			SpewWarning( "Failed to start receive thread %d.  %s\n", i, errMsg );
+			delete pRecvThread;
+			break;
+		}
 
-IRawUDPSocket *OpenRawUDPSocket( CRecvPacketCallback callback, SteamNetworkingErrMsg &errMsg, SteamNetworkingIPAddr *pAddrLocal, int *pnAddressFamilies )
-{
-	return OpenRawUDPSocketInternal( callback, errMsg, pAddrLocal, pnAddressFamilies );
+		int sockType = SOCK_DGRAM;
+		#if IsLinux()
+			sockType |= SOCK_CLOEXEC;
+		#endif
+		int sock[2];
+		if ( socketpair( AF_LOCAL, sockType, 0, sock ) != 0 )
+		{
+			SpewWarning( "Failed to start receive thread %d.  socketpair() call failed.  Error code 0x%08x.\n", i, GetLastSocketError() );
+			delete pRecvThread;
+			break;
+		}
+		pRecvThread->m_hSockWakeRead = sock[0];
+		pRecvThread->m_hSockWakeWrite = sock[1];
+		if ( !SetSocketNonBlocking( pRecvThread->m_hSockWakeRead ) || !SetSocketNonBlocking( pRecvThread->m_hSockWakeWrite ) )
+		{
+			AssertMsg1( false, "Failed to set socket nonblocking mode.  Error code 0x%08x.", GetLastSocketError() );
+		}
+		if ( !AddFDToEPoll( pRecvThread->m_epollfd, pRecvThread->m_hSockWakeRead, nullptr, errMsg ) )
+		{
+			SpewWarning( "Failed to start receive thread %d.  %s\n", i, errMsg );
+			delete pRecvThread;
+			break;
+		}
+
+		s_arpRecvThreads[ i ] = pRecvThread;
+		s_nRecvThreads = i+1;
+		pRecvThread->m_idxThread = i;
+		pRecvThread->m_pThread = new std::thread( RecvThreadProc, pRecvThread );
+	}
+
+	if ( s_nRecvThreads > 1 )
+		SpewMsg( "Using %d receive threads.\n", s_nRecvThreads );
 }
 
-static inline void AssertGlobalLockHeldExactlyOnce()
+/// Stop and free extra receive threads.  They never wait on the global
+/// lock without checking for the stop request, so the caller may hold it.
+static void StopRecvThreads()
 {
-	#if STEAMNETWORKINGSOCKETS_LOCK_DEBUG_LEVEL > 0
-		ThreadLockDebugInfo &t = GetThreadDebugInfo();
-		Assert( t.m_nHeldLocks == 1 && t.m_arHeldLocks[0] == &s_mutexGlobalLock );
-	#endif
+	for ( int i = 1 ; i < s_nRecvThreads ; ++i )
+	{
+		RecvThread_t *pRecvThread = s_arpRecvThreads[ i ];
+		s_arpRecvThreads[ i ] = nullptr;
+
+		pRecvThread->m_bStopRequested.store( true, std::memory_order_release );
+		char buf[1] = {0};
+		send( pRecvThread->m_hSockWakeWrite, buf, 1, 0 );
+		pRecvThread->m_pThread->join();
+		delete pRecvThread->m_pThread;
+		pRecvThread->m_pThread = nullptr;
+
+		// Any sockets still open at this point are a bug (see below), but
+		// don't leave them pointing at a thread that is gone
+		for ( CRawUDPSocketImpl *pSock: pRecvThread->m_vecSockets )
+			pSock->m_nRecvThread = 0;
+
+		delete pRecvThread;
+	}
+	s_nRecvThreads = 1;
+	s_nNextRecvThread = 0;
 }
 
+#endif // #ifdef USE_RECV_THREADS
+
 /// Draw one specific UDP socket.  Returns false if we detect a
 /// global shutdown attempt and abort
 static bool DrainSocket( CRawUDPSocketImpl *pSock )
 {
 
+	#ifdef USE_RECVMMSG
+	{
+		int nBatchSize = GlobalConfig::RecvBatchSize.Get();
+		if ( nBatchSize > 1 && s_pRecvBatchBuffers )
+			return DrainSocketBatched( pSock, nBatchSize );
+	}
+	#endif
+
 	// If the callback gets cleared, that indicates that the socket is pending
 	// destruction and is logically closed, even if the underlying UDP socket
 	// still exists.
@@ -1904,6 +3100,7 @@ static bool DrainSocket( CRawUDPSocketImpl *pSock )
 		socklen_t fromlen = sizeof(from);
 		int ret = ::recvfrom( pSock->m_socket, buf, sizeof( buf ), 0, (sockaddr *)&from, &fromlen );
 		SteamNetworkingMicroseconds usecRecvFromEnd = SteamNetworkingSockets_GetLocalTimestamp();
+		++s_nRecvSyscalls;
 
 		#ifdef STEAMNETWORKINGSOCKETS_LOWLEVEL_TIME_SOCKET_CALLS
 			if ( usecRecvFromEnd > s_usecIgnoreLongLockWaitTimeUntil )
@@ -1932,104 +3129,9 @@ static bool DrainSocket( CRawUDPSocketImpl *pSock )
 		// be handled/reported in the same way as any other bogus packet.)
 		if ( ret < 0 )
 			break;
+		++s_nRecvPackets;
 
-		// Add a tag.  If we end up holding the lock for a long time, this tag
-		// will tell us how many packets were processed
-		SteamNetworkingGlobalLock::AssertHeldByCurrentThread( "RecvUDPPacket" );
-
-		// Check simulated global rate limit.  Make sure this is fast
-		// when the limit is not in use
-		if ( unlikely( GlobalConfig::FakeRateLimit_Recv_Rate.Get() > 0 ) )
-		{
-
-			// Check if bucket already has tokens in it, which
-			// will be common.  If so, we can avoid reading the
-			// timer
-			if ( s_flFakeRateLimit_Recv_tokens <= 0.0f )
-			{
-
-				// Update bucket with tokens
-				UpdateFakeRateLimitTokenBuckets( usecRecvFromEnd );
-
-				// Still empty?
-				if ( s_flFakeRateLimit_Recv_tokens <= 0.0f )
-					continue;
-			}
-
-			// Spend tokens
-			s_flFakeRateLimit_Recv_tokens -= ret;
-		}
-
-		// Check for simulating random packet loss
-		if ( RandomBoolWithOdds( GlobalConfig::FakePacketLoss_Recv.Get() ) )
-			continue;
-
-		RecvPktInfo_t info;
-		info.m_adrFrom.SetFromSockadr( &from );
-
-		// If we're dual stack, convert mapped IPv4 back to ordinary IPv4
-		if ( pSock->m_nAddressFamilies == k_nAddressFamily_DualStack )
-			info.m_adrFrom.BConvertMappedToIPv4();
-
-		// Check for tracing
-		if ( GlobalConfig::PacketTraceMaxBytes.Get() >= 0 )
-		{
-			iovec tmp;
-			tmp.iov_base = buf;
-			tmp.iov_len = ret;
-			pSock->TracePkt( false, info.m_adrFrom, 1, &tmp );
-		}
-
-		int32 nPacketFakeLagTotal = GlobalConfig::FakePacketLag_Recv.Get();
-
-		// Check for simulating random packet reordering
-		if ( RandomBoolWithOdds( GlobalConfig::FakePacketReorder_Recv.Get() ) )
-		{
-			nPacketFakeLagTotal += GlobalConfig::FakePacketReorder_Time.Get();
-		}
-
-		// Check for simulating random packet duplication
-		if ( RandomBoolWithOdds( GlobalConfig::FakePacketDup_Recv.Get() ) )
-		{
-			int32 nDupLag = nPacketFakeLagTotal + WeakRandomInt( 0, GlobalConfig::FakePacketDup_TimeMax.Get() );
-			nDupLag = std::max( 1, nDupLag );
-			iovec temp;
-			temp.iov_len = ret;
-			temp.iov_base = buf;
-			s_packetLagQueueRecv.LagPacket( pSock, info.m_adrFrom, nDupLag, 1, &temp );
-		}
-
-		// Check for simulating lag
-		if ( nPacketFakeLagTotal > 0 )
-		{
-			iovec temp;
-			temp.iov_len = ret;
-			temp.iov_base = buf;
-			s_packetLagQueueRecv.LagPacket( pSock, info.m_adrFrom, nPacketFakeLagTotal, 1, &temp );
-		}
-		else
-		{
-			ETW_UDPRecvPacket( info.m_adrFrom, ret );
-
-			info.m_pPkt = buf;
-			info.m_cbPkt = ret;
-			info.m_usecNow = usecRecvFromEnd;
-			info.m_pSock = pSock;
-			pSock->m_callback( info );
-		}
-
-		#ifdef STEAMNETWORKINGSOCKETS_LOWLEVEL_TIME_SOCKET_CALLS
-			SteamNetworkingMicroseconds usecProcessPacketEnd = SteamNetworkingSockets_GetLocalTimestamp();
-			if ( usecProcessPacketEnd > s_usecIgnoreLongLockWaitTimeUntil )
-			{
-				SteamNetworkingMicroseconds usecProcessPacketElapsed = usecProcessPacketEnd - usecRecvFromEnd;
-				if ( usecProcessPacketElapsed > 1000 )
-				{
-					SpewWarning( "process packet took %.1fms\n", usecProcessPacketElapsed*1e-3 );
-					ETW_LongOp( "process packet", usecProcessPacketElapsed );
-				}
-			}
-		#endif
+		ProcessRecvPacket( pSock, buf, ret, from, usecRecvFromEnd );
 	}
 
 	// Continue normal operations
@@ -2039,7 +3141,7 @@ static bool DrainSocket( CRawUDPSocketImpl *pSock )
 /// Poll all of our sockets, and dispatch the packets received.
 /// This will return true if we own the lock, or false if we detected
 /// a shutdown request and bailed without re-squiring the lock.
-static bool PollRawUDPSockets( int nMaxTimeoutMS, bool bManualPoll )
+static bool PollRawUDPSockets( SteamNetworkingMicroseconds usecMaxTimeout, bool bManualPoll )
 {
 	// This should only ever be called from our one thread proc,
 	// and we assume that it will have locked the lock exactly once.
@@ -2101,14 +3203,17 @@ static bool PollRawUDPSockets( int nMaxTimeoutMS, bool bManualPoll )
 	if ( s_nLowLevelSupportRefCount.load(std::memory_order_acquire) <= 0 || s_bManualPollMode != bManualPoll )
 		return false; // ABORT THREAD
 
-	// Wait for data on one of the sockets, or for us to be asked to wake up
+	// Wait for data on one of the sockets, or for us to be asked to wake up.
+	// (Don't spin if we're on the app's thread.)
 	#if defined( USE_EPOLL )
 		struct epoll_event epoll_events[ 32 ];
-		int num_epoll_events = epoll_wait( s_epollfd, epoll_events, V_ARRAYSIZE( epoll_events ), nMaxTimeoutMS );
+		int num_epoll_events = bManualPoll
+			? EPollWait( s_epollfd, epoll_events, V_ARRAYSIZE( epoll_events ), usecMaxTimeout )
+			: EPollSpinThenWait( s_epollfd, epoll_events, V_ARRAYSIZE( epoll_events ), usecMaxTimeout );
 	#elif defined( USE_POLL )
-		int poll_result = poll( s_vecPollFDs.Base(), s_vecPollFDs.Count(), nMaxTimeoutMS );
+		int poll_result = poll( s_vecPollFDs.Base(), s_vecPollFDs.Count(), RoundWaitToMS( usecMaxTimeout ) );
 	#elif defined( _WIN32 )
-		WaitForSingleObject( s_hEventWakeThread, nMaxTimeoutMS );
+		WaitForSingleObject( s_hEventWakeThread, RoundWaitToMS( usecMaxTimeout ) );
 	#else
 		#error "How do?"
 	#endif
@@ -2718,12 +3823,13 @@ static bool SteamNetworkingSockets_InternalPoll( int msWait, bool bManualPoll )
 	AssertGlobalLockHeldExactlyOnce();
 
 	// Figure out how long to sleep
+	SteamNetworkingMicroseconds usecWait = SteamNetworkingMicroseconds( std::max( msWait, 0 ) ) * 1000;
 	SteamNetworkingMicroseconds usecNextWakeTime = IThinker::Thinker_GetNextScheduledThinkTime();
 	if ( usecNextWakeTime < k_nThinkTime_Never )
 	{
 
-		// Calc wait time to wake up as late as possible,
-		// rounded up to the nearest millisecond.
+		// Calc wait time to wake up as late as possible.  (We might
+		// need to round this, when we actually go to sleep.)
 		SteamNetworkingMicroseconds usecNow = SteamNetworkingSockets_GetLocalTimestamp();
 		int64 usecUntilNextThinkTime = usecNextWakeTime - usecNow;
 
@@ -2731,26 +3837,12 @@ static bool SteamNetworkingSockets_InternalPoll( int msWait, bool bManualPoll )
 		{
 			// Earliest thinker in the queue is ready to go now.
 			// There is no point in going to sleep
-			msWait = 0;
+			usecWait = 0;
 		}
 		else
 		{
-
-			// Set wake time to wake up at the target time.  We assume the scheduler
-			// only has 1ms precision, so we round to the nearest ms, so that we don't
-			// always wake up exactly 1ms early, go to sleep and wait for 1ms.
-			//
-			// NOTE: On linux, we have a precise timer and we could probably do better
-			// than this.  On windows, we could use an alertable timer, and presumably when
-			// we set the we could use a high precision relative time, and Windows could do
-			// smart stuff.
-			int msTaskWait = ( usecUntilNextThinkTime + 500 ) / 1000;
-
-			// We must wait at least 1 ms
-			msTaskWait = std::max( 1, msTaskWait );
-
 			// Limit to what the caller has requested
-			msWait = std::min( msWait, msTaskWait );
+			usecWait = std::min( usecWait, usecUntilNextThinkTime );
 		}
 	}
 
@@ -2759,10 +3851,10 @@ static bool SteamNetworkingSockets_InternalPoll( int msWait, bool bManualPoll )
 	// be explicitly waking the thread for good perf, we will notice
 	// the delay.  But not so long that a bug in some rare 
 	// shutdown race condition (or the like) will be catastrophic
-	msWait = std::min( msWait, k_msMaxPollWait );
+	usecWait = std::min( usecWait, SteamNetworkingMicroseconds( k_msMaxPollWait ) * 1000 );
 
 	// Poll sockets
-	if ( !PollRawUDPSockets( msWait, bManualPoll ) )
+	if ( !PollRawUDPSockets( usecWait, bManualPoll ) )
 	{
 		// Shutdown request, and they did NOT re-acquire the lock
 		return false;
@@ -2877,6 +3969,8 @@ static void SteamNetworkingThreadProc()
 	// this thread, if so
 	SeedWeakRandomGenerator();
 
+	SetServiceThreadAffinity( 0 );
+
 	SpewVerbose( "Service thread running.\n" );
 
 	// Keep looping until we're asked to terminate
@@ -3035,16 +4129,46 @@ void CSharedSocket::DefaultCallbackRecvPacket( const RecvPktInfo_t &info, CShare
 	callback( info );
 }
 
-bool CSharedSocket::BInit( const SteamNetworkingIPAddr &localAddr, CRecvPacketCallback callbackUnknownAddress, SteamNetworkingErrMsg &errMsg )
+bool CSharedSocket::BInit( const SteamNetworkingIPAddr &localAddr, CRecvPacketCallback callbackUnknownAddress, SteamNetworkingErrMsg &errMsg, bool bSpreadAcrossRecvThreads )
 {
 	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
 
 	Kill();
 
 	SteamNetworkingIPAddr bindAddr = localAddr;
-	m_pRawSock = OpenRawUDPSocket( CRecvPacketCallback( DefaultCallbackRecvPacket, this ), errMsg, &bindAddr, nullptr );
-	if ( m_pRawSock == nullptr )
-		return false;
+	#ifdef USE_RECV_THREADS
+	if ( bSpreadAcrossRecvThreads && s_nRecvThreads > 1 )
+	{
+		// Open the socket normally
+		CRawUDPSocketImpl *pRawSock = OpenRawUDPSocketInternal( CRecvPacketCallback( DefaultCallbackRecvPacket, this ), errMsg, &bindAddr, nullptr );
+		if ( pRawSock == nullptr )
+			return false;
+		m_pRawSock = pRawSock;
+
+		// Give each of the other threads its own descriptor for the same
+		// socket.  (We don't use SO_REUSEPORT, because that would let any
+		// other process running as the same user bind the port and take
+		// some of our traffic.)
+		for ( int i = 0 ; i < s_nRecvThreads ; ++i )
+		{
+			if ( i == pRawSock->m_nRecvThread )
+				continue;
+			CRawUDPSocketImpl *pExtraSock = DupRawUDPSocketForRecvThread( pRawSock, CRecvPacketCallback( DefaultCallbackRecvPacket, this ), i, errMsg );
+			if ( pExtraSock == nullptr )
+			{
+				Kill();
+				return false;
+			}
+			m_vecExtraRawSocks.AddToTail( pExtraSock );
+		}
+	}
+	else
+	#endif
+	{
+		m_pRawSock = OpenRawUDPSocket( CRecvPacketCallback( DefaultCallbackRecvPacket, this ), errMsg, &bindAddr, nullptr );
+		if ( m_pRawSock == nullptr )
+			return false;
+	}
 
 	m_callbackUnknownAddress = callbackUnknownAddress;
 	return true;
@@ -3053,6 +4177,8 @@ bool CSharedSocket::BInit( const SteamNetworkingIPAddr &localAddr, CRecvPacketCa
 void CSharedSocket::SetCallbackRecvPacket( CRecvPacketCallback callback )
 {
 	m_pRawSock->SetCallbackRecvPacket( callback );
+	for ( IRawUDPSocket *pExtraSock: m_vecExtraRawSocks )
+		pExtraSock->SetCallbackRecvPacket( callback );
 }
 
 void CSharedSocket::Kill()
@@ -3065,6 +4191,9 @@ void CSharedSocket::Kill()
 		m_pRawSock->Close();
 		m_pRawSock = nullptr;
 	}
+	for ( IRawUDPSocket *pExtraSock: m_vecExtraRawSocks )
+		pExtraSock->Close();
+	m_vecExtraRawSocks.RemoveAll();
 	FOR_EACH_HASHMAP( m_mapRemoteHosts, idx )
 	{
 		CloseRemoteHostByIndex( idx );
@@ -3384,7 +4513,7 @@ bool BSteamNetworkingSocketsLowLevelAddRef( SteamNetworkingErrMsg &errMsg )
 			// Add the wake socket to our epoll list.  Set the userdata to NULL.
 			// That's how we know it's just the wake event
 			#if defined( WAKE_THREAD_USING_SOCKET_PAIR )
-				if ( !AddFDToEPoll( s_hSockWakeThreadRead, nullptr, errMsg ) )
+				if ( !AddFDToEPoll( s_epollfd, s_hSockWakeThreadRead, nullptr, errMsg ) )
 					return false;
 			#elif defined( USE_EPOLL_ABORT )
 				// nothing to do
@@ -3399,6 +4528,21 @@ bool BSteamNetworkingSocketsLowLevelAddRef( SteamNetworkingErrMsg &errMsg )
 			s_bRecreatePollList = true;
 		#endif
 
+		// Buffers for batched receive and send
+		#ifdef USE_RECVMMSG
+			Assert( !s_pRecvBatchBuffers );
+			s_pRecvBatchBuffers = new RecvBatchBuffers_t;
+		#endif
+		#ifdef USE_SENDMMSG
+			Assert( !s_pSendBatch );
+			s_pSendBatch = new SendBatch_t;
+		#endif
+
+		// Extra receive threads
+		#ifdef USE_RECV_THREADS
+			StartRecvThreads();
+		#endif
+
 		SpewMsg( "Initialized low level socket/threading support.\n" );
 	}
 
@@ -3452,6 +4596,14 @@ void SteamNetworkingSocketsLowLevelDecRef()
 	// Stop the service thread, if we have one
 	if ( s_pServiceThread )
 		StopServiceThread();
+	#ifdef USE_RECV_THREADS
+		StopRecvThreads();
+	#endif
+
+	// Stop the crypto worker threads.  They will finish anything that is
+	// queued, and queue the results to run with the lock, which we'll
+	// process below.
+	StopWorkerThreads();
 
 	// Destory wake communication objects
 	#if defined( _WIN32 )
@@ -3514,6 +4666,22 @@ void SteamNetworkingSocketsLowLevelDecRef()
 	s_packetLagQueueRecv.Clear();
 	s_packetLagQueueSend.Clear();
 
+	// Free batched receive and send buffers
+	#ifdef USE_RECVMMSG
+		delete s_pRecvBatchBuffers;
+		s_pRecvBatchBuffers = nullptr;
+	#endif
+	#ifdef USE_SENDMMSG
+		Assert( s_nSendBatchScopeDepth == 0 );
+		Assert( !s_pSendBatch || s_pSendBatch->m_nPkts == 0 );
+		delete s_pSendBatch;
+		s_pSendBatch = nullptr;
+	#endif
+
+	// Return pooled message memory to the heap.  (Blocks in per-thread
+	// caches, and messages the app is still holding, are not affected.)
+	CSteamNetworkingMessage::TrimPool();
+
 	// Shutdown event tracing
 	ETW_Kill();
 
@@ -3880,6 +5048,29 @@ STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_Poll( int msMaxWait
 		SteamNetworkingGlobalLock::Unlock();
 }
 
+#ifdef STEAMNETWORKINGSOCKETS_STANDALONELIB
+STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_GetGlobalStats( SteamNetworkingGlobalStats_t *pStats, bool bReset )
+{
+	SteamNetworkingGlobalLock scopeLock( "SteamNetworkingSockets_GetGlobalStats" );
+	pStats->m_nRecvSyscalls = s_nRecvSyscalls;
+	pStats->m_nRecvPackets = s_nRecvPackets;
+	pStats->m_nSendSyscalls = s_nSendSyscalls;
+	pStats->m_nSendPackets = s_nSendPackets;
+	pStats->m_nSendPacketsTxTime = s_nSendPacketsTxTime;
+	CSteamNetworkingMessage::GetPoolStats( pStats, bReset );
+	CertStore_GetVerifiedCertCacheStats( &pStats->m_nCertCacheHits, &pStats->m_nCertCacheMisses, bReset );
+	CSteamNetworkListenSocketDirectUDP::GetAdmissionStats( pStats, bReset );
+	if ( bReset )
+	{
+		s_nRecvSyscalls = 0;
+		s_nRecvPackets = 0;
+		s_nSendSyscalls = 0;
+		s_nSendPackets = 0;
+		s_nSendPacketsTxTime = 0;
+	}
+}
+#endif
+
 STEAMNETWORKINGSOCKETS_INTERFACE void SteamNetworkingSockets_SetLockWaitWarningThreshold( SteamNetworkingMicroseconds usecTheshold )
 {
 	#if STEAMNETWORKINGSOCKETS_LOCK_DEBUG_LEVEL > 0
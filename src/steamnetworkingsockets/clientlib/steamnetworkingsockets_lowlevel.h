@@ -142,6 +142,10 @@ public:
 	/// The local address we ended up binding to
 	SteamNetworkingIPAddr m_boundAddr;
 
+	/// True if the kernel accepted SO_TXTIME on this socket, and so we can
+	/// stamp datagrams with a transmit time.  See RawUDPSendTxTimeScope
+	bool m_bTxTime = false;
+
 	/// Change the callback after it's been set.  Must be called while holding
 	/// the global lock
 	virtual void SetCallbackRecvPacket( CRecvPacketCallback callback ) = 0;
@@ -239,7 +243,12 @@ public:
 
 	/// Allocate a raw socket and setup bookkeeping structures so we can add
 	/// clients that will talk using it.
-	bool BInit( const SteamNetworkingIPAddr &localAddr, CRecvPacketCallback callbackUnknownAddress, SteamDatagramErrMsg &errMsg );
+	///
+	/// If bSpreadAcrossRecvThreads is set and we are running more than one
+	/// receive thread, every receive thread will read from the socket, using
+	/// its own descriptor, so incoming packets are spread across the threads.
+	/// All packets are still sent using the first descriptor.
+	bool BInit( const SteamNetworkingIPAddr &localAddr, CRecvPacketCallback callbackUnknownAddress, SteamDatagramErrMsg &errMsg, bool bSpreadAcrossRecvThreads = false );
 
 	/// Close all sockets and clean up all resources
 	void Kill();
@@ -285,6 +294,10 @@ private:
 	/// The raw socket that is being shared
 	IRawUDPSocket *m_pRawSock;
 
+	/// Additional descriptors for m_pRawSock, one for each of the other
+	/// receive threads.  See bSpreadAcrossRecvThreads
+	CUtlVector<IRawUDPSocket *> m_vecExtraRawSocks;
+
 	class RemoteHost : public IBoundUDPSocket
 	{
 	private:
@@ -314,6 +327,50 @@ private:
 
 extern int g_cbUDPSocketBufferSize;
 
+/// Max number of datagrams we will read from a socket with one system call.
+/// See k_ESteamNetworkingConfig_RecvBatchSize
+constexpr int k_nMaxUDPRecvBatchSize = 64;
+
+/// Max number of threads that can read from raw UDP sockets.
+/// See k_ESteamNetworkingConfig_RecvThreads
+constexpr int k_nMaxRecvThreads = 16;
+
+/// While at least one of these is in scope, datagrams sent on raw UDP
+/// sockets may be queued rather than sent immediately.  They are flushed
+/// when the outermost scope exits (or the queue fills up), using as few
+/// system calls as possible.  See k_ESteamNetworkingConfig_SendBatchMode.
+/// You must hold the global lock for the lifetime of the object.
+///
+/// Because the send is deferred, a packet queued this way is always
+/// reported as sent successfully.  (Which is not much different from UDP
+/// in general.)
+class RawUDPSendBatchScope
+{
+public:
+	RawUDPSendBatchScope();
+	~RawUDPSendBatchScope();
+};
+
+/// While one of these is in scope, datagrams sent on raw UDP sockets
+/// that have m_bTxTime set are stamped with a transmit time, and the
+/// kernel will hold them until then.  (See k_ESteamNetworkingConfig_SendTxTimeHorizon.)
+/// Other sockets ignore it.  You must hold the global lock for the
+/// lifetime of the object, and they do not nest.
+class RawUDPSendTxTimeScope
+{
+public:
+	RawUDPSendTxTimeScope();
+	~RawUDPSendTxTimeScope();
+
+	/// Stamp subsequent datagrams to go out this long from now.  ("Now"
+	/// is sampled once, the first time this is called with a nonzero
+	/// delay.)  Zero means send right away.
+	void SetDelay( SteamNetworkingMicroseconds usecDelay );
+
+private:
+	uint64 m_nBaseNanos;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // Misc low level service thread stuff
@@ -666,6 +723,12 @@ public:
 	/// on no particular thread and with no locks held
 	void QueueToRunInBackground();
 
+	/// Queue the item to run on one of the crypto worker threads, with
+	/// no locks held.  (See k_ESteamNetworkingConfig_CryptoWorkerThreads.)
+	/// The task must not have a target.  The caller should check that
+	/// the config value is nonzero, and do the work inline otherwise.
+	void QueueToRunOnWorkerThread();
+
 	/// Function call used to try to take the lock
 	typedef bool (*FTryLockFunc)( void *lock, int msTimeOut, const char *pszTag );
 
@@ -751,6 +814,11 @@ public:
 	// Run the queued tasks
 	void RunTasks();
 
+	// Remove the first task from the queue and run it.  Returns false
+	// if the queue was empty.  Used when several threads service the
+	// same queue; the tasks must not have a target.
+	bool RunOneTask();
+
 	// Return true if the task list is empty
 	inline bool empty() const { return m_pFirstTask == nullptr; }
 
@@ -69,6 +69,8 @@ void SSNPSenderState::Shutdown()
 	m_listSentReliableSegments.Purge();
 	m_listReadyRetryReliableRange.Purge();
 	m_vecLanes.clear();
+	m_vecFECLanes.clear();
+	m_nFECParityPending = 0;
 	m_cbPendingUnreliable = 0;
 	m_cbPendingReliable = 0;
 	m_cbSentUnackedReliable = 0;
@@ -79,10 +81,12 @@ SSNPSenderState::SSNPSenderState()
 {
 	// Setup the table of inflight packets with a sentinel.
 	m_mapInFlightPacketsByPktNum.clear();
-	SNPInFlightPacket_t &sentinel = m_mapInFlightPacketsByPktNum[INT64_MIN];
-	sentinel.m_bNack = false;
-	sentinel.m_pTransport = nullptr;
-	sentinel.m_usecWhenSent = 0;
+	std::pair<int64,SNPInFlightPacket_t> sentinel;
+	sentinel.first = INT64_MIN;
+	sentinel.second.m_bNack = false;
+	sentinel.second.m_pTransport = nullptr;
+	sentinel.second.m_usecWhenSent = 0;
+	m_mapInFlightPacketsByPktNum.insert( sentinel );
 	m_itNextInFlightPacketToTimeout = m_mapInFlightPacketsByPktNum.end();
 	DebugCheckInFlightPacketMap();
 }
@@ -237,16 +241,390 @@ SSNPReceiverState::SSNPReceiverState()
 	m_vecLanes.resize(1);
 }
 
+//-----------------------------------------------------------------------------
+SSNPRecvReliableStreamBuffer::SSNPRecvReliableStreamBuffer( SSNPRecvReliableStreamBuffer &&x )
+{
+	*this = std::move( x );
+}
+
+SSNPRecvReliableStreamBuffer &SSNPRecvReliableStreamBuffer::operator=( SSNPRecvReliableStreamBuffer &&x )
+{
+	if ( this != &x )
+	{
+		Clear();
+		free( m_ppChunkRing );
+		m_ppChunkRing = x.m_ppChunkRing; x.m_ppChunkRing = nullptr;
+		m_nChunkRingSize = x.m_nChunkRingSize; x.m_nChunkRingSize = 0;
+		m_idxFirstChunk = x.m_idxFirstChunk; x.m_idxFirstChunk = 0;
+		m_nChunks = x.m_nChunks; x.m_nChunks = 0;
+		m_nFrontOffset = x.m_nFrontOffset; x.m_nFrontOffset = 0;
+		m_cbSize = x.m_cbSize; x.m_cbSize = 0;
+		m_pSpareChunk = x.m_pSpareChunk; x.m_pSpareChunk = nullptr;
+	}
+	return *this;
+}
+
+void SSNPRecvReliableStreamBuffer::FreeChunk( uint8 *pChunk )
+{
+	if ( m_pSpareChunk )
+		free( pChunk );
+	else
+		m_pSpareChunk = pChunk;
+}
+
+void SSNPRecvReliableStreamBuffer::Clear()
+{
+	for ( int i = 0 ; i < m_nChunks ; ++i )
+		free( Chunk( i ) );
+	free( m_pSpareChunk );
+	free( m_ppChunkRing );
+	m_ppChunkRing = nullptr;
+	m_pSpareChunk = nullptr;
+	m_nChunkRingSize = 0;
+	m_idxFirstChunk = 0;
+	m_nChunks = 0;
+	m_nFrontOffset = 0;
+	m_cbSize = 0;
+}
+
+void SSNPRecvReliableStreamBuffer::Extend( int cbNewSize )
+{
+	Assert( cbNewSize >= m_cbSize );
+	int nChunksNeeded = ( m_nFrontOffset + cbNewSize + k_cbChunk - 1 ) / k_cbChunk;
+	if ( nChunksNeeded > m_nChunkRingSize )
+	{
+		// Grow the ring.  Unwrap the chunks so that the first one is at index 0
+		int nNewRingSize = std::max( m_nChunkRingSize, 4 );
+		while ( nNewRingSize < nChunksNeeded )
+			nNewRingSize *= 2;
+		uint8 **ppNewRing = (uint8 **)malloc( nNewRingSize * sizeof(uint8*) );
+		VerifyFatal( ppNewRing );
+		for ( int i = 0 ; i < m_nChunks ; ++i )
+			ppNewRing[i] = Chunk( i );
+		free( m_ppChunkRing );
+		m_ppChunkRing = ppNewRing;
+		m_nChunkRingSize = nNewRingSize;
+		m_idxFirstChunk = 0;
+	}
+	while ( m_nChunks < nChunksNeeded )
+	{
+		uint8 *pChunk = m_pSpareChunk;
+		if ( pChunk )
+		{
+			m_pSpareChunk = nullptr;
+		}
+		else
+		{
+			pChunk = (uint8 *)malloc( k_cbChunk );
+			VerifyFatal( pChunk );
+		}
+		Chunk( m_nChunks++ ) = pChunk;
+	}
+	m_cbSize = cbNewSize;
+}
+
+void SSNPRecvReliableStreamBuffer::Write( int nOffset, const void *pData, int cbData )
+{
+	Assert( nOffset >= 0 && nOffset + cbData <= m_cbSize );
+	const uint8 *pIn = (const uint8 *)pData;
+	int nPos = m_nFrontOffset + nOffset;
+	while ( cbData > 0 )
+	{
+		int nOffsetInChunk = nPos % k_cbChunk;
+		int cbCopy = std::min( cbData, k_cbChunk - nOffsetInChunk );
+		memcpy( Chunk( nPos / k_cbChunk ) + nOffsetInChunk, pIn, cbCopy );
+		pIn += cbCopy;
+		nPos += cbCopy;
+		cbData -= cbCopy;
+	}
+}
+
+void SSNPRecvReliableStreamBuffer::Read( int nOffset, void *pOut, int cbData ) const
+{
+	Assert( nOffset >= 0 && nOffset + cbData <= m_cbSize );
+	uint8 *pDest = (uint8 *)pOut;
+	int nPos = m_nFrontOffset + nOffset;
+	while ( cbData > 0 )
+	{
+		int nOffsetInChunk = nPos % k_cbChunk;
+		int cbCopy = std::min( cbData, k_cbChunk - nOffsetInChunk );
+		memcpy( pDest, Chunk( nPos / k_cbChunk ) + nOffsetInChunk, cbCopy );
+		pDest += cbCopy;
+		nPos += cbCopy;
+		cbData -= cbCopy;
+	}
+}
+
+const uint8 *SSNPRecvReliableStreamBuffer::Peek( int nOffset, int &cbContiguous ) const
+{
+	Assert( nOffset >= 0 && nOffset < m_cbSize );
+	int nPos = m_nFrontOffset + nOffset;
+	int nOffsetInChunk = nPos % k_cbChunk;
+	cbContiguous = std::min( m_cbSize - nOffset, k_cbChunk - nOffsetInChunk );
+	return Chunk( nPos / k_cbChunk ) + nOffsetInChunk;
+}
+
+void SSNPRecvReliableStreamBuffer::PopFront( int cbDiscard )
+{
+	Assert( cbDiscard >= 0 && cbDiscard <= m_cbSize );
+	m_cbSize -= cbDiscard;
+
+	// Emptied out?  Keep one chunk around as a spare, and start over
+	// at the front of the next chunk.
+	if ( m_cbSize == 0 )
+	{
+		while ( m_nChunks > 0 )
+		{
+			FreeChunk( Chunk( 0 ) );
+			m_idxFirstChunk = ( m_idxFirstChunk + 1 ) & ( m_nChunkRingSize-1 );
+			--m_nChunks;
+		}
+		m_nFrontOffset = 0;
+		return;
+	}
+
+	// Free up any chunks that are now completely consumed
+	m_nFrontOffset += cbDiscard;
+	while ( m_nFrontOffset >= k_cbChunk )
+	{
+		Assert( m_nChunks > 1 );
+		FreeChunk( Chunk( 0 ) );
+		m_idxFirstChunk = ( m_idxFirstChunk + 1 ) & ( m_nChunkRingSize-1 );
+		--m_nChunks;
+		m_nFrontOffset -= k_cbChunk;
+	}
+}
+
+//-----------------------------------------------------------------------------
+void SSNPIntervalSet::AddAtEnd( int64 nBegin, int64 nEnd )
+{
+	Assert( nBegin < nEnd );
+	Assert( empty() || back().m_nEnd < nBegin );
+	Interval x;
+	x.m_nBegin = nBegin;
+	x.m_nEnd = nEnd;
+	m_vecIntervals.push_back( x );
+}
+
+bool SSNPIntervalSet::Subtract( int64 nBegin, int64 nEnd, int nMaxIntervals )
+{
+	Assert( nBegin < nEnd );
+
+	// Locate the first interval that isn't entirely before the range.
+	// The list is short, so a linear search is fine
+	int n = size();
+	int idx = 0;
+	while ( idx < n && m_vecIntervals[idx].m_nEnd <= nBegin )
+		++idx;
+
+	while ( idx < n )
+	{
+		Interval &x = m_vecIntervals[idx];
+		Assert( x.m_nBegin < x.m_nEnd ); // Make sure we don't have degenerate/invalid intervals
+		if ( x.m_nBegin >= nEnd )
+			break;
+
+		if ( x.m_nBegin < nBegin )
+		{
+			if ( x.m_nEnd > nEnd )
+			{
+				// We are punching a hole in the middle.  Check the limit
+				if ( n >= nMaxIntervals )
+					return false;
+
+				// Insert the right hand side after this interval
+				Interval right;
+				right.m_nBegin = nEnd;
+				right.m_nEnd = x.m_nEnd;
+				x.m_nEnd = nBegin;
+				m_vecIntervals.push_back( right );
+				Interval *p = m_vecIntervals.end()-1;
+				Interval *pInsert = m_vecIntervals.begin() + idx + 1;
+				while ( p > pInsert )
+				{
+					p[0] = p[-1];
+					--p;
+				}
+				*pInsert = right;
+
+				// That's the only interval we could have touched
+				break;
+			}
+
+			// Chop off the end
+			x.m_nEnd = nBegin;
+			++idx;
+		}
+		else if ( x.m_nEnd > nEnd )
+		{
+			// Chop off the front.  Nothing after this can be touched
+			x.m_nBegin = nEnd;
+			break;
+		}
+		else
+		{
+			// Completely covered.  Remove it, and keep looking forward
+			m_vecIntervals.erase( m_vecIntervals.begin() + idx );
+			--n;
+		}
+	}
+	return true;
+}
+
+SSNPRecvUnreliableSegmentSlab::SSNPRecvUnreliableSegmentSlab()
+{
+	for ( int i = 0 ; i < k_nCapacity ; ++i )
+		m_arSlot[i] = uint8( i );
+}
+
+SSNPRecvUnreliableSegmentSlab::SSNPRecvUnreliableSegmentSlab( SSNPRecvUnreliableSegmentSlab &&x )
+{
+	for ( int i = 0 ; i < k_nCapacity ; ++i )
+		m_arSlot[i] = uint8( i );
+	*this = std::move( x );
+}
+
+SSNPRecvUnreliableSegmentSlab &SSNPRecvUnreliableSegmentSlab::operator=( SSNPRecvUnreliableSegmentSlab &&x )
+{
+	if ( this != &x )
+	{
+		Clear();
+		m_pSlots = x.m_pSlots; x.m_pSlots = nullptr;
+		m_nCount = x.m_nCount; x.m_nCount = 0;
+		memcpy( m_arMsgNum, x.m_arMsgNum, sizeof(m_arMsgNum) );
+		memcpy( m_arOffset, x.m_arOffset, sizeof(m_arOffset) );
+		memcpy( m_arSlot, x.m_arSlot, sizeof(m_arSlot) );
+	}
+	return *this;
+}
+
+void SSNPRecvUnreliableSegmentSlab::Clear()
+{
+	delete [] m_pSlots;
+	m_pSlots = nullptr;
+	m_nCount = 0;
+}
+
+SSNPRecvUnreliableSegmentData *SSNPRecvUnreliableSegmentSlab::Find( int64 nMsgNum, int nOffset ) const
+{
+	for ( int i = 0 ; i < m_nCount ; ++i )
+	{
+		if ( m_arMsgNum[i] == nMsgNum && m_arOffset[i] == nOffset )
+			return &m_pSlots[ m_arSlot[i] ];
+	}
+	return nullptr;
+}
+
+bool SSNPRecvUnreliableSegmentSlab::HasMessage( int64 nMsgNum ) const
+{
+	for ( int i = 0 ; i < m_nCount ; ++i )
+	{
+		if ( m_arMsgNum[i] == nMsgNum )
+			return true;
+	}
+	return false;
+}
+
+SSNPRecvUnreliableSegmentData *SSNPRecvUnreliableSegmentSlab::Insert( int64 nMsgNum, int nOffset )
+{
+	Assert( !Full() );
+	Assert( !Find( nMsgNum, nOffset ) );
+	if ( !m_pSlots )
+		m_pSlots = new SSNPRecvUnreliableSegmentData[ k_nCapacity ];
+
+	// Take the first free slot
+	int idx = m_nCount++;
+	m_arMsgNum[idx] = nMsgNum;
+	m_arOffset[idx] = nOffset;
+	SSNPRecvUnreliableSegmentData *pData = &m_pSlots[ m_arSlot[idx] ];
+	pData->m_cbSegSize = -1;
+	pData->m_bLast = false;
+	return pData;
+}
+
+void SSNPRecvUnreliableSegmentSlab::SetOffset( const SSNPRecvUnreliableSegmentData *pData, int nOffset )
+{
+	int nSlot = int( pData - m_pSlots );
+	for ( int i = 0 ; i < m_nCount ; ++i )
+	{
+		if ( m_arSlot[i] == nSlot )
+		{
+			m_arOffset[i] = nOffset;
+			return;
+		}
+	}
+	AssertMsg( false, "Segment not in slab" );
+}
+
+int SSNPRecvUnreliableSegmentSlab::GetMessageSegments( int64 nMsgNum, Segment *pOut ) const
+{
+	// Insertion sort.  There are only ever a handful of these
+	int n = 0;
+	for ( int i = 0 ; i < m_nCount ; ++i )
+	{
+		if ( m_arMsgNum[i] != nMsgNum )
+			continue;
+		int nOffset = m_arOffset[i];
+		int j = n++;
+		while ( j > 0 && pOut[j-1].m_nOffset > nOffset )
+		{
+			pOut[j] = pOut[j-1];
+			--j;
+		}
+		pOut[j].m_nOffset = nOffset;
+		pOut[j].m_pData = &m_pSlots[ m_arSlot[i] ];
+	}
+	return n;
+}
+
+void SSNPRecvUnreliableSegmentSlab::RemoveAt( int idx )
+{
+	Assert( idx >= 0 && idx < m_nCount );
+
+	// Swap with the last entry in use, so that its slot becomes the first free one
+	int idxLast = --m_nCount;
+	uint8 nSlot = m_arSlot[idx];
+	m_arMsgNum[idx] = m_arMsgNum[idxLast];
+	m_arOffset[idx] = m_arOffset[idxLast];
+	m_arSlot[idx] = m_arSlot[idxLast];
+	m_arSlot[idxLast] = nSlot;
+}
+
+void SSNPRecvUnreliableSegmentSlab::RemoveMessage( int64 nMsgNum )
+{
+	int i = 0;
+	while ( i < m_nCount )
+	{
+		if ( m_arMsgNum[i] == nMsgNum )
+			RemoveAt( i );
+		else
+			++i;
+	}
+}
+
+int64 SSNPRecvUnreliableSegmentSlab::RemoveOldestMessage()
+{
+	Assert( m_nCount > 0 );
+	int64 nOldestMsgNum = m_arMsgNum[0];
+	for ( int i = 1 ; i < m_nCount ; ++i )
+		nOldestMsgNum = std::min( nOldestMsgNum, m_arMsgNum[i] );
+	RemoveMessage( nOldestMsgNum );
+	return nOldestMsgNum;
+}
+
 //-----------------------------------------------------------------------------
 void SSNPReceiverState::InitPacketGapMap( int64 nMaxRecvPktNum, SteamNetworkingMicroseconds usecRecvTime )
 {
 	// Init packet gaps with a sentinel
 	m_mapPacketGaps.clear();
-	SSNPPacketGap &sentinel = m_mapPacketGaps[nMaxRecvPktNum+1];
-	sentinel.m_nEnd = INT64_MAX; // Used to identify the sentinel
-	sentinel.m_usecWhenReceivedPktBefore = usecRecvTime;
-	sentinel.m_usecWhenOKToNack = INT64_MAX; // Fixed value, for when there is nothing left to nack
-	sentinel.m_usecWhenAckPrior = INT64_MAX; // Time when we need to flush a report on all lower-numbered packets
+	std::pair<int64,SSNPPacketGap> sentinel;
+	sentinel.first = nMaxRecvPktNum+1;
+	sentinel.second.m_nEnd = INT64_MAX; // Used to identify the sentinel
+	sentinel.second.m_usecWhenReceivedPktBefore = usecRecvTime;
+	sentinel.second.m_usecWhenOKToNack = INT64_MAX; // Fixed value, for when there is nothing left to nack
+	sentinel.second.m_usecWhenDetected = INT64_MAX; // Not used
+	sentinel.second.m_usecWhenAckPrior = INT64_MAX; // Time when we need to flush a report on all lower-numbered packets
+	m_mapPacketGaps.insert( sentinel );
 
 	// Point at the sentinel
 	m_itPendingAck = m_mapPacketGaps.end();
@@ -254,6 +632,69 @@ void SSNPReceiverState::InitPacketGapMap( int64 nMaxRecvPktNum, SteamNetworkingM
 	m_itPendingNack = m_itPendingAck;
 }
 
+//-----------------------------------------------------------------------------
+void SSNPReceiverState::RecordReorderDelay( SteamNetworkingMicroseconds usecDelay )
+{
+	int idxBucket = 0;
+	while ( idxBucket < k_nReorderDelayBuckets-1 && usecDelay >= ( k_usecReorderDelayBucket0 << idxBucket ) )
+		++idxBucket;
+	++m_arReorderDelayHistogram[ idxBucket ];
+	++m_nReorderDelaySamples;
+
+	// Decay old samples, so that we will adapt if conditions change
+	if ( m_nReorderDelaySamples >= k_nReorderDelayMaxSamples )
+	{
+		m_nReorderDelaySamples = 0;
+		for ( uint16 &n: m_arReorderDelayHistogram )
+		{
+			n >>= 1;
+			m_nReorderDelaySamples += n;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+void SSNPReceiverState::RememberExpiredPacketGap( int64 nBegin, int64 nEnd, SteamNetworkingMicroseconds usecWhenDetected )
+{
+	SSNPExpiredPacketGap &gap = m_arExpiredPacketGaps[ m_idxNextExpiredPacketGap ];
+	gap.m_nBegin = nBegin;
+	gap.m_nEnd = nEnd;
+	gap.m_usecWhenDetected = usecWhenDetected;
+	m_idxNextExpiredPacketGap = ( m_idxNextExpiredPacketGap + 1 ) % k_nMaxExpiredPacketGaps;
+}
+
+//-----------------------------------------------------------------------------
+void SSNPReceiverState::RecordLateExpiredPacket( int64 nPktNum, SteamNetworkingMicroseconds usecNow )
+{
+	for ( const SSNPExpiredPacketGap &gap: m_arExpiredPacketGaps )
+	{
+		if ( gap.m_nBegin <= nPktNum && nPktNum < gap.m_nEnd )
+		{
+			RecordReorderDelay( usecNow - gap.m_usecWhenDetected );
+			return;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+SteamNetworkingMicroseconds SSNPReceiverState::GetNackDelay( int nPercentile ) const
+{
+	if ( nPercentile <= 0 || m_nReorderDelaySamples < k_nReorderDelayMinSamples )
+		return k_usecNackFlush;
+
+	// Find the first bucket where we have seen the requested
+	// percentage of the samples, and use its upper edge
+	int nThreshold = m_nReorderDelaySamples * nPercentile;
+	int nTotal = 0;
+	for ( int idxBucket = 0 ; idxBucket < k_nReorderDelayBuckets-1 ; ++idxBucket )
+	{
+		nTotal += m_arReorderDelayHistogram[ idxBucket ];
+		if ( nTotal*100 >= nThreshold )
+			return k_usecReorderDelayBucket0 << idxBucket;
+	}
+	return k_usecReorderDelayBucket0 << ( k_nReorderDelayBuckets-1 );
+}
+
 //-----------------------------------------------------------------------------
 void SSNPReceiverState::Shutdown()
 {
@@ -281,6 +722,9 @@ void CSteamNetworkConnectionBase::SNP_InitializeConnection( SteamNetworkingMicro
 	int64 w_init = Clamp( 4380, 2 * k_cbSteamNetworkingSocketsMaxEncryptedPayloadSend, 4 * k_cbSteamNetworkingSocketsMaxEncryptedPayloadSend );
 	m_sendRateData.m_nCurrentSendRateEstimate = int( k_nMillion * w_init / usecPing );
 
+	// Use that as the initial bandwidth estimate, and start probing from there
+	m_sendRateData.InitBandwidthEstimate( (float)m_sendRateData.m_nCurrentSendRateEstimate, usecNow );
+
 	// Go ahead and clamp it now
 	SNP_ClampSendRate();
 }
@@ -859,7 +1303,7 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 
 				// Receive the segment
 				bool bLastSegmentInMessage = ( nFrameType & 0x20 ) != 0;
-				if ( !SNP_ReceiveUnreliableSegment( nCurMsgNumForUnreliable, nOffset, pSegmentData, cbSegmentSize, bLastSegmentInMessage, idxCurrentLane, usecNow ) )
+				if ( !SNP_ReceiveUnreliableSegment( nCurMsgNumForUnreliable, nOffset, pSegmentData, cbSegmentSize, bLastSegmentInMessage, idxCurrentLane, usecNow, &ctx ) )
 				{
 					if ( !BStateIsActive() )
 						return false; // we decided to nuke the connection - abort packet processing
@@ -896,7 +1340,7 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 				}
 
 				// What do we expect to receive next?
-				int64 nExpectNextStreamPos = pCurrentLane->m_nReliableStreamPos + len( pCurrentLane->m_bufReliableStream );
+				int64 nExpectNextStreamPos = pCurrentLane->m_nReliableStreamPos + pCurrentLane->m_bufReliableStream.Size();
 
 				// Find the stream offset closest to that
 				nDecodeReliablePos = ( nExpectNextStreamPos & ~nMask ) + nOffset;
@@ -1010,10 +1454,11 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 			{
 				if ( h->second.m_nEnd > m_receiverState.m_nMinPktNumToSendAcks )
 				{
-					// Ug.  You're not supposed to modify the key in a map.
-					// I suppose that's legit, since you could violate the ordering.
-					// but in this case I know that this change is OK.
-					const_cast<int64 &>( h->first ) = m_receiverState.m_nMinPktNumToSendAcks;
+					// Trim the front of the gap.  We know this change won't break
+					// the ordering of the list
+					if ( h->second.m_nEnd < INT64_MAX )
+						m_receiverState.RememberExpiredPacketGap( h->first, m_receiverState.m_nMinPktNumToSendAcks, h->second.m_usecWhenDetected );
+					h->first = m_receiverState.m_nMinPktNumToSendAcks;
 					break;
 				}
 
@@ -1032,6 +1477,7 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 				}
 
 				// Packet loss is in the past.  Forget about it and move on
+				m_receiverState.RememberExpiredPacketGap( h->first, h->second.m_nEnd, h->second.m_usecWhenDetected );
 				h = m_receiverState.m_mapPacketGaps.erase(h);
 			}
 
@@ -1099,6 +1545,7 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 
 			// Locate our bookkeeping for this packet, or the latest one before it
 			// Remember, we have a sentinel with a low, invalid packet number
+			const bool bInFlightCapped = m_sendRateData.BInFlightCapped();
 			Assert( !m_senderState.m_mapInFlightPacketsByPktNum.empty() );
 			auto inFlightPkt = m_senderState.m_mapInFlightPacketsByPktNum.upper_bound( nLatestRecvSeqNum );
 			--inFlightPkt;
@@ -1148,6 +1595,7 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 						if ( msPing < 0 )
 							msPing = 0;
 						ProcessSNPPing( msPing, ctx );
+						m_sendRateData.OnRTTSample( std::max( usecElapsed - usecDelay, (SteamNetworkingMicroseconds)0 ), usecNow );
 
 						// Spew
 						SpewVerboseGroup( m_connectionConfig.LogLevel_AckRTT.Get(), "[%s] decode pkt %lld latest recv %lld delay %.1fms elapsed %.1fms ping %dms\n",
@@ -1289,6 +1737,9 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 						m_senderState.RemoveRefCountReliableSegment( hSeg );
 					}
 
+					// Update delivery rate accounting
+					m_sendRateData.OnPacketAcked( inFlightPkt->second, usecNow );
+
 					// Check if this was the next packet we were going to timeout, then advance
 					// pointer.  This guy didn't timeout.
 					if ( inFlightPkt == m_senderState.m_itNextInFlightPacketToTimeout )
@@ -1321,6 +1772,13 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 				--nBlocks;
 			}
 
+			// Update bandwidth estimate
+			m_sendRateData.OnAckFrameProcessed( usecNow );
+
+			// If we were waiting for acks before sending more data, wake up now
+			if ( bInFlightCapped && !m_sendRateData.BInFlightCapped() )
+				SetNextThinkTimeASAP();
+
 			//// Check for spewing
 			//if ( bAckedReliableRange && nLogLevelPacketDecode >= k_ESteamNetworkingSocketsDebugOutputType_Debug )
 			//{
@@ -1384,6 +1842,59 @@ bool CSteamNetworkConnectionBase::ProcessPlainTextDataChunk( int usecTimeSinceLa
 			nCurMsgNumForUnreliable = 0;
 			nDecodeReliablePos = 0;
 		}
+		else if ( nFrameType == 0xa0 )
+		{
+
+			//
+			// Parity for an unreliable message
+			//
+
+			// This counts against the segment limit, same as a data segment
+			if ( unlikely( nSegmentLimitRemaining <= 0 ) )
+			{
+				SpewWarningRateLimited( ctx.m_usecNow, "[%s] too many segments, aborting packert decode\n", GetDescription() );
+				bInhibitMarkReceived = true;
+				break;
+			}
+			--nSegmentLimitRemaining;
+
+			uint32 nLane, nSegments, cbMsgSize, cbParity;
+			uint64 nMsgNum;
+			READ_VARINT( nLane, "parity lane" );
+			READ_VARINT( nMsgNum, "parity msgnum" );
+			READ_VARINT( nSegments, "parity segment count" );
+			READ_VARINT( cbMsgSize, "parity msg size" );
+			READ_VARINT( cbParity, "parity size" );
+			if ( cbParity > (uint32)( pEnd - pDecode ) )
+				DECODE_ERROR( "SNP decode overrun %u bytes for unreliable parity", cbParity );
+			const uint8 *pParityData = pDecode;
+			pDecode += cbParity;
+
+			if ( nLane >= m_receiverState.m_vecLanes.size() )
+			{
+				// We haven't received any segments on this lane, so
+				// we can't have anything to rebuild
+			}
+			else if ( nLane >= (uint32)k_nMaxFECLanes
+				|| nMsgNum == 0 || nMsgNum >= (uint64)INT64_MAX
+				|| nSegments < 2 || nSegments > k_nMaxBufferedUnreliableSegments
+				|| cbMsgSize > k_cbMaxUnreliableMsgSizeRecv
+				|| cbParity == 0 || cbParity > k_cbMaxUnreliableSegmentSizeRecv )
+			{
+				// Since this is unreliable data, we can just ignore it.
+				SpewWarningRateLimited( usecNow, "[%s] Ignoring invalid parity for unreliable msg %llu, lane %u, %u segments, msg size %u, parity size %u\n",
+					GetDescription(), (unsigned long long)nMsgNum, nLane, nSegments, cbMsgSize, cbParity );
+			}
+			else if ( !SNP_ReceiveUnreliableParity( (int64)nMsgNum, (int)nSegments, (int)cbMsgSize, pParityData, (int)cbParity, (int)nLane, usecNow ) )
+			{
+				if ( !BStateIsActive() )
+					return false; // we decided to nuke the connection - abort packet processing
+
+				// Same as an unreliable segment we can't ingest right now.
+				// Don't ack this packet.
+				bInhibitMarkReceived = true;
+			}
+		}
 		else
 		{
 			DECODE_ERROR( "Invalid SNP frame lead byte 0x%02x", nFrameType );
@@ -1454,6 +1965,7 @@ void CSteamNetworkConnectionBase::SNP_SenderProcessPacketNack( int64 nPktNum, SN
 
 	// Mark as dropped
 	pkt.m_bNack = true;
+	m_sendRateData.OnPacketLost( pkt );
 
 	// Is this in-flight stats we were expecting an ack for?
 	if ( m_statsEndToEnd.m_pktNumInFlight == nPktNum )
@@ -1763,6 +2275,75 @@ struct SNPPacketSerializeHelper
 	SNPAckSerializerHelper m_acks;
 
 	uint8 payload[ k_cbSteamNetworkingSocketsMaxEncryptedPayloadSend ];
+
+	// Reliable message data that we have reserved space for in the payload,
+	// but not copied yet.  When we encrypt, we read these directly out of the
+	// message buffer, so the data only gets touched once.  (Reliable messages
+	// are kept alive by the inflight segment list until after we send, so the
+	// pointers remain valid.  Unreliable messages might be freed while we are
+	// still serializing, so we never defer those.)
+	struct DeferredCopy_t
+	{
+		uint8 *m_pDest;
+		const void *m_pSrc;
+		int m_cbData;
+	};
+	enum { k_nMaxDeferredCopies = 16 };
+	enum { k_cbMinDeferredCopy = 64 }; // Smaller than this, just copy it
+	DeferredCopy_t m_arDeferredCopy[ k_nMaxDeferredCopies ];
+	int m_nDeferredCopies = 0;
+
+	inline void CopyOrDefer( uint8 *pDest, const void *pSrc, int cbData )
+	{
+		if ( cbData < k_cbMinDeferredCopy || m_nDeferredCopies >= k_nMaxDeferredCopies )
+		{
+			memcpy( pDest, pSrc, cbData );
+			return;
+		}
+		DbgAssert( m_nDeferredCopies == 0 || m_arDeferredCopy[ m_nDeferredCopies-1 ].m_pDest + m_arDeferredCopy[ m_nDeferredCopies-1 ].m_cbData <= pDest );
+		DeferredCopy_t &d = m_arDeferredCopy[ m_nDeferredCopies++ ];
+		d.m_pDest = pDest;
+		d.m_pSrc = pSrc;
+		d.m_cbData = cbData;
+	}
+
+	void FlushDeferredCopies()
+	{
+		for ( int i = 0 ; i < m_nDeferredCopies ; ++i )
+			memcpy( m_arDeferredCopy[i].m_pDest, m_arDeferredCopy[i].m_pSrc, m_arDeferredCopy[i].m_cbData );
+		m_nDeferredCopies = 0;
+	}
+
+	// Describe the plaintext as a list of pieces, alternating between the
+	// payload buffer and the deferred message data.  Returns number of pieces
+	int GetGatherPieces( int cbPlainText, SymmetricCryptGatherPiece_t *pPieces ) const
+	{
+		int nPieces = 0;
+		const uint8 *p = payload;
+		for ( int i = 0 ; i < m_nDeferredCopies ; ++i )
+		{
+			const DeferredCopy_t &d = m_arDeferredCopy[i];
+			if ( d.m_pDest > p )
+			{
+				pPieces[nPieces].m_pData = p;
+				pPieces[nPieces].m_cbData = d.m_pDest - p;
+				++nPieces;
+			}
+			pPieces[nPieces].m_pData = d.m_pSrc;
+			pPieces[nPieces].m_cbData = d.m_cbData;
+			++nPieces;
+			p = d.m_pDest + d.m_cbData;
+		}
+		const uint8 *pEnd = payload + cbPlainText;
+		Assert( p <= pEnd );
+		if ( pEnd > p )
+		{
+			pPieces[nPieces].m_pData = p;
+			pPieces[nPieces].m_cbData = pEnd - p;
+			++nPieces;
+		}
+		return nPieces;
+	}
 };
 
 bool CSteamNetworkConnectionBase::SNP_SendPacket( CConnectionTransport *pTransport, SendPacketContext_t &ctx )
@@ -1846,6 +2427,7 @@ bool CSteamNetworkConnectionBase::SNP_SendPacket( CConnectionTransport *pTranspo
 
 		// No encryption!
 		// Ask current transport to deliver it directly
+		helper.FlushDeferredCopies();
 		nBytesSent = helper.InFlightPkt().m_pTransport->SendEncryptedDataChunk( helper.payload, cbPlainText, ctx );
 	}
 	else
@@ -1858,12 +2440,27 @@ bool CSteamNetworkConnectionBase::SNP_SendPacket( CConnectionTransport *pTranspo
 		// Encrypt the chunk
 		uint8 arEncryptedChunk[ k_cbSteamNetworkingSocketsMaxEncryptedPayloadSend + 64 ]; // Should not need pad
 		uint32 cbEncrypted = sizeof(arEncryptedChunk);
-		DbgVerify( m_pCryptContextSend->Encrypt(
-			helper.payload, cbPlainText, // plaintext
-			m_cryptIVSend.m_buf, // IV
-			arEncryptedChunk, &cbEncrypted, // output
-			nullptr, 0 // no AAD
-		) );
+		if ( helper.m_nDeferredCopies == 0 )
+		{
+			DbgVerify( m_pCryptContextSend->Encrypt(
+				helper.payload, cbPlainText, // plaintext
+				m_cryptIVSend.m_buf, // IV
+				arEncryptedChunk, &cbEncrypted, // output
+				nullptr, 0 // no AAD
+			) );
+		}
+		else
+		{
+			// Encrypt reliable message data directly out of the message buffers
+			SymmetricCryptGatherPiece_t arPieces[ SNPPacketSerializeHelper::k_nMaxDeferredCopies*2 + 1 ];
+			int nPieces = helper.GetGatherPieces( cbPlainText, arPieces );
+			DbgVerify( m_pCryptContextSend->EncryptGather(
+				arPieces, nPieces, // plaintext
+				m_cryptIVSend.m_buf, // IV
+				arEncryptedChunk, &cbEncrypted, // output
+				nullptr, 0 // no AAD
+			) );
+		}
 
 		//SpewMsg( "Send encrypt IV %llu + %02x%02x%02x%02x  encrypted %d %02x%02x%02x%02x\n",
 		//	*(uint64 *)&m_cryptIVSend.m_buf,
@@ -1890,6 +2487,7 @@ bool CSteamNetworkConnectionBase::SNP_SendPacket( CConnectionTransport *pTranspo
 	}
 
 	// We sent a packet.  Track it
+	m_sendRateData.OnPacketSent( helper.InFlightPkt(), nBytesSent, m_senderState.m_mapInFlightPacketsByPktNum.size() <= 1, m_senderState.PendingBytesTotal() == 0 );
 	auto pairInsertResult = m_senderState.m_mapInFlightPacketsByPktNum.insert( helper.m_insertInflightPkt );
 	Assert( pairInsertResult.second ); // We should have inserted a new element, not updated an existing element
 
@@ -2090,6 +2688,34 @@ template<bool k_bUnreliableOnly> struct SNPSegmentCollector<k_bUnreliableOnly,fa
 	}
 };
 
+// XOR a block of bytes into another.  Used for unreliable FEC parity
+static void XORBytes( void *pDest, const void *pSrc, int cb )
+{
+	uint8 *d = (uint8 *)pDest;
+	const uint8 *s = (const uint8 *)pSrc;
+	while ( cb >= 8 )
+	{
+		uint64 a, b;
+		memcpy( &a, d, 8 );
+		memcpy( &b, s, 8 );
+		a ^= b;
+		memcpy( d, &a, 8 );
+		d += 8; s += 8; cb -= 8;
+	}
+	while ( cb > 0 )
+	{
+		*(d++) ^= *(s++);
+		--cb;
+	}
+}
+
+// Check if unreliable segments on a lane should be protected with parity.
+// Older peers don't know the parity frame, so don't send it to them.
+static inline bool BLaneUsesFEC( int nFECLanes, int idxLane, uint32 nPeerProtocolVersion )
+{
+	return (unsigned)idxLane < (unsigned)k_nMaxFECLanes && ( (uint32)nFECLanes & ( 1u << idxLane ) ) != 0 && nPeerProtocolVersion >= 12;
+}
+
 template<bool k_bUnreliableOnly>
 inline uint8 *CSteamNetworkConnectionBase::SNP_SerializeSegmentArray( uint8 *pPayloadPtr, SNPPacketSerializeHelper &helper, SNPEncodedSegment *pSegBegin, SNPEncodedSegment *pSegEnd, bool bLastLane )
 {
@@ -2138,7 +2764,8 @@ inline uint8 *CSteamNetworkConnectionBase::SNP_SerializeSegmentArray( uint8 *pPa
 			// (Even an empty reliable message requires some framing in the stream.)
 			Assert( pSeg->m_cbSegSize > 0 );
 
-			// Copy the unreliable segment into the packet.  Does the portion we are serializing
+			// Copy the reliable segment into the packet.  (The message body is usually
+			// not actually copied here, see CopyOrDefer.)  Does the portion we are serializing
 			// begin in the header?
 			CSteamNetworkingMessage::ReliableSendInfo_t &msgRelInfo = pSeg->m_pMsg->ReliableSendInfo();
 			const int cbHdr = msgRelInfo.m_cbHdr;
@@ -2152,14 +2779,14 @@ inline uint8 *CSteamNetworkConnectionBase::SNP_SerializeSegmentArray( uint8 *pPa
 				int cbCopyBody = pSeg->m_cbSegSize - cbCopyHdr;
 				if ( cbCopyBody > 0 )
 				{
-					memcpy( pPayloadPtr, pSeg->m_pMsg->m_pData, cbCopyBody );
+					helper.CopyOrDefer( pPayloadPtr, pSeg->m_pMsg->m_pData, cbCopyBody );
 					pPayloadPtr += cbCopyBody;
 				}
 			}
 			else
 			{
 				// This segment is entirely from the message body
-				memcpy( pPayloadPtr, (char*)pSeg->m_pMsg->m_pData + pSeg->m_nOffset - cbHdr, pSeg->m_cbSegSize );
+				helper.CopyOrDefer( pPayloadPtr, (char*)pSeg->m_pMsg->m_pData + pSeg->m_nOffset - cbHdr, pSeg->m_cbSegSize );
 				pPayloadPtr += pSeg->m_cbSegSize;
 			}
 
@@ -2233,6 +2860,10 @@ inline uint8 *CSteamNetworkConnectionBase::SNP_SerializeSegmentArray( uint8 *pPa
 			memcpy( pPayloadPtr, (char*)pSeg->m_pMsg->m_pData + pSeg->m_nOffset, pSeg->m_cbSegSize );
 			pPayloadPtr += pSeg->m_cbSegSize;
 
+			// Update FEC parity?
+			if ( unlikely( BLaneUsesFEC( m_connectionConfig.UnreliableFECLanes.Get(), idxLane, m_statsEndToEnd.m_nPeerProtocolVersion ) ) )
+				SNP_AccumulateFECParity( idxLane, pSeg->m_pMsg, pSeg->m_nOffset, pSeg->m_cbSegSize );
+
 			// Spew
 			SpewDebugGroup( helper.m_nLogLevelPacketDecode, "[%s]   encode pkt %lld unreliable msg %lld offset %d+%d=%d\n",
 				GetDescription(), (long long)m_statsEndToEnd.m_nNextSendSequenceNumber, (long long)pSeg->m_pMsg->m_nMessageNumber,
@@ -2333,6 +2964,18 @@ int CSteamNetworkConnectionBase::SNP_SerializePacketInternal( SNPPacketSerialize
 	if ( pPayloadPtr == nullptr )
 		return 0;
 
+	// Parity for unreliable messages that we just finished sending.  This
+	// goes first, it's no use unless it arrives promptly.  (And we limited
+	// the segment size on those lanes, so that it will fit.)
+	if (
+		unlikely( m_senderState.m_nFECParityPending > 0 )
+		&& m_sendRateData.BCanSendData()
+		&& BStateIsConnectedForWirePurposes()
+		&& helper.InFlightPkt().m_pTransport == m_pTransport
+	) {
+		pPayloadPtr = SNP_SerializeFECParityFrames( pPayloadPtr, helper.m_pPayloadEnd );
+	}
+
 	// Get list of ack blocks we might want to serialize, and which
 	// of those acks we really want to flush out right now.
 	SNP_GatherAckBlocks( helper );
@@ -2342,7 +2985,7 @@ int CSteamNetworkConnectionBase::SNP_SerializePacketInternal( SNPPacketSerialize
 		pLog->m_usecTime = usecNow;
 		pLog->m_cbPendingReliable = m_senderState.m_cbPendingReliable;
 		pLog->m_cbPendingUnreliable = m_senderState.m_cbPendingUnreliable;
-		pLog->m_nPacketGaps = len( m_receiverState.m_mapPacketGaps )-1;
+		pLog->m_nPacketGaps = (int)m_receiverState.m_mapPacketGaps.size()-1;
 		pLog->m_nAckBlocksNeeded = helper.m_acks.m_nBlocksNeedToAck;
 		pLog->m_nPktNumNextPendingAck = m_receiverState.m_itPendingAck->first;
 		pLog->m_usecNextPendingAckTime = m_receiverState.m_itPendingAck->second.m_usecWhenAckPrior;
@@ -2386,7 +3029,7 @@ int CSteamNetworkConnectionBase::SNP_SerializePacketInternal( SNPPacketSerialize
 
 	// Check if we are actually going to send data in this packet
 	if (
-		m_sendRateData.m_flTokenBucket < 0.0 // No bandwidth available.  (Presumably this is a relatively rare out-of-band connectivity check, etc)  FIXME should we use a different token bucket per transport?
+		!m_sendRateData.BCanSendData() // No bandwidth available.  (Presumably this is a relatively rare out-of-band connectivity check, etc)  FIXME should we use a different token bucket per transport?
 		|| !BStateIsConnectedForWirePurposes() // not actually in a connection state where we should be sending real data yet
 		|| helper.InFlightPkt().m_pTransport != m_pTransport // transport is not the selected transport
 	) {
@@ -2575,6 +3218,18 @@ int CSteamNetworkConnectionBase::SNP_SerializePacketInternal( SNPPacketSerialize
 		else
 		{
 			pSeg = pCollectorLane->AddUnreliable( pSendMsg, sendLane.m_cbCurrentSendMessageSent );
+
+			// If this lane is protected with parity, then make sure the
+			// parity, which is as big as the largest segment, will fit in a packet.
+			if ( unlikely( BLaneUsesFEC( m_connectionConfig.UnreliableFECLanes.Get(), idxLane, m_statsEndToEnd.m_nPeerProtocolVersion ) ) )
+			{
+				const int cbMaxFECSegSize = m_cbMaxPlaintextPayloadSend - k_cbMaxFECParityFrameOverhead;
+				if ( pSeg->m_cbSegSize > cbMaxFECSegSize )
+				{
+					pSeg->m_cbSegSize = cbMaxFECSegSize;
+					bLastSegment = true;
+				}
+			}
 		}
 
 		// Can't fit the whole thing?
@@ -2771,7 +3426,12 @@ done_with_all_segments:
 
 void CSteamNetworkConnectionBase::SNP_SentNonDataPacket( CConnectionTransport *pTransport, int cbPkt, SteamNetworkingMicroseconds usecNow )
 {
-	std::pair<int64,SNPInFlightPacket_t> pairInsert( m_statsEndToEnd.m_nNextSendSequenceNumber-1, SNPInFlightPacket_t{ usecNow, false, pTransport, {} } );
+	std::pair<int64,SNPInFlightPacket_t> pairInsert;
+	pairInsert.first = m_statsEndToEnd.m_nNextSendSequenceNumber-1;
+	pairInsert.second.m_usecWhenSent = usecNow;
+	pairInsert.second.m_bNack = false;
+	pairInsert.second.m_pTransport = pTransport;
+	m_sendRateData.OnPacketSent( pairInsert.second, cbPkt, m_senderState.m_mapInFlightPacketsByPktNum.size() <= 1, true );
 	auto pairInsertResult = m_senderState.m_mapInFlightPacketsByPktNum.insert( pairInsert );
 	Assert( pairInsertResult.second ); // We should have inserted a new element, not updated an existing element.  Probably an order of operations bug with m_nNextSendSequenceNumber
 
@@ -2792,7 +3452,7 @@ void CSteamNetworkConnectionBase::SNP_GatherAckBlocks( SNPPacketSerializeHelper
 	helper.m_acks.m_nBlocksNeedToAck = 0;
 
 	// Fast case for no packet loss we need to ack, which will (hopefully!) be a common case
-	int n = len( m_receiverState.m_mapPacketGaps ) - 1;
+	int n = (int)m_receiverState.m_mapPacketGaps.size() - 1;
 	if ( n <= 0 )
 		return;
 
@@ -2906,7 +3566,8 @@ uint8 *CSteamNetworkConnectionBase::SNP_SerializeAckBlocks( const SNPPacketSeria
 	#endif
 
 	// Locate the sentinel and get the latest packet we should ack, and its timestamp
-	auto itSentinel = m_receiverState.m_mapPacketGaps.rbegin();
+	auto itSentinel = m_receiverState.m_mapPacketGaps.end();
+	--itSentinel;
 	const int64 nLastPktToAck = itSentinel->first-1;
 	const SteamNetworkingMicroseconds usecWhenRecvLastPktToAck = itSentinel->second.m_usecWhenReceivedPktBefore;
 	Assert( nLastPktToAck <= m_statsEndToEnd.m_nMaxRecvPktNum );
@@ -2923,7 +3584,7 @@ uint8 *CSteamNetworkConnectionBase::SNP_SerializeAckBlocks( const SNPPacketSeria
 			GetDescription(),
 			(long long)m_statsEndToEnd.m_nNextSendSequenceNumber, (long long)nLastPktToAck
 		);
-		m_receiverState.m_mapPacketGaps.rbegin()->second.m_usecWhenAckPrior = INT64_MAX; // Clear timer, we wrote everything we needed to
+		m_receiverState.m_mapPacketGaps.back().second.m_usecWhenAckPrior = INT64_MAX; // Clear timer, we wrote everything we needed to
 
 		#ifdef SNP_ENABLE_PACKETSENDLOG
 			pLog->m_nAckBlocksSent = 0;
@@ -3188,13 +3849,119 @@ inline uint8 *CSteamNetworkConnectionBase::SNP_SerializeStopWaitingFrame( SNPPac
 	return pOut;
 }
 
+void CSteamNetworkConnectionBase::SNP_AccumulateFECParity( int idxLane, const CSteamNetworkingMessage *pMsg, int nOffset, int cbSegSize )
+{
+	if ( len( m_senderState.m_vecFECLanes ) <= idxLane )
+		m_senderState.m_vecFECLanes.resize( idxLane+1 );
+	SSNPSenderState::FECLane &fec = m_senderState.m_vecFECLanes[ idxLane ];
+	const bool bEndOfMessage = ( nOffset + cbSegSize >= pMsg->m_cbSize );
+
+	// Start of a new message?
+	if ( nOffset == 0 )
+	{
+		// No need for parity if the message wasn't fragmented
+		if ( bEndOfMessage )
+		{
+			fec.m_nMsgNum = 0;
+			return;
+		}
+		fec.m_nMsgNum = pMsg->m_nMessageNumber;
+		fec.m_nSegments = 0;
+		fec.m_cbParity = 0;
+	}
+	else if ( fec.m_nMsgNum != pMsg->m_nMessageNumber )
+	{
+		// We didn't see the beginning of this message.  (FEC was
+		// turned on while it was in progress.)
+		return;
+	}
+
+	// Segments on this lane should have been limited so that the parity will fit
+	if ( cbSegSize > (int)sizeof(fec.m_parity) )
+	{
+		AssertMsg( false, "Unreliable segment too big for parity" );
+		fec.m_nMsgNum = 0;
+		return;
+	}
+
+	// XOR the segment into the parity.  Segments are all aligned at the start,
+	// so the parity is as big as the largest one
+	const uint8 *pSegData = (const uint8 *)pMsg->m_pData + nOffset;
+	if ( cbSegSize > fec.m_cbParity )
+	{
+		memcpy( fec.m_parity + fec.m_cbParity, pSegData + fec.m_cbParity, cbSegSize - fec.m_cbParity );
+		XORBytes( fec.m_parity, pSegData, fec.m_cbParity );
+		fec.m_cbParity = cbSegSize;
+	}
+	else
+	{
+		XORBytes( fec.m_parity, pSegData, cbSegSize );
+	}
+	++fec.m_nSegments;
+	if ( !bEndOfMessage )
+		return;
+
+	// Message is finished.  Queue the parity to go out.  If we still
+	// have parity from an earlier message that we didn't get a chance to
+	// send, it's replaced; that message is long gone anyway.
+	if ( fec.m_nPendingMsgNum == 0 )
+		++m_senderState.m_nFECParityPending;
+	fec.m_nPendingMsgNum = fec.m_nMsgNum;
+	fec.m_nPendingSegments = fec.m_nSegments;
+	fec.m_cbPendingMsgSize = pMsg->m_cbSize;
+	fec.m_cbPendingParity = fec.m_cbParity;
+	memcpy( fec.m_pendingParity, fec.m_parity, fec.m_cbParity );
+	fec.m_nMsgNum = 0;
+}
+
+uint8 *CSteamNetworkConnectionBase::SNP_SerializeFECParityFrames( uint8 *pOut, const uint8 *pOutEnd )
+{
+	for ( int idxLane = 0 ; idxLane < len( m_senderState.m_vecFECLanes ) && m_senderState.m_nFECParityPending > 0 ; ++idxLane )
+	{
+		SSNPSenderState::FECLane &fec = m_senderState.m_vecFECLanes[ idxLane ];
+		if ( fec.m_nPendingMsgNum == 0 )
+			continue;
+
+		uint8 hdr[ k_cbMaxFECParityFrameOverhead ];
+		uint8 *p = hdr;
+		*(p++) = 0xa0;
+		p = SerializeVarInt( p, (uint32)idxLane );
+		p = SerializeVarInt( p, (uint64)fec.m_nPendingMsgNum );
+		p = SerializeVarInt( p, (uint32)fec.m_nPendingSegments );
+		p = SerializeVarInt( p, (uint32)fec.m_cbPendingMsgSize );
+		p = SerializeVarInt( p, (uint32)fec.m_cbPendingParity );
+		const int cbHdr = p - hdr;
+		const int cbFrame = cbHdr + fec.m_cbPendingParity;
+
+		// Won't fit in this packet?
+		if ( pOut + cbFrame > pOutEnd )
+		{
+			// If it would fit in a full packet, wait for the next one.  Otherwise
+			// (e.g. the MTU changed), just discard it.  FEC is best effort.
+			if ( cbFrame <= m_cbMaxPlaintextPayloadSend - k_cbMaxFECParityFrameOverhead/2 )
+				continue;
+		}
+		else
+		{
+			memcpy( pOut, hdr, cbHdr );
+			memcpy( pOut + cbHdr, fec.m_pendingParity, fec.m_cbPendingParity );
+			pOut += cbFrame;
+		}
+
+		fec.m_nPendingMsgNum = 0;
+		--m_senderState.m_nFECParityPending;
+	}
+	return pOut;
+}
+
 bool CSteamNetworkConnectionBase::SNP_ReceiveUnreliableSegment(
 	int64 nMsgNum,
 	int nOffset,
 	const void *pSegmentData, int cbSegmentSize,
 	bool bLastSegmentInMessage,
 	int idxLane,
-	SteamNetworkingMicroseconds usecNow )
+	SteamNetworkingMicroseconds usecNow,
+	RecvPacketContext_t *pCtx )
 {
 	SpewDebugGroup( m_connectionConfig.LogLevel_PacketDecode.Get(), "[%s] RX msg %lld offset %d+%d=%d %02x ... %02x\n", GetDescription(), nMsgNum, nOffset, cbSegmentSize, nOffset+cbSegmentSize, ((byte*)pSegmentData)[0], ((byte*)pSegmentData)[cbSegmentSize-1] );
 
@@ -3214,23 +3981,20 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveUnreliableSegment(
 	{
 
 		// Deliver it immediately, don't go through the fragmentation assembly process below.
-		// (Although that would work.)
-		return ReceivedMessageData( pSegmentData, cbSegmentSize, idxLane, nMsgNum, k_nSteamNetworkingSend_Unreliable, usecNow );
+		// (Although that would work.)  If the segment was decrypted, the message
+		// may be able to point at a shared copy of the packet.
+		return ReceivedMessageData( pSegmentData, cbSegmentSize, idxLane, nMsgNum, k_nSteamNetworkingSend_Unreliable, usecNow, pCtx );
 	}
 	SSNPReceiverState::Lane &lane = m_receiverState.m_vecLanes[ idxLane ];
 
 	// Limit number of unreliable segments we store.  We just use a fixed
 	// limit, rather than trying to be smart by expiring based on time or whatever.
-	if ( len( lane.m_mapUnreliableSegments ) > k_nMaxBufferedUnreliableSegments )
+	SSNPRecvUnreliableSegmentSlab &segments = lane.m_unreliableSegments;
+	if ( segments.Count() > k_nMaxBufferedUnreliableSegments )
 	{
-		auto itDelete = lane.m_mapUnreliableSegments.begin();
-
 		// If we're going to delete some, go ahead and delete all of them for this
 		// message.
-		int64 nDeleteMsgNum = itDelete->first.m_nMsgNum;
-		do {
-			itDelete = lane.m_mapUnreliableSegments.erase( itDelete );
-		} while ( itDelete != lane.m_mapUnreliableSegments.end() && itDelete->first.m_nMsgNum == nDeleteMsgNum );
+		int64 nDeleteMsgNum = segments.RemoveOldestMessage();
 
 		// Warn if the message we are receiving is older (or the same) than the one
 		// we are deleting.  If sender is legit, then it probably means that we have
@@ -3244,18 +4008,14 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveUnreliableSegment(
 	}
 
 	// Message fragment.  Find/insert the entry in our reassembly queue
-	// I really hate this syntax and interface.
-	SSNPRecvUnreliableSegmentKey key;
-	key.m_nMsgNum = nMsgNum;
-	key.m_nOffset = nOffset;
-	SSNPRecvUnreliableSegmentData &data = lane.m_mapUnreliableSegments[ key ];
-	if ( data.m_cbSegSize >= 0 )
+	SSNPRecvUnreliableSegmentData *pData = segments.Find( nMsgNum, nOffset );
+	if ( pData )
 	{
 		// We got another segment starting at the same offset.  This is weird, since they shouldn't
 		// be doing.  But remember that we're working on top of UDP, which could deliver packets
 		// multiple times.  We'll spew about it, just in case it indicates a bug in this code or the sender.
 		SpewWarningRateLimited( usecNow, "[%s] Received unreliable msg %lld segment offset %d twice.  Sizes %d,%d, last=%d,%d\n",
-			GetDescription(), nMsgNum, nOffset, data.m_cbSegSize, cbSegmentSize, (int)data.m_bLast, (int)bLastSegmentInMessage );
+			GetDescription(), nMsgNum, nOffset, pData->m_cbSegSize, cbSegmentSize, (int)pData->m_bLast, (int)bLastSegmentInMessage );
 
 		// Just drop the segment.  Note that the sender might have sent a longer segment from the previous
 		// one, in which case this segment contains new data, and is not therefore redundant.  That seems
@@ -3267,45 +4027,122 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveUnreliableSegment(
 		return true;
 	}
 
-	// Segment in the map either just got inserted, or is a subset of the segment
-	// we just received.  Replace it.
-	data.m_cbSegSize = cbSegmentSize;
-	Assert( !data.m_bLast );
-	data.m_bLast = bLastSegmentInMessage;
-	memcpy( data.m_buf, pSegmentData, cbSegmentSize );
+	// Segment just got inserted.  Fill it in
+	pData = segments.Insert( nMsgNum, nOffset );
+	pData->m_cbSegSize = cbSegmentSize;
+	pData->m_bLast = bLastSegmentInMessage;
+	memcpy( pData->m_buf, pSegmentData, cbSegmentSize );
 
 	// Now check if that completed the message
-	key.m_nOffset = 0;
-	auto itMsgStart = lane.m_mapUnreliableSegments.lower_bound( key );
-	auto end = lane.m_mapUnreliableSegments.end();
-	Assert( itMsgStart != end );
-	auto itMsgLast = itMsgStart;
+	return SNP_ReassembleUnreliableMessage( nMsgNum, idxLane, usecNow );
+}
+
+// Check if we have received all of the segments of an unreliable message.
+// The segments are sorted by offset.  Returns the total size of the message,
+// or -1 if we are still missing something
+static int GetCompleteUnreliableMessageSize( const SSNPRecvUnreliableSegmentSlab::Segment *pSegs, int nSegs )
+{
 	int cbMessageSize = 0;
-	for (;;)
+	for ( int i = 0 ; i < nSegs ; ++i )
 	{
+		const SSNPRecvUnreliableSegmentSlab::Segment &seg = pSegs[i];
+		if ( seg.m_nOffset == k_nUnreliableParityOffset )
+			continue;
+
 		// Is this the thing we expected?
-		if ( itMsgLast->first.m_nMsgNum != nMsgNum || itMsgLast->first.m_nOffset > cbMessageSize )
+		if ( seg.m_nOffset > cbMessageSize )
 		{
-			// We've got a gap.  We'll need to wait to fill it.  For now, we're done.
-			return true;
+			// We've got a gap.  We'll need to wait to fill it.
+			return -1;
 		}
 
 		// Update.  This code looks more complicated than strictly necessary, but it works
 		// if we have overlapping segments.
-		cbMessageSize = std::max( cbMessageSize, itMsgLast->first.m_nOffset + itMsgLast->second.m_cbSegSize );
+		cbMessageSize = std::max( cbMessageSize, seg.m_nOffset + seg.m_pData->m_cbSegSize );
 
 		// Is that the end?
-		if ( itMsgLast->second.m_bLast )
-			break;
+		if ( seg.m_pData->m_bLast )
+			return cbMessageSize;
+	}
+
+	// We expect more segments in this message to follow.
+	return -1;
+}
 
-		// Still looking for the end
-		++itMsgLast;
-		if ( itMsgLast == end )
+// If we have the parity for an unreliable message, and exactly one
+// segment is missing, rebuild that segment.  The parity entry is
+// turned into the missing segment.
+static bool RecoverUnreliableSegmentFromParity( SSNPRecvUnreliableSegmentSlab &segments, const SSNPRecvUnreliableSegmentSlab::Segment *pSegs, int nSegs )
+{
+	// Parity sorts first
+	if ( nSegs < 1 || pSegs[0].m_nOffset != k_nUnreliableParityOffset )
+		return false;
+	SSNPRecvUnreliableSegmentData &parity = *pSegs[0].m_pData;
+
+	// Locate the hole.  The segments that we have must be exactly the ones
+	// the parity was computed from, minus one.
+	int nHoleBegin = -1;
+	int nHoleEnd = -1;
+	int nPos = 0;
+	for ( int i = 1 ; i < nSegs ; ++i )
+	{
+		const SSNPRecvUnreliableSegmentSlab::Segment &seg = pSegs[i];
+		if ( seg.m_nOffset != nPos )
 		{
+			// Overlapping segments, or more than one hole?
+			if ( seg.m_nOffset < nPos || nHoleBegin >= 0 )
+				return false;
+			nHoleBegin = nPos;
+			nHoleEnd = seg.m_nOffset;
+		}
+		if ( seg.m_pData->m_cbSegSize > parity.m_cbSegSize )
+			return false;
+		nPos = seg.m_nOffset + seg.m_pData->m_cbSegSize;
+	}
+	if ( nPos < parity.m_cbParityMsgSize )
+	{
+		if ( nHoleBegin >= 0 )
+			return false;
+		nHoleBegin = nPos;
+		nHoleEnd = parity.m_cbParityMsgSize;
+	}
+	else if ( nPos > parity.m_cbParityMsgSize )
+	{
+		return false;
+	}
+	if ( nHoleBegin < 0 || nSegs != parity.m_nParitySegments || nHoleEnd - nHoleBegin > parity.m_cbSegSize )
+		return false;
+
+	// The missing segment is the XOR of the parity and all of the segments we did receive
+	for ( int i = 1 ; i < nSegs ; ++i )
+		XORBytes( parity.m_buf, pSegs[i].m_pData->m_buf, pSegs[i].m_pData->m_cbSegSize );
+	parity.m_cbSegSize = nHoleEnd - nHoleBegin;
+	parity.m_bLast = ( nHoleEnd == parity.m_cbParityMsgSize );
+	segments.SetOffset( &parity, nHoleBegin );
+	return true;
+}
+
+bool CSteamNetworkConnectionBase::SNP_ReassembleUnreliableMessage( int64 nMsgNum, int idxLane, SteamNetworkingMicroseconds usecNow )
+{
+	SSNPRecvUnreliableSegmentSlab &segments = m_receiverState.m_vecLanes[ idxLane ].m_unreliableSegments;
 
-			// We expect more segments in this message to follow.  For now, we're done.
+	SSNPRecvUnreliableSegmentSlab::Segment arSegs[ SSNPRecvUnreliableSegmentSlab::k_nCapacity ];
+	int nSegs = segments.GetMessageSegments( nMsgNum, arSegs );
+	int cbMessageSize = GetCompleteUnreliableMessageSize( arSegs, nSegs );
+	if ( cbMessageSize < 0 )
+	{
+		// Still missing a piece.  Can we rebuild it from the parity?
+		if ( !RecoverUnreliableSegmentFromParity( segments, arSegs, nSegs ) )
+			return true;
+		nSegs = segments.GetMessageSegments( nMsgNum, arSegs );
+		cbMessageSize = GetCompleteUnreliableMessageSize( arSegs, nSegs );
+		if ( cbMessageSize < 0 )
+		{
+			// Sender is sending us weird segments.  Don't bother trying to deal with it
 			return true;
 		}
+
+		SpewVerboseGroup( m_connectionConfig.LogLevel_PacketDecode.Get(), "[%s] Rebuilt missing segment of unreliable msg %lld from parity\n", GetDescription(), (long long)nMsgNum );
 	}
 
 	CSteamNetworkingMessage *pMsg = AllocateNewRecvMessage( cbMessageSize, k_nSteamNetworkingSend_Unreliable, usecNow );
@@ -3318,29 +4155,64 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveUnreliableSegment(
 
 	// OK, we have the complete message!  Gather the
 	// segments into a contiguous buffer
-	for (;;)
+	for ( int i = 0 ; i < nSegs ; ++i )
 	{
-		Assert( itMsgStart->first.m_nMsgNum == nMsgNum );
-		memcpy( (char *)pMsg->m_pData + itMsgStart->first.m_nOffset, itMsgStart->second.m_buf, itMsgStart->second.m_cbSegSize );
+		const SSNPRecvUnreliableSegmentSlab::Segment &seg = arSegs[i];
+		if ( seg.m_nOffset == k_nUnreliableParityOffset )
+			continue;
+		memcpy( (char *)pMsg->m_pData + seg.m_nOffset, seg.m_pData->m_buf, seg.m_pData->m_cbSegSize );
 
 		// Done?
-		if ( itMsgStart->second.m_bLast )
+		if ( seg.m_pData->m_bLast )
 			break;
-
-		// Remove entry from list, and move onto the next entry
-		itMsgStart = lane.m_mapUnreliableSegments.erase( itMsgStart );
 	}
 
-	// Erase the last segment, and anything else we might have hanging around
+	// Discard the segments, and anything else we might have hanging around
 	// for this message (???)
-	do {
-		itMsgStart = lane.m_mapUnreliableSegments.erase( itMsgStart );
-	} while ( itMsgStart != end && itMsgStart->first.m_nMsgNum == nMsgNum );
+	segments.RemoveMessage( nMsgNum );
 
 	// Deliver the message.
 	return ReceivedMessage( pMsg );
 }
 
+bool CSteamNetworkConnectionBase::SNP_ReceiveUnreliableParity( int64 nMsgNum, int nSegments, int cbMsgSize, const void *pParityData, int cbParity, int idxLane, SteamNetworkingMicroseconds usecNow )
+{
+	SpewDebugGroup( m_connectionConfig.LogLevel_PacketDecode.Get(), "[%s] RX msg %lld parity for %d segments, %d bytes\n", GetDescription(), (long long)nMsgNum, nSegments, cbMsgSize );
+
+	// Ignore data segments when we are not going to process them (e.g. linger)
+	if ( GetState() != k_ESteamNetworkingConnectionState_Connected )
+		return false;
+
+	// The parity is only useful if we have some of the segments.  If we don't
+	// have any, then we either already delivered the message, or we lost too
+	// much of it.  (Or the parity arrived before all of the segments, which
+	// should be very rare.)
+	SSNPRecvUnreliableSegmentSlab &segments = m_receiverState.m_vecLanes[ idxLane ].m_unreliableSegments;
+	if ( !segments.HasMessage( nMsgNum ) )
+		return true;
+	if ( segments.Find( nMsgNum, k_nUnreliableParityOffset ) )
+	{
+		// Duplicate.  Just ignore it
+		return true;
+	}
+
+	// Same limit as for segments
+	if ( segments.Count() > k_nMaxBufferedUnreliableSegments )
+	{
+		if ( segments.RemoveOldestMessage() == nMsgNum )
+			return true;
+	}
+
+	SSNPRecvUnreliableSegmentData *pData = segments.Insert( nMsgNum, k_nUnreliableParityOffset );
+	pData->m_cbSegSize = cbParity;
+	pData->m_nParitySegments = nSegments;
+	pData->m_cbParityMsgSize = cbMsgSize;
+	memcpy( pData->m_buf, pParityData, cbParity );
+
+	// Now see if that lets us rebuild the message
+	return SNP_ReassembleUnreliableMessage( nMsgNum, idxLane, usecNow );
+}
+
 bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int64 nSegBegin, const uint8 *pSegmentData, int cbSegmentSize, int idxLane, SteamNetworkingMicroseconds usecNow )
 {
 	int nLogLevelPacketDecode = m_connectionConfig.LogLevel_PacketDecode.Get();
@@ -3400,7 +4272,7 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 	// stream buffer and decode directly.
 
 	// What do we expect to receive next?
-	const int64 nExpectNextStreamPos = lane.m_nReliableStreamPos + len( lane.m_bufReliableStream );
+	const int64 nExpectNextStreamPos = lane.m_nReliableStreamPos + lane.m_bufReliableStream.Size();
 	const int32 nMaxRecvBufferSize = m_connectionConfig.RecvBufferSize.Get();
 	const int32 nMaxMessageSize = m_connectionConfig.RecvMaxMessageSize.Get();
 
@@ -3408,7 +4280,7 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 	if ( nSegEnd > nExpectNextStreamPos )
 	{
 		int64 cbNewSize = nSegEnd - lane.m_nReliableStreamPos;
-		Assert( cbNewSize > len( lane.m_bufReliableStream ) );
+		Assert( cbNewSize > lane.m_bufReliableStream.Size() );
 
 		// Check if we have too much data buffered, just stop processing
 		// this packet, and forget we ever received it.  We need to protect
@@ -3423,9 +4295,9 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 			SpewWarningRateLimited( usecNow, "[%s] decode pkt %lld abort.  %lld bytes reliable data buffered [%lld-%lld), new size would be %lld to %lld\n",
 				GetDescription(),
 				(long long)nPktNum,
-				(long long)lane.m_bufReliableStream.size(),
+				(long long)lane.m_bufReliableStream.Size(),
 				(long long)lane.m_nReliableStreamPos,
-				(long long)( lane.m_nReliableStreamPos + lane.m_bufReliableStream.size() ),
+				(long long)nExpectNextStreamPos,
 				(long long)cbNewSize, (long long)nSegEnd
 			);
 			return false;  // DO NOT ACK THIS PACKET
@@ -3434,16 +4306,16 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 		// Check if this is going to make a new gap
 		if ( nSegBegin > nExpectNextStreamPos )
 		{
-			if ( !lane.m_mapReliableStreamGaps.empty() )
+			if ( !lane.m_setReliableStreamGaps.empty() )
 			{
 
 				// We should never have a gap at the very end of the buffer.
 				// (Why would we extend the buffer, unless we needed to to
 				// store some data?)
-				Assert( lane.m_mapReliableStreamGaps.rbegin()->second < nExpectNextStreamPos );
+				Assert( lane.m_setReliableStreamGaps.back().m_nEnd < nExpectNextStreamPos );
 
 				// We need to add a new gap.  See if we're already too fragmented.
-				if ( len( lane.m_mapReliableStreamGaps ) >= k_nMaxReliableStreamGaps_Extend )
+				if ( lane.m_setReliableStreamGaps.size() >= k_nMaxReliableStreamGaps_Extend )
 				{
 					// Stop processing the packet, and don't ack it
 					// This indicates the connection is in pretty bad shape,
@@ -3451,9 +4323,9 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 					SpewWarningRateLimited( usecNow, "[%s] decode pkt %lld abort.  Reliable stream already has %d fragments, first is [%lld,%lld), last is [%lld,%lld), new segment is [%lld,%lld)\n",
 						GetDescription(),
 						(long long)nPktNum,
-						len( lane.m_mapReliableStreamGaps ),
-						(long long)lane.m_mapReliableStreamGaps.begin()->first, (long long)lane.m_mapReliableStreamGaps.begin()->second,
-						(long long)lane.m_mapReliableStreamGaps.rbegin()->first, (long long)lane.m_mapReliableStreamGaps.rbegin()->second,
+						lane.m_setReliableStreamGaps.size(),
+						(long long)lane.m_setReliableStreamGaps.front().m_nBegin, (long long)lane.m_setReliableStreamGaps.front().m_nEnd,
+						(long long)lane.m_setReliableStreamGaps.back().m_nBegin, (long long)lane.m_setReliableStreamGaps.back().m_nEnd,
 						(long long)nSegBegin, (long long)nSegEnd
 					);
 					return false;  // DO NOT ACK THIS PACKET
@@ -3461,9 +4333,9 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 			}
 
 			// Add a gap
-			lane.m_mapReliableStreamGaps[ nExpectNextStreamPos ] = nSegBegin;
+			lane.m_setReliableStreamGaps.AddAtEnd( nExpectNextStreamPos, nSegBegin );
 		}
-		lane.m_bufReliableStream.resize( size_t( cbNewSize ) );
+		lane.m_bufReliableStream.Extend( int( cbNewSize ) );
 	}
 
 	// If segment overlapped the existing buffer, we might need to discard the front
@@ -3482,87 +4354,20 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 		Assert( nSegBegin < nSegEnd );
 
 		// Check if this filled in one or more gaps (or made a hole in the middle!)
-		if ( !lane.m_mapReliableStreamGaps.empty() )
+		// Protect against malicious sender.  A good sender will fill the gaps in
+		// stream position order and not fragment like this
+		if ( !lane.m_setReliableStreamGaps.empty() && !lane.m_setReliableStreamGaps.Subtract( nSegBegin, nSegEnd, k_nMaxReliableStreamGaps_Fragment ) )
 		{
-			auto gapFilled = lane.m_mapReliableStreamGaps.upper_bound( nSegBegin );
-			if ( gapFilled != lane.m_mapReliableStreamGaps.begin() )
-			{
-				--gapFilled;
-				Assert( gapFilled->first < gapFilled->second ); // Make sure we don't have degenerate/invalid gaps in our table
-				Assert( gapFilled->first <= nSegBegin ); // Make sure we located the gap we think we located
-				if ( gapFilled->second > nSegBegin ) // gap is not entirely before this segment
-				{
-					do {
-
-						// Common case where we fill exactly at the start
-						if ( nSegBegin == gapFilled->first )
-						{
-							if ( nSegEnd < gapFilled->second )
-							{
-								// We filled the first bit of the gap.  Chop off the front bit that we filled.
-								// We cast away const here because we know that we aren't violating the ordering constraints
-								const_cast<int64&>( gapFilled->first ) = nSegEnd;
-								break;
-							}
-
-							// Filled the whole gap.
-							// Erase, and move forward in case this also fills more gaps
-							// !SPEED! Since exactly filing the gap should be common, we might
-							// check specifically for that case and early out here.
-							gapFilled = lane.m_mapReliableStreamGaps.erase( gapFilled );
-						}
-						else if ( nSegEnd >= gapFilled->second )
-						{
-							// Chop off the end of the gap
-							Assert( nSegBegin < gapFilled->second );
-							gapFilled->second = nSegBegin;
-
-							// And maybe subsequent gaps!
-							++gapFilled;
-						}
-						else
-						{
-							// We are fragmenting.
-							Assert( nSegBegin > gapFilled->first );
-							Assert( nSegEnd < gapFilled->second );
-
-							// Protect against malicious sender.  A good sender will
-							// fill the gaps in stream position order and not fragment
-							// like this
-							if ( len( lane.m_mapReliableStreamGaps ) >= k_nMaxReliableStreamGaps_Fragment )
-							{
-								// Stop processing the packet, and don't ack it
-								SpewWarningRateLimited( usecNow, "[%s] decode pkt %lld abort.  Reliable stream already has %d fragments, first is [%lld,%lld), last is [%lld,%lld).  We don't want to fragment [%lld,%lld) with new segment [%lld,%lld)\n",
-									GetDescription(),
-									(long long)nPktNum,
-									len( lane.m_mapReliableStreamGaps ),
-									(long long)lane.m_mapReliableStreamGaps.begin()->first, (long long)lane.m_mapReliableStreamGaps.begin()->second,
-									(long long)lane.m_mapReliableStreamGaps.rbegin()->first, (long long)lane.m_mapReliableStreamGaps.rbegin()->second,
-									(long long)gapFilled->first, (long long)gapFilled->second,
-									(long long)nSegBegin, (long long)nSegEnd
-								);
-								return false;  // DO NOT ACK THIS PACKET
-							}
-
-							// Save bounds of the right side
-							int64 nRightHandBegin = nSegEnd;
-							int64 nRightHandEnd = gapFilled->second;
-
-							// Truncate the left side
-							gapFilled->second = nSegBegin;
-
-							// Add the right hand gap
-							lane.m_mapReliableStreamGaps[ nRightHandBegin ] = nRightHandEnd;
-
-							// And we know that we cannot possible have covered any more gaps
-							break;
-						}
-
-						// In some rare cases we might fill more than one gap with a single segment.
-						// So keep searching forward.
-					} while ( gapFilled != lane.m_mapReliableStreamGaps.end() && gapFilled->first < nSegEnd );
-				}
-			}
+			// Stop processing the packet, and don't ack it
+			SpewWarningRateLimited( usecNow, "[%s] decode pkt %lld abort.  Reliable stream already has %d fragments, first is [%lld,%lld), last is [%lld,%lld).  We don't want to fragment with new segment [%lld,%lld)\n",
+				GetDescription(),
+				(long long)nPktNum,
+				lane.m_setReliableStreamGaps.size(),
+				(long long)lane.m_setReliableStreamGaps.front().m_nBegin, (long long)lane.m_setReliableStreamGaps.front().m_nEnd,
+				(long long)lane.m_setReliableStreamGaps.back().m_nBegin, (long long)lane.m_setReliableStreamGaps.back().m_nEnd,
+				(long long)nSegBegin, (long long)nSegEnd
+			);
+			return false;  // DO NOT ACK THIS PACKET
 		}
 	}
 
@@ -3571,32 +4376,32 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 	// time to figure that out.
 	int nBufOffset = nSegBegin - lane.m_nReliableStreamPos;
 	Assert( nBufOffset >= 0 );
-	Assert( nBufOffset+cbSegmentSize <= len( lane.m_bufReliableStream ) );
-	memcpy( &lane.m_bufReliableStream[nBufOffset], pSegmentData, cbSegmentSize );
+	Assert( nBufOffset+cbSegmentSize <= lane.m_bufReliableStream.Size() );
+	lane.m_bufReliableStream.Write( nBufOffset, pSegmentData, cbSegmentSize );
 
 	// Figure out how many valid bytes are at the head of the buffer
 	int nNumReliableBytes;
-	if ( lane.m_mapReliableStreamGaps.empty() )
+	if ( lane.m_setReliableStreamGaps.empty() )
 	{
-		nNumReliableBytes = len( lane.m_bufReliableStream );
+		nNumReliableBytes = lane.m_bufReliableStream.Size();
 	}
 	else
 	{
-		auto firstGap = lane.m_mapReliableStreamGaps.begin();
-		Assert( firstGap->first >= lane.m_nReliableStreamPos );
-		if ( firstGap->first < nSegBegin )
+		const SSNPIntervalSet::Interval &firstGap = lane.m_setReliableStreamGaps.front();
+		Assert( firstGap.m_nBegin >= lane.m_nReliableStreamPos );
+		if ( firstGap.m_nBegin < nSegBegin )
 		{
 			// There's gap in front of us, and therefore if we didn't have
 			// a complete reliable message before, we don't have one now.
-			Assert( firstGap->second <= nSegBegin );
+			Assert( firstGap.m_nEnd <= nSegBegin );
 			return true;
 		}
 
 		// We do have a gap, but it's somewhere after this segment.
-		Assert( firstGap->first >= nSegEnd );
-		nNumReliableBytes = firstGap->first - lane.m_nReliableStreamPos;
+		Assert( firstGap.m_nBegin >= nSegEnd );
+		nNumReliableBytes = firstGap.m_nBegin - lane.m_nReliableStreamPos;
 		Assert( nNumReliableBytes > 0 );
-		Assert( nNumReliableBytes < len( lane.m_bufReliableStream ) ); // The last byte in the buffer should always be valid!
+		Assert( nNumReliableBytes < lane.m_bufReliableStream.Size() ); // The last byte in the buffer should always be valid!
 	}
 	Assert( nNumReliableBytes > 0 );
 
@@ -3609,9 +4414,20 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 		// each time we get a new packet.  We could cache off the result if we find out
 		// that it's worth while.  It should be pretty fast, though, so let's keep the
 		// code simple until we know that it's worthwhile.
-		uint8 *pReliableStart = &lane.m_bufReliableStream[0];
-		uint8 *pReliableDecode = pReliableStart;
-		uint8 *pReliableEnd = pReliableDecode + nNumReliableBytes;
+		//
+		// The header is small, but it might straddle a chunk boundary.  If so, copy
+		// it out so we can parse it from contiguous memory.
+		uint8 hdrTemp[ 1 + 10 + 10 ]; // Header byte, plus two varints
+		int cbContiguous;
+		const uint8 *pReliableStart = lane.m_bufReliableStream.Peek( 0, cbContiguous );
+		int cbHdrAvail = std::min( nNumReliableBytes, (int)sizeof(hdrTemp) );
+		if ( cbContiguous < cbHdrAvail )
+		{
+			lane.m_bufReliableStream.Read( 0, hdrTemp, cbHdrAvail );
+			pReliableStart = hdrTemp;
+		}
+		const uint8 *pReliableDecode = pReliableStart;
+		const uint8 *pReliableEnd = pReliableDecode + cbHdrAvail;
 
 		// Spew
 		SpewDebugGroup( nLogLevelPacketDecode, "[%s]   decode pkt %lld valid reliable bytes = %d [%lld,%lld)\n",
@@ -3710,27 +4526,37 @@ bool CSteamNetworkConnectionBase::SNP_ReceiveReliableSegment( int64 nPktNum, int
 		}
 
 		// Do we have the full thing?
-		if ( pReliableDecode+cbMsgSize > pReliableEnd )
+		int cbHdr = int( pReliableDecode - pReliableStart );
+		if ( cbHdr + cbMsgSize > nNumReliableBytes )
 		{
 			// Ouch, we did all that work and still don't have the whole message.
 			return true; // packet is OK, can be acked, and continue processing it
 		}
 
-		// We have a full message!  Queue it
-		if ( !ReceivedMessageData( pReliableDecode, cbMsgSize, idxLane, nMsgNum, k_nSteamNetworkingSend_Reliable, usecNow ) )
+		// We have a full message!  Gather it out of the stream buffer
+		// directly into the message, and queue it
+		CSteamNetworkingMessage *pMsg = AllocateNewRecvMessage( cbMsgSize, k_nSteamNetworkingSend_Reliable, usecNow );
+		if ( !pMsg )
 		{
 			// Don't ack this packet!
 			return false;
 		}
-		pReliableDecode += cbMsgSize;
-		int cbStreamConsumed = pReliableDecode-pReliableStart;
+		pMsg->m_idxLane = idxLane;
+		pMsg->m_nMessageNumber = nMsgNum;
+		lane.m_bufReliableStream.Read( cbHdr, pMsg->m_pData, cbMsgSize );
+		if ( !ReceivedMessage( pMsg ) )
+		{
+			// Don't ack this packet!
+			return false;
+		}
+		int cbStreamConsumed = cbHdr + cbMsgSize;
 
 		// Advance bookkeeping
 		lane.m_nLastRecvReliableMsgNum = nMsgNum;
 		lane.m_nReliableStreamPos += cbStreamConsumed;
 
 		// Remove the data from the from the front of the buffer
-		pop_from_front( lane.m_bufReliableStream, cbStreamConsumed );
+		lane.m_bufReliableStream.PopFront( cbStreamConsumed );
 
 		// We might have more in the stream that is ready to dispatch right now.
 		nNumReliableBytes -= cbStreamConsumed;
@@ -3745,20 +4571,25 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 	// Check if sender has already told us they don't need us to
 	// account for packets this old anymore
 	if ( unlikely( nPktNum < m_receiverState.m_nMinPktNumToSendAcks ) )
+	{
+		// Probably we NACKed it, and it showed up anyway.  Learn from that.
+		m_receiverState.RecordLateExpiredPacket( nPktNum, usecNow );
 		return;
+	}
 
 	// Locate the sentinel in the packet gap map, which records the last packet
 	// number that we will ack.
-	auto itSentinel = m_receiverState.m_mapPacketGaps.rbegin();
+	auto itSentinel = m_receiverState.m_mapPacketGaps.end();
+	--itSentinel;
 	const int64 nExpectedNextPktNum = itSentinel->first;
 
 	// Fast path for the (hopefully) most common case of packets arriving in order
 	if ( likely( nPktNum == nExpectedNextPktNum ) )
 	{
 		// Update the sentinel.  Since the sentinel is always the highest numbered
-		// entry in the map, it should always be legal to increase its key without
-		// violating std::map sorting invariants
-		const_cast<int64&>( itSentinel->first ) = nPktNum+1;
+		// entry in the list, it should always be legal to increase its key without
+		// violating sorting invariants
+		itSentinel->first = nPktNum+1;
 		itSentinel->second.m_usecWhenReceivedPktBefore = usecNow;
 
 		if ( bScheduleAck ) // fast path for all unreliable data (common when we are just being used for transport)
@@ -3789,14 +4620,25 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 		x.second.m_usecWhenAckPrior = itSentinel->second.m_usecWhenAckPrior;
 
 		// When should we nack this?
+		x.second.m_usecWhenDetected = usecNow;
 		x.second.m_usecWhenOKToNack = usecNow;
 		if ( nPktNum < m_statsEndToEnd.m_nMaxRecvPktNum + 3 )
-			x.second.m_usecWhenOKToNack += k_usecNackFlush;
+			x.second.m_usecWhenOKToNack += m_receiverState.GetNackDelay( m_connectionConfig.NackDelayPercentile.Get() );
+
+		// Gaps must stay sorted by when it's OK to nack them.  The learned
+		// nack delay can shrink, so a new gap might otherwise come due
+		// before an older one.
+		if ( itSentinel != m_receiverState.m_mapPacketGaps.begin() )
+		{
+			auto itPrev = itSentinel;
+			--itPrev;
+			x.second.m_usecWhenOKToNack = std::max( x.second.m_usecWhenOKToNack, itPrev->second.m_usecWhenOKToNack );
+		}
 
 		// Update the sentinel.  Since the sentinel is always the highest numbered
-		// entry in the map, it should always be legal to increase its key without
-		// violating std::map sorting invariants
-		const_cast<int64&>( itSentinel->first ) = nPktNum+1;
+		// entry in the list, it should always be legal to increase its key without
+		// violating sorting invariants
+		itSentinel->first = nPktNum+1;
 		itSentinel->second.m_usecWhenReceivedPktBefore = usecNow;
 
 		// Insert the gap
@@ -3862,7 +4704,9 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 		}
 
 		// Packet is in a gap where we previously thought packets were lost.
-		// (Packets arriving out of order.)
+		// (Packets arriving out of order.)  Remember how late it was, so we
+		// can learn how long to wait before NACKing.
+		m_receiverState.RecordReorderDelay( usecNow - itGap->second.m_usecWhenDetected );
 
 		// Last packet in gap?
 		if ( itGap->second.m_nEnd-1 == nPktNum )
@@ -3935,10 +4779,9 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 		else if ( itGap->first == nPktNum )
 		{
 			// First packet in multi-packet gap.
-			// Shrink packet from the front
-			// Cast away const to allow us to modify the key.
-			// We know this won't break the map ordering
-			++const_cast<int64&>( itGap->first );
+			// Shrink packet from the front.
+			// We know this won't break the list ordering
+			++itGap->first;
 			Assert( itGap->first < itGap->second.m_nEnd );
 			itGap->second.m_usecWhenReceivedPktBefore = usecNow;
 
@@ -3966,6 +4809,7 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 			else
 				upper.second.m_usecWhenAckPrior = itNext->second.m_usecWhenAckPrior;
 			upper.second.m_usecWhenOKToNack = itGap->second.m_usecWhenOKToNack;
+			upper.second.m_usecWhenDetected = itGap->second.m_usecWhenDetected;
 
 			// Truncate the current gap
 			itGap->second.m_nEnd = nPktNum;
@@ -4062,7 +4906,7 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 
 	// Check if our we are very badly fragmented and need to protect
 	// against a malicious sender.
-	if ( unlikely( len( m_receiverState.m_mapPacketGaps ) >= k_nMaxPacketGaps ) )
+	if ( unlikely( (int)m_receiverState.m_mapPacketGaps.size() >= k_nMaxPacketGaps ) )
 	{
 
 		// Tune this code if this changes
@@ -4112,6 +4956,7 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 		itGapNext->second.m_usecWhenReceivedPktBefore = itGapToDelete->second.m_usecWhenReceivedPktBefore;
 		Assert( itGapNext->second.m_usecWhenOKToNack >= itGapToDelete->second.m_usecWhenOKToNack );
 		itGapNext->second.m_usecWhenOKToNack = itGapToDelete->second.m_usecWhenOKToNack;
+		itGapNext->second.m_usecWhenDetected = std::min( itGapNext->second.m_usecWhenDetected, itGapToDelete->second.m_usecWhenDetected );
 		if ( itGapToDelete->second.m_usecWhenAckPrior < INT64_MAX )
 		{
 			Assert( itGapNext->second.m_usecWhenAckPrior < INT64_MAX );
@@ -4153,6 +4998,345 @@ void CSteamNetworkConnectionBase::SNP_RecordReceivedPktNum( int64 nPktNum, Steam
 
 }
 
+//-----------------------------------------------------------------------------
+// Bandwidth estimation
+//-----------------------------------------------------------------------------
+
+/// Pacing gain used in startup (and its inverse in drain).  2/ln(2), the
+/// smallest gain that will double the delivery rate each round trip.
+constexpr float k_flBBRHighGain = 2.885f;
+
+/// Pacing gain cycle in steady state.  Probe for more bandwidth for one
+/// phase, then drain any queue that built up for one phase, then cruise.
+static const float k_arBBRProbeBWGainCycle[] = { 1.25f, 0.75f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
+constexpr int k_nBBRProbeBWGainCycleLen = V_ARRAYSIZE( k_arBBRProbeBWGainCycle );
+
+/// A ProbeBW phase lasts one min RTT, but not shorter than this.  Otherwise
+/// on a LAN we would be probing up constantly.
+constexpr SteamNetworkingMicroseconds k_usecBBRMinPhaseDuration = 25*1000;
+
+/// Min duration of a slot in the bandwidth max filter
+constexpr SteamNetworkingMicroseconds k_usecBBRMinFilterSlot = 100*1000;
+
+/// If we haven't seen the min RTT go any lower in this long, then enter ProbeRTT
+constexpr SteamNetworkingMicroseconds k_usecBBRMinRTTExpiry = 10*k_nMillion;
+
+/// How long to spend in ProbeRTT
+constexpr SteamNetworkingMicroseconds k_usecBBRProbeRTTDuration = 200*1000;
+
+/// Pacing gain used in ProbeRTT
+constexpr float k_flBBRProbeRTTGain = 0.5f;
+
+/// Startup is over when the bandwidth estimate fails to grow by this
+/// factor for this many rounds in a row
+constexpr float k_flBBRFullBtlBwThreshold = 1.25f;
+constexpr int k_nBBRFullBtlBwRounds = 3;
+
+/// Multiple of the bandwidth delay product that we allow in flight.
+/// This leaves room for delayed and stretched acks.
+constexpr float k_flBBRCwndGain = 2.0f;
+
+/// Never cap the data in flight below this many full size packets.  This
+/// is also the cap while we are in ProbeRTT.
+constexpr int k_nBBRMinInFlightPackets = 4;
+
+/// Limit on the ack aggregation estimate, as a time at the bottleneck rate
+constexpr SteamNetworkingMicroseconds k_usecBBRMaxExtraAcked = 100*1000;
+
+/// Max number of rounds to spend in drain
+constexpr int k_nBBRMaxDrainRounds = 3;
+
+/// A round with more than this fraction of bytes lost is a congestion signal
+constexpr float k_flBBRLossThreshold = 0.02f;
+
+/// When we see heavy loss, how much to reduce the bandwidth ceiling.
+/// (We won't go below the delivery rate we actually observed.)
+constexpr float k_flBBRLossBeta = 0.7f;
+
+void SSendRateData::InitBandwidthEstimate( float flInitialRate, SteamNetworkingMicroseconds usecNow )
+{
+	// NOTE: The initial rate is just a guess.  We don't put it
+	// into the filter; the first real sample will replace it.
+	m_eBBRState = k_eBBRState_Startup;
+	m_flPacingGain = k_flBBRHighGain;
+	m_flBtlBw = flInitialRate;
+	memset( m_arBtlBwFilter, 0, sizeof(m_arBtlBwFilter) );
+	m_nBtlBwFilterSlot = 0;
+	m_usecBtlBwFilterSlotStart = usecNow;
+	m_flBwLo = 0.0f;
+	m_nDelivered = 0;
+	m_usecDeliveredTime = usecNow;
+	m_usecFirstSentTime = usecNow;
+	m_nRoundCount = 0;
+	m_nNextRoundDelivered = 0;
+	m_nRoundStartDelivered = 0;
+	m_nLostInRound = 0;
+	m_flRoundMaxDeliveryRate = 0.0f;
+	m_usecMinRTT = 0;
+	m_usecMinRTTStamp = usecNow;
+	m_usecAckEpochStart = usecNow;
+	m_cbAckEpochAcked = 0;
+	m_nDeliveredLastAckFrame = 0;
+	memset( m_arExtraAckedFilter, 0, sizeof(m_arExtraAckedFilter) );
+	m_flFullBtlBw = 0.0f;
+	m_nFullBtlBwRounds = 0;
+	m_bFilledPipe = false;
+	m_rateSample.m_bValid = false;
+}
+
+void SSendRateData::OnPacketSent( SNPInFlightPacket_t &pkt, int cbPkt, bool bNothingInFlight, bool bAppLimited )
+{
+	// If nothing is in flight, then we are starting from idle.  Don't
+	// measure the idle time as part of the interval for the next sample.
+	if ( bNothingInFlight )
+	{
+		m_usecFirstSentTime = pkt.m_usecWhenSent;
+		m_usecDeliveredTime = pkt.m_usecWhenSent;
+	}
+
+	pkt.m_nDeliveredAtSend = m_nDelivered;
+	pkt.m_usecSinceDeliveredTimeAtSend = (uint32)std::min<SteamNetworkingMicroseconds>( pkt.m_usecWhenSent - m_usecDeliveredTime, UINT32_MAX );
+	pkt.m_usecSinceFirstSentTimeAtSend = (uint32)std::min<SteamNetworkingMicroseconds>( pkt.m_usecWhenSent - m_usecFirstSentTime, UINT32_MAX );
+	Assert( cbPkt == (uint16)cbPkt );
+	pkt.m_cbPkt = (uint16)cbPkt;
+	pkt.m_bAppLimited = bAppLimited;
+	m_cbInFlight += cbPkt;
+}
+
+void SSendRateData::OnPacketAcked( const SNPInFlightPacket_t &pkt, SteamNetworkingMicroseconds usecNow )
+{
+	// Ignore the sentinel
+	if ( pkt.m_cbPkt == 0 )
+		return;
+
+	// If we already declared it lost, we already stopped counting it
+	if ( !pkt.m_bNack )
+		m_cbInFlight = std::max( m_cbInFlight - pkt.m_cbPkt, (int64)0 );
+
+	m_nDelivered += pkt.m_cbPkt;
+	m_usecDeliveredTime = usecNow;
+
+	// We take a sample based on the most recently sent packet that was acked
+	if ( m_rateSample.m_bValid && pkt.m_nDeliveredAtSend <= m_rateSample.m_nPriorDelivered )
+		return;
+	m_rateSample.m_nPriorDelivered = pkt.m_nDeliveredAtSend;
+	m_rateSample.m_usecPriorDeliveredTime = pkt.m_usecWhenSent - pkt.m_usecSinceDeliveredTimeAtSend;
+	m_rateSample.m_usecPriorFirstSentTime = pkt.m_usecWhenSent - pkt.m_usecSinceFirstSentTimeAtSend;
+	m_rateSample.m_usecSent = pkt.m_usecWhenSent;
+	m_rateSample.m_bAppLimited = pkt.m_bAppLimited;
+	m_rateSample.m_bValid = true;
+	m_usecFirstSentTime = pkt.m_usecWhenSent;
+}
+
+void SSendRateData::OnPacketLost( const SNPInFlightPacket_t &pkt )
+{
+	m_nLostInRound += pkt.m_cbPkt;
+	m_cbInFlight = std::max( m_cbInFlight - pkt.m_cbPkt, (int64)0 );
+}
+
+void SSendRateData::OnRTTSample( SteamNetworkingMicroseconds usecRTT, SteamNetworkingMicroseconds usecNow )
+{
+	if ( m_eBBRState == k_eBBRState_ProbeRTT )
+	{
+		if ( m_usecProbeRTTMin <= 0 || usecRTT < m_usecProbeRTTMin )
+			m_usecProbeRTTMin = usecRTT;
+	}
+	if ( m_usecMinRTT <= 0 || usecRTT <= m_usecMinRTT )
+	{
+		m_usecMinRTT = usecRTT;
+		m_usecMinRTTStamp = usecNow;
+	}
+}
+
+void SSendRateData::OnAckFrameProcessed( SteamNetworkingMicroseconds usecNow )
+{
+	const SteamNetworkingMicroseconds usecPhaseDuration = std::max( m_usecMinRTT, k_usecBBRMinPhaseDuration );
+
+	bool bRoundStart = false;
+	bool bAppLimited = true;
+	float flRate = 0.0f;
+	if ( m_rateSample.m_bValid )
+	{
+		m_rateSample.m_bValid = false;
+		bAppLimited = m_rateSample.m_bAppLimited;
+
+		// Did a round trip just finish?
+		if ( m_rateSample.m_nPriorDelivered >= m_nNextRoundDelivered )
+		{
+			m_nNextRoundDelivered = m_nDelivered;
+			++m_nRoundCount;
+			bRoundStart = true;
+		}
+
+		// Calculate delivery rate.  Use the longer of the send and ack
+		// intervals, so that we are not fooled by ack compression or
+		// by sending in a burst.
+		SteamNetworkingMicroseconds usecSendElapsed = m_rateSample.m_usecSent - m_rateSample.m_usecPriorFirstSentTime;
+		SteamNetworkingMicroseconds usecAckElapsed = m_usecDeliveredTime - m_rateSample.m_usecPriorDeliveredTime;
+		SteamNetworkingMicroseconds usecInterval = std::max( usecSendElapsed, usecAckElapsed );
+		if ( usecInterval > 0 )
+			flRate = float( m_nDelivered - m_rateSample.m_nPriorDelivered ) * 1e6f / float( usecInterval );
+	}
+
+	if ( bRoundStart )
+	{
+
+		// Check for heavy loss in the round that just ended
+		int64 cbDeliveredInRound = m_nDelivered - m_nRoundStartDelivered;
+		if ( m_nLostInRound > 0 && (float)m_nLostInRound > (float)( cbDeliveredInRound + m_nLostInRound ) * k_flBBRLossThreshold )
+		{
+			// Set a ceiling on our bandwidth
+			if ( m_flBwLo <= 0.0f )
+				m_flBwLo = m_flBtlBw;
+			m_flBwLo = std::max( m_flRoundMaxDeliveryRate, m_flBwLo * k_flBBRLossBeta );
+
+			// Startup is over.  If we were probing for more bandwidth,
+			// we found the limit, so stop now.
+			m_bFilledPipe = true;
+			if ( m_eBBRState == k_eBBRState_ProbeBW && m_idxProbeBWCycle == 0 )
+			{
+				m_idxProbeBWCycle = 1;
+				m_usecProbeBWCycleStamp = usecNow;
+			}
+		}
+		m_nRoundStartDelivered = m_nDelivered;
+		m_nLostInRound = 0;
+		m_flRoundMaxDeliveryRate = 0.0f;
+
+		// Time to advance to the next slot in the max filter?
+		if ( usecNow >= m_usecBtlBwFilterSlotStart + k_usecBBRMinFilterSlot )
+		{
+			++m_nBtlBwFilterSlot;
+			m_arBtlBwFilter[ m_nBtlBwFilterSlot % k_nBtlBwFilterSlots ] = 0.0f;
+			m_arExtraAckedFilter[ m_nBtlBwFilterSlot % k_nBtlBwFilterSlots ] = 0;
+			m_usecBtlBwFilterSlotStart = usecNow;
+		}
+	}
+
+	// If we were app limited, the sample is only a lower bound
+	// on the bandwidth, and is only useful if it's a new max
+	if ( flRate > 0.0f && ( !bAppLimited || flRate >= m_flBtlBw ) )
+	{
+		m_flRoundMaxDeliveryRate = std::max( m_flRoundMaxDeliveryRate, flRate );
+		float &flSlot = m_arBtlBwFilter[ m_nBtlBwFilterSlot % k_nBtlBwFilterSlots ];
+		flSlot = std::max( flSlot, flRate );
+	}
+
+	// Recalculate max.  (If we don't have any samples, keep our initial guess.)
+	float flMax = 0.0f;
+	for ( float x: m_arBtlBwFilter )
+		flMax = std::max( flMax, x );
+	if ( flMax > 0.0f )
+		m_flBtlBw = flMax;
+
+	// Measure ack aggregation.  If acks have fallen behind what we
+	// expected from the bandwidth estimate, start a new epoch.
+	const int64 cbNewlyAcked = m_nDelivered - m_nDeliveredLastAckFrame;
+	m_nDeliveredLastAckFrame = m_nDelivered;
+	if ( cbNewlyAcked > 0 )
+	{
+		int64 cbExpected = (int64)( m_flBtlBw * ( usecNow - m_usecAckEpochStart ) * 1e-6f );
+		if ( m_cbAckEpochAcked <= cbExpected )
+		{
+			m_usecAckEpochStart = usecNow;
+			m_cbAckEpochAcked = 0;
+			cbExpected = 0;
+		}
+		m_cbAckEpochAcked += cbNewlyAcked;
+
+		// Don't let a bad bandwidth estimate make this grow without limit
+		int64 cbExtraAcked = std::min( m_cbAckEpochAcked - cbExpected, (int64)( m_flBtlBw * k_usecBBRMaxExtraAcked * 1e-6f ) );
+		int64 &cbSlot = m_arExtraAckedFilter[ m_nBtlBwFilterSlot % k_nBtlBwFilterSlots ];
+		cbSlot = std::max( cbSlot, cbExtraAcked );
+	}
+
+	// Check if we've found the bottleneck bandwidth during startup
+	if ( bRoundStart && !m_bFilledPipe && !bAppLimited )
+	{
+		if ( m_flBtlBw >= m_flFullBtlBw * k_flBBRFullBtlBwThreshold )
+		{
+			m_flFullBtlBw = m_flBtlBw;
+			m_nFullBtlBwRounds = 0;
+		}
+		else if ( ++m_nFullBtlBwRounds >= k_nBBRFullBtlBwRounds )
+		{
+			m_bFilledPipe = true;
+		}
+	}
+
+	switch ( m_eBBRState )
+	{
+		case k_eBBRState_Startup:
+			if ( m_bFilledPipe )
+			{
+				m_eBBRState = k_eBBRState_Drain;
+				m_nDrainStartRound = m_nRoundCount;
+			}
+			break;
+
+		case k_eBBRState_Drain:
+			// The queue we built has drained once the data in flight is
+			// down to the bandwidth delay product.  Don't wait more than
+			// a few rounds, in case the estimate is off.
+			if ( m_cbInFlight <= EstimateBDP( m_flBtlBw ) + ExtraAcked() || m_nRoundCount >= m_nDrainStartRound + k_nBBRMaxDrainRounds )
+			{
+				m_eBBRState = k_eBBRState_ProbeBW;
+				m_idxProbeBWCycle = 2; // Start cruising
+				m_usecProbeBWCycleStamp = usecNow;
+			}
+			break;
+
+		case k_eBBRState_ProbeBW:
+			if ( usecNow >= m_usecProbeBWCycleStamp + usecPhaseDuration )
+			{
+				m_idxProbeBWCycle = ( m_idxProbeBWCycle + 1 ) % k_nBBRProbeBWGainCycleLen;
+				m_usecProbeBWCycleStamp = usecNow;
+
+				// Starting to probe up?  Then forget about the loss ceiling.
+				if ( m_idxProbeBWCycle == 0 )
+					m_flBwLo = 0.0f;
+			}
+			break;
+
+		case k_eBBRState_ProbeRTT:
+			if ( usecNow >= m_usecProbeRTTDone && m_nRoundCount > m_nProbeRTTRound )
+			{
+				if ( m_usecProbeRTTMin > 0 )
+					m_usecMinRTT = m_usecProbeRTTMin;
+				m_usecMinRTTStamp = usecNow;
+				if ( m_bFilledPipe )
+				{
+					m_eBBRState = k_eBBRState_ProbeBW;
+					m_idxProbeBWCycle = 2;
+					m_usecProbeBWCycleStamp = usecNow;
+				}
+				else
+				{
+					m_eBBRState = k_eBBRState_Startup;
+				}
+			}
+			break;
+	}
+
+	// Time to refresh the min RTT?
+	if ( m_eBBRState != k_eBBRState_ProbeRTT && usecNow > m_usecMinRTTStamp + k_usecBBRMinRTTExpiry )
+	{
+		m_eBBRState = k_eBBRState_ProbeRTT;
+		m_usecProbeRTTDone = usecNow + std::max( k_usecBBRProbeRTTDuration, m_usecMinRTT );
+		m_nProbeRTTRound = m_nRoundCount;
+		m_usecProbeRTTMin = 0;
+	}
+
+	// Set pacing gain for the current phase
+	switch ( m_eBBRState )
+	{
+		case k_eBBRState_Startup: m_flPacingGain = k_flBBRHighGain; break;
+		case k_eBBRState_Drain: m_flPacingGain = 1.0f / k_flBBRHighGain; break;
+		case k_eBBRState_ProbeBW: m_flPacingGain = k_arBBRProbeBWGainCycle[ m_idxProbeBWCycle ]; break;
+		case k_eBBRState_ProbeRTT: m_flPacingGain = k_flBBRProbeRTTGain; break;
+	}
+}
+
 int CSteamNetworkConnectionBase::SNP_ClampSendRate()
 {
 	// Get effective clamp limits.  We clamp the limits themselves to be safe
@@ -4165,24 +5349,35 @@ int CSteamNetworkConnectionBase::SNP_ClampSendRate()
 	{
 		m_sendRateData.m_nCurrentSendRateEstimate = nMin;
 		m_sendRateData.m_flCurrentSendRateUsed = m_sendRateData.m_nCurrentSendRateEstimate;
+		m_sendRateData.m_cbInFlightCap = INT64_MAX;
 		// FIXME - Note that in this case we are effectively application limited.  We'll want to note this in the future
 	}
 	else
 	{
 
-		// Clamp it, adjusting the value if it's out of range
-		if ( m_sendRateData.m_nCurrentSendRateEstimate >= nMax )
-		{
-			m_sendRateData.m_nCurrentSendRateEstimate = nMax;
-			// FIXME - Note that in this case we are effectively application limited.  We'll want to note this in the future
-		}
-		else if ( m_sendRateData.m_nCurrentSendRateEstimate < nMin )
+		// Our estimate is the bottleneck bandwidth, clamped to the limits.
+		// The rate we actually pace at also depends on the current phase.
+		const float flBandwidth = m_sendRateData.BandwidthEstimate();
+		m_sendRateData.m_nCurrentSendRateEstimate = Clamp( (int)std::min( flBandwidth, (float)nMax ), nMin, nMax );
+		m_sendRateData.m_flCurrentSendRateUsed = Clamp( flBandwidth * m_sendRateData.m_flPacingGain, (float)nMin, (float)nMax );
+
+		// Cap the data in flight to a multiple of the bandwidth delay product,
+		// plus what we send while the peer holds on to acks.  Until we have
+		// an RTT measurement, we don't know what that is, and only the pacing
+		// rate limits us.
+		const int64 cbMinCap = k_nBBRMinInFlightPackets * k_cbSteamNetworkingSocketsMaxUDPMsgLen;
+		const int64 cbBDP = m_sendRateData.EstimateBDP( (float)m_sendRateData.m_nCurrentSendRateEstimate );
+		if ( cbBDP <= 0 )
+			m_sendRateData.m_cbInFlightCap = INT64_MAX;
+		else if ( m_sendRateData.m_eBBRState == SSendRateData::k_eBBRState_ProbeRTT )
+			m_sendRateData.m_cbInFlightCap = cbMinCap;
+		else
 		{
-			m_sendRateData.m_nCurrentSendRateEstimate = nMin;
+			// In startup, allow as much in flight as we are pacing, so that
+			// the cap doesn't slow down the search for the bottleneck
+			const float flGain = m_sendRateData.m_eBBRState == SSendRateData::k_eBBRState_Startup ? k_flBBRHighGain : k_flBBRCwndGain;
+			m_sendRateData.m_cbInFlightCap = std::max( (int64)( ( cbBDP + m_sendRateData.ExtraAcked() ) * flGain ), cbMinCap );
 		}
-
-		// FIXME - In the future we might implement BBR probe cycle
-		m_sendRateData.m_flCurrentSendRateUsed = m_sendRateData.m_nCurrentSendRateEstimate;
 	}
 
 	// Return value
@@ -4208,6 +5403,15 @@ SteamNetworkingMicroseconds CSteamNetworkConnectionBase::SNP_ThinkSendState( Ste
 	COMPILE_TIME_ASSERT( 1 << 11 == 2048 );
 	int nMaxPacketsPerThinkRemaining = g_cbUDPSocketBufferSize >> 11;
 
+	// Hand the whole burst to the OS together, when we leave this function
+	RawUDPSendBatchScope scopeSendBatch;
+
+	// If the kernel will pace for us, we can hand it packets before we
+	// have the tokens, stamped with the time when we will.
+	RawUDPSendTxTimeScope scopeTxTime;
+	const SteamNetworkingMicroseconds usecSendAheadHorizon = SNP_GetSendAheadHorizon();
+	const float flSendAheadAllowance = usecSendAheadHorizon * 1e-6f * m_sendRateData.m_flCurrentSendRateUsed;
+
 	// Keep sending packets until we run out of tokens
 	while ( m_pTransport )
 	{
@@ -4225,16 +5429,24 @@ SteamNetworkingMicroseconds CSteamNetworkConnectionBase::SNP_ThinkSendState( Ste
 		}
 
 		// Send the next data packet.
-		if ( !m_pTransport->SendDataPacket( usecNow ) )
+		if ( usecSendAheadHorizon > 0 )
+		{
+			scopeTxTime.SetDelay( m_sendRateData.CalcTimeUntilNextSend() );
+			m_sendRateData.m_flSendAheadAllowance = flSendAheadAllowance;
+		}
+		bool bSent = m_pTransport->SendDataPacket( usecNow );
+		m_sendRateData.m_flSendAheadAllowance = 0.0f;
+		if ( !bSent )
 		{
 			// Problem sending packet.  Nuke token bucket, but request
 			// a wakeup relatively quick to check on our state again
-			m_sendRateData.m_flTokenBucket = m_sendRateData.m_flCurrentSendRateUsed * -0.001f;
+			m_sendRateData.m_flTokenBucket = std::min( m_sendRateData.m_flTokenBucket, m_sendRateData.m_flCurrentSendRateUsed * -0.001f );
 			return usecNow + 2000;
 		}
 
-		// We spent some tokens, do we have any left?
-		if ( m_sendRateData.m_flTokenBucket < 0.0f )
+		// We spent some tokens, do we have any left?  (Or can we
+		// borrow against the future?)
+		if ( m_sendRateData.m_flTokenBucket + flSendAheadAllowance < 0.0f )
 			break;
 
 		// Sent too many packets in one burst?
@@ -4243,8 +5455,9 @@ SteamNetworkingMicroseconds CSteamNetworkConnectionBase::SNP_ThinkSendState( Ste
 			// We're sending too much at one time.  Nuke token bucket so that
 			// we'll be ready to send again very soon, but not immediately.
 			// We don't want the outer code to complain that we are requesting
-			// a wakeup call in the past
-			m_sendRateData.m_flTokenBucket = m_sendRateData.m_flCurrentSendRateUsed * -0.0005f;
+			// a wakeup call in the past.  (If we have been sending ahead,
+			// we might already be further in debt than this.)
+			m_sendRateData.m_flTokenBucket = std::min( m_sendRateData.m_flTokenBucket, m_sendRateData.m_flCurrentSendRateUsed * -0.0005f );
 			return usecNow + 1000;
 		}
 	}
@@ -4255,6 +5468,14 @@ SteamNetworkingMicroseconds CSteamNetworkConnectionBase::SNP_ThinkSendState( Ste
 	return usecNextAction;
 }
 
+SteamNetworkingMicroseconds CSteamNetworkConnectionBase::SNP_GetSendAheadHorizon() const
+{
+	const int32 usecHorizon = GlobalConfig::SendTxTimeHorizon.Get();
+	if ( usecHorizon <= 0 || !m_pTransport || !m_pTransport->BSupportsTxTime() )
+		return 0;
+	return usecHorizon;
+}
+
 void CSteamNetworkConnectionBase::SNP_TokenBucket_Accumulate( SteamNetworkingMicroseconds usecNow )
 {
 	// If we're not connected, just keep our bucket full
@@ -4320,7 +5541,8 @@ void CSteamNetworkConnectionBase::SNP_DebugCheckPacketGapMapSentinel() const
 {
 
 	// Locate the sentinel and get the latest packet we should ack, and its timestamp
-	auto itSentinel = m_receiverState.m_mapPacketGaps.rbegin();
+	auto itSentinel = m_receiverState.m_mapPacketGaps.end();
+	--itSentinel;
 	const int64 nLastPktToAck = itSentinel->first-1;
 	const SteamNetworkingMicroseconds usecWhenRecvLastPktToAck = itSentinel->second.m_usecWhenReceivedPktBefore;
 	Assert( nLastPktToAck <= m_statsEndToEnd.m_nMaxRecvPktNum );
@@ -4386,10 +5608,19 @@ SteamNetworkingMicroseconds CSteamNetworkConnectionBase::SNP_TimeWhenWantToSendN
 		return k_nThinkTime_Never;
 	}
 
+	// Too much data in flight?  Then we need to wait for an ack
+	if ( m_sendRateData.BInFlightCapped() )
+		return k_nThinkTime_Never;
+
 	// Reliable retry triggered?  Then send it ASAP
 	if ( !m_senderState.m_listReadyRetryReliableRange.IsEmpty() )
 		return 0;
 
+	// Parity for an unreliable message?  It's only useful if it arrives
+	// right behind the segments, so don't make it wait for Nagle.
+	if ( m_senderState.m_nFECParityPending > 0 )
+		return 0;
+
 	// Anything queued?
 	SteamNetworkingMicroseconds usecNextSend;
 	if ( m_senderState.m_messagesQueued.empty() )
@@ -4456,6 +5687,12 @@ SteamNetworkingMicroseconds CSteamNetworkConnectionBase::SNP_GetNextThinkTime( S
 		// Time when we *could* send the next packet, ignoring Nagle
 		SteamNetworkingMicroseconds usecNextSend = usecNow;
 		SteamNetworkingMicroseconds usecQueueTime = m_sendRateData.CalcTimeUntilNextSend();
+
+		// If the kernel is pacing for us, then we don't need to wake up
+		// until it has drained about half of what we already handed it
+		if ( usecQueueTime > 0 )
+			usecQueueTime -= SNP_GetSendAheadHorizon() / 2;
+
 		if ( usecQueueTime > 0 )
 		{
 			usecNextSend += usecQueueTime;
@@ -4509,6 +5746,7 @@ void CSteamNetworkConnectionBase::SNP_PopulateRealTimeStatus( SteamNetConnection
 		pStatus->m_cbPendingReliable = m_senderState.m_cbPendingReliable;
 		pStatus->m_cbSentUnackedReliable = m_senderState.m_cbSentUnackedReliable;
 		pStatus->m_usecQueueTime = INT64_MAX; // Assume for now
+		pStatus->m_usecNackDelay = m_receiverState.GetNackDelay( m_connectionConfig.NackDelayPercentile.Get() );
 	}
 
 	// Fill in per-lane info
@@ -4679,7 +5917,7 @@ bool CSteamNetworkConnectionBase::SNP_BHasAnyBufferedRecvData() const
 	// !KLUDGE! Linear scan of all lanes!
 	for ( const SSNPReceiverState::Lane &l: m_receiverState.m_vecLanes )
 	{
-		if ( !l.m_bufReliableStream.empty() )
+		if ( !l.m_bufReliableStream.Empty() )
 			return true;
 	}
 	return false;
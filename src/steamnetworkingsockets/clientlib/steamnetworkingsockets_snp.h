@@ -9,10 +9,11 @@
 #include <set>
 
 struct P2PSessionState_t;
+struct SteamNetworkingGlobalStats_t;
 
 namespace SteamNetworkingSocketsLib {
 
-struct LockDebugInfo;
+struct ShortDurationLock;
 
 // Acks may be delayed.  This controls the precision used on the wire to encode the delay time.
 constexpr int k_nAckDelayPrecisionShift = 5;
@@ -21,18 +22,19 @@ constexpr SteamNetworkingMicroseconds k_usecAckDelayPrecision = (1 << k_nAckDela
 // When a receiver detects a dropped packet, wait a bit before NACKing it, to give it time
 // to arrive out of order.  This is really important for many different types of connections
 // that send on different channels, e.g. DSL, Wifi.
-// Here we really could be smarter, by tracking how often dropped
-// packets really do arrive out of order.  If the rate is low, then it's
-// probably best to go ahead and send a NACK now, rather than waiting.
-// But if dropped packets do often arrive out of order, then waiting
-// to NACK will probably save some retransmits.  In fact, instead
-// of learning the rate, we should probably try to learn the delay.
-// E.g. a probability distribution P(t), which describes the odds
-// that a dropped packet will have arrived at time t.  Then you
-// adjust the NACK delay such that P(nack_delay) gives the best
-// balance between false positive and false negative rates.
+// We learn how long to wait from the delays we actually observe.  Each time a gap
+// is filled, we record how long ago we detected the gap in a histogram.  Then we wait long
+// enough for a certain percentage of those packets (k_ESteamNetworkingConfig_NackDelayPercentile).
+// Until we have enough samples, or if learning is disabled, we use this fixed delay.
 constexpr SteamNetworkingMicroseconds k_usecNackFlush = 3*1000;
 
+// Reorder delay histogram.  Bucket N counts delays less than k_usecReorderDelayBucket0 << N.
+// The last bucket also holds anything larger.
+constexpr int k_nReorderDelayBuckets = 10;
+constexpr SteamNetworkingMicroseconds k_usecReorderDelayBucket0 = 250;
+constexpr int k_nReorderDelayMinSamples = 16; // Don't trust the histogram until we have this many samples
+constexpr int k_nReorderDelayMaxSamples = 1024; // Decay old samples when we reach this many, so we can adapt
+
 constexpr int k_nMaxReliableStreamGaps_Extend = 30; // Discard reliable data past the end of the stream, if it would cause us to get too many gaps
 constexpr int k_nMaxReliableStreamGaps_Fragment = 20; // Discard reliable data that is filling in the middle of a hole, if it would cause the number of gaps to exceed this number
 constexpr int k_nMaxPacketGaps = 62; // Don't bother tracking more than N gaps.  Instead, we will end up NACKing some packets that we actually did receive.  This should not break the protocol, but it protects us from malicious sender
@@ -49,6 +51,21 @@ constexpr int k_nMaxPacketGaps = 62; // Don't bother tracking more than N gaps.
 // error correction.)
 constexpr int k_nMaxBufferedUnreliableSegments = 20;
 
+// Forward error correction for unreliable messages.  (See k_ESteamNetworkingConfig_UnreliableFECLanes.)
+// The parity for a fragmented message is the XOR of all of its segments, each
+// one aligned at the start of the parity buffer, so it's as large as the largest
+// segment.  On lanes that use FEC, we limit the size of segments so that the parity
+// frame (plus a stop_waiting frame) can always fit in a single packet.
+constexpr int k_cbMaxFECParityFrameOverhead = 32;
+
+// The lanes that use FEC are a bitmask in an int32 config value, so only
+// the first 31 lanes can use it.
+constexpr int k_nMaxFECLanes = 31;
+
+// Key used to store a parity block in the unreliable segment reassembly map.
+// It sorts before all of the segments of the message.
+constexpr int k_nUnreliableParityOffset = -1;
+
 // If app tries to send a message larger than N bytes unreliably,
 // complain about it, and automatically convert to reliable.
 // About 15 segments.
@@ -85,6 +102,28 @@ public:
 	static CSteamNetworkingMessage *New( uint32 cbSize );
 	static void DefaultFreeData( SteamNetworkingMessage_t *pMsg );
 
+	/// Allocate a payload buffer.  Small buffers come from the message
+	/// pool; larger ones go to the heap.  Either way, they must be freed
+	/// with FreeBuffer (which is what DefaultFreeData does).
+	static void *AllocBuffer( uint32 cbSize );
+	static void FreeBuffer( void *pData );
+
+	/// Allocate a reference counted buffer, which several messages may point
+	/// into.  Used to hold a decrypted packet, so that received messages don't
+	/// need to be copied out of it.  The buffer starts out with one reference.
+	static void *AllocSharedBuffer( uint32 cbSize );
+	static void AddRefSharedBuffer( void *pBuf );
+	static void ReleaseSharedBuffer( void *pBuf );
+
+	/// Point the message at a range in a shared buffer, and take a reference.
+	void SetSharedBufferData( void *pSharedBuffer, void *pData, uint32 cbSize );
+
+	/// Fill in the message pool fields of the global stats
+	static void GetPoolStats( SteamNetworkingGlobalStats_t *pStats, bool bReset );
+
+	/// Return all free blocks held in the shared pool to the heap
+	static void TrimPool();
+
 	/// OK to delay sending this message until this time.  Set to zero to explicitly force
 	/// Nagle timer to expire and send now (but this should behave the same as if the
 	/// timer < usecNow).  If the timer is cleared, then all messages with lower message numbers
@@ -149,6 +188,10 @@ public:
 	/// Remove it from queues
 	void Unlink();
 
+	/// Shared buffer that m_pData points into, if the data was set
+	/// using SetSharedBufferData
+	void *m_pSharedBuffer;
+
 	struct Links
 	{
 		SteamNetworkingMessageQueue *m_pQueue;
@@ -181,7 +224,7 @@ struct SteamNetworkingMessageQueue
 {
 	CSteamNetworkingMessage *m_pFirst = nullptr;
 	CSteamNetworkingMessage *m_pLast = nullptr;
-	LockDebugInfo *m_pRequiredLock = nullptr; // Is there a lock that is required to be held while we access this queue?
+	ShortDurationLock *m_pRequiredLock = nullptr; // Is there a lock that is required to be held while we access this queue?
 	int m_nMessageCount = 0;
 	int m_nMessageSize = 0;
 
@@ -247,27 +290,447 @@ struct SNPSendReliableSegment_t
 };
 #pragma pack(pop)
 
+/// Bidirectional iterator used by the packet-number keyed containers below.
+/// It just remembers the container and a handle, and asks the container to
+/// resolve and advance it.  So unlike a pointer, it remains valid when the
+/// container reallocates; it is only invalidated if the item is erased.
+template <typename TContainer, typename TValue>
+class CSNPContainerIterator
+{
+public:
+	CSNPContainerIterator() {}
+	CSNPContainerIterator( TContainer *pContainer, int64 h ) : m_pContainer( pContainer ), m_h( h ) {}
+	template <typename C, typename V>
+	CSNPContainerIterator( const CSNPContainerIterator<C,V> &x ) : m_pContainer( x.m_pContainer ), m_h( x.m_h ) {}
+
+	inline TValue &operator*() const { return m_pContainer->Item( m_h ); }
+	inline TValue *operator->() const { return &m_pContainer->Item( m_h ); }
+	inline CSNPContainerIterator &operator++() { m_h = m_pContainer->NextHandle( m_h ); return *this; }
+	inline CSNPContainerIterator &operator--() { m_h = m_pContainer->PrevHandle( m_h ); return *this; }
+	template <typename C, typename V>
+	inline bool operator==( const CSNPContainerIterator<C,V> &x ) const { return m_h == x.m_h; }
+	template <typename C, typename V>
+	inline bool operator!=( const CSNPContainerIterator<C,V> &x ) const { return m_h != x.m_h; }
+
+	TContainer *m_pContainer = nullptr;
+	int64 m_h = 0;
+};
+
+/// Map of items keyed by packet number, with (a subset of) the std::map
+/// interface.  Keys are expected to be inserted in increasing order and
+/// removed more or less from the front, so the items are stored in a
+/// power-of-two ring indexed by packet number, with a bitmask of occupied
+/// slots so that iteration can skip quickly over items that were removed
+/// from the middle.  Insert and erase are O(1) and don't allocate unless
+/// the span of packet numbers outgrows the ring.
+///
+/// The key INT64_MIN is reserved for a sentinel, which is stored outside
+/// the ring.  Iterator handles are the packet number.
+template <typename T>
+class CSNPPacketNumRing
+{
+public:
+	typedef std::pair<int64,T> value_type;
+	typedef CSNPContainerIterator<CSNPPacketNumRing<T>, value_type > iterator;
+	typedef CSNPContainerIterator<const CSNPPacketNumRing<T>, const value_type > const_iterator;
+
+	static constexpr int64 k_nKeySentinel = INT64_MIN;
+	static constexpr int64 k_nHandleEnd = INT64_MAX;
+
+	inline bool empty() const { return m_nCount == 0 && !m_bHasSentinel; }
+	inline size_t size() const { return (size_t)m_nCount + ( m_bHasSentinel ? 1 : 0 ); }
+
+	inline iterator begin() { return iterator( this, FirstHandle() ); }
+	inline iterator end() { return iterator( this, k_nHandleEnd ); }
+	inline const_iterator begin() const { return const_iterator( this, FirstHandle() ); }
+	inline const_iterator end() const { return const_iterator( this, k_nHandleEnd ); }
+
+	/// Locate first item with a packet number > nKey
+	iterator upper_bound( int64 nKey )
+	{
+		if ( m_nCount == 0 || nKey >= m_nTail )
+			return end();
+		if ( nKey < m_nHead )
+			return iterator( this, m_nHead );
+		return iterator( this, FindNextOccupied( nKey ) );
+	}
+
+	/// Locate first item with a packet number >= nKey
+	iterator lower_bound( int64 nKey )
+	{
+		if ( nKey == k_nKeySentinel )
+			return begin();
+		return upper_bound( nKey-1 );
+	}
+
+	std::pair<iterator,bool> insert( const value_type &x )
+	{
+		const int64 nKey = x.first;
+		Assert( nKey != k_nHandleEnd );
+		if ( nKey == k_nKeySentinel )
+		{
+			if ( m_bHasSentinel )
+				return std::pair<iterator,bool>( iterator( this, nKey ), false );
+			m_sentinel = x;
+			m_bHasSentinel = true;
+			return std::pair<iterator,bool>( iterator( this, nKey ), true );
+		}
+
+		if ( m_nCount == 0 )
+		{
+			if ( m_vecSlots.empty() )
+				Grow( k_nMinCapacity );
+			m_nHead = m_nTail = nKey;
+		}
+		else
+		{
+			int64 nHead = std::min( m_nHead, nKey );
+			int64 nTail = std::max( m_nTail, nKey );
+			if ( nTail - nHead >= (int64)m_vecSlots.size() )
+				Grow( nTail - nHead + 1 );
+			else if ( IsOccupied( nKey ) )
+				return std::pair<iterator,bool>( iterator( this, nKey ), false );
+			m_nHead = nHead;
+			m_nTail = nTail;
+		}
+
+		const int64 idx = nKey & m_nMask;
+		m_vecSlots[ idx ] = x;
+		m_vecOccupied[ idx >> 6 ] |= uint64(1) << ( idx & 63 );
+		++m_nCount;
+		return std::pair<iterator,bool>( iterator( this, nKey ), true );
+	}
+
+	/// Remove the item, and return the item after it
+	iterator erase( iterator it )
+	{
+		const int64 nKey = it.m_h;
+		if ( nKey == k_nKeySentinel )
+		{
+			Assert( m_bHasSentinel );
+			m_bHasSentinel = false;
+			m_sentinel.second = T();
+			return begin();
+		}
+
+		Assert( m_nCount > 0 && IsOccupied( nKey ) );
+		const int64 nNext = NextHandle( nKey );
+		const int64 idx = nKey & m_nMask;
+		m_vecSlots[ idx ].second = T();
+		m_vecOccupied[ idx >> 6 ] &= ~( uint64(1) << ( idx & 63 ) );
+		--m_nCount;
+		if ( m_nCount > 0 )
+		{
+			if ( nKey == m_nHead )
+				m_nHead = nNext;
+			else if ( nKey == m_nTail )
+				m_nTail = FindPrevOccupied( nKey );
+		}
+		return iterator( this, nNext );
+	}
+
+	/// Remove everything, including the sentinel, and free memory
+	void clear()
+	{
+		std_vector<value_type>().swap( m_vecSlots );
+		std_vector<uint64>().swap( m_vecOccupied );
+		m_nMask = 0;
+		m_nCount = 0;
+		m_bHasSentinel = false;
+		m_sentinel.second = T();
+	}
+
+	//
+	// Iterator support
+	//
+
+	inline value_type &Item( int64 h )
+	{
+		if ( h == k_nKeySentinel )
+		{
+			DbgAssert( m_bHasSentinel );
+			return m_sentinel;
+		}
+		DbgAssert( m_nCount > 0 && IsOccupied( h ) );
+		return m_vecSlots[ h & m_nMask ];
+	}
+	inline const value_type &Item( int64 h ) const { return const_cast<CSNPPacketNumRing<T> *>( this )->Item( h ); }
+
+	int64 NextHandle( int64 h ) const
+	{
+		if ( h == k_nKeySentinel )
+			return m_nCount > 0 ? m_nHead : k_nHandleEnd;
+		Assert( h != k_nHandleEnd );
+		if ( h >= m_nTail )
+			return k_nHandleEnd;
+		return FindNextOccupied( h );
+	}
+
+	int64 PrevHandle( int64 h ) const
+	{
+		if ( h == k_nHandleEnd )
+		{
+			if ( m_nCount > 0 )
+				return m_nTail;
+			Assert( m_bHasSentinel );
+			return k_nKeySentinel;
+		}
+		Assert( h != k_nKeySentinel );
+		if ( h <= m_nHead )
+		{
+			Assert( m_bHasSentinel );
+			return k_nKeySentinel;
+		}
+		return FindPrevOccupied( h );
+	}
+
+private:
+	static constexpr int64 k_nMinCapacity = 64; // Must be power of two, and at least 64
+
+	value_type m_sentinel;
+	bool m_bHasSentinel = false;
+	int m_nCount = 0; // Not including the sentinel
+	int64 m_nHead = 0; // Lowest packet number in the ring.  Only valid if m_nCount > 0
+	int64 m_nTail = 0; // Highest packet number in the ring.  Only valid if m_nCount > 0
+	int64 m_nMask = 0;
+	std_vector<value_type> m_vecSlots;
+	std_vector<uint64> m_vecOccupied;
+
+	inline int64 FirstHandle() const
+	{
+		if ( m_bHasSentinel )
+			return k_nKeySentinel;
+		return m_nCount > 0 ? m_nHead : k_nHandleEnd;
+	}
+
+	inline bool IsOccupied( int64 nKey ) const
+	{
+		const int64 idx = nKey & m_nMask;
+		return ( m_vecOccupied[ idx >> 6 ] >> ( idx & 63 ) ) & 1;
+	}
+
+	// Return the lowest occupied packet number > nKey.  nKey must be < m_nTail
+	int64 FindNextOccupied( int64 nKey ) const
+	{
+		int64 k = nKey+1;
+		for (;;)
+		{
+			const int64 idx = k & m_nMask;
+			const uint64 bits = m_vecOccupied[ idx >> 6 ] >> ( idx & 63 );
+			if ( bits )
+				return k + FindLeastSignificantBit64( bits );
+			k += 64 - ( idx & 63 );
+			DbgAssert( k <= m_nTail );
+		}
+	}
+
+	// Return the highest occupied packet number < nKey.  nKey must be > m_nHead
+	int64 FindPrevOccupied( int64 nKey ) const
+	{
+		int64 k = nKey-1;
+		for (;;)
+		{
+			const int64 idx = k & m_nMask;
+			const uint64 bits = m_vecOccupied[ idx >> 6 ] << ( 63 - ( idx & 63 ) );
+			if ( bits )
+				return k - ( 63 - FindMostSignificantBit64( bits ) );
+			k -= ( idx & 63 ) + 1;
+			DbgAssert( k >= m_nHead );
+		}
+	}
+
+	// Make sure the ring can hold a span of at least nSpan packet numbers
+	void Grow( int64 nSpan )
+	{
+		int64 nCapacity = std::max( (int64)m_vecSlots.size(), k_nMinCapacity );
+		while ( nCapacity < nSpan )
+			nCapacity *= 2;
+
+		std_vector<value_type> vecSlots( (size_t)nCapacity );
+		std_vector<uint64> vecOccupied( (size_t)( nCapacity >> 6 ), 0 );
+		const int64 nMask = nCapacity-1;
+		if ( m_nCount > 0 )
+		{
+			for ( int64 k = m_nHead ; ; k = FindNextOccupied( k ) )
+			{
+				const int64 idx = k & nMask;
+				vecSlots[ idx ] = std::move( m_vecSlots[ k & m_nMask ] );
+				vecOccupied[ idx >> 6 ] |= uint64(1) << ( idx & 63 );
+				if ( k == m_nTail )
+					break;
+			}
+		}
+		m_vecSlots.swap( vecSlots );
+		m_vecOccupied.swap( vecOccupied );
+		m_nMask = nMask;
+	}
+};
+
+/// Small map of items keyed by packet number, with (a subset of) the std::map
+/// interface.  Used where we expect only a handful of items and insertion
+/// and lookup happen near the end.  Items are kept in a doubly-linked list,
+/// ordered by key, inside a single contiguous array, so after the first few
+/// inserts there are no more allocations.  Lookup scans from the end, so
+/// it's O(n), but for the sizes we deal with this beats chasing tree nodes.
+///
+/// Iterator handles are the index of the node in the array.
+template <typename T>
+class CSNPPacketNumList
+{
+public:
+	typedef std::pair<int64,T> value_type;
+	typedef CSNPContainerIterator<CSNPPacketNumList<T>, value_type > iterator;
+	typedef CSNPContainerIterator<const CSNPPacketNumList<T>, const value_type > const_iterator;
+
+	static constexpr int64 k_nHandleEnd = -1;
+
+	inline bool empty() const { return m_nCount == 0; }
+	inline size_t size() const { return (size_t)m_nCount; }
+
+	inline iterator begin() { return iterator( this, m_idxHead ); }
+	inline iterator end() { return iterator( this, k_nHandleEnd ); }
+	inline const_iterator begin() const { return const_iterator( this, m_idxHead ); }
+	inline const_iterator end() const { return const_iterator( this, k_nHandleEnd ); }
+
+	/// Last item.  (List must not be empty)
+	inline value_type &back() { Assert( m_nCount > 0 ); return m_vecNodes[ m_idxTail ].m_item; }
+	inline const value_type &back() const { Assert( m_nCount > 0 ); return m_vecNodes[ m_idxTail ].m_item; }
+
+	/// Locate first item with a key > nKey
+	iterator upper_bound( int64 nKey )
+	{
+		int idx = FindLastNotAfter( nKey );
+		return iterator( this, idx < 0 ? m_idxHead : m_vecNodes[ idx ].m_idxNext );
+	}
+
+	std::pair<iterator,bool> insert( const value_type &x )
+	{
+		const int idxPrev = FindLastNotAfter( x.first );
+		if ( idxPrev >= 0 && m_vecNodes[ idxPrev ].m_item.first == x.first )
+			return std::pair<iterator,bool>( iterator( this, idxPrev ), false );
+
+		int idx = m_idxFree;
+		if ( idx >= 0 )
+		{
+			m_idxFree = m_vecNodes[ idx ].m_idxNext;
+		}
+		else
+		{
+			idx = len( m_vecNodes );
+			m_vecNodes.resize( idx+1 );
+		}
+
+		Node &node = m_vecNodes[ idx ];
+		node.m_item = x;
+		node.m_idxPrev = idxPrev;
+		if ( idxPrev < 0 )
+		{
+			node.m_idxNext = m_idxHead;
+			m_idxHead = idx;
+		}
+		else
+		{
+			node.m_idxNext = m_vecNodes[ idxPrev ].m_idxNext;
+			m_vecNodes[ idxPrev ].m_idxNext = idx;
+		}
+		if ( node.m_idxNext < 0 )
+			m_idxTail = idx;
+		else
+			m_vecNodes[ node.m_idxNext ].m_idxPrev = idx;
+		++m_nCount;
+		return std::pair<iterator,bool>( iterator( this, idx ), true );
+	}
+
+	/// Remove the item, and return the item after it
+	iterator erase( iterator it )
+	{
+		const int idx = (int)it.m_h;
+		Assert( idx >= 0 && idx < len( m_vecNodes ) );
+		Node &node = m_vecNodes[ idx ];
+		const int idxNext = node.m_idxNext;
+		if ( node.m_idxPrev < 0 )
+			m_idxHead = idxNext;
+		else
+			m_vecNodes[ node.m_idxPrev ].m_idxNext = idxNext;
+		if ( idxNext < 0 )
+			m_idxTail = node.m_idxPrev;
+		else
+			m_vecNodes[ idxNext ].m_idxPrev = node.m_idxPrev;
+		node.m_idxNext = m_idxFree;
+		m_idxFree = idx;
+		--m_nCount;
+		return iterator( this, idxNext );
+	}
+
+	/// Remove everything.  Memory is retained
+	void clear()
+	{
+		m_vecNodes.clear();
+		m_idxHead = m_idxTail = m_idxFree = -1;
+		m_nCount = 0;
+	}
+
+	//
+	// Iterator support
+	//
+
+	inline value_type &Item( int64 h ) { DbgAssert( h >= 0 ); return m_vecNodes[ (size_t)h ].m_item; }
+	inline const value_type &Item( int64 h ) const { DbgAssert( h >= 0 ); return m_vecNodes[ (size_t)h ].m_item; }
+	inline int64 NextHandle( int64 h ) const { Assert( h >= 0 ); return m_vecNodes[ (size_t)h ].m_idxNext; }
+	inline int64 PrevHandle( int64 h ) const { return h < 0 ? m_idxTail : m_vecNodes[ (size_t)h ].m_idxPrev; }
+
+private:
+	struct Node
+	{
+		value_type m_item;
+		int m_idxPrev;
+		int m_idxNext;
+	};
+	std_vector<Node> m_vecNodes;
+	int m_idxHead = -1;
+	int m_idxTail = -1;
+	int m_idxFree = -1;
+	int m_nCount = 0;
+
+	// Locate the last node with key <= nKey, or -1 if none
+	int FindLastNotAfter( int64 nKey ) const
+	{
+		int idx = m_idxTail;
+		while ( idx >= 0 && m_vecNodes[ idx ].m_item.first > nKey )
+			idx = m_vecNodes[ idx ].m_idxPrev;
+		return idx;
+	}
+};
+
 /// A packet that has been sent but we don't yet know if was received
-/// or dropped.  These are kept in an ordered map keyed by packet number.
+/// or dropped.  These are kept in a ring keyed by packet number.
 /// (Hence the packet number not being a member)  When we receive an ACK,
 /// we remove packets from this list.
 struct SNPInFlightPacket_t
 {
-	//
-	// FIXME - Could definitely pack this structure better.  And maybe
-	//         worth it to optimize cache
-	//
-
 	/// Local timestamp when we sent it
 	SteamNetworkingMicroseconds m_usecWhenSent;
 
+	/// Transport used to send
+	CConnectionTransport *m_pTransport;
+
+	/// Delivery rate sampling state at the time we sent this packet.
+	/// The times are stored relative to m_usecWhenSent, to keep this
+	/// structure small.  See SSendRateData::OnPacketSent
+	int64 m_nDeliveredAtSend = 0;
+	uint32 m_usecSinceDeliveredTimeAtSend = 0;
+	uint32 m_usecSinceFirstSentTimeAtSend = 0;
+
+	/// Size on the wire.  0 for the sentinel
+	uint16 m_cbPkt = 0;
+
 	/// Did we get an ack block from peer that explicitly marked this
 	/// packet as being skipped?  Note that we might subsequently get an
 	/// an ack for this same packet, that's OK!
 	bool m_bNack;
 
-	/// Transport used to send
-	CConnectionTransport *m_pTransport;
+	/// We had nothing else to send when this went out
+	bool m_bAppLimited = false;
 
 	/// Reliable segments that were sent.  We might have multiple of
 	/// these either due to multiple lanes or retransmission.
@@ -304,6 +767,164 @@ struct SSendRateData
 	/// Last time that we added tokens to m_flTokenBucket
 	SteamNetworkingMicroseconds m_usecTokenBucketTime = 0;
 
+	/// While we are handing a packet to a transport that lets the kernel
+	/// pace it, the number of bytes we may run the token bucket into
+	/// debt, because the packet will be held until the tokens are
+	/// available.  (See k_ESteamNetworkingConfig_SendTxTimeHorizon.)
+	/// Otherwise 0.
+	float m_flSendAheadAllowance = 0;
+
+	/// Bytes in packets that we have sent, and that have not yet been
+	/// acked or declared lost
+	int64 m_cbInFlight = 0;
+
+	/// Limit on m_cbInFlight.  This is the estimated bandwidth delay
+	/// product, times a gain.  INT64_MAX if bandwidth estimation is disabled.
+	/// See SNP_ClampSendRate
+	int64 m_cbInFlightCap = INT64_MAX;
+
+	/// True if we have enough data in flight, and should wait for acks before sending more
+	inline bool BInFlightCapped() const { return m_cbInFlight >= m_cbInFlightCap; }
+
+	/// True if we have the bandwidth to put data into a packet now
+	inline bool BCanSendData() const { return m_flTokenBucket + m_flSendAheadAllowance >= 0.0f && !BInFlightCapped(); }
+
+	//
+	// Bandwidth estimation.  This is modeled on BBR:
+	// https://datatracker.ietf.org/doc/html/draft-cardwell-iccrg-bbr-congestion-control
+	// We measure the delivery rate from acks, keep a windowed max of
+	// that as the bottleneck bandwidth estimate, and pace at a multiple
+	// of it that depends on what phase we are in.  As in BBR, the data
+	// in flight is also capped to a multiple of the estimated bandwidth
+	// delay product, so that we don't keep filling a queue when the
+	// estimate is too high.  (m_cbInFlightCap)  We also borrow the loss
+	// response from BBRv2: a round trip with heavy loss places a ceiling
+	// on the bandwidth we use, until we next probe up.
+	//
+
+	enum EBBRState
+	{
+		k_eBBRState_Startup, // Exponential growth until the delivery rate stops increasing
+		k_eBBRState_Drain, // Pace slowly, to drain the queue we built during startup
+		k_eBBRState_ProbeBW, // Steady state.  Cycle pacing gain to probe for more bandwidth
+		k_eBBRState_ProbeRTT, // Pace slowly to drain queues and get a fresh min RTT measurement
+	};
+	EBBRState m_eBBRState = k_eBBRState_Startup;
+
+	/// Current pacing gain, applied to the bottleneck bandwidth estimate
+	float m_flPacingGain = 1.0f;
+
+	/// Bottleneck bandwidth estimate, in bytes per second.  Max of
+	/// m_arBtlBwFilter.
+	float m_flBtlBw = 64*1024;
+
+	/// Windowed max filter.  Max delivery rate sample observed in each of
+	/// the last k_nBtlBwFilterSlots slots.  A slot is one round trip, but
+	/// not shorter than a minimum duration, so that the window doesn't
+	/// become uselessly short on a LAN.
+	static constexpr int k_nBtlBwFilterSlots = 10;
+	float m_arBtlBwFilter[ k_nBtlBwFilterSlots ] = {};
+	int64 m_nBtlBwFilterSlot = 0;
+	SteamNetworkingMicroseconds m_usecBtlBwFilterSlotStart = 0;
+
+	/// Ceiling on bandwidth due to recent loss.  0 if none
+	float m_flBwLo = 0.0f;
+
+	/// Current bandwidth estimate, taking into account any loss ceiling
+	inline float BandwidthEstimate() const { return m_flBwLo > 0.0f ? std::min( m_flBtlBw, m_flBwLo ) : m_flBtlBw; }
+
+	/// Total bytes that have been acked, and the time that changed
+	int64 m_nDelivered = 0;
+	SteamNetworkingMicroseconds m_usecDeliveredTime = 0;
+
+	/// Send time of the most recently sent packet that has been acked
+	SteamNetworkingMicroseconds m_usecFirstSentTime = 0;
+
+	/// Round trip counter.  A round ends when a packet that was sent after
+	/// the previous round ended gets acked.
+	int64 m_nRoundCount = 0;
+	int64 m_nNextRoundDelivered = 0;
+
+	/// Stats for the current round
+	int64 m_nRoundStartDelivered = 0;
+	int64 m_nLostInRound = 0;
+	float m_flRoundMaxDeliveryRate = 0.0f;
+
+	/// Min RTT, and the time we last measured it
+	SteamNetworkingMicroseconds m_usecMinRTT = 0;
+	SteamNetworkingMicroseconds m_usecMinRTTStamp = 0;
+
+	/// Startup: detect when the delivery rate stops growing
+	float m_flFullBtlBw = 0.0f;
+	int m_nFullBtlBwRounds = 0;
+	bool m_bFilledPipe = false;
+
+	/// Drain: the round we entered it
+	int64 m_nDrainStartRound = 0;
+
+	/// ProbeBW: which phase of the gain cycle we are in, and when it started
+	int m_idxProbeBWCycle = 0;
+	SteamNetworkingMicroseconds m_usecProbeBWCycleStamp = 0;
+
+	/// ProbeRTT: when we can leave, and the lowest RTT we saw while in it
+	SteamNetworkingMicroseconds m_usecProbeRTTDone = 0;
+	int64 m_nProbeRTTRound = 0;
+	SteamNetworkingMicroseconds m_usecProbeRTTMin = 0;
+
+	/// The newest packet acked in the ack frame we are currently processing
+	struct RateSample_t
+	{
+		int64 m_nPriorDelivered;
+		SteamNetworkingMicroseconds m_usecPriorDeliveredTime;
+		SteamNetworkingMicroseconds m_usecPriorFirstSentTime;
+		SteamNetworkingMicroseconds m_usecSent;
+		bool m_bAppLimited;
+		bool m_bValid = false;
+	};
+	RateSample_t m_rateSample;
+
+	/// Reset the model, using an initial guess at the bandwidth
+	void InitBandwidthEstimate( float flInitialRate, SteamNetworkingMicroseconds usecNow );
+
+	/// Stamp a packet with the delivery rate sampling state, as we send it
+	void OnPacketSent( SNPInFlightPacket_t &pkt, int cbPkt, bool bNothingInFlight, bool bAppLimited );
+
+	/// Called for each packet in an ack frame that is acked
+	void OnPacketAcked( const SNPInFlightPacket_t &pkt, SteamNetworkingMicroseconds usecNow );
+
+	/// Called when we decide a packet was lost
+	void OnPacketLost( const SNPInFlightPacket_t &pkt );
+
+	/// Called for each RTT measurement (with the peer's ack delay removed)
+	void OnRTTSample( SteamNetworkingMicroseconds usecRTT, SteamNetworkingMicroseconds usecNow );
+
+	/// Called after we finish processing an ack frame.  Takes a delivery
+	/// rate sample and updates the bandwidth model.
+	void OnAckFrameProcessed( SteamNetworkingMicroseconds usecNow );
+
+	/// Ack aggregation.  The peer batches up acks, so we need to keep
+	/// sending while we wait on them.  We measure how much more data was
+	/// acked than the bandwidth estimate would predict, since the start of
+	/// the current "epoch" (which restarts when acks fall behind the
+	/// estimate), and keep a windowed max, using the same slots as the
+	/// bandwidth filter.  This is what BBR calls "extra_acked".
+	SteamNetworkingMicroseconds m_usecAckEpochStart = 0;
+	int64 m_cbAckEpochAcked = 0;
+	int64 m_nDeliveredLastAckFrame = 0;
+	int64 m_arExtraAckedFilter[ k_nBtlBwFilterSlots ] = {};
+
+	/// Current extra_acked estimate.  Max of m_arExtraAckedFilter
+	inline int64 ExtraAcked() const
+	{
+		int64 cbMax = 0;
+		for ( int64 cb: m_arExtraAckedFilter )
+			cbMax = std::max( cbMax, cb );
+		return cbMax;
+	}
+
+	/// Estimated bandwidth delay product, in bytes.  0 if we don't have an RTT sample yet
+	inline int64 EstimateBDP( float flBandwidth ) const { return (int64)( flBandwidth * m_usecMinRTT * 1e-6f ); }
+
 	/// Calculate time until we could send our next packet, checking our token
 	/// bucket and the current send rate
 	SteamNetworkingMicroseconds CalcTimeUntilNextSend() const
@@ -421,6 +1042,31 @@ struct SSNPSenderState
 	int m_cbSentUnackedReliable = 0;
 	inline int PendingBytesTotal() const { return m_cbPendingUnreliable + m_cbPendingReliable; }
 
+	/// Forward error correction state for one lane
+	struct FECLane
+	{
+		/// Message we are currently sending, and the XOR of the
+		/// segments we have sent so far.
+		int64 m_nMsgNum = 0;
+		int m_nSegments = 0;
+		int m_cbParity = 0;
+		uint8 m_parity[ k_cbSteamNetworkingSocketsMaxEncryptedPayloadSend ];
+
+		/// Parity for a finished message, waiting to be sent.
+		/// m_nPendingMsgNum is 0 if there isn't any.
+		int64 m_nPendingMsgNum = 0;
+		int m_nPendingSegments = 0;
+		int m_cbPendingMsgSize = 0;
+		int m_cbPendingParity = 0;
+		uint8 m_pendingParity[ k_cbSteamNetworkingSocketsMaxEncryptedPayloadSend ];
+	};
+
+	/// FEC state, indexed by lane.  Empty unless FEC has been used
+	std_vector<FECLane> m_vecFECLanes;
+
+	/// Number of lanes with parity waiting to be sent
+	int m_nFECParityPending = 0;
+
 	// Stats.  FIXME - move to LinkStatsEndToEnd and track rate counters
 	int64 m_nMessagesSentReliable = 0;
 	int64 m_nMessagesSentUnreliable = 0;
@@ -428,12 +1074,12 @@ struct SSNPSenderState
 	/// List of packets that we have sent but don't know whether they were received or not.
 	/// We keep a dummy sentinel at the head of the list, with a negative packet number.
 	/// This vastly simplifies the processing.
-	std_map<int64,SNPInFlightPacket_t> m_mapInFlightPacketsByPktNum;
+	CSNPPacketNumRing<SNPInFlightPacket_t> m_mapInFlightPacketsByPktNum;
 
 	/// The next unacked packet that should be timed out and implicitly NACKed,
 	/// if we don't receive an ACK in time.  Will be m_mapInFlightPacketsByPktNum.end()
 	/// if we don't have any in flight packets that we are waiting on.
-	std_map<int64,SNPInFlightPacket_t>::iterator m_itNextInFlightPacketToTimeout;
+	CSNPPacketNumRing<SNPInFlightPacket_t>::iterator m_itNextInFlightPacketToTimeout;
 
 	/// Reliable segments that have been sent at least once and either
 	/// have not yet been acked, or have references by in-flight packets
@@ -477,24 +1123,166 @@ struct SSNPSenderState
 	#endif
 };
 
-struct SSNPRecvUnreliableSegmentKey
+struct SSNPRecvUnreliableSegmentData
 {
-	int64 m_nMsgNum;
-	int m_nOffset;
+	int m_cbSegSize = -1;
+	bool m_bLast = false;
+
+	// Only used for a parity block
+	int m_nParitySegments = 0;
+	int m_cbParityMsgSize = 0;
+
+	char m_buf[ k_cbMaxUnreliableSegmentSizeRecv ];
+};
+
+/// Unreliable message segments that we have received, while we wait for the
+/// rest of the message.  The number of segments we buffer is capped at a small
+/// number, so they live in a fixed slab of slots, allocated the first time we
+/// need it and then reused.  The keys are kept in small separate arrays, which
+/// are cheap to scan.  Receiving fragmented messages doesn't touch the heap.
+class SSNPRecvUnreliableSegmentSlab
+{
+public:
+	enum { k_nCapacity = k_nMaxBufferedUnreliableSegments+1 };
 
-	inline bool operator<(const SSNPRecvUnreliableSegmentKey &x) const
+	/// An entry for a message, as returned by GetMessageSegments
+	struct Segment
 	{
-		if ( m_nMsgNum < x.m_nMsgNum ) return true;
-		if ( m_nMsgNum > x.m_nMsgNum ) return false;
-		return m_nOffset < x.m_nOffset;
-	}
+		int m_nOffset;
+		SSNPRecvUnreliableSegmentData *m_pData;
+	};
+
+	SSNPRecvUnreliableSegmentSlab();
+	SSNPRecvUnreliableSegmentSlab( SSNPRecvUnreliableSegmentSlab &&x );
+	SSNPRecvUnreliableSegmentSlab &operator=( SSNPRecvUnreliableSegmentSlab &&x );
+	SSNPRecvUnreliableSegmentSlab( const SSNPRecvUnreliableSegmentSlab & ) = delete;
+	SSNPRecvUnreliableSegmentSlab &operator=( const SSNPRecvUnreliableSegmentSlab & ) = delete;
+	~SSNPRecvUnreliableSegmentSlab() { Clear(); }
+
+	inline int Count() const { return m_nCount; }
+	inline bool Full() const { return m_nCount >= k_nCapacity; }
+
+	/// Locate the entry with the specified key.  Returns nullptr if not found
+	SSNPRecvUnreliableSegmentData *Find( int64 nMsgNum, int nOffset ) const;
+
+	/// Return true if we have any entries for the message
+	bool HasMessage( int64 nMsgNum ) const;
+
+	/// Add an entry.  The key must not already be present, and we must not be full.
+	/// The segment size is set to -1; the caller fills in the rest.
+	SSNPRecvUnreliableSegmentData *Insert( int64 nMsgNum, int nOffset );
+
+	/// Change the offset of an existing entry
+	void SetOffset( const SSNPRecvUnreliableSegmentData *pData, int nOffset );
+
+	/// Get all of the entries for a message (including any parity), sorted
+	/// by offset.  pOut must have room for k_nCapacity.  Returns the count.
+	int GetMessageSegments( int64 nMsgNum, Segment *pOut ) const;
+
+	/// Discard all entries for a message
+	void RemoveMessage( int64 nMsgNum );
+
+	/// Discard all entries for the oldest message.  Returns its message number
+	int64 RemoveOldestMessage();
+
+	/// Discard everything and free the slab
+	void Clear();
+
+private:
+	SSNPRecvUnreliableSegmentData *m_pSlots = nullptr;
+
+	// The first m_nCount entries are in use.  m_arSlot is a permutation of
+	// the slot indices; the entries past m_nCount are the free slots.
+	int m_nCount = 0;
+	int64 m_arMsgNum[ k_nCapacity ];
+	int m_arOffset[ k_nCapacity ];
+	uint8 m_arSlot[ k_nCapacity ];
+
+	void RemoveAt( int idx );
 };
 
-struct SSNPRecvUnreliableSegmentData
+/// Reliable data stream that we have received, but not yet parsed as
+/// reliable messages and dispatched.  The data is stored in fixed-size
+/// chunks, which are kept in a ring.  Growing at the end and consuming
+/// from the front are both cheap, no matter how much is buffered, and
+/// chunks are freed as soon as they are consumed.  (With a single
+/// contiguous buffer, we would need to move all of the remaining data
+/// every time we dispatched a message.)
+///
+/// Offsets are relative to the first byte in the buffer.
+class SSNPRecvReliableStreamBuffer
 {
-	int m_cbSegSize = -1;
-	bool m_bLast = false;
-	char m_buf[ k_cbMaxUnreliableSegmentSizeRecv ];
+public:
+	enum { k_cbChunk = 4096 };
+
+	SSNPRecvReliableStreamBuffer() {}
+	SSNPRecvReliableStreamBuffer( SSNPRecvReliableStreamBuffer &&x );
+	SSNPRecvReliableStreamBuffer &operator=( SSNPRecvReliableStreamBuffer &&x );
+	SSNPRecvReliableStreamBuffer( const SSNPRecvReliableStreamBuffer & ) = delete;
+	SSNPRecvReliableStreamBuffer &operator=( const SSNPRecvReliableStreamBuffer & ) = delete;
+	~SSNPRecvReliableStreamBuffer() { Clear(); }
+
+	inline int Size() const { return m_cbSize; }
+	inline bool Empty() const { return m_cbSize == 0; }
+
+	/// Grow the buffer to the specified size.  New bytes are uninitialized.
+	void Extend( int cbNewSize );
+
+	/// Copy data into / out of the buffer
+	void Write( int nOffset, const void *pData, int cbData );
+	void Read( int nOffset, void *pOut, int cbData ) const;
+
+	/// Get a pointer to the byte at the specified offset, and the number of
+	/// bytes from there that are contiguous in memory
+	const uint8 *Peek( int nOffset, int &cbContiguous ) const;
+
+	/// Discard bytes from the front
+	void PopFront( int cbDiscard );
+
+	/// Free everything
+	void Clear();
+
+private:
+	uint8 **m_ppChunkRing = nullptr; // Size is always a power of two
+	int m_nChunkRingSize = 0;
+	int m_idxFirstChunk = 0;
+	int m_nChunks = 0;
+	int m_nFrontOffset = 0; // Offset of the first byte within the first chunk
+	int m_cbSize = 0;
+	uint8 *m_pSpareChunk = nullptr; // So we don't hit the heap every time we cross a chunk boundary
+
+	inline uint8 *&Chunk( int idx ) const { return m_ppChunkRing[ ( m_idxFirstChunk + idx ) & ( m_nChunkRingSize-1 ) ]; }
+	void FreeChunk( uint8 *pChunk );
+};
+
+/// Set of non-overlapping half-open intervals [begin,end), sorted by position.
+/// Used to track the gaps in the reliable stream.  The number of gaps is capped at
+/// a small number, so a sorted array is much cheaper than a tree.
+class SSNPIntervalSet
+{
+public:
+	struct Interval
+	{
+		int64 m_nBegin;
+		int64 m_nEnd;
+	};
+
+	inline bool empty() const { return m_vecIntervals.empty(); }
+	inline int size() const { return (int)m_vecIntervals.size(); }
+	inline const Interval &front() const { return m_vecIntervals[0]; }
+	inline const Interval &back() const { return m_vecIntervals[ m_vecIntervals.size()-1 ]; }
+	inline const Interval &operator[]( int idx ) const { return m_vecIntervals[ idx ]; }
+	inline void clear() { m_vecIntervals.clear(); }
+
+	/// Add an interval after all of the existing ones
+	void AddAtEnd( int64 nBegin, int64 nEnd );
+
+	/// Remove the range [nBegin,nEnd) from the set.  If this would split an interval
+	/// in two and we already have nMaxIntervals, nothing is changed and we return false.
+	bool Subtract( int64 nBegin, int64 nEnd, int nMaxIntervals );
+
+private:
+	vstd::small_vector<Interval,4> m_vecIntervals;
 };
 
 struct SSNPPacketGap
@@ -503,7 +1291,19 @@ struct SSNPPacketGap
 	SteamNetworkingMicroseconds m_usecWhenReceivedPktBefore; // So we can send RTT data in our acks
 	SteamNetworkingMicroseconds m_usecWhenAckPrior; // We need to send an ack for everything with lower packet numbers than this gap by this time.  (Earlier is OK.)
 	SteamNetworkingMicroseconds m_usecWhenOKToNack; // Don't give up on the gap being filed before this time
+	SteamNetworkingMicroseconds m_usecWhenDetected; // When we first noticed these packets were missing.  So we can learn how long reordered packets take to arrive
+};
+
+/// A packet gap that we stopped tracking, because the sender told us to
+/// stop waiting for it.  (Usually because we NACKed it.)  We remember a
+/// few of these, so that if the packets show up late, we can learn from it.
+struct SSNPExpiredPacketGap
+{
+	int64 m_nBegin;
+	int64 m_nEnd;
+	SteamNetworkingMicroseconds m_usecWhenDetected;
 };
+constexpr int k_nMaxExpiredPacketGaps = 8;
 
 struct SSNPReceiverState
 {
@@ -518,15 +1318,13 @@ struct SSNPReceiverState
 	{
 
 		/// Unreliable message segments that we have received.  When an unreliable message
-		/// needs to be fragmented, we store the pieces here.  NOTE: it might be more efficient
-		/// to use a simpler container, with worse O(), since this should ordinarily be
-		/// a pretty small list.
-		std_map<SSNPRecvUnreliableSegmentKey,SSNPRecvUnreliableSegmentData> m_mapUnreliableSegments;
+		/// needs to be fragmented, we store the pieces here.
+		SSNPRecvUnreliableSegmentSlab m_unreliableSegments;
 
 		/// The highest message number we have seen so far.
 		int64 m_nHighestSeenMsgNum = 0;
 
-		/// Stream position of the first byte in m_bufReliableData.  Remember that the first byte
+		/// Stream position of the first byte in m_bufReliableStream.  Remember that the first byte
 		/// in the reliable stream is actually at position 1, not 0
 		int64 m_nReliableStreamPos = 1;
 
@@ -536,16 +1334,11 @@ struct SSNPReceiverState
 		/// Reliable data stream that we have received but not yet
 		/// parsed as reliable messages and dispatched them.  This
 		/// might have gaps in it!
-		std_vector<byte> m_bufReliableStream;
+		SSNPRecvReliableStreamBuffer m_bufReliableStream;
 
-		/// Gaps in the reliable data.  These are created when we receive reliable data that
-		/// is beyond what we expect next.  Since these must never overlap, we store them
-		/// using begin as the key and end as the value.
-		///
-		/// !SPEED! We should probably use a small fixed-sized, sorted vector here,
-		/// since in most cases the list will be small, and the cost of dynamic memory
-		/// allocation will be way worse than O(n) insertion/removal.
-		std_map<int64,int64> m_mapReliableStreamGaps;
+		/// Gaps in the reliable data, by stream position.  These are created when we
+		/// receive reliable data that is beyond what we expect next.
+		SSNPIntervalSet m_setReliableStreamGaps;
 	};
 	#if STEAMNETWORKINGSOCKETS_MAX_LANES > 4
 		std_vector<Lane> m_vecLanes;
@@ -571,11 +1364,7 @@ struct SSNPReceiverState
 	///   INT64_MAX means nothing scheduled).  Remember, our wire
 	///   protocol cannot report on packet N without also reporting
 	///   on all packets numbered < N.
-	///
-	/// !SPEED! We should probably use a small fixed-sized, sorted vector here,
-	/// since in most cases the list will be small, and the cost of dynamic memory
-	/// allocation will be way worse than O(n) insertion/removal.
-	std_map<int64,SSNPPacketGap> m_mapPacketGaps;
+	CSNPPacketNumList<SSNPPacketGap> m_mapPacketGaps;
 
 	/// Oldest packet sequence number we need to ack to our peer
 	int64 m_nMinPktNumToSendAcks = 0;
@@ -604,13 +1393,13 @@ struct SSNPReceiverState
 	/// bookkeeping is to figure out which acks we *need* to send,
 	/// and which acks we cannot send yet, so we can make optimal
 	/// decisions.
-	std_map<int64,SSNPPacketGap>::iterator m_itPendingAck;
+	CSNPPacketNumList<SSNPPacketGap>::iterator m_itPendingAck;
 
 	/// Iterator into m_mapPacketGaps.  If != the sentinel,
 	/// we will avoid reporting on the dropped packets in this
 	/// gap (and all higher numbered packets), because we are
 	/// waiting in the hopes that they will arrive out of order.
-	std_map<int64,SSNPPacketGap>::iterator m_itPendingNack;
+	CSNPPacketNumList<SSNPPacketGap>::iterator m_itPendingNack;
 
 	/// Queue a flush of ALL acks (and NACKs!) by the given time.
 	/// If anything is scheduled to happen earlier, that schedule
@@ -642,6 +1431,26 @@ struct SSNPReceiverState
 	/// Setup the sentinel
 	void InitPacketGapMap( int64 nMaxRecvPktNum, SteamNetworkingMicroseconds usecRecvTime );
 
+	/// Histogram of how long it took for packets that arrived out of
+	/// order to fill in a gap, measured from when the gap was detected.
+	uint16 m_arReorderDelayHistogram[ k_nReorderDelayBuckets ] = {};
+	int m_nReorderDelaySamples = 0;
+
+	/// Add a sample to the reorder delay histogram
+	void RecordReorderDelay( SteamNetworkingMicroseconds usecDelay );
+
+	/// Recently expired packet gaps.  If we NACK too early, the sender will
+	/// stop waiting for those packets, and we need these to learn the delay.
+	SSNPExpiredPacketGap m_arExpiredPacketGaps[ k_nMaxExpiredPacketGaps ] = {};
+	int m_idxNextExpiredPacketGap = 0;
+	void RememberExpiredPacketGap( int64 nBegin, int64 nEnd, SteamNetworkingMicroseconds usecWhenDetected );
+	void RecordLateExpiredPacket( int64 nPktNum, SteamNetworkingMicroseconds usecNow );
+
+	/// How long should we wait for missing packets to arrive, before
+	/// we NACK them?  nPercentile is the percentage of reordered packets
+	/// we are willing to wait for.
+	SteamNetworkingMicroseconds GetNackDelay( int nPercentile ) const;
+
 	// Stats.  FIXME - move to LinkStatsEndToEnd and track rate counters
 	int64 m_nMessagesRecvReliable = 0;
 	int64 m_nMessagesRecvUnreliable = 0;
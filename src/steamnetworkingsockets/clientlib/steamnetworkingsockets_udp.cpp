@@ -3,6 +3,7 @@
 #include "steamnetworkingsockets_udp.h"
 #include "csteamnetworkingsockets.h"
 #include "crypto.h"
+#include <steam/steamnetworkingsockets.h>
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -74,20 +75,326 @@ void ReallyReportBadUDPPacket( const char *pszFrom, const char *pszMsgType, cons
 		} \
 	}
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// Handshake message codecs
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// https://protobuf.dev/programming-guides/encoding/
+enum EProtobufWireType
+{
+	k_EProtobufWireType_VarInt = 0,
+	k_EProtobufWireType_Fixed64 = 1,
+	k_EProtobufWireType_LengthDelimited = 2,
+	k_EProtobufWireType_Fixed32 = 5,
+};
+
+/// Walks the fields of a protobuf-encoded message, without allocating
+/// anything.  Once any read fails, m_bError is set and BNextField will
+/// return false.
+struct ProtobufFieldReader
+{
+	ProtobufFieldReader( const void *pData, int cbData )
+	: m_p( (const uint8 *)pData ), m_pEnd( (const uint8 *)pData + cbData ), m_bError( false ) {}
+
+	const uint8 *m_p;
+	const uint8 *const m_pEnd;
+	bool m_bError;
+
+	bool BReadVarInt( uint64 &x )
+	{
+		// Protobuf never uses more than 10 bytes.  (Unlike DeserializeVarInt,
+		// we have to assume that the data is hostile.)
+		x = 0;
+		for ( int nShift = 0 ; nShift < 70 && m_p < m_pEnd ; nShift += 7 )
+		{
+			uint8 b = *(m_p++);
+			x |= uint64( b & 0x7f ) << nShift;
+			if ( !( b & 0x80 ) )
+				return true;
+		}
+		m_bError = true;
+		return false;
+	}
+
+	bool BReadFixed32( uint32 &x )
+	{
+		if ( m_pEnd - m_p < 4 )
+		{
+			m_bError = true;
+			return false;
+		}
+		memcpy( &x, m_p, 4 );
+		x = LittleDWord( x );
+		m_p += 4;
+		return true;
+	}
+
+	bool BReadFixed64( uint64 &x )
+	{
+		if ( m_pEnd - m_p < 8 )
+		{
+			m_bError = true;
+			return false;
+		}
+		memcpy( &x, m_p, 8 );
+		x = LittleQWord( x );
+		m_p += 8;
+		return true;
+	}
+
+	/// Read the tag of the next field.  Returns false at the end of the
+	/// message, or if there's an error
+	bool BNextField( uint32 &nField, int &nWireType )
+	{
+		if ( m_bError || m_p >= m_pEnd )
+			return false;
+		uint64 nTag;
+		if ( !BReadVarInt( nTag ) )
+			return false;
+		nField = uint32( nTag >> 3 );
+		nWireType = int( nTag & 7 );
+		if ( nField == 0 || nTag > 0xffffffffu )
+		{
+			m_bError = true;
+			return false;
+		}
+		return true;
+	}
+
+	/// Skip the value of a field we don't know about, or that has
+	/// an unexpected type
+	void Skip( int nWireType )
+	{
+		uint64 x;
+		uint32 y;
+		switch ( nWireType )
+		{
+			case k_EProtobufWireType_VarInt: BReadVarInt( x ); return;
+			case k_EProtobufWireType_Fixed64: BReadFixed64( x ); return;
+			case k_EProtobufWireType_Fixed32: BReadFixed32( y ); return;
+			case k_EProtobufWireType_LengthDelimited:
+				if ( BReadVarInt( x ) )
+				{
+					if ( x > uint64( m_pEnd - m_p ) )
+						m_bError = true;
+					else
+						m_p += x;
+				}
+				return;
+		}
+
+		// Groups are deprecated, and none of our messages use them
+		m_bError = true;
+	}
+};
+
+static inline uint8 *SerializeFixed32Field( uint8 *p, uint32 nField, uint32 x )
+{
+	Assert( nField < 16 );
+	*(p++) = uint8( ( nField << 3 ) | k_EProtobufWireType_Fixed32 );
+	x = LittleDWord( x );
+	memcpy( p, &x, 4 );
+	return p+4;
+}
+
+static inline uint8 *SerializeFixed64Field( uint8 *p, uint32 nField, uint64 x )
+{
+	Assert( nField < 16 );
+	*(p++) = uint8( ( nField << 3 ) | k_EProtobufWireType_Fixed64 );
+	x = LittleQWord( x );
+	memcpy( p, &x, 8 );
+	return p+8;
+}
+
+static inline uint8 *SerializeVarIntField( uint8 *p, uint32 nField, uint32 x )
+{
+	Assert( nField < 16 );
+	*(p++) = uint8( ( nField << 3 ) | k_EProtobufWireType_VarInt );
+	return SerializeVarInt( p, x );
+}
+
+bool ChallengeRequestMsg_t::ParseFromArray( const void *pData, int cbData )
+{
+	*this = ChallengeRequestMsg_t();
+	ProtobufFieldReader r( pData, cbData );
+	uint32 nField;
+	int nWireType;
+	uint64 x;
+	while ( r.BNextField( nField, nWireType ) )
+	{
+		if ( nField == 1 && nWireType == k_EProtobufWireType_Fixed32 )
+			r.BReadFixed32( m_unConnectionID );
+		else if ( nField == 3 && nWireType == k_EProtobufWireType_Fixed64 )
+			r.BReadFixed64( m_ulMyTimestamp );
+		else if ( nField == 4 && nWireType == k_EProtobufWireType_VarInt )
+		{
+			if ( r.BReadVarInt( x ) )
+				m_nProtocolVersion = uint32( x );
+		}
+		else
+			r.Skip( nWireType );
+	}
+	return !r.m_bError;
+}
+
+uint8 *ChallengeRequestMsg_t::SerializeToArray( uint8 *p ) const
+{
+	p = SerializeFixed32Field( p, 1, m_unConnectionID );
+	p = SerializeFixed64Field( p, 3, m_ulMyTimestamp );
+	p = SerializeVarIntField( p, 4, m_nProtocolVersion );
+	return p;
+}
+
+bool ChallengeReplyMsg_t::ParseFromArray( const void *pData, int cbData )
+{
+	*this = ChallengeReplyMsg_t();
+	ProtobufFieldReader r( pData, cbData );
+	uint32 nField;
+	int nWireType;
+	uint64 x;
+	while ( r.BNextField( nField, nWireType ) )
+	{
+		if ( nField == 1 && nWireType == k_EProtobufWireType_Fixed32 )
+			r.BReadFixed32( m_unConnectionID );
+		else if ( nField == 2 && nWireType == k_EProtobufWireType_Fixed64 )
+			r.BReadFixed64( m_ulChallenge );
+		else if ( nField == 3 && nWireType == k_EProtobufWireType_Fixed64 )
+			r.BReadFixed64( m_ulYourTimestamp );
+		else if ( nField == 4 && nWireType == k_EProtobufWireType_VarInt )
+		{
+			if ( r.BReadVarInt( x ) )
+				m_nProtocolVersion = uint32( x );
+		}
+		else
+			r.Skip( nWireType );
+	}
+	return !r.m_bError;
+}
+
+uint8 *ChallengeReplyMsg_t::SerializeToArray( uint8 *p ) const
+{
+	p = SerializeFixed32Field( p, 1, m_unConnectionID );
+	p = SerializeFixed64Field( p, 2, m_ulChallenge );
+	p = SerializeFixed64Field( p, 3, m_ulYourTimestamp );
+	p = SerializeVarIntField( p, 4, m_nProtocolVersion );
+	return p;
+}
+
+bool ConnectRequestHeader_t::ParseFromArray( const void *pData, int cbData )
+{
+	*this = ConnectRequestHeader_t();
+	ProtobufFieldReader r( pData, cbData );
+	uint32 nField;
+	int nWireType;
+	while ( r.BNextField( nField, nWireType ) )
+	{
+		if ( nField == 1 && nWireType == k_EProtobufWireType_Fixed32 )
+			r.BReadFixed32( m_unClientConnectionID );
+		else if ( nField == 2 && nWireType == k_EProtobufWireType_Fixed64 )
+			r.BReadFixed64( m_ulChallenge );
+		else
+			r.Skip( nWireType );
+	}
+	return !r.m_bError;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // CSteamNetworkListenSocketDirectUDP
 //
 /////////////////////////////////////////////////////////////////////////////
 
+/// Number of connect requests admitted on all listen sockets that are still
+/// in the middle of the handshake.  (MaxPendingHandshakes)  Protected by
+/// the global lock, as are the other admission counters.
+static int s_nPendingHandshakes = 0;
+static int64 s_nConnectRequestsRateLimited = 0;
+static int64 s_nConnectRequestsOverBudget = 0;
+
+/// Pending handshakes, by source IP address.  (MaxPendingHandshakesPerIP)
+/// Addresses are removed when their count drops to zero.
+static CUtlHashMap<CIPAddress, int, std::equal_to<CIPAddress>, CIPAddress::Hash > s_mapPendingHandshakesByIP;
+
+/// Check if we have room in the pending handshake budget for another
+/// request from this address
+static bool BHavePendingHandshakeBudget( const CIPAddress &ip )
+{
+	const int nMaxPendingHandshakes = GlobalConfig::MaxPendingHandshakes.Get();
+	if ( nMaxPendingHandshakes > 0 && s_nPendingHandshakes >= nMaxPendingHandshakes )
+		return false;
+	const int nMaxPendingHandshakesPerIP = GlobalConfig::MaxPendingHandshakesPerIP.Get();
+	if ( nMaxPendingHandshakesPerIP > 0 )
+	{
+		int idx = s_mapPendingHandshakesByIP.Find( ip );
+		if ( idx != s_mapPendingHandshakesByIP.InvalidIndex() && s_mapPendingHandshakesByIP[ idx ] >= nMaxPendingHandshakesPerIP )
+			return false;
+	}
+	return true;
+}
+
+static void AddPendingHandshake( const CIPAddress &ip )
+{
+	++s_nPendingHandshakes;
+	int idx = s_mapPendingHandshakesByIP.Find( ip );
+	if ( idx == s_mapPendingHandshakesByIP.InvalidIndex() )
+		s_mapPendingHandshakesByIP.Insert( ip, 1 );
+	else
+		++s_mapPendingHandshakesByIP[ idx ];
+}
+
+static void RemovePendingHandshake( const CIPAddress &ip )
+{
+	Assert( s_nPendingHandshakes > 0 );
+	--s_nPendingHandshakes;
+	int idx = s_mapPendingHandshakesByIP.Find( ip );
+	if ( idx == s_mapPendingHandshakesByIP.InvalidIndex() )
+	{
+		Assert( false );
+		return;
+	}
+	if ( --s_mapPendingHandshakesByIP[ idx ] <= 0 )
+		s_mapPendingHandshakesByIP.RemoveAt( idx );
+}
+
+/// Max number of source addresses that a listen socket tracks for connect
+/// request rate limiting
+const int k_nMaxConnectRateLimitSources = 4096;
+
+/// A connect request that is being checked on a crypto worker thread,
+/// before we create a connection for it.  (IP_DeferConnectionAlloc)
+struct ConnectRequestVerifyJob_t : CryptoHandshakeVerifyJob_t
+{
+	CSteamNetworkListenSocketDirectUDP *m_pListenSocket = nullptr; // Cleared if the listen socket is destroyed
+	CMsgSteamSockets_UDP_ConnectRequest m_msg;
+	netadr_t m_adrFrom;
+	SteamNetworkingIdentity m_identityRemote;
+	int m_cbPkt = 0;
+	SteamNetworkingMicroseconds m_usecRecv = 0;
+
+	virtual void Finished() override
+	{
+		RemovePendingHandshake( m_adrFrom );
+		if ( m_pListenSocket )
+			m_pListenSocket->ConnectRequestVerified( *this );
+	}
+};
+
 CSteamNetworkListenSocketDirectUDP::CSteamNetworkListenSocketDirectUDP( CSteamNetworkingSockets *pSteamNetworkingSocketsInterface )
 : CSteamNetworkListenSocketBase( pSteamNetworkingSocketsInterface )
 {
 	m_pSock = nullptr;
+	m_usecLastPruneConnectRateLimit = 0;
 }
 
 CSteamNetworkListenSocketDirectUDP::~CSteamNetworkListenSocketDirectUDP()
 {
+	// Any requests still being checked will be discarded when they finish
+	for ( ConnectRequestVerifyJob_t *pJob: m_vecPendingConnectRequests )
+		pJob->m_pListenSocket = nullptr;
+	m_vecPendingConnectRequests.clear();
+
 	// Clean up socket, if any
 	if ( m_pSock )
 	{
@@ -127,7 +434,7 @@ bool CSteamNetworkListenSocketDirectUDP::BInit( const SteamNetworkingIPAddr &loc
 	}
 
 	m_pSock = new CSharedSocket;
-	if ( !m_pSock->BInit( localAddr, CRecvPacketCallback( ReceivedFromUnknownHost, this ), errMsg ) )
+	if ( !m_pSock->BInit( localAddr, CRecvPacketCallback( ReceivedFromUnknownHost, this ), errMsg, true ) )
 	{
 		delete m_pSock;
 		m_pSock = nullptr;
@@ -196,13 +503,14 @@ void CSteamNetworkListenSocketDirectUDP::ReceivedFromUnknownHost( const RecvPktI
 	}
 	else if ( *pPkt == k_ESteamNetworkingUDPMsg_ChallengeRequest )
 	{
-		ParsePaddedPacket( pPkt, cbPkt, CMsgSteamSockets_UDP_ChallengeRequest, msg )
+		ParsePaddedPacket( pPkt, cbPkt, ChallengeRequestMsg_t, msg )
 		pSock->Received_ChallengeRequest( msg, adrFrom, usecNow );
 	}
 	else if ( *pPkt == k_ESteamNetworkingUDPMsg_ConnectRequest )
 	{
-		ParseProtobufBody( pPkt+1, cbPkt-1, CMsgSteamSockets_UDP_ConnectRequest, msg )
-		pSock->Received_ConnectRequest( msg, adrFrom, cbPkt, usecNow );
+		// Don't parse the whole thing until we know it's worth the trouble
+		ParseProtobufBody( pPkt+1, cbPkt-1, ConnectRequestHeader_t, hdr )
+		pSock->Received_ConnectRequest( hdr, pPkt+1, cbPkt-1, adrFrom, cbPkt, usecNow );
 	}
 	else if ( *pPkt == k_ESteamNetworkingUDPMsg_ConnectionClosed )
 	{
@@ -252,9 +560,9 @@ inline uint16 GetChallengeTime( SteamNetworkingMicroseconds usecNow )
 	return uint16( usecNow >> 20 );
 }
 
-void CSteamNetworkListenSocketDirectUDP::Received_ChallengeRequest( const CMsgSteamSockets_UDP_ChallengeRequest &msg, const netadr_t &adrFrom, SteamNetworkingMicroseconds usecNow )
+void CSteamNetworkListenSocketDirectUDP::Received_ChallengeRequest( const ChallengeRequestMsg_t &msg, const netadr_t &adrFrom, SteamNetworkingMicroseconds usecNow )
 {
-	if ( msg.connection_id() == 0 )
+	if ( msg.m_unConnectionID == 0 )
 	{
 		ReportBadPacket( "ChallengeRequest", "Missing connection_id." );
 		return;
@@ -273,20 +581,28 @@ void CSteamNetworkListenSocketDirectUDP::Received_ChallengeRequest( const CMsgSt
 	uint64 nChallenge = GenerateChallenge( nTime, adrFrom );
 
 	// Send them a reply
-	CMsgSteamSockets_UDP_ChallengeReply msgReply;
-	msgReply.set_connection_id( msg.connection_id() );
-	msgReply.set_challenge( nChallenge );
-	msgReply.set_your_timestamp( msg.my_timestamp() );
-	msgReply.set_protocol_version( k_nCurrentProtocolVersion );
-	SendMsg( k_ESteamNetworkingUDPMsg_ChallengeReply, msgReply, adrFrom );
+	ChallengeReplyMsg_t msgReply;
+	msgReply.m_unConnectionID = msg.m_unConnectionID;
+	msgReply.m_ulChallenge = nChallenge;
+	msgReply.m_ulYourTimestamp = msg.m_ulMyTimestamp;
+	msgReply.m_nProtocolVersion = k_nCurrentProtocolVersion;
+	if ( !m_pSock )
+	{
+		Assert( false );
+		return;
+	}
+	uint8 pkt[ 1 + ChallengeReplyMsg_t::k_cbMaxSerializedSize ];
+	pkt[0] = k_ESteamNetworkingUDPMsg_ChallengeReply;
+	uint8 *pEnd = msgReply.SerializeToArray( pkt+1 );
+	m_pSock->BSendRawPacket( pkt, int( pEnd - pkt ), adrFrom );
 }
 
-void CSteamNetworkListenSocketDirectUDP::Received_ConnectRequest( const CMsgSteamSockets_UDP_ConnectRequest &msg, const netadr_t &adrFrom, int cbPkt, SteamNetworkingMicroseconds usecNow )
+void CSteamNetworkListenSocketDirectUDP::Received_ConnectRequest( const ConnectRequestHeader_t &hdr, const void *pMsgBody, int cbMsgBody, const netadr_t &adrFrom, int cbPkt, SteamNetworkingMicroseconds usecNow )
 {
 	SteamDatagramErrMsg errMsg;
 
 	// Make sure challenge was generated relatively recently
-	uint16 nTimeThen = uint32( msg.challenge() );
+	uint16 nTimeThen = uint32( hdr.m_ulChallenge );
 	uint16 nElapsed = GetChallengeTime( usecNow ) - nTimeThen;
 	if ( nElapsed > GetChallengeTime( 4*k_nMillion ) )
 	{
@@ -295,19 +611,50 @@ void CSteamNetworkListenSocketDirectUDP::Received_ConnectRequest( const CMsgStea
 	}
 
 	// Assuming we sent them this time value, re-create the challenge we would have sent them.
-	if ( GenerateChallenge( nTimeThen, adrFrom ) != msg.challenge() )
+	if ( GenerateChallenge( nTimeThen, adrFrom ) != hdr.m_ulChallenge )
 	{
 		ReportBadPacket( "ConnectRequest", "Incorrect challenge.  Could be spoofed." );
 		return;
 	}
 
-	uint32 unClientConnectionID = msg.client_connection_id();
+	uint32 unClientConnectionID = hdr.m_unClientConnectionID;
 	if ( unClientConnectionID == 0 )
 	{
 		ReportBadPacket( "ConnectRequest", "Missing connection ID" );
 		return;
 	}
 
+	// A retry of a request that we are still checking?
+	for ( const ConnectRequestVerifyJob_t *pJob: m_vecPendingConnectRequests )
+	{
+		if ( pJob->m_adrFrom == adrFrom && pJob->m_msg.client_connection_id() == unClientConnectionID )
+			return;
+	}
+
+	// Everything up to this point has been cheap, and we haven't kept any
+	// state.  Before we go any further, make sure we can afford it.  The
+	// challenge proves that they can receive packets at this address, so
+	// it's safe to charge the request to it.  Just drop requests that
+	// we don't have room for.  The client will retry.
+	if ( !BCheckConnectRateLimit( adrFrom, usecNow ) )
+	{
+		++s_nConnectRequestsRateLimited;
+		return;
+	}
+	if ( !BHavePendingHandshakeBudget( adrFrom ) )
+	{
+		++s_nConnectRequestsOverBudget;
+		return;
+	}
+
+	// OK, now it's worth deserializing the whole message
+	CMsgSteamSockets_UDP_ConnectRequest msg;
+	if ( !msg.ParseFromArray( pMsgBody, cbMsgBody ) )
+	{
+		ReportBadPacket( "ConnectRequest", "Protobuf parse failed." );
+		return;
+	}
+
 	// Parse out identity from the cert
 	SteamNetworkingIdentity identityRemote;
 	bool bIdentityInCert = true;
@@ -385,6 +732,121 @@ void CSteamNetworkListenSocketDirectUDP::Received_ConnectRequest( const CMsgStea
 		}
 	}
 
+	// Check their crypto before we create the connection?
+	if ( m_connectionConfig.IP_DeferConnectionAlloc.Get() && BQueueConnectRequestVerify( msg, adrFrom, identityRemote, cbPkt, usecNow ) )
+		return;
+
+	AcceptConnectRequest( msg, adrFrom, identityRemote, cbPkt, usecNow, nullptr );
+}
+
+bool CSteamNetworkListenSocketDirectUDP::BCheckConnectRateLimit( const netadr_t &adrFrom, SteamNetworkingMicroseconds usecNow )
+{
+	const int nRate = m_connectionConfig.IP_ConnectRateLimit.Get();
+	if ( nRate <= 0 )
+		return true;
+	const float flRate = (float)nRate;
+	const float flBurst = (float)m_connectionConfig.IP_ConnectRateLimitBurst.Get();
+
+	const CIPAddress &ipFrom = adrFrom;
+	int idx = m_mapConnectRateLimit.Find( ipFrom );
+	if ( idx == m_mapConnectRateLimit.InvalidIndex() )
+	{
+		// Table full?  Forget about sources that have been quiet long enough
+		// that their buckets have filled back up.  That's a linear scan, so
+		// don't do it too often.  If there's still no room, let the request
+		// through.  MaxPendingHandshakes still protects us.
+		if ( m_mapConnectRateLimit.Count() >= k_nMaxConnectRateLimitSources )
+		{
+			if ( usecNow < m_usecLastPruneConnectRateLimit + k_nMillion )
+				return true;
+			m_usecLastPruneConnectRateLimit = usecNow;
+			FOR_EACH_HASHMAP( m_mapConnectRateLimit, i )
+			{
+				if ( m_mapConnectRateLimit[ i ].BIsFull( usecNow, flRate ) )
+					m_mapConnectRateLimit.RemoveAt( i );
+			}
+			if ( m_mapConnectRateLimit.Count() >= k_nMaxConnectRateLimitSources )
+				return true;
+		}
+		idx = m_mapConnectRateLimit.Insert( ipFrom );
+	}
+
+	return m_mapConnectRateLimit[ idx ].BCheck( usecNow, flRate, flBurst );
+}
+
+bool CSteamNetworkListenSocketDirectUDP::BQueueConnectRequestVerify( const CMsgSteamSockets_UDP_ConnectRequest &msg, const netadr_t &adrFrom, const SteamNetworkingIdentity &identityRemote, int cbPkt, SteamNetworkingMicroseconds usecNow )
+{
+	if ( GlobalConfig::CryptoWorkerThreads.Get() <= 0 )
+		return false;
+
+	// We need the key from their cert.  If anything is unusual, just
+	// accept it the normal way, which will report the problem.
+	CMsgSteamDatagramCertificate msgCert;
+	if ( !msg.has_cert() || !msg.has_crypt() || !msgCert.ParseFromString( msg.cert().cert() ) || !msgCert.has_key_data() )
+		return false;
+
+	ConnectRequestVerifyJob_t *pJob = new ConnectRequestVerifyJob_t;
+	pJob->m_bServer = true;
+	pJob->m_sCryptRemote = msg.crypt().info();
+	pJob->m_eKeyType = msgCert.key_type();
+	pJob->m_sPublicKey = msgCert.key_data();
+	pJob->m_sSignature = msg.crypt().signature();
+	pJob->m_pListenSocket = this;
+	pJob->m_msg = msg;
+	pJob->m_adrFrom = adrFrom;
+	pJob->m_identityRemote = identityRemote;
+	pJob->m_cbPkt = cbPkt;
+	pJob->m_usecRecv = usecNow;
+
+	m_vecPendingConnectRequests.push_back( pJob );
+	AddPendingHandshake( adrFrom );
+	QueueCryptoHandshakeVerifyJob( pJob );
+	return true;
+}
+
+void CSteamNetworkListenSocketDirectUDP::ConnectRequestVerified( ConnectRequestVerifyJob_t &job )
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+	Assert( job.m_pListenSocket == this );
+	job.m_pListenSocket = nullptr;
+	auto itJob = std::find( m_vecPendingConnectRequests.begin(), m_vecPendingConnectRequests.end(), &job );
+	if ( itJob == m_vecPendingConnectRequests.end() )
+	{
+		Assert( false );
+		return;
+	}
+	m_vecPendingConnectRequests.erase( itJob );
+
+	const netadr_t &adrFrom = job.m_adrFrom;
+	if ( !job.m_bSignatureOK )
+	{
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingSockets_GetLocalTimestamp();
+		ReportBadPacket( "ConnectRequest", "Bad crypt info.  %s", job.m_errMsg );
+		return;
+	}
+
+	AcceptConnectRequest( job.m_msg, adrFrom, job.m_identityRemote, job.m_cbPkt, job.m_usecRecv, &job );
+}
+
+void CSteamNetworkListenSocketDirectUDP::GetAdmissionStats( SteamNetworkingGlobalStats_t *pStats, bool bReset )
+{
+	SteamNetworkingGlobalLock::AssertHeldByCurrentThread();
+	pStats->m_nConnectRequestsRateLimited = s_nConnectRequestsRateLimited;
+	pStats->m_nConnectRequestsOverBudget = s_nConnectRequestsOverBudget;
+	pStats->m_nPendingHandshakes = s_nPendingHandshakes;
+	if ( bReset )
+	{
+		s_nConnectRequestsRateLimited = 0;
+		s_nConnectRequestsOverBudget = 0;
+	}
+}
+
+void CSteamNetworkListenSocketDirectUDP::AcceptConnectRequest( const CMsgSteamSockets_UDP_ConnectRequest &msg, const netadr_t &adrFrom, const SteamNetworkingIdentity &identityRemote, int cbPkt, SteamNetworkingMicroseconds usecRecv, const CryptoHandshakeVerifyJob_t *pVerifiedJob )
+{
+	SteamDatagramErrMsg errMsg;
+	const uint32 unClientConnectionID = msg.client_connection_id();
+	const SteamNetworkingMicroseconds usecNow = pVerifiedJob ? SteamNetworkingSockets_GetLocalTimestamp() : usecRecv;
+
 	// Does this connection already exist?  (At a different address?)
 	int h = m_mapChildConnections.Find( RemoteConnectionKey_t{ identityRemote, unClientConnectionID } );
 	if ( h != m_mapChildConnections.InvalidIndex() )
@@ -411,14 +873,15 @@ void CSteamNetworkListenSocketDirectUDP::Received_ConnectRequest( const CMsgStea
 	CSteamNetworkConnectionUDP *pConn = new CSteamNetworkConnectionUDP( m_pSteamNetworkingSocketsInterface, connectionLock );
 
 	// OK, they have completed the handshake.  Accept the connection.
-	if ( !pConn->BBeginAccept( this, adrFrom, m_pSock, identityRemote, unClientConnectionID, msg.cert(), msg.crypt(), errMsg ) )
+	if ( !pConn->BBeginAccept( this, adrFrom, m_pSock, identityRemote, unClientConnectionID, msg.cert(), msg.crypt(), errMsg, pVerifiedJob ) )
 	{
 		SpewWarning( "Failed to accept connection from %s.  %s\n", CUtlNetAdrRender( adrFrom ).String(), errMsg );
 		pConn->ConnectionQueueDestroy();
 		return;
 	}
+	pConn->MarkPendingHandshake( adrFrom );
 
-	pConn->m_statsEndToEnd.TrackRecvPacket( cbPkt, usecNow );
+	pConn->m_statsEndToEnd.TrackRecvPacket( cbPkt, usecRecv );
 
 	// Did they send us a ping estimate?
 	if ( msg.has_ping_est_ms() )
@@ -429,7 +892,7 @@ void CSteamNetworkListenSocketDirectUDP::Received_ConnectRequest( const CMsgStea
 		}
 		else
 		{
-			pConn->m_statsEndToEnd.m_ping.ReceivedPing( msg.ping_est_ms(), usecNow );
+			pConn->m_statsEndToEnd.m_ping.ReceivedPing( msg.ping_est_ms(), usecRecv );
 		}
 	}
 
@@ -438,7 +901,7 @@ void CSteamNetworkListenSocketDirectUDP::Received_ConnectRequest( const CMsgStea
 	if ( msg.has_my_timestamp() )
 	{
 		pConn->m_ulHandshakeRemoteTimestamp = msg.my_timestamp();
-		pConn->m_usecWhenReceivedHandshakeRemoteTimestamp = usecNow;
+		pConn->m_usecWhenReceivedHandshakeRemoteTimestamp = usecRecv;
 	}
 }
 
@@ -926,10 +1389,40 @@ void CConnectionTransportUDPBase::GetDetailedConnectionStatus( SteamNetworkingDe
 CSteamNetworkConnectionUDP::CSteamNetworkConnectionUDP( CSteamNetworkingSockets *pSteamNetworkingSocketsInterface, ConnectionScopeLock &scopeLock )
 : CSteamNetworkConnectionBase( pSteamNetworkingSocketsInterface, scopeLock )
 {
+	m_bPendingHandshake = false;
 }
 
 CSteamNetworkConnectionUDP::~CSteamNetworkConnectionUDP()
 {
+	ClearPendingHandshake();
+}
+
+void CSteamNetworkConnectionUDP::MarkPendingHandshake( const CIPAddress &ipRemote )
+{
+	Assert( !m_bPendingHandshake );
+	if ( GetState() != k_ESteamNetworkingConnectionState_Connecting )
+		return;
+	m_bPendingHandshake = true;
+	m_ipPendingHandshake = ipRemote;
+	AddPendingHandshake( ipRemote );
+}
+
+void CSteamNetworkConnectionUDP::ClearPendingHandshake()
+{
+	if ( !m_bPendingHandshake )
+		return;
+	m_bPendingHandshake = false;
+	RemovePendingHandshake( m_ipPendingHandshake );
+}
+
+void CSteamNetworkConnectionUDP::ConnectionStateChanged( ESteamNetworkingConnectionState eOldState )
+{
+	CSteamNetworkConnectionBase::ConnectionStateChanged( eOldState );
+
+	// Once the app has accepted the connection, or it has gone away,
+	// it no longer counts against the handshake budget
+	if ( GetState() != k_ESteamNetworkingConnectionState_Connecting )
+		ClearPendingHandshake();
 }
 
 CConnectionTransportUDP::CConnectionTransportUDP( CSteamNetworkConnectionUDP &connection )
@@ -1188,6 +1681,11 @@ bool CConnectionTransportUDP::BCanSendEndToEndData() const
 	return m_pSocket != nullptr;
 }
 
+bool CConnectionTransportUDP::BSupportsTxTime() const
+{
+	return m_pSocket && m_pSocket->GetRawSock()->m_bTxTime;
+}
+
 void CConnectionTransportUDP::SendEndToEndConnectRequest( SteamNetworkingMicroseconds usecNow )
 {
 	Assert( !ListenSocket() );
@@ -1217,7 +1715,8 @@ bool CSteamNetworkConnectionUDP::BBeginAccept(
 	uint32 unConnectionIDRemote,
 	const CMsgSteamDatagramCertificateSigned &msgCert,
 	const CMsgSteamDatagramSessionCryptInfoSigned &msgCryptSessionInfo,
-	SteamDatagramErrMsg &errMsg
+	SteamDatagramErrMsg &errMsg,
+	const CryptoHandshakeVerifyJob_t *pVerifiedJob
 )
 {
 	AssertMsg( !m_pTransport, "Trying to accept when we already have transport?" );
@@ -1248,8 +1747,10 @@ bool CSteamNetworkConnectionUDP::BBeginAccept(
 		return false;
 	}
 
-	// Process crypto handshake now
-	if ( RecvCryptoHandshake( msgCert, msgCryptSessionInfo, true, errMsg ) != k_ESteamNetConnectionEnd_Invalid )
+	// Process crypto handshake now.  The expensive part might finish
+	// later on a worker thread, but we go ahead and enter the connecting
+	// state regardless, so we will ignore retries of the connect request.
+	if ( RecvCryptoHandshake( msgCert, msgCryptSessionInfo, true, errMsg, true, pVerifiedJob ) != k_ESteamNetConnectionEnd_Invalid )
 	{
 		DestroyTransport();
 		return false;
@@ -1403,13 +1904,13 @@ void CConnectionTransportUDP::PacketReceived( const RecvPktInfo_t &info, CConnec
 	}
 	else if ( *pPkt == k_ESteamNetworkingUDPMsg_ChallengeRequest )
 	{
-		ParsePaddedPacket( pPkt, cbPkt, CMsgSteamSockets_UDP_ChallengeRequest, msg )
-		pSelf->Received_ChallengeOrConnectRequest( "ChallengeRequest", msg.connection_id(), usecNow );
+		ParsePaddedPacket( pPkt, cbPkt, ChallengeRequestMsg_t, msg )
+		pSelf->Received_ChallengeOrConnectRequest( "ChallengeRequest", msg.m_unConnectionID, usecNow );
 	}
 	else if ( *pPkt == k_ESteamNetworkingUDPMsg_ConnectRequest )
 	{
-		ParseProtobufBody( pPkt+1, cbPkt-1, CMsgSteamSockets_UDP_ConnectRequest, msg )
-		pSelf->Received_ChallengeOrConnectRequest( "ConnectRequest", msg.client_connection_id(), usecNow );
+		ParseProtobufBody( pPkt+1, cbPkt-1, ConnectRequestHeader_t, hdr )
+		pSelf->Received_ChallengeOrConnectRequest( "ConnectRequest", hdr.m_unClientConnectionID, usecNow );
 	}
 	else
 	{
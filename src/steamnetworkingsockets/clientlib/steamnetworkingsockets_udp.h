@@ -10,6 +10,7 @@
 namespace SteamNetworkingSocketsLib {
 
 class CConnectionTransportUDPBase;
+struct ConnectRequestVerifyJob_t;
 
 #pragma pack( push, 1 )
 
@@ -60,6 +61,62 @@ struct UDPRecvPacketContext_t : RecvPacketContext_t
 	CMsgSteamSockets_UDP_Stats *m_pStatsIn;
 };
 
+//
+// Hand-rolled codecs for the handshake messages that a listen socket receives
+// from hosts it doesn't know.  Anybody can send these, and we want to be able
+// to deal with a lot of them cheaply, without any memory allocation.  They are
+// wire-compatible with the messages in steamnetworkingsockets_messages_udp.proto.
+// ParseFromArray has the same signature as the protobuf method, so these work
+// with ParsePaddedPacket and ParseProtobufBody.  Unknown fields are skipped.
+// If a field appears more than once, the last one wins, as with protobuf.
+//
+
+/// CMsgSteamSockets_UDP_ChallengeRequest
+struct ChallengeRequestMsg_t
+{
+	uint32 m_unConnectionID = 0;
+	uint64 m_ulMyTimestamp = 0;
+	uint32 m_nProtocolVersion = 0;
+
+	/// Max size of the serialized message
+	enum { k_cbMaxSerializedSize = 1+4 + 1+8 + 1+5 };
+
+	bool ParseFromArray( const void *pData, int cbData );
+
+	/// Serialize all fields, exactly as protobuf would if they were all set.
+	/// Returns a pointer to the next byte.
+	uint8 *SerializeToArray( uint8 *p ) const;
+};
+
+/// CMsgSteamSockets_UDP_ChallengeReply
+struct ChallengeReplyMsg_t
+{
+	uint32 m_unConnectionID = 0;
+	uint64 m_ulChallenge = 0;
+	uint64 m_ulYourTimestamp = 0;
+	uint32 m_nProtocolVersion = 0;
+
+	/// Max size of the serialized message
+	enum { k_cbMaxSerializedSize = 1+4 + 1+8 + 1+8 + 1+5 };
+
+	bool ParseFromArray( const void *pData, int cbData );
+
+	/// Serialize all fields, exactly as protobuf would if they were all set.
+	/// Returns a pointer to the next byte.
+	uint8 *SerializeToArray( uint8 *p ) const;
+};
+
+/// Just the fields of CMsgSteamSockets_UDP_ConnectRequest that we need to
+/// decide whether a request is worth looking at any further.  If it is,
+/// the whole thing gets parsed by protobuf.
+struct ConnectRequestHeader_t
+{
+	uint32 m_unClientConnectionID = 0;
+	uint64 m_ulChallenge = 0;
+
+	bool ParseFromArray( const void *pData, int cbData );
+};
+
 extern std::string DescribeStatsContents( const CMsgSteamSockets_UDP_Stats &msg );
 extern bool BCheckRateLimitReportBadPacket( SteamNetworkingMicroseconds usecNow );
 extern void ReallyReportBadUDPPacket( const char *pszFrom, const char *pszMsgType, const char *pszFmt, ... );
@@ -87,6 +144,14 @@ public:
 
 	CSharedSocket *GetSharedSocket() { return m_pSock; };
 
+	/// Called with the global lock held when a crypto worker thread has
+	/// finished checking a connect request that we haven't created a
+	/// connection for yet.  (IP_DeferConnectionAlloc)
+	void ConnectRequestVerified( ConnectRequestVerifyJob_t &job );
+
+	/// Fetch counters for SteamNetworkingSockets_GetGlobalStats
+	static void GetAdmissionStats( SteamNetworkingGlobalStats_t *pStats, bool bReset );
+
 private:
 	virtual ~CSteamNetworkListenSocketDirectUDP(); // hidden destructor, don't call directly.  Use Destroy()
 
@@ -100,13 +165,37 @@ private:
 	/// Generate a challenge
 	uint64 GenerateChallenge( uint16 nTime, const netadr_t &adr ) const;
 
+	/// Connect request rate limit for each source IP address.  (Ports are
+	/// ignored.)  Entries whose buckets have filled back up are pruned
+	/// when the table gets too big.
+	CUtlHashMap<CIPAddress, TokenBucketRateLimiter, std::equal_to<CIPAddress>, CIPAddress::Hash > m_mapConnectRateLimit;
+	SteamNetworkingMicroseconds m_usecLastPruneConnectRateLimit;
+
+	/// Check if a connect request from this address is within the rate limit
+	bool BCheckConnectRateLimit( const netadr_t &adrFrom, SteamNetworkingMicroseconds usecNow );
+
+	/// Connect requests that are being checked by a crypto worker thread,
+	/// before we create the connection.  (IP_DeferConnectionAlloc)  The
+	/// jobs are owned by the worker; we just need to know which requests
+	/// are retries, and to let the jobs know if we go away.
+	std::vector<ConnectRequestVerifyJob_t *> m_vecPendingConnectRequests;
+
+	/// Hand a connect request off to a crypto worker thread, without
+	/// creating a connection yet.  Returns false if we can't, and should
+	/// just accept it the normal way
+	bool BQueueConnectRequestVerify( const CMsgSteamSockets_UDP_ConnectRequest &msg, const netadr_t &adrFrom, const SteamNetworkingIdentity &identityRemote, int cbPkt, SteamNetworkingMicroseconds usecNow );
+
+	/// Create a connection for a request that has been admitted.  If
+	/// pVerifiedJob is not NULL, the crypto has already been checked.
+	void AcceptConnectRequest( const CMsgSteamSockets_UDP_ConnectRequest &msg, const netadr_t &adrFrom, const SteamNetworkingIdentity &identityRemote, int cbPkt, SteamNetworkingMicroseconds usecRecv, const CryptoHandshakeVerifyJob_t *pVerifiedJob );
+
 	// Callback to handle a packet when it doesn't match
 	// any known address
 	static void ReceivedFromUnknownHost( const RecvPktInfo_t &info, CSteamNetworkListenSocketDirectUDP *pSock );
 
 	// Process packets from a source address that does not already correspond to a session
-	void Received_ChallengeRequest( const CMsgSteamSockets_UDP_ChallengeRequest &msg, const netadr_t &adrFrom, SteamNetworkingMicroseconds usecNow );
-	void Received_ConnectRequest( const CMsgSteamSockets_UDP_ConnectRequest &msg, const netadr_t &adrFrom, int cbPkt, SteamNetworkingMicroseconds usecNow );
+	void Received_ChallengeRequest( const ChallengeRequestMsg_t &msg, const netadr_t &adrFrom, SteamNetworkingMicroseconds usecNow );
+	void Received_ConnectRequest( const ConnectRequestHeader_t &hdr, const void *pMsgBody, int cbMsgBody, const netadr_t &adrFrom, int cbPkt, SteamNetworkingMicroseconds usecNow );
 	void Received_ConnectionClosed( const CMsgSteamSockets_UDP_ConnectionClosed &msg, const netadr_t &adrFrom, SteamNetworkingMicroseconds usecNow );
 	void SendMsg( uint8 nMsgID, const google::protobuf::MessageLite &msg, const netadr_t &adrTo );
 	void SendPaddedMsg( uint8 nMsgID, const google::protobuf::MessageLite &msg, const netadr_t adrTo );
@@ -164,6 +253,7 @@ public:
 	virtual void TransportFreeResources() override;
 	virtual bool BCanSendEndToEndConnectRequest() const override;
 	virtual bool BCanSendEndToEndData() const override;
+	virtual bool BSupportsTxTime() const override;
 	virtual void SendEndToEndConnectRequest( SteamNetworkingMicroseconds usecNow ) override;
 	virtual void TransportConnectionStateChanged( ESteamNetworkingConnectionState eOldState ) override;
 	virtual void TransportPopulateConnectionInfo( SteamNetConnectionInfo_t &info ) const override;
@@ -221,10 +311,23 @@ public:
 		uint32 unConnectionIDRemote,
 		const CMsgSteamDatagramCertificateSigned &msgCert,
 		const CMsgSteamDatagramSessionCryptInfoSigned &msgSessionInfo,
-		SteamDatagramErrMsg &errMsg
+		SteamDatagramErrMsg &errMsg,
+		const CryptoHandshakeVerifyJob_t *pVerifiedJob = nullptr
 	);
+
+	/// Count this connection against the global pending handshake
+	/// budget (and the one for its address) until it leaves the
+	/// connecting state
+	void MarkPendingHandshake( const CIPAddress &ipRemote );
 protected:
 	virtual ~CSteamNetworkConnectionUDP(); // hidden destructor, don't call directly.  Use ConnectionQueueDestroy()
+	virtual void ConnectionStateChanged( ESteamNetworkingConnectionState eOldState ) override;
+
+	/// Are we counted in the pending handshake budget?  If so, this is
+	/// the address we were charged to.
+	bool m_bPendingHandshake;
+	CIPAddress m_ipPendingHandshake;
+	void ClearPendingHandshake();
 };
 
 /// A connection over loopback
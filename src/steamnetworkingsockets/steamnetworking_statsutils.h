@@ -404,6 +404,13 @@ struct TokenBucketRateLimiter
 		return true;
 	}
 
+	/// Return true if the bucket would be full by now, so it is no
+	/// different from one that was just Reset().
+	bool BIsFull( SteamNetworkingMicroseconds usecNow, float flMaxSteadyStateRate ) const
+	{
+		return m_flTokenDeficitFromFull <= ( usecNow - m_usecLastTime ) * 1e-6f * flMaxSteadyStateRate;
+	}
+
 private:
 
 	/// Last time a token was spent
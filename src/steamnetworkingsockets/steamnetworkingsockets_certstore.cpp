@@ -272,6 +272,50 @@ struct PublicKey
 static CUtlHashMap<uint64,std::unique_ptr<PublicKey>,std::equal_to<uint64>,std::hash<uint64> > s_mapPublicKeys;
 static bool s_bTrustValid = false;
 
+// A cert that we recently checked in CertStore_CheckCert and found to be
+// good.  The same cert is often presented over and over (a client
+// reconnecting, or lots of clients sharing a cert), and checking the
+// signature is expensive.
+struct VerifiedCert
+{
+	SHA256Digest_t m_digest; // Digest of the signed cert data
+	uint64 m_ca_key_id;
+	std::string m_signature;
+	time_t m_timeExpiry; // Earliest expiry of the cert and the CA chain
+	const CertAuthScope *m_pCAAuthScope;
+	CMsgSteamDatagramCertificate m_msgCert;
+	int64 m_nLastUsed; // For evicting the least recently used one
+};
+
+// Max number of certs to remember
+constexpr int k_nMaxVerifiedCerts = 1024;
+
+// Looked up by the first 8 bytes of the digest.  Anything that could change
+// the trust of any key flushes all of it, since the results depend on the
+// whole chain.
+static CUtlHashMap<uint64,VerifiedCert,std::equal_to<uint64>,std::hash<uint64> > s_mapVerifiedCerts;
+static int64 s_nVerifiedCertLastUsed;
+static int64 s_nVerifiedCertCacheHits;
+static int64 s_nVerifiedCertCacheMisses;
+
+static uint64 VerifiedCertKey( const SHA256Digest_t &digest )
+{
+	uint64 nKey;
+	memcpy( &nKey, digest, sizeof(nKey) );
+	return nKey;
+}
+
+static void FlushVerifiedCerts()
+{
+	s_mapVerifiedCerts.RemoveAll();
+}
+
+static void InvalidateTrust()
+{
+	s_bTrustValid = false;
+	FlushVerifiedCerts();
+}
+
 static PublicKey *FindPublicKey( uint64 nKeyID )
 {
 	int idx = s_mapPublicKeys.Find( nKeyID );
@@ -302,7 +346,7 @@ static void CertStore_OneTimeInit()
 void CertStore_Reset()
 {
 	s_mapPublicKeys.RemoveAll();
-	s_bTrustValid = false;
+	InvalidateTrust();
 }
 
 void CertStore_AddKeyRevocation( uint64 key_id )
@@ -314,7 +358,7 @@ void CertStore_AddKeyRevocation( uint64 key_id )
 		pKey->m_eTrust = k_ETrust_Revoked;
 		pKey->m_status_msg = "Revoked";
 		s_mapPublicKeys.Insert( key_id, std::unique_ptr<PublicKey>( pKey ) );
-		s_bTrustValid = false;
+		InvalidateTrust();
 		return;
 	}
 
@@ -330,7 +374,7 @@ void CertStore_AddKeyRevocation( uint64 key_id )
 	pKey->m_eTrust = k_ETrust_Revoked;
 	pKey->m_status_msg = "Revoked";
 
-	s_bTrustValid = false;
+	InvalidateTrust();
 }
 
 bool CertStore_AddCertFromBase64( const char *pszBase64, SteamNetworkingErrMsg &errMsg )
@@ -391,7 +435,7 @@ bool CertStore_AddCertFromBase64( const char *pszBase64, SteamNetworkingErrMsg &
 	pKey->m_vecCerts.emplace_back( std::move( cert ) );
 
 	// Invalidate trust, recompute it next time we ask for it
-	s_bTrustValid = false;
+	InvalidateTrust();
 
 	// OK
 	return true;
@@ -651,6 +695,38 @@ const CertAuthScope *CertStore_CheckCASignature( const std::string &signed_data,
 
 const CertAuthScope *CertStore_CheckCert( const CMsgSteamDatagramCertificateSigned &msgCertSigned, CMsgSteamDatagramCertificate &outMsgCert, time_t timeNow, SteamNetworkingErrMsg &errMsg )
 {
+	// Make sure the cache isn't holding on to results from before
+	// the cert store changed
+	CertStore_EnsureTrustValid();
+
+	// Have we already checked this exact cert recently?
+	SHA256Digest_t digest;
+	CCrypto::GenerateSHA256Digest( msgCertSigned.cert().c_str(), msgCertSigned.cert().length(), &digest );
+	const uint64 nKey = VerifiedCertKey( digest );
+	int idx = s_mapVerifiedCerts.Find( nKey );
+	if ( idx != s_mapVerifiedCerts.InvalidIndex() )
+	{
+		VerifiedCert &cached = s_mapVerifiedCerts[ idx ];
+		if (
+			memcmp( cached.m_digest, digest, sizeof(digest) ) == 0
+			&& cached.m_ca_key_id == msgCertSigned.ca_key_id()
+			&& cached.m_signature == msgCertSigned.ca_signature()
+		) {
+			if ( cached.m_timeExpiry >= timeNow )
+			{
+				++s_nVerifiedCertCacheHits;
+				cached.m_nLastUsed = ++s_nVerifiedCertLastUsed;
+				outMsgCert = cached.m_msgCert;
+				return cached.m_pCAAuthScope;
+			}
+
+			// Expired.  Forget it, and let the checks below
+			// produce the appropriate error.
+			s_mapVerifiedCerts.RemoveAt( idx );
+		}
+	}
+	++s_nVerifiedCertCacheMisses;
+
 	const CertAuthScope *pResult = CertStore_CheckCASignature( msgCertSigned.cert(), msgCertSigned.ca_key_id(), msgCertSigned.ca_signature(), timeNow, errMsg );
 	if ( !pResult )
 		return nullptr;
@@ -700,9 +776,42 @@ const CertAuthScope *CertStore_CheckCert( const CMsgSteamDatagramCertificateSign
 		}
 	}
 
+	// Remember that this cert is good, replacing anything else with the
+	// same key.  If we're full, evict the least recently used one.  (We only
+	// scan on a miss, which costs a lot more than this anyway.)
+	if ( s_mapVerifiedCerts.Find( nKey ) == s_mapVerifiedCerts.InvalidIndex() && s_mapVerifiedCerts.Count() >= k_nMaxVerifiedCerts )
+	{
+		int idxOldest = s_mapVerifiedCerts.InvalidIndex();
+		FOR_EACH_HASHMAP( s_mapVerifiedCerts, i )
+		{
+			if ( idxOldest == s_mapVerifiedCerts.InvalidIndex() || s_mapVerifiedCerts[ i ].m_nLastUsed < s_mapVerifiedCerts[ idxOldest ].m_nLastUsed )
+				idxOldest = i;
+		}
+		s_mapVerifiedCerts.RemoveAt( idxOldest );
+	}
+	VerifiedCert &entry = *s_mapVerifiedCerts.FindOrInsertGetPtr( nKey );
+	memcpy( entry.m_digest, digest, sizeof(digest) );
+	entry.m_ca_key_id = msgCertSigned.ca_key_id();
+	entry.m_signature = msgCertSigned.ca_signature();
+	entry.m_timeExpiry = std::min( (time_t)outMsgCert.time_expiry(), pResult->m_timeExpiry );
+	entry.m_pCAAuthScope = pResult;
+	entry.m_msgCert = outMsgCert;
+	entry.m_nLastUsed = ++s_nVerifiedCertLastUsed;
+
 	return pResult;
 }
 
+void CertStore_GetVerifiedCertCacheStats( int64 *pnHits, int64 *pnMisses, bool bReset )
+{
+	*pnHits = s_nVerifiedCertCacheHits;
+	*pnMisses = s_nVerifiedCertCacheMisses;
+	if ( bReset )
+	{
+		s_nVerifiedCertCacheHits = 0;
+		s_nVerifiedCertCacheMisses = 0;
+	}
+}
+
 const CertAuthScope *CertStore_CheckPublicKey( uint64 nKeyID, time_t timeNow, SteamNetworkingErrMsg &errMsg )
 {
 	CertStore_EnsureTrustValid();
@@ -127,8 +127,16 @@ extern const CertAuthScope *CertStore_CheckCASignature( const std::string &signe
 /// Also deserializes the cert and make sure it is not expired.
 /// DOES NOT CHECK that the appid, pops, etc in the cert
 /// are granted by the CA chain.  You need to do that!
+///
+/// Certs that pass are remembered (up to a limit), keyed by a digest of
+/// the signed data, so that checking the same cert again is cheap.
+/// Adding certs or revocations forgets all of them.
 extern const CertAuthScope *CertStore_CheckCert( const CMsgSteamDatagramCertificateSigned &msgCertSigned, CMsgSteamDatagramCertificate &outMsgCert, time_t timeNow, SteamNetworkingErrMsg &errMsg );
 
+/// Number of times CertStore_CheckCert found the cert among the ones
+/// it had already verified, and the number of times it had to do the work.
+extern void CertStore_GetVerifiedCertCacheStats( int64 *pnHits, int64 *pnMisses, bool bReset );
+
 /// Check if a cert gives permission to access a certain app.
 extern bool CheckCertAppID( const CMsgSteamDatagramCertificate &msgCert, const CertAuthScope *pCertAuthScope, AppId_t nAppID, SteamNetworkingErrMsg &errMsg );
 
@@ -22,6 +22,9 @@
 #include <vstdlib/random.h>
 #include <tier1/utlvector.h>
 #include <tier1/utlbuffer.h>
+#ifdef __BMI2__
+	#include <immintrin.h>
+#endif
 #include "keypair.h"
 #include <tier0/memdbgoff.h>
 #include <steamnetworkingsockets_messages_certs.pb.h>
@@ -368,7 +371,7 @@ constexpr int k_nRouteScoreHuge = INT_MAX/8;
 /// Protocol version of this code.  This is a blunt instrument, which is incremented when we
 /// wish to change the wire protocol in a way that doesn't have some other easy
 /// mechanism for dealing with compatibility (e.g. using protobuf's robust mechanisms).
-const uint32 k_nCurrentProtocolVersion = 11;
+const uint32 k_nCurrentProtocolVersion = 12;
 
 /// Minimum required version we will accept from a peer.  We increment this
 /// when we introduce wire breaking protocol changes and do not wish to be
@@ -424,9 +427,38 @@ inline byte *SerializeVarInt( byte *p, T x )
 	return p+1;
 }
 
-/// Serialize a bar int, but return null if we want to go past the end
+// Spread the low 56 bits of x into 7-bit groups, one group in the low 7 bits
+// of each byte.  Together with a single 64-bit load/store, this lets us
+// encode and decode varints up to 8 bytes without looping over the bytes.
+inline uint64 VarIntScatter7BitGroups( uint64 x )
+{
+	#ifdef __BMI2__
+		return _pdep_u64( x, 0x7f7f7f7f7f7f7f7fULL );
+	#else
+		x = ( ( x & 0x00fffffff0000000ULL ) << 4 ) | ( x & 0x000000000fffffffULL );
+		x = ( ( x & 0x0fffc0000fffc000ULL ) << 2 ) | ( x & 0x00003fff00003fffULL );
+		x = ( ( x & 0x3f803f803f803f80ULL ) << 1 ) | ( x & 0x007f007f007f007fULL );
+		return x;
+	#endif
+}
+
+// Inverse of VarIntScatter7BitGroups.  The high bit of each byte is ignored.
+inline uint64 VarIntGather7BitGroups( uint64 x )
+{
+	#ifdef __BMI2__
+		return _pext_u64( x, 0x7f7f7f7f7f7f7f7fULL );
+	#else
+		x &= 0x7f7f7f7f7f7f7f7fULL;
+		x = ( ( x & 0x7f007f007f007f00ULL ) >> 1 ) | ( x & 0x007f007f007f007fULL );
+		x = ( ( x & 0x3fff00003fff0000ULL ) >> 2 ) | ( x & 0x00003fff00003fffULL );
+		x = ( ( x & 0x0fffffff00000000ULL ) >> 4 ) | ( x & 0x000000000fffffffULL );
+		return x;
+	#endif
+}
+
+/// Serialize a var int one byte at a time, but return null if we want to go past the end
 template <typename T>
-inline byte *SerializeVarInt( byte *p, T x, const byte *pEnd )
+inline byte *SerializeVarIntScalar( byte *p, T x, const byte *pEnd )
 {
 	while ( x >= (unsigned)0x80 ) // if you get a warning, it's because you are using a signed type!  Don't use this for signed data!
 	{
@@ -445,6 +477,24 @@ inline byte *SerializeVarInt( byte *p, T x, const byte *pEnd )
 	return p+1;
 }
 
+/// Serialize a var int, but return null if we want to go past the end.
+///
+/// NOTE: This may scribble on bytes after the returned pointer, up to pEnd.
+template <typename T>
+inline byte *SerializeVarInt( byte *p, T x, const byte *pEnd )
+{
+	// If we have room, write all the bytes at once
+	if ( x >= (unsigned)0x80 && pEnd - p >= 8 && (uint64)x < ( (uint64)1 << 56 ) )
+	{
+		int nBytes = FindMostSignificantBit64( (uint64)x ) / 7 + 1;
+		uint64 nContinueBits = 0x8080808080808080ULL & ( ( (uint64)1 << ( 8*nBytes - 8 ) ) - 1 );
+		uint64 w = LittleQWord( VarIntScatter7BitGroups( (uint64)x ) | nContinueBits );
+		memcpy( p, &w, 8 );
+		return p + nBytes;
+	}
+	return SerializeVarIntScalar( p, x, pEnd );
+}
+
 inline int VarIntSerializedSize( uint32 x )
 {
 	if ( x < (1U<<7) ) return 1;
@@ -471,13 +521,13 @@ inline int VarIntSerializedSize( uint64 x )
 	return 10;
 }
 
-// De-serialize a var-int encoded quantity.  Returns pointer to the next byte,
-// or NULL if there was a decoding error (we hit the end of stream.)
+// De-serialize a var-int encoded quantity one byte at a time.  Returns pointer
+// to the next byte, or NULL if there was a decoding error (we hit the end of stream.)
 // https://developers.google.com/protocol-buffers/docs/encoding
 //
 // NOTE: We do not detect overflow.
 template <typename T>
-inline byte *DeserializeVarInt( byte *p, const byte *end, T &x )
+inline byte *DeserializeVarIntScalar( byte *p, const byte *end, T &x )
 {
 	if ( p >= end )
 		return nullptr;
@@ -494,12 +544,43 @@ inline byte *DeserializeVarInt( byte *p, const byte *end, T &x )
 	return p;
 }
 
+// De-serialize a var-int encoded quantity.  Returns pointer to the next byte,
+// or NULL if there was a decoding error (we hit the end of stream.)
+// Produces exactly the same results as DeserializeVarIntScalar.
+//
+// NOTE: We do not detect overflow.
+template <typename T>
+inline byte *DeserializeVarInt( byte *p, const byte *end, T &x )
+{
+	// If there are at least 8 bytes left, load them all at once, and
+	// locate the terminating byte (the first one without the high bit set)
+	if ( end - p >= 8 && ( *p & 0x80 ) )
+	{
+		uint64 w;
+		memcpy( &w, p, 8 );
+		w = LittleQWord( w );
+		uint64 nStopBits = ~w & 0x8080808080808080ULL;
+		if ( nStopBits )
+		{
+			int nBits = FindLeastSignificantBit64( nStopBits ) + 1; // 16, 24, ..., 64
+			x = T( VarIntGather7BitGroups( w & ( ~(uint64)0 >> ( 64 - nBits ) ) ) );
+			return p + ( nBits >> 3 );
+		}
+	}
+	return DeserializeVarIntScalar( p, end, x );
+}
+
 // Const version
 template <typename T>
 inline const byte *DeserializeVarInt( const byte *p, const byte *end, T &x )
 {
 	return DeserializeVarInt( const_cast<byte*>( p ), end, x );
 }
+template <typename T>
+inline const byte *DeserializeVarIntScalar( const byte *p, const byte *end, T &x )
+{
+	return DeserializeVarIntScalar( const_cast<byte*>( p ), end, x );
+}
 
 void LinkStatsPrintInstantaneousToBuf( const char *pszLeader, const SteamDatagramLinkInstantaneousStats &stats, CUtlBuffer &buf );
 void LinkStatsPrintLifetimeToBuf( const char *pszLeader, const SteamDatagramLinkLifetimeStats &stats, CUtlBuffer &buf );
@@ -866,7 +947,12 @@ struct ConnectionConfig
 	ConfigValue<int32> SendRateMax;
 	ConfigValue<int32> MTU_PacketSize;
 	ConfigValue<int32> NagleTime;
+	ConfigValue<int32> NackDelayPercentile;
+	ConfigValue<int32> UnreliableFECLanes;
 	ConfigValue<int32> IP_AllowWithoutAuth;
+	ConfigValue<int32> IP_ConnectRateLimit;
+	ConfigValue<int32> IP_ConnectRateLimitBurst;
+	ConfigValue<int32> IP_DeferConnectionAlloc;
 	ConfigValue<int32> Unencrypted;
 	ConfigValue<int32> SymmetricConnect;
 	ConfigValue<int32> LocalVirtualPort;
@@ -932,6 +1018,18 @@ namespace GlobalConfig
 	extern GlobalConfigValue<int32> FakeRateLimit_Send_Burst;
 	extern GlobalConfigValue<int32> FakeRateLimit_Recv_Rate;
 	extern GlobalConfigValue<int32> FakeRateLimit_Recv_Burst;
+	extern GlobalConfigValue<int32> RecvBatchSize;
+	extern GlobalConfigValue<int32> SendBatchMode;
+	extern GlobalConfigValue<int32> MessagePoolSize;
+	extern GlobalConfigValue<int32> RecvThreads;
+	extern GlobalConfigValue<int32> SendTxTimeHorizon;
+	extern GlobalConfigValue<int32> PreciseServiceWait;
+	extern GlobalConfigValue<int32> ServiceThreadSpinTime;
+	extern GlobalConfigValue<int32> SocketBusyPoll;
+	extern GlobalConfigValue<int32> ServiceThreadCPU;
+	extern GlobalConfigValue<int32> CryptoWorkerThreads;
+	extern GlobalConfigValue<int32> MaxPendingHandshakes;
+	extern GlobalConfigValue<int32> MaxPendingHandshakesPerIP;
 	extern GlobalConfigValue<int32> ECN;
 
 	extern GlobalConfigValue<int32> EnumerateDevVars;
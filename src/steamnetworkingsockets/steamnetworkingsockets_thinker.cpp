@@ -6,8 +6,6 @@
 	#pragma GCC diagnostic ignored "-Wstrict-overflow"
 #endif
 
-#include <tier1/utlpriorityqueue.h>
-
 #include "steamnetworkingsockets_thinker.h"
 
 #ifdef IS_STEAMDATAGRAMROUTER
@@ -27,24 +25,29 @@ namespace SteamNetworkingSocketsLib {
 //
 /////////////////////////////////////////////////////////////////////////////
 
-struct ThinkerLess
-{
-	bool operator()( const IThinker *a, const IThinker *b ) const
-	{
-		return a->GetNextThinkTime() > b->GetNextThinkTime();
-	}
-};
-class ThinkerSetIndex
+struct ThinkerTimingWheelTraits
 {
-public:
-	static void SetIndex( IThinker *p, int idx, void *pContext ) { p->m_queueIndex = idx; }
+	static inline CUtlTimingWheelLinks<IThinker> &Links( IThinker *p ) { return p->m_timingWheelLinks; }
+	static inline int64 Time( const IThinker *p ) { return p->m_usecNextThinkTime; }
 };
 
-static CUtlPriorityQueue<IThinker*,ThinkerLess,ThinkerSetIndex> s_queueThinkers;
+// Thinkers are bucketed into ~1ms ticks.  Thinkers that are due
+// within the current tick are scanned individually, so callbacks are
+// never early, and the timing precision is the same as a heap.
+static CUtlTimingWheel<IThinker,ThinkerTimingWheelTraits,10> s_wheelThinkers;
+
+#ifndef IS_STEAMDATAGRAMROUTER
+// Time when the service thread expects to wake up.  If somebody schedules
+// a think before this, we need to wake it up early.
+static SteamNetworkingMicroseconds s_usecServiceThreadWakeTime = k_nThinkTime_Never;
+
+// See ThinkerDeferServiceThreadWakeScope.  Protected by s_mutexThinkerTable
+static int s_nDeferServiceThreadWake = 0;
+static bool s_bServiceThreadWakeDeferred = false;
+#endif
 
 IThinker::IThinker()
 : m_usecNextThinkTime( k_nThinkTime_Never )
-, m_queueIndex( -1 )
 {
 }
 
@@ -100,49 +103,26 @@ void IThinker::InternalSetNextThinkTime( SteamNetworkingMicroseconds usecTargetT
 		usecTargetThinkTime = SteamNetworkingSockets_GetLocalTimestamp() + 2000;
 	}
 
-	// Clearing it?
-	if ( usecTargetThinkTime == k_nThinkTime_Never )
+	// Remove from our current position in the wheel, if any
+	if ( s_wheelThinkers.IsInWheel( this ) )
 	{
-		if ( m_queueIndex >= 0 )
-		{
-			Assert( s_queueThinkers.Element( m_queueIndex ) == this );
-			s_queueThinkers.RemoveAt( m_queueIndex );
-			Assert( m_queueIndex == -1 );
-		}
-
-		m_usecNextThinkTime = k_nThinkTime_Never;
-		return;
+		Assert( m_usecNextThinkTime != k_nThinkTime_Never );
+		s_wheelThinkers.Remove( this );
 	}
-
-	// Save current time when the next thinker wants service
-	#ifndef IS_STEAMDATAGRAMROUTER
-		SteamNetworkingMicroseconds usecNextWake = ( s_queueThinkers.Count() > 0 ) ? s_queueThinkers.ElementAtHead()->GetNextThinkTime() : k_nThinkTime_Never;
-	#endif
-
-	// Not currently scheduled?
-	if ( m_queueIndex < 0 )
+	else
 	{
 		Assert( m_usecNextThinkTime == k_nThinkTime_Never );
-		m_usecNextThinkTime = usecTargetThinkTime;
-		s_queueThinkers.Insert( this );
 	}
-	else
-	{
 
-		// We're already scheduled.
-		Assert( s_queueThinkers.Element( m_queueIndex ) == this );
-		Assert( m_usecNextThinkTime != k_nThinkTime_Never );
-
-		// Set the new schedule time
-		m_usecNextThinkTime = usecTargetThinkTime;
+	// Set the new schedule time
+	m_usecNextThinkTime = usecTargetThinkTime;
 
-		// And update our position in the queue
-		s_queueThinkers.RevaluateElement( m_queueIndex );
-	}
+	// Clearing it?
+	if ( usecTargetThinkTime == k_nThinkTime_Never )
+		return;
 
-	// Check that we know our place
-	Assert( m_queueIndex >= 0 );
-	Assert( s_queueThinkers.Element( m_queueIndex ) == this );
+	// Insert into the wheel.  This is O(1)
+	s_wheelThinkers.Insert( this );
 
 	#ifndef IS_STEAMDATAGRAMROUTER
 		// Do we need service before we were previously schedule to wake up?
@@ -150,95 +130,126 @@ void IThinker::InternalSetNextThinkTime( SteamNetworkingMicroseconds usecTargetT
 		// NOTE: On Windows we could use a waitable timer.  This would avoid
 		// waking up the service thread just to re-schedule when it should
 		// wake up for real.
-		if ( m_usecNextThinkTime < usecNextWake )
+		if ( m_usecNextThinkTime < s_usecServiceThreadWakeTime )
+		{
+			s_usecServiceThreadWakeTime = m_usecNextThinkTime;
+			if ( s_nDeferServiceThreadWake > 0 )
+				s_bServiceThreadWakeDeferred = true;
+			else
+				WakeServiceThread();
+		}
+	#endif
+}
+
+ThinkerDeferServiceThreadWakeScope::ThinkerDeferServiceThreadWakeScope()
+{
+	#ifndef IS_STEAMDATAGRAMROUTER
+		s_mutexThinkerTable.lock();
+		++s_nDeferServiceThreadWake;
+		s_mutexThinkerTable.unlock();
+	#endif
+}
+
+ThinkerDeferServiceThreadWakeScope::~ThinkerDeferServiceThreadWakeScope()
+{
+	#ifndef IS_STEAMDATAGRAMROUTER
+		s_mutexThinkerTable.lock();
+		Assert( s_nDeferServiceThreadWake > 0 );
+		bool bWake = false;
+		if ( --s_nDeferServiceThreadWake == 0 && s_bServiceThreadWakeDeferred )
+		{
+			s_bServiceThreadWakeDeferred = false;
+			bWake = true;
+		}
+		s_mutexThinkerTable.unlock();
+		if ( bWake )
 			WakeServiceThread();
 	#endif
 }
 
 SteamNetworkingMicroseconds IThinker::Thinker_GetNextScheduledThinkTime()
 {
-	SteamNetworkingMicroseconds usecResult = k_nThinkTime_Never;
 	s_mutexThinkerTable.lock();
-	if ( s_queueThinkers.Count() )
-		usecResult = s_queueThinkers.ElementAtHead()->GetNextThinkTime();
+
+	SteamNetworkingMicroseconds usecResult = s_wheelThinkers.GetNextTime();
+
+	// Remember when the service thread will wake up
+	#ifndef IS_STEAMDATAGRAMROUTER
+		s_usecServiceThreadWakeTime = usecResult;
+	#endif
+
 	s_mutexThinkerTable.unlock();
 	return usecResult;
 }
 
 void IThinker::Thinker_ProcessThinkers()
 {
-	// We need the lock to access the thinker queue
+	// We need the lock to access the thinker wheel
 	s_mutexThinkerTable.lock();
 
-	// Until the queue is empty
 	int nIterations = 0;
-	while ( s_queueThinkers.Count() > 0 )
+	for (;;)
 	{
 
-		// Grab the head element
-		IThinker *pNextThinker = s_queueThinkers.ElementAtHead();
-
-		// Refetch timestamp each time.  The reason is that certain thinkers
-		// may pass through to other systems (e.g. fake lag) that fetch the time.
-		// If we don't update the time here, that code may have used the newer
-		// timestamp (e.g. to mark when a packet was received) and then
-		// in our next iteration, we will use an older timestamp to process
-		// a thinker.
-		SteamNetworkingMicroseconds usecNow = SteamNetworkingSockets_GetLocalTimestamp();
-
-		// Scheduled too far in the future?
-		if ( pNextThinker->GetNextThinkTime() >= usecNow )
-		{
-			// Keep waiting
-			break;
-		}
-
-		++nIterations;
-		if ( nIterations > 10000 )
-		{
-			AssertMsg1( false, "Processed thinkers %d times -- probably one thinker keeps requesting an immediate wakeup call.", nIterations );
+		// Gather up everybody who is due into the expired list.
+		// If nobody is ready, then we're done
+		if ( s_wheelThinkers.CollectExpired( SteamNetworkingSockets_GetLocalTimestamp() ) == 0 && !s_wheelThinkers.GetExpiredHead() )
 			break;
-		}
 
-		// Try to acquire the thinker's lock, if any
-		if ( pNextThinker->TryLock() )
+		// Process the batch, in order.  Note that Think() can add or remove
+		// any thinker, including ones in the expired list, so we always just
+		// grab the head of the list.
+		while ( IThinker *pNextThinker = s_wheelThinkers.GetExpiredHead() )
 		{
 
-			// Go ahead and clear his think time now and remove him
-			// from the heap.  He needs to schedule a new think time
-			// if heeds service again.  For thinkers that need frequent
-			// service, removing them and then re-inserting them when
-			// they reschedule is a bit of extra work that could be
-			// optimized by trying to not remove them now, but adjusting
-			// them once we know when they want to think.  But this
-			// is probably just a bit too complicated for the expected
-			// benefit.  If the number of total Thinkers is relatively
-			// small (which it probably will be), the heap operations
-			// are probably negligible.
-			pNextThinker->InternalSetNextThinkTime( k_nThinkTime_Never );
-
-			// Release the global thinker table lock, so that other threads
-			// can schedule work while we are doing work here.
-			// (E.g. other connections can be accessed in the main thread,
-			// and can mark the connection to wake up.)
-			s_mutexThinkerTable.unlock();
-
-			// Execute callback.  (Note: this could result
-			// in self-destruction or essentially any change
-			// to the rest of the queue.)
-			pNextThinker->Think( usecNow );
-
-			// Re-acquire table lock for the next check
-			s_mutexThinkerTable.lock();
-		}
-		else
-		{
-			// Deadlock!  Should be extremely rare.  Reschedule him for 1ms in the
-			// future, and we'll try again.
-			pNextThinker->InternalSetNextThinkTime( usecNow + 1000 );
+			++nIterations;
+			if ( nIterations > 10000 )
+			{
+				AssertMsg1( false, "Processed thinkers %d times -- probably one thinker keeps requesting an immediate wakeup call.", nIterations );
+				goto done;
+			}
+
+			// Refetch timestamp each time.  The reason is that certain thinkers
+			// may pass through to other systems (e.g. fake lag) that fetch the time.
+			// If we don't update the time here, that code may have used the newer
+			// timestamp (e.g. to mark when a packet was received) and then
+			// in our next iteration, we will use an older timestamp to process
+			// a thinker.
+			SteamNetworkingMicroseconds usecNow = SteamNetworkingSockets_GetLocalTimestamp();
+
+			// Try to acquire the thinker's lock, if any
+			if ( pNextThinker->TryLock() )
+			{
+
+				// Go ahead and clear his think time now and remove him
+				// from the wheel.  He needs to schedule a new think time
+				// if heeds service again.
+				pNextThinker->InternalSetNextThinkTime( k_nThinkTime_Never );
+
+				// Release the global thinker table lock, so that other threads
+				// can schedule work while we are doing work here.
+				// (E.g. other connections can be accessed in the main thread,
+				// and can mark the connection to wake up.)
+				s_mutexThinkerTable.unlock();
+
+				// Execute callback.  (Note: this could result
+				// in self-destruction or essentially any change
+				// to the rest of the wheel.)
+				pNextThinker->Think( usecNow );
+
+				// Re-acquire table lock for the next check
+				s_mutexThinkerTable.lock();
+			}
+			else
+			{
+				// Deadlock!  Should be extremely rare.  Reschedule him for 1ms in the
+				// future, and we'll try again.
+				pNextThinker->InternalSetNextThinkTime( usecNow + 1000 );
+			}
 		}
 	}
 
+done:
 	// Release table lock
 	s_mutexThinkerTable.unlock();
 }
@@ -246,7 +257,7 @@ void IThinker::Thinker_ProcessThinkers()
 #ifdef DBGFLAG_VALIDATE
 void Thinker_ValidateStatics( CValidator &validator )
 {
-	ValidateRecursive( s_queueThinkers );
+	s_wheelThinkers.Validate( validator, "s_wheelThinkers" );
 }
 
 void IThinker::Validate( CValidator &validator, const char *pchName )
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "steamnetworkingsockets_internal.h"
+#include <tier1/utltimingwheel.h>
 
 namespace SteamNetworkingSocketsLib {
 
@@ -16,7 +17,7 @@ namespace SteamNetworkingSocketsLib {
 
 const SteamNetworkingMicroseconds k_nThinkTime_Never = INT64_MAX;
 const SteamNetworkingMicroseconds k_nThinkTime_ASAP = 1; // by convention, we do not allow setting a think time to 0, since 0 is often an uninitialized variable.
-class ThinkerSetIndex;
+struct ThinkerTimingWheelTraits;
 
 class IThinker
 {
@@ -71,8 +72,8 @@ protected:
 
 private:
 	SteamNetworkingMicroseconds m_usecNextThinkTime;
-	int m_queueIndex;
-	friend class ThinkerSetIndex;
+	CUtlTimingWheelLinks<IThinker> m_timingWheelLinks;
+	friend struct ThinkerTimingWheelTraits;
 
 	void InternalSetNextThinkTime( SteamNetworkingMicroseconds usecTargetThinkTime );
 	void InternalEnsureMinThinkTime( SteamNetworkingMicroseconds usecTargetThinkTime );
@@ -81,6 +82,17 @@ public:
 	virtual void Validate( CValidator &validator, const char *pchName );
 	#endif
 };
+/// While any of these exist, scheduling a thinker earlier than the service
+/// thread is planning to wake up does not wake it right away.  Instead, it
+/// is woken once, when the last scope is destroyed.  Use this when queuing
+/// work on many objects at once, so that the service thread does not start
+/// processing the first one while we are still busy with the rest.
+struct ThinkerDeferServiceThreadWakeScope
+{
+	ThinkerDeferServiceThreadWakeScope();
+	~ThinkerDeferServiceThreadWakeScope();
+};
+
 template <typename L>
 class ILockableThinker : public IThinker
 {
@@ -0,0 +1,11 @@
+// CHECK macros for the tests that poke at library internals directly.
+// A failed check asserts (if asserts are enabled) and sets g_failed,
+// which the test program must define.
+#pragma once
+
+#include <tier0/dbg.h>
+
+extern bool g_failed;
+
+#define CHECK(x) do { bool _check_result; Assert( (_check_result = (x)) != false ); g_failed |= !_check_result; } while(0)
+#define CHECK_EQUAL(a,b) do { bool _check_eq_result; Assert( (_check_eq_result = ((a)==(b))) != false ); g_failed |= !_check_eq_result; } while(0)
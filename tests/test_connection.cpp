@@ -6,8 +6,12 @@
 #include <string.h>
 #include <string>
 #include <random>
+#include <algorithm>
+#include <vector>
 #include <chrono>
+#include <ctime>
 #include <thread>
+#include <atomic>
 
 #include <steam/steamnetworkingsockets.h>
 #include <steam/isteamnetworkingutils.h>
@@ -1185,6 +1189,1494 @@ void Test_netloopback_throughput()
 	SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
 }
 
+// Benchmark batched UDP receive.  Blast small unreliable messages across
+// a socket pair that talks over the loopback adapter, with batching
+// on and off, and report the packet rate and the number of recv
+// system calls we needed per packet.
+void Test_netloopback_recv_batching()
+{
+	HSteamNetConnection hServer, hClient;
+	assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+	SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+	SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+
+	// Don't let the send rate be the bottleneck
+	const int nSendRate = 64*1000*1000;
+	SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendRateMin, nSendRate );
+	SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendRateMax, nSendRate );
+	SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendBufferSize, 4*1024*1024 );
+
+	constexpr int k_cbMsg = 200;
+	constexpr int k_nMsgsPerPump = 256;
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 3 * 1e6 );
+	char msg[ k_cbMsg ] = {};
+
+	for ( int nBatchSize: { 1, 8, 32 } )
+	{
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_RecvBatchSize, nBatchSize );
+
+		// Clear counters
+		SteamNetworkingGlobalStats_t stats;
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+
+		int64 nMsgRecv = 0;
+		SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecNow;
+		do
+		{
+			TEST_PumpCallbacks();
+
+			for ( int i = 0 ; i < k_nMsgsPerPump ; ++i )
+				SteamNetworkingSockets()->SendMessageToConnection( hServer, msg, k_cbMsg, k_nSteamNetworkingSend_UnreliableNoNagle, nullptr );
+
+			SteamNetworkingMessage_t *pMsg[ 64 ];
+			for (;;)
+			{
+				int nMsg = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hClient, pMsg, 64 );
+				assert( nMsg >= 0 );
+				for ( int i = 0 ; i < nMsg ; ++i )
+					pMsg[i]->Release();
+				nMsgRecv += nMsg;
+				if ( nMsg < 64 )
+					break;
+			}
+
+			usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		} while ( usecNow < usecStartTime + k_usecRunTime );
+
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+		double flElapsedSeconds = ( usecNow - usecStartTime ) * 1e-6;
+		TEST_Printf( "RecvBatchSize=%2d: %8.0f pkts/sec  %6.3f syscalls/pkt  (%lld msgs recv)  Send: %6.3f syscalls/pkt\n",
+			nBatchSize,
+			stats.m_nRecvPackets / flElapsedSeconds,
+			stats.m_nRecvPackets > 0 ? (double)stats.m_nRecvSyscalls / (double)stats.m_nRecvPackets : 0.0,
+			(long long)nMsgRecv,
+			stats.m_nSendPackets > 0 ? (double)stats.m_nSendSyscalls / (double)stats.m_nSendPackets : 0.0
+		);
+		assert( stats.m_nRecvPackets > 0 );
+	}
+
+	// Cleanup
+	SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+	SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+}
+
+// Send reliable data at a fixed rate over the loopback adapter, with and
+// without kernel pacing (SO_TXTIME), and check that we still deliver at
+// the configured rate.  The loopback adapter doesn't use the fq qdisc,
+// so the packets are not actually held, but we can see that they were
+// stamped, and that the sender hands them to the OS in bigger batches.
+void Test_netloopback_txtime_pacing()
+{
+	const int nSendRate = 4*1000*1000;
+	constexpr int k_cbQueueTarget = 256*1024;
+	constexpr int k_cbMsg = 16*1024;
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 3 * 1e6 );
+
+	for ( int usecHorizon: { 0, 4000 } )
+	{
+		// Must be set before the sockets are opened
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_SendTxTimeHorizon, usecHorizon );
+
+		HSteamNetConnection hServer, hClient;
+		assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+		SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+		SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendRateMin, nSendRate );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendRateMax, nSendRate );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendBufferSize, 1024*1024 );
+
+		// Clear counters
+		SteamNetworkingGlobalStats_t stats;
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+
+		int64 cbRecv = 0;
+		SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecNow;
+		do
+		{
+			TEST_PumpCallbacks();
+
+			// Keep the pipe full
+			SteamNetConnectionRealTimeStatus_t serverStatus;
+			assert( k_EResultOK == SteamNetworkingSockets()->GetConnectionRealTimeStatus( hServer, &serverStatus, 0, nullptr ) );
+			while ( serverStatus.m_cbPendingReliable < k_cbQueueTarget )
+			{
+				SteamNetworkingMessage_t *pSendMsg = SteamNetworkingUtils()->AllocateMessage( k_cbMsg );
+				pSendMsg->m_conn = hServer;
+				pSendMsg->m_nFlags = k_nSteamNetworkingSend_Reliable;
+				SteamNetworkingSockets()->SendMessages( 1, &pSendMsg, nullptr );
+				serverStatus.m_cbPendingReliable += k_cbMsg;
+			}
+
+			// Drain the receive side
+			SteamNetworkingMessage_t *pMsgs[ 64 ];
+			int nMsgs;
+			while ( ( nMsgs = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hClient, pMsgs, 64 ) ) > 0 )
+			{
+				for ( int i = 0 ; i < nMsgs ; ++i )
+				{
+					cbRecv += pMsgs[i]->m_cbSize;
+					pMsgs[i]->Release();
+				}
+			}
+
+			std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+			usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		} while ( usecNow < usecStartTime + k_usecRunTime );
+
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+		double flElapsedSeconds = ( usecNow - usecStartTime ) * 1e-6;
+		double flRecvRate = cbRecv / flElapsedSeconds;
+		TEST_Printf( "SendTxTimeHorizon=%5dus: Recv:%7.0fK/sec  %6.3f send syscalls/pkt  %lld of %lld pkts stamped\n",
+			usecHorizon,
+			flRecvRate * 1e-3,
+			stats.m_nSendPackets > 0 ? (double)stats.m_nSendSyscalls / (double)stats.m_nSendPackets : 0.0,
+			(long long)stats.m_nSendPacketsTxTime,
+			(long long)stats.m_nSendPackets
+		);
+
+		// We should be delivering at about the configured rate either way,
+		// and only stamp packets when asked to
+		assert( flRecvRate > nSendRate * 0.8 && flRecvRate < nSendRate * 1.2 );
+		if ( usecHorizon == 0 )
+			assert( stats.m_nSendPacketsTxTime == 0 );
+		#ifdef __linux__
+			else
+				assert( stats.m_nSendPacketsTxTime > 0 );
+		#endif
+
+		SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+		SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+	}
+
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_SendTxTimeHorizon, 0 );
+}
+
+// Measure one-way latency of messages that are delayed by a short Nagle
+// timer, over a socket pair on the loopback adapter.  The message goes
+// out when the service thread wakes up for the Nagle deadline, so this
+// shows how precisely the service thread wakes up.  Compare waits rounded
+// to milliseconds with precise waits (k_ESteamNetworkingConfig_PreciseServiceWait).
+void Test_netloopback_latency()
+{
+	HSteamNetConnection hServer, hClient;
+	assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+	SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+	SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+
+	constexpr int k_usecNagle = 250;
+	SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_NagleTime, k_usecNagle );
+
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 2 * 1e6 );
+	double flMedian[2];
+	for ( int bPrecise = 0 ; bPrecise <= 1 ; ++bPrecise )
+	{
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_PreciseServiceWait, bPrecise );
+
+		std::vector<SteamNetworkingMicroseconds> vecLatency;
+		SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecNow;
+		do
+		{
+			TEST_PumpCallbacks();
+
+			// Send a message stamped with the current time
+			usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+			SteamNetworkingSockets()->SendMessageToConnection( hServer, &usecNow, sizeof(usecNow), k_nSteamNetworkingSend_Unreliable, nullptr );
+
+			// Wait a bit, at a random phase relative to the millisecond clock
+			std::this_thread::sleep_for( std::chrono::microseconds( std::uniform_int_distribution<>( 1500, 2500 )( g_rand ) ) );
+
+			// Check when the messages actually arrived
+			SteamNetworkingMessage_t *pMsgs[ 16 ];
+			int nMsgs;
+			while ( ( nMsgs = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hClient, pMsgs, 16 ) ) > 0 )
+			{
+				for ( int i = 0 ; i < nMsgs ; ++i )
+				{
+					SteamNetworkingMicroseconds usecSent;
+					assert( pMsgs[i]->m_cbSize == sizeof(usecSent) );
+					memcpy( &usecSent, pMsgs[i]->m_pData, sizeof(usecSent) );
+					vecLatency.push_back( pMsgs[i]->m_usecTimeReceived - usecSent );
+					pMsgs[i]->Release();
+				}
+			}
+
+			usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		} while ( usecNow < usecStartTime + k_usecRunTime );
+
+		assert( vecLatency.size() > 100 );
+		std::sort( vecLatency.begin(), vecLatency.end() );
+		auto Percentile = [&]( double p ) { return (double)vecLatency[ size_t( p * ( vecLatency.size() - 1 ) ) ]; };
+		flMedian[ bPrecise ] = Percentile( .5 );
+		TEST_Printf( "PreciseServiceWait=%d: %d msgs, one-way latency (Nagle %dus): p50=%4.0fus  p90=%4.0fus  p99=%4.0fus  max=%5.0fus\n",
+			bPrecise, (int)vecLatency.size(), k_usecNagle,
+			Percentile( .5 ), Percentile( .9 ), Percentile( .99 ), (double)vecLatency.back() );
+	}
+
+	// Precise waits should never make things worse
+	assert( flMedian[1] <= flMedian[0] + 100 );
+
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_PreciseServiceWait, 1 );
+	SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+	SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+}
+
+// Measure the time from when a message is sent until it is dispatched
+// on the receiving side, over a socket pair on the loopback adapter,
+// with the service thread sleeping in epoll vs spinning.  Also report
+// how much CPU the process burned, which is the cost of spinning.
+void Test_netloopback_spin_latency()
+{
+	HSteamNetConnection hServer, hClient;
+	assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+	SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+	SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 2 * 1e6 );
+	for ( int usecSpin: { 0, 5000 } )
+	{
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_ServiceThreadSpinTime, usecSpin );
+
+		std::vector<SteamNetworkingMicroseconds> vecLatency;
+		std::clock_t cpuStart = std::clock();
+		SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecNow;
+		do
+		{
+			TEST_PumpCallbacks();
+
+			// Send a message stamped with the current time.  It goes out
+			// right away, so the latency is dominated by how quickly the
+			// service thread notices it on the other side.
+			usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+			SteamNetworkingSockets()->SendMessageToConnection( hServer, &usecNow, sizeof(usecNow), k_nSteamNetworkingSend_UnreliableNoNagle, nullptr );
+
+			std::this_thread::sleep_for( std::chrono::microseconds( std::uniform_int_distribution<>( 500, 1500 )( g_rand ) ) );
+
+			SteamNetworkingMessage_t *pMsgs[ 16 ];
+			int nMsgs;
+			while ( ( nMsgs = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hClient, pMsgs, 16 ) ) > 0 )
+			{
+				for ( int i = 0 ; i < nMsgs ; ++i )
+				{
+					SteamNetworkingMicroseconds usecSent;
+					assert( pMsgs[i]->m_cbSize == sizeof(usecSent) );
+					memcpy( &usecSent, pMsgs[i]->m_pData, sizeof(usecSent) );
+					vecLatency.push_back( pMsgs[i]->m_usecTimeReceived - usecSent );
+					pMsgs[i]->Release();
+				}
+			}
+
+			usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		} while ( usecNow < usecStartTime + k_usecRunTime );
+
+		double flCPUSeconds = double( std::clock() - cpuStart ) / CLOCKS_PER_SEC;
+		double flElapsedSeconds = ( usecNow - usecStartTime ) * 1e-6;
+
+		assert( vecLatency.size() > 100 );
+		std::sort( vecLatency.begin(), vecLatency.end() );
+		auto Percentile = [&]( double p ) { return (double)vecLatency[ size_t( p * ( vecLatency.size() - 1 ) ) ]; };
+		TEST_Printf( "ServiceThreadSpinTime=%5dus: %d msgs, send-to-dispatch: p50=%4.0fus  p90=%4.0fus  p99=%4.0fus  max=%5.0fus  CPU:%4.0f%%\n",
+			usecSpin, (int)vecLatency.size(),
+			Percentile( .5 ), Percentile( .9 ), Percentile( .99 ), (double)vecLatency.back(),
+			flCPUSeconds / flElapsedSeconds * 100.0 );
+	}
+
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_ServiceThreadSpinTime, 0 );
+	SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+	SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+}
+
+void Test_bandwidth_estimation()
+{
+	// Make sure we drop packets if the sender exceeds the "bottleneck"
+	// rate, and check that the estimator finds it
+	for ( int nLimitKB: { 300, 1500 } )
+	{
+		const int nLimit = nLimitKB*1000;
+		TEST_Printf( "-- BOTTLENECK: %dKB/sec -------\n\n", nLimitKB );
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakeRateLimit_Send_Rate, nLimit );
+
+		HSteamNetConnection hServer, hClient;
+		assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+		SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+		SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+
+		// Give the estimator plenty of room on both sides
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendRateMin, 32*1000 );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendRateMax, 16*1000*1000 );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendBufferSize, 1024*1024 );
+
+		constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 8 * 1e6 );
+		constexpr SteamNetworkingMicroseconds k_usecMeasureAfter = SteamNetworkingMicroseconds( 4 * 1e6 );
+		constexpr int k_cbQueueTarget = 128*1024;
+		constexpr int k_cbMsg = 16*1024;
+
+		SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecLastPrint = usecStartTime;
+		int64 cbRecv = 0, cbRecvLastPrint = 0, cbRecvMeasureStart = -1;
+		double flEstimateSum = 0.0;
+		int nEstimateSamples = 0;
+		for (;;)
+		{
+			TEST_PumpCallbacks();
+
+			SteamNetConnectionRealTimeStatus_t serverStatus;
+			assert( k_EResultOK == SteamNetworkingSockets()->GetConnectionRealTimeStatus( hServer, &serverStatus, 0, nullptr ) );
+
+			SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+			SteamNetworkingMicroseconds usecElapsed = usecNow - usecStartTime;
+			if ( usecElapsed > k_usecRunTime )
+				break;
+			if ( usecElapsed > k_usecMeasureAfter && cbRecvMeasureStart < 0 )
+				cbRecvMeasureStart = cbRecv;
+
+			// Print and sample the estimate periodically
+			if ( usecNow > usecLastPrint + 500*1000 )
+			{
+				TEST_Printf( "Elapsed:%6.0fms  Estimate:%7.0fK/sec  Recv:%7.0fK/sec  Pending:%5dK\n",
+					usecElapsed * 1e-3,
+					serverStatus.m_nSendRateBytesPerSecond * 1e-3,
+					( cbRecv - cbRecvLastPrint ) * 1e-3 / ( ( usecNow - usecLastPrint ) * 1e-6 ),
+					serverStatus.m_cbPendingReliable / 1024
+				);
+				if ( cbRecvMeasureStart >= 0 )
+				{
+					flEstimateSum += serverStatus.m_nSendRateBytesPerSecond;
+					++nEstimateSamples;
+				}
+				usecLastPrint = usecNow;
+				cbRecvLastPrint = cbRecv;
+			}
+
+			// Keep the pipe full
+			while ( serverStatus.m_cbPendingReliable < k_cbQueueTarget )
+			{
+				SteamNetworkingMessage_t *pSendMsg = SteamNetworkingUtils()->AllocateMessage( k_cbMsg );
+				pSendMsg->m_conn = hServer;
+				pSendMsg->m_nFlags = k_nSteamNetworkingSend_Reliable;
+				SteamNetworkingSockets()->SendMessages( 1, &pSendMsg, nullptr );
+				serverStatus.m_cbPendingReliable += k_cbMsg;
+			}
+
+			// Drain the receive side
+			SteamNetworkingMessage_t *pMsgs[ 64 ];
+			int nMsgs;
+			while ( ( nMsgs = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hClient, pMsgs, 64 ) ) > 0 )
+			{
+				for ( int i = 0 ; i < nMsgs ; ++i )
+				{
+					cbRecv += pMsgs[i]->m_cbSize;
+					pMsgs[i]->Release();
+				}
+			}
+
+			std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+		}
+
+		double flAvgEstimate = flEstimateSum / std::max( nEstimateSamples, 1 );
+		double flAvgRecv = ( cbRecv - cbRecvMeasureStart ) / ( ( k_usecRunTime - k_usecMeasureAfter ) * 1e-6 );
+		TEST_Printf( "Bottleneck %dK/sec: avg estimate %.0fK/sec (%.0f%%), avg goodput %.0fK/sec (%.0f%%)\n\n",
+			nLimitKB, flAvgEstimate * 1e-3, flAvgEstimate * 100.0 / nLimit, flAvgRecv * 1e-3, flAvgRecv * 100.0 / nLimit );
+
+		// We should converge near the bottleneck, and actually use most of it
+		assert( flAvgEstimate > nLimit * 0.7 && flAvgEstimate < nLimit * 1.3 );
+		assert( flAvgRecv > nLimit * 0.6 );
+
+		SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+		SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+	}
+
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakeRateLimit_Send_Rate, 0 );
+}
+
+// Contents of test message bodies, based on the message number,
+// so that we can tell if anything got mixed up
+static uint8 MsgPattern( int64 nMsgNum, int ofs ) { return uint8( nMsgNum*131 + ofs*7 + ( ofs >> 8 ) ); }
+
+// Stream a large amount of reliable data over a lossy connection, and make
+// sure it all arrives intact.  With packet loss, the receiver is constantly
+// buffering data behind gaps in the reliable stream, and then dispatching
+// a bunch of it at once when the gap is filled.  Reports the throughput.
+void Test_reliable_stream_lossy()
+{
+	const int64 k_cbTotal = 64*1024*1024;
+	const int k_cbMsg = k_cbMaxSteamNetworkingSocketsMessageSizeSend;
+	const int k_nSendRate = 256*1000*1000;
+	const int k_cbMaxQueued = 4*1024*1024;
+
+	// Create a loopback connection, over the local network, so that
+	// the fake packet loss applies
+	SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, 1.0f );
+	SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Recv, 0 );
+	HSteamNetConnection hServer, hClient;
+	assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+	SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+	SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+	for ( HSteamNetConnection hConn: { hServer, hClient } )
+	{
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hConn, k_ESteamNetworkingConfig_SendRateMin, k_nSendRate );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hConn, k_ESteamNetworkingConfig_SendRateMax, k_nSendRate );
+	}
+	SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_SendBufferSize, k_cbMaxQueued + k_cbMsg );
+	SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_RecvBufferSize, 8*1024*1024 );
+
+	SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+	SteamNetworkingMicroseconds usecLastPrint = usecStartTime;
+	int64 cbBytesSent = 0;
+	int64 cbBytesRecv = 0;
+	int64 nMsgSent = 0;
+	int64 nMsgRecv = 0;
+	while ( cbBytesRecv < k_cbTotal )
+	{
+		TEST_PumpCallbacks();
+
+		SteamNetConnectionRealTimeStatus_t serverStatus;
+		assert( k_EResultOK == SteamNetworkingSockets()->GetConnectionRealTimeStatus( hServer, &serverStatus, 0, nullptr ) );
+
+		// Keep the send queue full
+		while ( cbBytesSent < k_cbTotal && serverStatus.m_cbPendingReliable + k_cbMsg <= k_cbMaxQueued )
+		{
+			SteamNetworkingMessage_t *pSendMsg = SteamNetworkingUtils()->AllocateMessage( k_cbMsg );
+			pSendMsg->m_conn = hServer;
+			pSendMsg->m_nFlags = k_nSteamNetworkingSend_Reliable;
+			++nMsgSent;
+			uint8 *pData = (uint8 *)pSendMsg->m_pData;
+			for ( int i = 0 ; i < k_cbMsg ; ++i )
+				pData[i] = MsgPattern( nMsgSent, i );
+
+			int64 nMsgNumberOrResult;
+			SteamNetworkingSockets()->SendMessages( 1, &pSendMsg, &nMsgNumberOrResult );
+			assert( nMsgNumberOrResult == nMsgSent );
+			serverStatus.m_cbPendingReliable += k_cbMsg;
+			cbBytesSent += k_cbMsg;
+		}
+
+		// Receive, and check the contents
+		SteamNetworkingMessage_t *pMsg[ 16 ];
+		int nMsg = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hClient, pMsg, 16 );
+		assert( nMsg >= 0 );
+		for ( int i = 0 ; i < nMsg ; ++i )
+		{
+			++nMsgRecv;
+			assert( pMsg[i]->m_nMessageNumber == nMsgRecv );
+			assert( pMsg[i]->m_cbSize == k_cbMsg );
+			const uint8 *pData = (const uint8 *)pMsg[i]->m_pData;
+			for ( int j = 0 ; j < k_cbMsg ; ++j )
+			{
+				if ( pData[j] != MsgPattern( nMsgRecv, j ) )
+				{
+					TEST_Printf( "Message %lld corrupt at offset %d\n", (long long)nMsgRecv, j );
+					TEST_Fatal( "Reliable stream corruption" );
+				}
+			}
+			cbBytesRecv += pMsg[i]->m_cbSize;
+			pMsg[i]->Release();
+		}
+
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		if ( usecLastPrint + 1000*1000 < usecNow )
+		{
+			double flElapsedSeconds = ( usecNow - usecStartTime ) * 1e-6;
+			TEST_Printf( "Elapsed:%6.0fms   Sent:%7.0fK   Recv:%7.0fK = %5.0fK/sec\n",
+				flElapsedSeconds * 1e3, cbBytesSent * 1e-3, cbBytesRecv * 1e-3, cbBytesRecv * 1e-3 / flElapsedSeconds );
+			usecLastPrint = usecNow;
+			assert( flElapsedSeconds < 120.0 );
+		}
+	}
+
+	{
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		double flElapsedSeconds = ( usecNow - usecStartTime ) * 1e-6;
+		TEST_Printf( "TOTAL:  %6.0fms   Recv:%7.0fK in %lld messages = %5.0fK/sec\n\n",
+			flElapsedSeconds * 1e3, cbBytesRecv * 1e-3, (long long)nMsgRecv, cbBytesRecv * 1e-3 / flElapsedSeconds );
+	}
+
+	// Cleanup
+	SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+	SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+	SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, 0 );
+}
+
+// Send a steady stream of packets, some of which are reordered by a
+// fixed amount, and make sure the receiver learns to wait that long
+// before NACKing.
+void Test_nack_delay_reorder()
+{
+	const int k_msReorderTime = 10;
+	const SteamNetworkingMicroseconds k_usecFixedNackDelay = 3000;
+
+	SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketReorder_Send, 10.0f );
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakePacketReorder_Time, k_msReorderTime );
+	HSteamNetConnection hServer, hClient;
+	assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+	SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+	SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+
+	// Server is not learning, so it should always use the fixed delay
+	SteamNetworkingUtils()->SetConnectionConfigValueInt32( hServer, k_ESteamNetworkingConfig_NackDelayPercentile, 0 );
+
+	SteamNetConnectionRealTimeStatus_t status;
+	assert( k_EResultOK == SteamNetworkingSockets()->GetConnectionRealTimeStatus( hClient, &status, 0, nullptr ) );
+	assert( status.m_usecNackDelay == k_usecFixedNackDelay );
+
+	// Send small reliable messages in both directions, every couple of milliseconds.
+	// (Reliable, so that the sender keeps asking for acks, and the receiver
+	// keeps tracking the gaps.)
+	SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+	while ( SteamNetworkingUtils()->GetLocalTimestamp() < usecStartTime + 3*1000*1000 )
+	{
+		uint8 payload[ 32 ] = {};
+		for ( HSteamNetConnection hConn: { hServer, hClient } )
+		{
+			SteamNetworkingSockets()->SendMessageToConnection( hConn, payload, sizeof(payload), k_nSteamNetworkingSend_ReliableNoNagle, nullptr );
+
+			SteamNetworkingMessage_t *pMsg[ 16 ];
+			int nMsg;
+			while ( ( nMsg = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hConn, pMsg, 16 ) ) > 0 )
+			{
+				for ( int i = 0 ; i < nMsg ; ++i )
+					pMsg[i]->Release();
+			}
+		}
+		TEST_PumpCallbacks();
+	}
+
+	// Check what each side learned
+	assert( k_EResultOK == SteamNetworkingSockets()->GetConnectionRealTimeStatus( hClient, &status, 0, nullptr ) );
+	TEST_Printf( "Client learned NACK delay %.1fms\n", status.m_usecNackDelay * 1e-3 );
+	assert( status.m_usecNackDelay >= k_msReorderTime*1000/2 );
+	assert( status.m_usecNackDelay <= k_msReorderTime*1000*4 );
+	assert( k_EResultOK == SteamNetworkingSockets()->GetConnectionRealTimeStatus( hServer, &status, 0, nullptr ) );
+	TEST_Printf( "Server NACK delay %.1fms (fixed)\n", status.m_usecNackDelay * 1e-3 );
+	assert( status.m_usecNackDelay == k_usecFixedNackDelay );
+
+	// Cleanup
+	SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+	SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+	SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketReorder_Send, 0 );
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakePacketReorder_Time, 15 );
+}
+
+// Send fragmented unreliable messages over a lossy link, with and
+// without FEC, and compare how many of them get through.
+void Test_unreliable_fec_loss_sweep()
+{
+	const int k_nMsgs = 500;
+	const int k_cbMsg = 4000;
+
+	for ( float flLossPct: { 0.0f, 2.0f, 5.0f, 10.0f } )
+	{
+		float arDelivered[2];
+		for ( int bFEC = 0 ; bFEC < 2 ; ++bFEC )
+		{
+			SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, 0 );
+			HSteamNetConnection hServer, hClient;
+			assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+			SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+			SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+			SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_SendRateMin, 10*1024*1024 );
+			SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_SendRateMax, 10*1024*1024 );
+			SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_SendBufferSize, 10*1024*1024 );
+			SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_UnreliableFECLanes, bFEC ? 1 : 0 );
+			SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, flLossPct );
+
+			std::vector<bool> vecReceived( k_nMsgs, false );
+			int nReceived = 0;
+			auto ReceiveMessages = [&]()
+			{
+				SteamNetworkingMessage_t *pMsg[ 16 ];
+				int nMsg;
+				while ( ( nMsg = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hServer, pMsg, 16 ) ) > 0 )
+				{
+					for ( int i = 0 ; i < nMsg ; ++i )
+					{
+						assert( pMsg[i]->m_cbSize == k_cbMsg );
+						const uint8 *pData = (const uint8 *)pMsg[i]->m_pData;
+						int idx;
+						memcpy( &idx, pData, sizeof(idx) );
+						assert( idx >= 0 && idx < k_nMsgs );
+						for ( int j = sizeof(idx) ; j < k_cbMsg ; ++j )
+							assert( pData[j] == uint8( idx + j ) );
+						assert( !vecReceived[idx] );
+						vecReceived[idx] = true;
+						++nReceived;
+						pMsg[i]->Release();
+					}
+				}
+			};
+
+			// Send a couple of messages each time through the loop
+			uint8 msg[ k_cbMsg ];
+			for ( int idx = 0 ; idx < k_nMsgs ; ++idx )
+			{
+				memcpy( msg, &idx, sizeof(idx) );
+				for ( int j = sizeof(idx) ; j < k_cbMsg ; ++j )
+					msg[j] = uint8( idx + j );
+				assert( SteamNetworkingSockets()->SendMessageToConnection( hClient, msg, k_cbMsg, k_nSteamNetworkingSend_UnreliableNoNagle, nullptr ) == k_EResultOK );
+				if ( idx % 2 )
+				{
+					TEST_PumpCallbacks();
+					ReceiveMessages();
+				}
+			}
+
+			// Wait for stragglers
+			SteamNetworkingMicroseconds usecStopTime = SteamNetworkingUtils()->GetLocalTimestamp() + 500*1000;
+			while ( SteamNetworkingUtils()->GetLocalTimestamp() < usecStopTime )
+			{
+				TEST_PumpCallbacks();
+				ReceiveMessages();
+			}
+
+			arDelivered[bFEC] = float( nReceived ) / k_nMsgs;
+
+			SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, 0 );
+			SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+			SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+		}
+
+		TEST_Printf( "Loss %4.1f%%: delivered %5.1f%% without FEC, %5.1f%% with FEC\n", flLossPct, arDelivered[0]*100.0f, arDelivered[1]*100.0f );
+		if ( flLossPct == 0.0f )
+		{
+			assert( arDelivered[0] == 1.0f );
+			assert( arDelivered[1] == 1.0f );
+		}
+		else if ( flLossPct >= 10.0f )
+		{
+			assert( arDelivered[1] > arDelivered[0] + 0.1f );
+		}
+	}
+}
+
+// Send unreliable messages of all sizes, most of them fragmented,
+// over a link that drops, reorders, and duplicates packets.  Make sure
+// every message that gets reassembled is delivered exactly once, intact.
+void Test_unreliable_reassembly()
+{
+	const int k_nMsgs = 1000;
+	auto MsgSize = []( int idx ) -> int { return int( sizeof(int) + ( uint32( idx ) * 2654435761u >> 8 ) % 6000 ); };
+
+	for ( float flLossPct: { 0.0f, 5.0f } )
+	{
+		SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, 0 );
+		HSteamNetConnection hServer, hClient;
+		assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+		SteamNetworkingSockets()->SetConnectionName( hServer, "server" );
+		SteamNetworkingSockets()->SetConnectionName( hClient, "client" );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_SendRateMin, 4*1024*1024 );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_SendRateMax, 4*1024*1024 );
+		SteamNetworkingUtils()->SetConnectionConfigValueInt32( hClient, k_ESteamNetworkingConfig_SendBufferSize, 10*1024*1024 );
+		SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, flLossPct );
+		SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketReorder_Send, 10.0f );
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakePacketReorder_Time, 1 );
+		SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketDup_Send, 10.0f );
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakePacketDup_TimeMax, 1 );
+
+		std::vector<bool> vecReceived( k_nMsgs, false );
+		int nReceived = 0;
+		auto ReceiveMessages = [&]()
+		{
+			SteamNetworkingMessage_t *pMsg[ 16 ];
+			int nMsg;
+			while ( ( nMsg = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hServer, pMsg, 16 ) ) > 0 )
+			{
+				for ( int i = 0 ; i < nMsg ; ++i )
+				{
+					const uint8 *pData = (const uint8 *)pMsg[i]->m_pData;
+					int idx;
+					assert( pMsg[i]->m_cbSize >= (int)sizeof(idx) );
+					memcpy( &idx, pData, sizeof(idx) );
+					assert( idx >= 0 && idx < k_nMsgs );
+					if ( pMsg[i]->m_cbSize != MsgSize( idx ) )
+						TEST_Fatal( "Message %d is %d bytes, expected %d", idx, pMsg[i]->m_cbSize, MsgSize( idx ) );
+					for ( int j = sizeof(idx) ; j < pMsg[i]->m_cbSize ; ++j )
+					{
+						if ( pData[j] != MsgPattern( idx, j ) )
+							TEST_Fatal( "Message %d corrupt at offset %d", idx, j );
+					}
+					if ( vecReceived[idx] )
+						TEST_Fatal( "Message %d delivered twice", idx );
+					vecReceived[idx] = true;
+					++nReceived;
+					pMsg[i]->Release();
+				}
+			}
+		};
+
+		uint8 msg[ 8000 ];
+		for ( int idx = 0 ; idx < k_nMsgs ; ++idx )
+		{
+			int cbMsg = MsgSize( idx );
+			memcpy( msg, &idx, sizeof(idx) );
+			for ( int j = sizeof(idx) ; j < cbMsg ; ++j )
+				msg[j] = MsgPattern( idx, j );
+			assert( SteamNetworkingSockets()->SendMessageToConnection( hClient, msg, cbMsg, k_nSteamNetworkingSend_UnreliableNoNagle, nullptr ) == k_EResultOK );
+			if ( idx % 4 == 3 )
+			{
+				TEST_PumpCallbacks();
+				ReceiveMessages();
+			}
+		}
+
+		// Wait for stragglers
+		SteamNetworkingMicroseconds usecStopTime = SteamNetworkingUtils()->GetLocalTimestamp() + 500*1000;
+		while ( SteamNetworkingUtils()->GetLocalTimestamp() < usecStopTime )
+		{
+			TEST_PumpCallbacks();
+			ReceiveMessages();
+		}
+
+		// Even with no loss, the receiver only buffers a limited number of
+		// unreliable segments, and will throw away an incomplete message
+		// when reordering leaves too many of them waiting.  So allow a few
+		// to go missing.
+		TEST_Printf( "Loss %4.1f%%: delivered %d of %d messages\n", flLossPct, nReceived, k_nMsgs );
+		if ( flLossPct == 0.0f )
+			assert( nReceived >= k_nMsgs*98/100 );
+		else
+			assert( nReceived > k_nMsgs/2 );
+
+		SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, 0 );
+		SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketReorder_Send, 0 );
+		SteamNetworkingUtils()->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketDup_Send, 0 );
+		SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+		SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+	}
+}
+
+void Test_message_pool()
+{
+	constexpr int k_nMsgs = 256;
+	constexpr int k_nRounds = 100;
+	SteamNetworkingMessage_t *pMsgs[ k_nMsgs ];
+
+	// Mix of no buffer, small, MTU-sized, and too big to pool
+	const int arSizes[] = { 0, 100, 1200, 64*1024 };
+
+	SteamNetworkingGlobalStats_t statsStart, stats;
+	SteamNetworkingSockets_GetGlobalStats( &statsStart, true );
+
+	// Allocate and free on the same thread.  After the first round, nearly
+	// everything should come from the pool
+	for ( int r = 0 ; r < k_nRounds ; ++r )
+	{
+		for ( int i = 0 ; i < k_nMsgs ; ++i )
+		{
+			pMsgs[i] = SteamNetworkingUtils()->AllocateMessage( arSizes[ i % 4 ] );
+			assert( pMsgs[i] );
+			if ( pMsgs[i]->m_cbSize > 0 )
+				memset( pMsgs[i]->m_pData, r, pMsgs[i]->m_cbSize );
+		}
+		for ( int i = 0 ; i < k_nMsgs ; ++i )
+			pMsgs[i]->Release();
+	}
+	SteamNetworkingSockets_GetGlobalStats( &stats, true );
+	TEST_Printf( "Same thread: %lld allocs, %.1f%% hits, %lld in use, %lld free\n",
+		(long long)stats.m_nMessagePoolAllocs,
+		stats.m_nMessagePoolAllocs > 0 ? stats.m_nMessagePoolHits * 100.0 / stats.m_nMessagePoolAllocs : 0.0,
+		(long long)stats.m_nMessagePoolBlocksInUse, (long long)stats.m_nMessagePoolBlocksFree );
+	assert( stats.m_nMessagePoolBlocksInUse == statsStart.m_nMessagePoolBlocksInUse );
+	assert( stats.m_nMessagePoolHits * 10 > stats.m_nMessagePoolAllocs * 9 );
+
+	// Allocate here, free on another thread.  Blocks should make their way
+	// back through the shared pool
+	for ( int r = 0 ; r < k_nRounds ; ++r )
+	{
+		for ( int i = 0 ; i < k_nMsgs ; ++i )
+			pMsgs[i] = SteamNetworkingUtils()->AllocateMessage( arSizes[ i % 4 ] );
+		std::thread t( [&pMsgs]() {
+			for ( int i = 0 ; i < k_nMsgs ; ++i )
+				pMsgs[i]->Release();
+		} );
+		t.join();
+	}
+	SteamNetworkingSockets_GetGlobalStats( &stats, true );
+	TEST_Printf( "Cross thread: %lld allocs, %.1f%% hits, %lld in use, %lld free\n",
+		(long long)stats.m_nMessagePoolAllocs,
+		stats.m_nMessagePoolAllocs > 0 ? stats.m_nMessagePoolHits * 100.0 / stats.m_nMessagePoolAllocs : 0.0,
+		(long long)stats.m_nMessagePoolBlocksInUse, (long long)stats.m_nMessagePoolBlocksFree );
+	assert( stats.m_nMessagePoolBlocksInUse == statsStart.m_nMessagePoolBlocksInUse );
+	assert( stats.m_nMessagePoolHits * 2 > stats.m_nMessagePoolAllocs );
+}
+
+// Unreliable messages that fill most of a packet are delivered pointing
+// into the decrypted packet buffer, rather than copied.  Small messages,
+// and reliable ones, get their own buffer.  Either way, every buffer must
+// go back to the pool when the messages are released.
+void Test_recv_shared_buffer()
+{
+	struct Case_t
+	{
+		int m_cbMsg;
+		int m_nSendFlags;
+		bool m_bExpectShared;
+	};
+	const Case_t arCases[] = {
+		{ 100, k_nSteamNetworkingSend_UnreliableNoNagle, false },
+		{ 400, k_nSteamNetworkingSend_UnreliableNoNagle, false },
+		{ 1000, k_nSteamNetworkingSend_UnreliableNoNagle, true },
+		{ 1000, k_nSteamNetworkingSend_ReliableNoNagle, false },
+	};
+
+	// Messages that own their buffer use the default free function
+	SteamNetworkingMessage_t *pRefMsg = SteamNetworkingUtils()->AllocateMessage( 100 );
+	void (*pfnDefaultFreeData)( SteamNetworkingMessage_t * ) = pRefMsg->m_pfnFreeData;
+	pRefMsg->Release();
+
+	HSteamNetConnection hServer, hClient;
+	assert( SteamNetworkingSockets()->CreateSocketPair( &hServer, &hClient, true, nullptr, nullptr ) );
+
+	SteamNetworkingGlobalStats_t statsStart, stats;
+	SteamNetworkingSockets_GetGlobalStats( &statsStart, false );
+
+	constexpr int k_nMsgsPerCase = 16;
+	uint8 msg[ 1200 ];
+	for ( const Case_t &c: arCases )
+	{
+		for ( int i = 0 ; i < k_nMsgsPerCase ; ++i )
+		{
+			for ( int j = 0 ; j < c.m_cbMsg ; ++j )
+				msg[j] = MsgPattern( i, j );
+			assert( SteamNetworkingSockets()->SendMessageToConnection( hClient, msg, c.m_cbMsg, c.m_nSendFlags, nullptr ) == k_EResultOK );
+		}
+
+		// Hold on to everything until the end, so that released packet
+		// buffers can't be reused for later messages
+		std::vector<SteamNetworkingMessage_t *> vecMsgs;
+		SteamNetworkingMicroseconds usecTimeout = SteamNetworkingUtils()->GetLocalTimestamp() + 2*1000*1000;
+		while ( (int)vecMsgs.size() < k_nMsgsPerCase && SteamNetworkingUtils()->GetLocalTimestamp() < usecTimeout )
+		{
+			TEST_PumpCallbacks();
+			SteamNetworkingMessage_t *pMsg[ k_nMsgsPerCase ];
+			int n = SteamNetworkingSockets()->ReceiveMessagesOnConnection( hServer, pMsg, k_nMsgsPerCase );
+			for ( int i = 0 ; i < n ; ++i )
+				vecMsgs.push_back( pMsg[i] );
+		}
+		TEST_Printf( "%4d byte %s messages: received %d of %d\n", c.m_cbMsg, ( c.m_nSendFlags & k_nSteamNetworkingSend_Reliable ) ? "reliable" : "unreliable", (int)vecMsgs.size(), k_nMsgsPerCase );
+		assert( !vecMsgs.empty() );
+
+		// Messages that are split across packets are reassembled into
+		// their own buffer, so we can't expect every big one to be shared
+		int nShared = 0;
+		for ( SteamNetworkingMessage_t *pMsg: vecMsgs )
+		{
+			assert( pMsg->m_cbSize == c.m_cbMsg );
+			if ( pMsg->m_pfnFreeData != pfnDefaultFreeData )
+				++nShared;
+		}
+		TEST_Printf( "    %d point into the packet buffer\n", nShared );
+		if ( c.m_bExpectShared ? nShared == 0 : nShared > 0 )
+			TEST_Fatal( "%d byte messages %s", c.m_cbMsg, nShared ? "should have been copied" : "were all copied" );
+
+		// Data is intact.  (Unreliable messages might arrive out of order)
+		for ( SteamNetworkingMessage_t *pMsg: vecMsgs )
+		{
+			const uint8 *pData = (const uint8 *)pMsg->m_pData;
+			bool bFound = false;
+			for ( int i = 0 ; i < k_nMsgsPerCase && !bFound ; ++i )
+			{
+				bFound = true;
+				for ( int j = 0 ; j < c.m_cbMsg && bFound ; ++j )
+					bFound = pData[j] == MsgPattern( i, j );
+			}
+			assert( bFound );
+		}
+		for ( SteamNetworkingMessage_t *pMsg: vecMsgs )
+			pMsg->Release();
+	}
+
+	SteamNetworkingSockets()->CloseConnection( hServer, 0, nullptr, false );
+	SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+
+	// Give the service thread a chance to clean up, then make sure
+	// no buffers were leaked
+	for ( int i = 0 ; i < 10 ; ++i )
+		TEST_PumpCallbacks();
+	SteamNetworkingSockets_GetGlobalStats( &stats, false );
+	TEST_Printf( "Message pool blocks in use: %lld at start, %lld at end\n", (long long)statsStart.m_nMessagePoolBlocksInUse, (long long)stats.m_nMessagePoolBlocksInUse );
+	assert( stats.m_nMessagePoolBlocksInUse <= statsStart.m_nMessagePoolBlocksInUse );
+}
+
+void Test_pollgroup_drain_mt()
+{
+	// Each worker thread owns a poll group, and a few loopback connection
+	// pairs whose receiving end is in that poll group.  It sends on its
+	// connections and drains its poll group as fast as it can.  Workers
+	// should not contend with each other for any locks.
+	constexpr int k_nConnsPerGroup = 4;
+	constexpr int k_nMsgsPerSend = 32;
+	constexpr int k_cbMsg = 64;
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 2 * 1e6 );
+
+	for ( int nThreads: { 1, 2, 4, 8 } )
+	{
+		struct Worker_t
+		{
+			HSteamNetPollGroup m_hPollGroup;
+			HSteamNetConnection m_hSend[ k_nConnsPerGroup ];
+			HSteamNetConnection m_hRecv[ k_nConnsPerGroup ];
+			int64 m_nMsgRecv = 0;
+		};
+		std::vector<Worker_t> vecWorkers( nThreads );
+		for ( Worker_t &w: vecWorkers )
+		{
+			w.m_hPollGroup = SteamNetworkingSockets()->CreatePollGroup();
+			assert( w.m_hPollGroup != k_HSteamNetPollGroup_Invalid );
+			for ( int i = 0 ; i < k_nConnsPerGroup ; ++i )
+			{
+				assert( SteamNetworkingSockets()->CreateSocketPair( &w.m_hSend[i], &w.m_hRecv[i], false, nullptr, nullptr ) );
+				assert( SteamNetworkingSockets()->SetConnectionPollGroup( w.m_hRecv[i], w.m_hPollGroup ) );
+			}
+		}
+
+		std::vector<std::thread> vecThreads;
+		SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+		for ( Worker_t &w: vecWorkers )
+		{
+			vecThreads.emplace_back( [&w, usecStartTime]() {
+				char msg[ k_cbMsg ] = {};
+				SteamNetworkingMessage_t *pMsg[ 64 ];
+				while ( SteamNetworkingUtils()->GetLocalTimestamp() < usecStartTime + k_usecRunTime )
+				{
+					for ( int i = 0 ; i < k_nConnsPerGroup ; ++i )
+					{
+						for ( int j = 0 ; j < k_nMsgsPerSend ; ++j )
+							SteamNetworkingSockets()->SendMessageToConnection( w.m_hSend[i], msg, k_cbMsg, k_nSteamNetworkingSend_Reliable, nullptr );
+					}
+					for (;;)
+					{
+						int nMsg = SteamNetworkingSockets()->ReceiveMessagesOnPollGroup( w.m_hPollGroup, pMsg, 64 );
+						assert( nMsg >= 0 );
+						for ( int i = 0 ; i < nMsg ; ++i )
+							pMsg[i]->Release();
+						w.m_nMsgRecv += nMsg;
+						if ( nMsg < 64 )
+							break;
+					}
+				}
+			} );
+		}
+		for ( std::thread &t: vecThreads )
+			t.join();
+		double flElapsedSeconds = ( SteamNetworkingUtils()->GetLocalTimestamp() - usecStartTime ) * 1e-6;
+
+		int64 nMsgRecv = 0;
+		for ( Worker_t &w: vecWorkers )
+		{
+			assert( w.m_nMsgRecv > 0 );
+			nMsgRecv += w.m_nMsgRecv;
+			for ( int i = 0 ; i < k_nConnsPerGroup ; ++i )
+			{
+				SteamNetworkingSockets()->CloseConnection( w.m_hSend[i], 0, nullptr, false );
+				SteamNetworkingSockets()->CloseConnection( w.m_hRecv[i], 0, nullptr, false );
+			}
+			SteamNetworkingSockets()->DestroyPollGroup( w.m_hPollGroup );
+		}
+		TEST_Printf( "%d thread(s): %9.0f msgs/sec total, %9.0f msgs/sec per thread\n",
+			nThreads, nMsgRecv / flElapsedSeconds, nMsgRecv / flElapsedSeconds / nThreads );
+	}
+}
+
+// Many clients send to one server over the loopback adapter, with the
+// socket reads spread over 1 to 8 receive threads.  Reports the rate at
+// which the server receives messages.  Only the recv calls move off the
+// service thread, so don't expect this to scale with the number of cores;
+// processing is still serialized by the global lock.  The library must be
+// restarted for each thread count.
+static HSteamListenSocket s_hScalingListenSocket;
+static HSteamNetPollGroup s_hScalingPollGroup;
+static void OnScalingConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
+{
+	if ( pInfo->m_info.m_hListenSocket == s_hScalingListenSocket && pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connecting )
+	{
+		assert( SteamNetworkingSockets()->AcceptConnection( pInfo->m_hConn ) == k_EResultOK );
+		assert( SteamNetworkingSockets()->SetConnectionPollGroup( pInfo->m_hConn, s_hScalingPollGroup ) );
+	}
+}
+
+void Test_recv_threads_throughput()
+{
+	constexpr int k_nClients = 16;
+	constexpr int k_cbMsg = 200;
+	constexpr int k_nMsgsPerPump = 32;
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 2 * 1e6 );
+	char msg[ k_cbMsg ] = {};
+
+	for ( int nThreads: { 1, 2, 4, 8 } )
+	{
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_RecvThreads, nThreads );
+		TEST_Kill();
+		TEST_Init( nullptr );
+		SteamNetworkingUtils()->SetGlobalCallback_SteamNetConnectionStatusChanged( OnScalingConnectionStatusChanged );
+
+		SteamNetworkingIPAddr addrServer;
+		addrServer.SetIPv4( 0x7f000001, PORT_SERVER+1 );
+		s_hScalingPollGroup = SteamNetworkingSockets()->CreatePollGroup();
+		s_hScalingListenSocket = SteamNetworkingSockets()->CreateListenSocketIP( addrServer, 0, nullptr );
+		assert( s_hScalingListenSocket != k_HSteamListenSocket_Invalid );
+
+		// Don't let the send rate be the bottleneck
+		SteamNetworkingConfigValue_t opt[2];
+		opt[0].SetInt32( k_ESteamNetworkingConfig_SendRateMin, 16*1000*1000 );
+		opt[1].SetInt32( k_ESteamNetworkingConfig_SendRateMax, 16*1000*1000 );
+		HSteamNetConnection hClients[ k_nClients ];
+		for ( HSteamNetConnection &hClient: hClients )
+		{
+			hClient = SteamNetworkingSockets()->ConnectByIPAddress( addrServer, 2, opt );
+			assert( hClient != k_HSteamNetConnection_Invalid );
+		}
+
+		// Wait for everybody to connect
+		SteamNetworkingMicroseconds usecConnectTimeout = SteamNetworkingUtils()->GetLocalTimestamp() + 10*1000*1000;
+		for (;;)
+		{
+			TEST_PumpCallbacks();
+			int nConnected = 0;
+			for ( HSteamNetConnection hClient: hClients )
+			{
+				SteamNetConnectionInfo_t info;
+				assert( SteamNetworkingSockets()->GetConnectionInfo( hClient, &info ) );
+				if ( info.m_eState == k_ESteamNetworkingConnectionState_Connected )
+					++nConnected;
+			}
+			if ( nConnected == k_nClients )
+				break;
+			assert( SteamNetworkingUtils()->GetLocalTimestamp() < usecConnectTimeout );
+		}
+
+		// Clear counters
+		SteamNetworkingGlobalStats_t stats;
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+
+		int64 nMsgRecv = 0;
+		SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecNow;
+		do
+		{
+			SteamNetworkingSockets()->RunCallbacks();
+			for ( HSteamNetConnection hClient: hClients )
+			{
+				for ( int i = 0 ; i < k_nMsgsPerPump ; ++i )
+					SteamNetworkingSockets()->SendMessageToConnection( hClient, msg, k_cbMsg, k_nSteamNetworkingSend_UnreliableNoNagle, nullptr );
+			}
+
+			SteamNetworkingMessage_t *pMsg[ 64 ];
+			for (;;)
+			{
+				int nMsg = SteamNetworkingSockets()->ReceiveMessagesOnPollGroup( s_hScalingPollGroup, pMsg, 64 );
+				assert( nMsg >= 0 );
+				for ( int i = 0 ; i < nMsg ; ++i )
+					pMsg[i]->Release();
+				nMsgRecv += nMsg;
+				if ( nMsg < 64 )
+					break;
+			}
+
+			usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		} while ( usecNow < usecStartTime + k_usecRunTime );
+
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+		double flElapsedSeconds = ( usecNow - usecStartTime ) * 1e-6;
+		TEST_Printf( "RecvThreads=%d: %9.0f msgs/sec  %9.0f pkts/sec recv\n",
+			nThreads,
+			nMsgRecv / flElapsedSeconds,
+			stats.m_nRecvPackets / flElapsedSeconds
+		);
+		assert( nMsgRecv > 0 );
+
+		// Cleanup
+		for ( HSteamNetConnection hClient: hClients )
+			SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+		SteamNetworkingSockets()->CloseListenSocket( s_hScalingListenSocket );
+		SteamNetworkingSockets()->DestroyPollGroup( s_hScalingPollGroup );
+		s_hScalingListenSocket = k_HSteamListenSocket_Invalid;
+		s_hScalingPollGroup = k_HSteamNetPollGroup_Invalid;
+	}
+
+	// Restart with the default
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_RecvThreads, 1 );
+	TEST_Kill();
+	TEST_Init( nullptr );
+}
+
+// Measure latency on an established connection while a storm of clients
+// keep connecting to the same listen socket and then going away.  Compare
+// doing the handshake crypto inline on the service thread with handing it
+// off to worker threads (k_ESteamNetworkingConfig_CryptoWorkerThreads).
+// Note that the clients live in this process, too, so the service thread
+// still does their half of the handshake.
+static HSteamListenSocket s_hStormListenSocket;
+static HSteamNetPollGroup s_hStormPollGroup;
+static std::atomic<int> s_nStormAccepted;
+static void OnStormConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
+{
+	if ( pInfo->m_info.m_hListenSocket == s_hStormListenSocket && pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connecting )
+	{
+		// Client might have given up already
+		if ( SteamNetworkingSockets()->AcceptConnection( pInfo->m_hConn ) == k_EResultOK )
+		{
+			SteamNetworkingSockets()->SetConnectionPollGroup( pInfo->m_hConn, s_hStormPollGroup );
+			++s_nStormAccepted;
+		}
+	}
+	else if ( pInfo->m_info.m_hListenSocket == s_hStormListenSocket && pInfo->m_info.m_eState != k_ESteamNetworkingConnectionState_Connected )
+	{
+		SteamNetworkingSockets()->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+	}
+}
+
+// Send timestamped messages over an established connection to the storm
+// listen socket, and record how long they take to arrive.  Returns the
+// elapsed time, in seconds.  The latencies are returned sorted.
+static double MeasureStormLatency( HSteamNetConnection hClient, SteamNetworkingMicroseconds usecRunTime, std::vector<SteamNetworkingMicroseconds> &vecLatency )
+{
+	SteamNetworkingMicroseconds usecStartTime = SteamNetworkingUtils()->GetLocalTimestamp();
+	SteamNetworkingMicroseconds usecNow;
+	do
+	{
+		TEST_PumpCallbacks();
+
+		usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingSockets()->SendMessageToConnection( hClient, &usecNow, sizeof(usecNow), k_nSteamNetworkingSend_UnreliableNoNagle, nullptr );
+
+		std::this_thread::sleep_for( std::chrono::microseconds( std::uniform_int_distribution<>( 500, 1500 )( g_rand ) ) );
+
+		SteamNetworkingMessage_t *pMsgs[ 16 ];
+		int nMsgs;
+		while ( ( nMsgs = SteamNetworkingSockets()->ReceiveMessagesOnPollGroup( s_hStormPollGroup, pMsgs, 16 ) ) > 0 )
+		{
+			for ( int i = 0 ; i < nMsgs ; ++i )
+			{
+				SteamNetworkingMicroseconds usecSent;
+				assert( pMsgs[i]->m_cbSize == sizeof(usecSent) );
+				memcpy( &usecSent, pMsgs[i]->m_pData, sizeof(usecSent) );
+				vecLatency.push_back( pMsgs[i]->m_usecTimeReceived - usecSent );
+				pMsgs[i]->Release();
+			}
+		}
+
+		usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+	} while ( usecNow < usecStartTime + usecRunTime );
+
+	assert( vecLatency.size() > 100 );
+	std::sort( vecLatency.begin(), vecLatency.end() );
+	return ( usecNow - usecStartTime ) * 1e-6;
+}
+
+void Test_reconnect_storm_latency()
+{
+	constexpr int k_nStormClients = 64;
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 3 * 1e6 );
+
+	for ( int nWorkers: { 0, 2 } )
+	{
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_CryptoWorkerThreads, nWorkers );
+		TEST_Kill();
+		TEST_Init( nullptr );
+		SteamNetworkingUtils()->SetGlobalCallback_SteamNetConnectionStatusChanged( OnStormConnectionStatusChanged );
+
+		SteamNetworkingIPAddr addrServer;
+		addrServer.SetIPv4( 0x7f000001, PORT_SERVER+2 );
+		s_hStormPollGroup = SteamNetworkingSockets()->CreatePollGroup();
+		s_hStormListenSocket = SteamNetworkingSockets()->CreateListenSocketIP( addrServer, 0, nullptr );
+		assert( s_hStormListenSocket != k_HSteamListenSocket_Invalid );
+		s_nStormAccepted = 0;
+
+		// Establish the connection we'll measure
+		HSteamNetConnection hClient = SteamNetworkingSockets()->ConnectByIPAddress( addrServer, 0, nullptr );
+		assert( hClient != k_HSteamNetConnection_Invalid );
+		SteamNetworkingMicroseconds usecConnectTimeout = SteamNetworkingUtils()->GetLocalTimestamp() + 10*1000*1000;
+		for (;;)
+		{
+			TEST_PumpCallbacks();
+			SteamNetConnectionInfo_t info;
+			assert( SteamNetworkingSockets()->GetConnectionInfo( hClient, &info ) );
+			if ( info.m_eState == k_ESteamNetworkingConnectionState_Connected && s_nStormAccepted == 1 )
+				break;
+			assert( SteamNetworkingUtils()->GetLocalTimestamp() < usecConnectTimeout );
+		}
+
+		// Start the storm.  Each wave of clients connects all at once,
+		// and then they all disconnect
+		std::atomic<bool> bStopStorm( false );
+		std::atomic<int> nStormConnects( 0 );
+		std::thread threadStorm( [&]() {
+			std::vector<HSteamNetConnection> vecStorm;
+			while ( !bStopStorm )
+			{
+				for ( int i = 0 ; i < k_nStormClients ; ++i )
+					vecStorm.push_back( SteamNetworkingSockets()->ConnectByIPAddress( addrServer, 0, nullptr ) );
+				nStormConnects += k_nStormClients;
+				std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+				for ( HSteamNetConnection hStorm: vecStorm )
+					SteamNetworkingSockets()->CloseConnection( hStorm, 0, nullptr, false );
+				vecStorm.clear();
+			}
+		} );
+
+		// Send timestamped messages over the established connection, and see when they arrive
+		std::vector<SteamNetworkingMicroseconds> vecLatency;
+		double flElapsedSeconds = MeasureStormLatency( hClient, k_usecRunTime, vecLatency );
+
+		bStopStorm = true;
+		threadStorm.join();
+
+		auto Percentile = [&]( double p ) { return (double)vecLatency[ size_t( p * ( vecLatency.size() - 1 ) ) ]; };
+		TEST_Printf( "CryptoWorkerThreads=%d: %5.0f connects/sec (%d accepted), %d msgs on established connection: p50=%5.0fus  p90=%5.0fus  p99=%6.0fus  max=%6.0fus\n",
+			nWorkers, nStormConnects / flElapsedSeconds, s_nStormAccepted - 1, (int)vecLatency.size(),
+			Percentile( .5 ), Percentile( .9 ), Percentile( .99 ), (double)vecLatency.back() );
+		assert( s_nStormAccepted > 1 );
+
+		// Cleanup
+		SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+		SteamNetworkingSockets()->CloseListenSocket( s_hStormListenSocket );
+		SteamNetworkingSockets()->DestroyPollGroup( s_hStormPollGroup );
+		s_hStormListenSocket = k_HSteamListenSocket_Invalid;
+		s_hStormPollGroup = k_HSteamNetPollGroup_Invalid;
+	}
+
+	// Restart with the default
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_CryptoWorkerThreads, 2 );
+	TEST_Kill();
+	TEST_Init( nullptr );
+}
+
+// Flood a listen socket with connection requests that all come from the
+// same IP address, and measure latency on an established connection, with
+// and without the listen socket admission controls:
+// k_ESteamNetworkingConfig_IP_ConnectRateLimit, MaxPendingHandshakes,
+// MaxPendingHandshakesPerIP, and IP_DeferConnectionAlloc.  As in
+// reconnect_storm_latency, the flooding clients are in this process.
+void Test_connect_flood_latency()
+{
+	constexpr int k_nFloodClientsPerWave = 32;
+	constexpr SteamNetworkingMicroseconds k_usecRunTime = SteamNetworkingMicroseconds( 3 * 1e6 );
+
+	for ( bool bAdmissionControl: { false, true } )
+	{
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_MaxPendingHandshakes, bAdmissionControl ? 16 : 0 );
+		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_MaxPendingHandshakesPerIP, bAdmissionControl ? 8 : 0 );
+		TEST_Kill();
+		TEST_Init( nullptr );
+		SteamNetworkingUtils()->SetGlobalCallback_SteamNetConnectionStatusChanged( OnStormConnectionStatusChanged );
+
+		SteamNetworkingIPAddr addrServer;
+		addrServer.SetIPv4( 0x7f000001, PORT_SERVER+3 );
+		SteamNetworkingConfigValue_t opt[3];
+		opt[0].SetInt32( k_ESteamNetworkingConfig_IP_ConnectRateLimit, bAdmissionControl ? 20 : 0 );
+		opt[1].SetInt32( k_ESteamNetworkingConfig_IP_ConnectRateLimitBurst, 8 );
+		opt[2].SetInt32( k_ESteamNetworkingConfig_IP_DeferConnectionAlloc, bAdmissionControl ? 1 : 0 );
+		s_hStormPollGroup = SteamNetworkingSockets()->CreatePollGroup();
+		s_hStormListenSocket = SteamNetworkingSockets()->CreateListenSocketIP( addrServer, 3, opt );
+		assert( s_hStormListenSocket != k_HSteamListenSocket_Invalid );
+		s_nStormAccepted = 0;
+
+		// Establish the connection we'll measure, before the flood starts
+		HSteamNetConnection hClient = SteamNetworkingSockets()->ConnectByIPAddress( addrServer, 0, nullptr );
+		assert( hClient != k_HSteamNetConnection_Invalid );
+		SteamNetworkingMicroseconds usecConnectTimeout = SteamNetworkingUtils()->GetLocalTimestamp() + 10*1000*1000;
+		for (;;)
+		{
+			TEST_PumpCallbacks();
+			SteamNetConnectionInfo_t info;
+			assert( SteamNetworkingSockets()->GetConnectionInfo( hClient, &info ) );
+			if ( info.m_eState == k_ESteamNetworkingConnectionState_Connected && s_nStormAccepted == 1 )
+				break;
+			assert( SteamNetworkingUtils()->GetLocalTimestamp() < usecConnectTimeout );
+		}
+
+		SteamNetworkingGlobalStats_t stats;
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+
+		// Start the flood.  New clients keep arriving, and each one
+		// gives up after a while.
+		std::atomic<bool> bStopFlood( false );
+		std::atomic<int> nFloodConnects( 0 );
+		std::thread threadFlood( [&]() {
+			std::vector<HSteamNetConnection> vecFlood;
+			while ( !bStopFlood )
+			{
+				for ( int i = 0 ; i < k_nFloodClientsPerWave ; ++i )
+					vecFlood.push_back( SteamNetworkingSockets()->ConnectByIPAddress( addrServer, 0, nullptr ) );
+				nFloodConnects += k_nFloodClientsPerWave;
+				std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );
+				if ( (int)vecFlood.size() >= 8*k_nFloodClientsPerWave )
+				{
+					for ( int i = 0 ; i < k_nFloodClientsPerWave ; ++i )
+						SteamNetworkingSockets()->CloseConnection( vecFlood[i], 0, nullptr, false );
+					vecFlood.erase( vecFlood.begin(), vecFlood.begin() + k_nFloodClientsPerWave );
+				}
+			}
+			for ( HSteamNetConnection hFlood: vecFlood )
+				SteamNetworkingSockets()->CloseConnection( hFlood, 0, nullptr, false );
+		} );
+
+		std::vector<SteamNetworkingMicroseconds> vecLatency;
+		double flElapsedSeconds = MeasureStormLatency( hClient, k_usecRunTime, vecLatency );
+
+		bStopFlood = true;
+		threadFlood.join();
+		SteamNetworkingSockets_GetGlobalStats( &stats, true );
+
+		auto Percentile = [&]( double p ) { return (double)vecLatency[ size_t( p * ( vecLatency.size() - 1 ) ) ]; };
+		TEST_Printf( "Admission control %s: %5.0f connects/sec (%d accepted, %lld rate limited, %lld over budget), %d msgs on established connection: p50=%5.0fus  p90=%5.0fus  p99=%6.0fus  max=%6.0fus\n",
+			bAdmissionControl ? "on " : "off", nFloodConnects / flElapsedSeconds, s_nStormAccepted - 1,
+			(long long)stats.m_nConnectRequestsRateLimited, (long long)stats.m_nConnectRequestsOverBudget, (int)vecLatency.size(),
+			Percentile( .5 ), Percentile( .9 ), Percentile( .99 ), (double)vecLatency.back() );
+		assert( s_nStormAccepted > 1 );
+		if ( bAdmissionControl )
+		{
+			assert( stats.m_nConnectRequestsRateLimited > 0 );
+		}
+		else
+		{
+			assert( stats.m_nConnectRequestsRateLimited == 0 );
+			assert( stats.m_nConnectRequestsOverBudget == 0 );
+		}
+
+		// Cleanup.  Once everything is gone, nothing should still be
+		// counted as pending.
+		SteamNetworkingSockets()->CloseConnection( hClient, 0, nullptr, false );
+		SteamNetworkingSockets()->CloseListenSocket( s_hStormListenSocket );
+		SteamNetworkingSockets()->DestroyPollGroup( s_hStormPollGroup );
+		s_hStormListenSocket = k_HSteamListenSocket_Invalid;
+		s_hStormPollGroup = k_HSteamNetPollGroup_Invalid;
+		SteamNetworkingMicroseconds usecDrainTimeout = SteamNetworkingUtils()->GetLocalTimestamp() + 2*1000*1000;
+		do
+		{
+			TEST_PumpCallbacks();
+			SteamNetworkingSockets_GetGlobalStats( &stats, false );
+		} while ( stats.m_nPendingHandshakes > 0 && SteamNetworkingUtils()->GetLocalTimestamp() < usecDrainTimeout );
+		assert( stats.m_nPendingHandshakes == 0 );
+	}
+
+	// Restart with the default
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_MaxPendingHandshakes, 1024 );
+	SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_MaxPendingHandshakesPerIP, 0 );
+	TEST_Kill();
+	TEST_Init( nullptr );
+}
+
+// Send the same message to 1 to 500 connections, by looping over
+// SendMessageToConnection, and using the broadcast APIs
+void Test_broadcast_send()
+{
+	constexpr int k_nMaxRecipients = 500;
+	constexpr int k_cbMsg = 1000;
+	constexpr int k_nSendsPerTest = 10000;
+	char msg[ k_cbMsg ];
+	for ( int i = 0 ; i < k_cbMsg ; ++i )
+		msg[i] = (char)i;
+
+	HSteamNetPollGroup hSendPollGroup = SteamNetworkingSockets()->CreatePollGroup();
+	HSteamNetPollGroup hRecvPollGroup = SteamNetworkingSockets()->CreatePollGroup();
+	std::vector<HSteamNetConnection> vecSend, vecRecv;
+	std::vector<int64> vecResults( k_nMaxRecipients );
+
+	// Receive everything, and make sure we got what we expected.  The
+	// connections go over the loopback adapter, so wait for it to arrive
+	auto Drain = [&]( int nExpected ) {
+		SteamNetworkingMessage_t *pMsg[ 64 ];
+		int nRecv = 0;
+		SteamNetworkingMicroseconds usecTimeout = SteamNetworkingUtils()->GetLocalTimestamp() + 5*1000*1000;
+		while ( nRecv < nExpected )
+		{
+			int nMsg = SteamNetworkingSockets()->ReceiveMessagesOnPollGroup( hRecvPollGroup, pMsg, 64 );
+			assert( nMsg >= 0 );
+			for ( int i = 0 ; i < nMsg ; ++i )
+			{
+				assert( pMsg[i]->m_cbSize == k_cbMsg );
+				assert( memcmp( pMsg[i]->m_pData, msg, k_cbMsg ) == 0 );
+				pMsg[i]->Release();
+			}
+			nRecv += nMsg;
+			if ( nMsg == 0 )
+			{
+				assert( SteamNetworkingUtils()->GetLocalTimestamp() < usecTimeout );
+				std::this_thread::yield();
+			}
+		}
+		assert( nRecv == nExpected );
+	};
+
+	for ( int nRecipients: { 1, 10, 50, 100, 500 } )
+	{
+		while ( (int)vecSend.size() < nRecipients )
+		{
+			HSteamNetConnection hSend, hRecv;
+			assert( SteamNetworkingSockets()->CreateSocketPair( &hSend, &hRecv, true, nullptr, nullptr ) );
+			SteamNetworkingUtils()->SetConnectionConfigValueInt32( hSend, k_ESteamNetworkingConfig_SendRateMin, 10*1024*1024 );
+			SteamNetworkingUtils()->SetConnectionConfigValueInt32( hSend, k_ESteamNetworkingConfig_SendRateMax, 10*1024*1024 );
+			assert( SteamNetworkingSockets()->SetConnectionPollGroup( hSend, hSendPollGroup ) );
+			assert( SteamNetworkingSockets()->SetConnectionPollGroup( hRecv, hRecvPollGroup ) );
+			vecSend.push_back( hSend );
+			vecRecv.push_back( hRecv );
+		}
+
+		const int nRounds = std::max( 1, k_nSendsPerTest / nRecipients );
+		SteamNetworkingMicroseconds usecLoop = 0, usecList = 0, usecPollGroup = 0;
+		for ( int r = 0 ; r < nRounds ; ++r )
+		{
+			SteamNetworkingMicroseconds usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+			for ( HSteamNetConnection hSend: vecSend )
+				assert( SteamNetworkingSockets()->SendMessageToConnection( hSend, msg, k_cbMsg, k_nSteamNetworkingSend_ReliableNoNagle, nullptr ) == k_EResultOK );
+			usecLoop += SteamNetworkingUtils()->GetLocalTimestamp() - usecStart;
+			Drain( nRecipients );
+
+			usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+			SteamNetworkingSockets_SendMessageToConnections( nRecipients, vecSend.data(), msg, k_cbMsg, k_nSteamNetworkingSend_ReliableNoNagle, vecResults.data() );
+			usecList += SteamNetworkingUtils()->GetLocalTimestamp() - usecStart;
+			for ( int i = 0 ; i < nRecipients ; ++i )
+				assert( vecResults[i] > 0 );
+			Drain( nRecipients );
+
+			usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+			int nQueued = SteamNetworkingSockets_SendMessageToPollGroup( hSendPollGroup, msg, k_cbMsg, k_nSteamNetworkingSend_ReliableNoNagle );
+			usecPollGroup += SteamNetworkingUtils()->GetLocalTimestamp() - usecStart;
+			assert( nQueued == nRecipients );
+			Drain( nRecipients );
+		}
+
+		double flSends = double( nRounds ) * nRecipients;
+		TEST_Printf( "%3d recipients: loop %6.3fusec/msg  list %6.3fusec/msg  pollgroup %6.3fusec/msg\n",
+			nRecipients,
+			usecLoop / flSends,
+			usecList / flSends,
+			usecPollGroup / flSends );
+	}
+
+	// Bad handles are reported individually
+	HSteamNetConnection hBad[2] = { vecSend[0], k_HSteamNetConnection_Invalid };
+	SteamNetworkingSockets_SendMessageToConnections( 2, hBad, msg, k_cbMsg, k_nSteamNetworkingSend_ReliableNoNagle, vecResults.data() );
+	assert( vecResults[0] > 0 );
+	assert( vecResults[1] == -k_EResultInvalidParam );
+	Drain( 1 );
+	assert( SteamNetworkingSockets_SendMessageToPollGroup( k_HSteamNetPollGroup_Invalid, msg, k_cbMsg, k_nSteamNetworkingSend_ReliableNoNagle ) == -1 );
+
+	for ( HSteamNetConnection hConn: vecSend )
+		SteamNetworkingSockets()->CloseConnection( hConn, 0, nullptr, false );
+	for ( HSteamNetConnection hConn: vecRecv )
+		SteamNetworkingSockets()->CloseConnection( hConn, 0, nullptr, false );
+	SteamNetworkingSockets()->DestroyPollGroup( hSendPollGroup );
+	SteamNetworkingSockets()->DestroyPollGroup( hRecvPollGroup );
+}
+
+// Unit tests for library internals live in their own files.  They
+// report failures using CHECK(), which sets this.
+bool g_failed = false;
+extern void Test_snp_packetnum_containers();
+extern void Test_timingwheel();
+extern void Test_timingwheel_perf();
+extern void Test_varint();
+extern void Test_varint_perf();
+extern void Test_udp_handshake();
+extern void Test_udp_handshake_perf();
+extern void Test_unreliable_segment_slab();
+extern void Test_message_shared_buffer();
+
 int main( int argc, const char **argv  )
 {
 	typedef void (*FnTest)(void);
@@ -1200,8 +2692,33 @@ int main( int argc, const char **argv  )
 		TEST(quick),
 		TEST(soak),
 		TEST(netloopback_throughput),
+		TEST(netloopback_recv_batching),
+		TEST(netloopback_txtime_pacing),
+		TEST(netloopback_latency),
+		TEST(netloopback_spin_latency),
+		TEST(reliable_stream_lossy),
+		TEST(nack_delay_reorder),
+		TEST(unreliable_fec_loss_sweep),
+		TEST(unreliable_reassembly),
+		TEST(message_pool),
+		TEST(message_shared_buffer),
+		TEST(recv_shared_buffer),
+		TEST(pollgroup_drain_mt),
+		TEST(recv_threads_throughput),
+		TEST(reconnect_storm_latency),
+		TEST(connect_flood_latency),
+		TEST(broadcast_send),
+		TEST(bandwidth_estimation),
 		TEST(lane_quick_queueanddrain),
-		TEST(lane_quick_priority_and_background)
+		TEST(lane_quick_priority_and_background),
+		TEST(snp_packetnum_containers),
+		TEST(timingwheel),
+		TEST(timingwheel_perf),
+		TEST(varint),
+		TEST(varint_perf),
+		TEST(udp_handshake),
+		TEST(udp_handshake_perf),
+		TEST(unreliable_segment_slab)
 	};
 
 	struct Suite_t {
@@ -1209,7 +2726,7 @@ int main( int argc, const char **argv  )
 		std::vector< Test_t > m_vecTests;
 	};
 	static const Suite_t test_suites[] = {
-		{ "suite-quick", { TEST(identity), TEST(quick), TEST(lane_quick_queueanddrain), TEST(netloopback_throughput), TEST(lane_quick_priority_and_background) } }
+		{ "suite-quick", { TEST(identity), TEST(quick), TEST(lane_quick_queueanddrain), TEST(netloopback_throughput), TEST(lane_quick_priority_and_background), TEST(message_pool), TEST(message_shared_buffer), TEST(recv_shared_buffer), TEST(snp_packetnum_containers), TEST(timingwheel), TEST(varint), TEST(udp_handshake), TEST(unreliable_segment_slab), TEST(unreliable_reassembly) } }
 	};
 
 	if ( argc < 2 )
@@ -1282,6 +2799,8 @@ print_available_tests_and_exit:
 
 		// Run the test
 		(*t.m_func)();
+		if ( g_failed )
+			TEST_Fatal( "Test '%s' FAILED", t.m_pszName );
 
 		TEST_Printf( "\n" );
 		TEST_Printf( "Test '%s' completed OK\n\n", t.m_pszName );
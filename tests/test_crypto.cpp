@@ -9,10 +9,10 @@
 #include <unistd.h>
 #endif
 
+#include "test_check.h"
+
 // I copied these tests from the Steam branch.
 // A little compatibility glue so I don't have to make any changes to them.
-#define CHECK(x) do { bool _check_result; Assert( (_check_result = (x)) != false ); g_failed |= !_check_result; } while(0)
-#define CHECK_EQUAL(a,b) do { bool _check_eq_result; Assert( (_check_eq_result = ((a)==(b))) != false ); g_failed |= !_check_eq_result; } while(0)
 #define RETURNIFNOT(x) { if ( !(x) ) { AssertMsg( false, #x ); return; } }
 #define RETURNFALSEIFNOT(x) { if ( !(x) ) { AssertMsg( false, #x ); return false; } }
 const int k_cSmallBuff = 100;					// smallish buffer
@@ -591,6 +591,84 @@ void TestEllipticPerf()
 	printf( "\tVerify ed25519 signature (big):\t\t\t%f MB/sec (%d iterations)\n", dRateLargeMBPerSecCheck, k_cIterationsSignBig );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Tests batch ed25519 signature verification, and compares the
+//			perf against checking the signatures one at a time
+//-----------------------------------------------------------------------------
+void TestEllipticBatchVerifyPerf()
+{
+	const int k_nMaxBatch = CECSigningBatchVerifier::k_nMaxBatch;
+	const int k_cubMsg = 128; // About the size of the crypt info in a handshake
+	const int k_cSignatures = 2048;
+
+	// Each message is signed by a different key, like it would be
+	// when a bunch of clients connect at once
+	static CECSigningPublicKey rgPub[k_nMaxBatch];
+	static uint8 rgubMsg[k_nMaxBatch][k_cubMsg];
+	static CryptoSignature_t rgSignature[k_nMaxBatch];
+	CCrypto::GenerateRandomBlock( rgubMsg, sizeof( rgubMsg ) );
+	for ( int i = 0; i < k_nMaxBatch; ++i )
+	{
+		CECSigningPrivateKey priv;
+		CCrypto::GenerateSigningKeyPair( &rgPub[i], &priv );
+		CCrypto::GenerateSignature( rgubMsg[i], k_cubMsg, priv, &rgSignature[i] );
+	}
+
+	CECSigningBatchVerifier batch;
+	bool rgbValid[k_nMaxBatch];
+
+	// Make sure we can find a bad signature in a batch, using any of
+	// the different code paths
+	for ( int nBatch: { 1, 3, 8, k_nMaxBatch } )
+	{
+		batch.Clear();
+		for ( int i = 0; i < nBatch; ++i )
+			CHECK( batch.Add( rgPub[i], rgubMsg[i], k_cubMsg, rgSignature[i] ) == i );
+		CHECK( batch.Verify( rgbValid ) );
+
+		int idxBad = nBatch / 2;
+		CryptoSignature_t badSignature;
+		memcpy( badSignature, rgSignature[idxBad], sizeof(badSignature) );
+		badSignature[5] ^= 0x10;
+		batch.Clear();
+		for ( int i = 0; i < nBatch; ++i )
+			batch.Add( rgPub[i], rgubMsg[i], k_cubMsg, i == idxBad ? badSignature : rgSignature[i] );
+		CHECK( !batch.Verify( rgbValid ) );
+		for ( int i = 0; i < nBatch; ++i )
+			CHECK( rgbValid[i] == ( i != idxBad ) );
+	}
+	CHECK( batch.IsFull() );
+	CHECK( batch.Add( rgPub[0], rgubMsg[0], k_cubMsg, rgSignature[0] ) < 0 );
+
+	for ( int nBatch: { 1, 8, k_nMaxBatch } )
+	{
+		int x = 0;
+
+		// One at a time
+		uint64 usecStart = Plat_USTime();
+		for ( int n = 0; n < k_cSignatures; n += nBatch )
+		{
+			for ( int i = 0; i < nBatch; ++i )
+				x += (int)CCrypto::VerifySignature( rgubMsg[i], k_cubMsg, rgPub[i], rgSignature[i] );
+		}
+		double dMicrosecSingle = double( Plat_USTime() - usecStart ) / k_cSignatures;
+
+		// Batched
+		usecStart = Plat_USTime();
+		for ( int n = 0; n < k_cSignatures; n += nBatch )
+		{
+			batch.Clear();
+			for ( int i = 0; i < nBatch; ++i )
+				batch.Add( rgPub[i], rgubMsg[i], k_cubMsg, rgSignature[i] );
+			x += (int)batch.Verify( nullptr ) * nBatch;
+		}
+		double dMicrosecBatch = double( Plat_USTime() - usecStart ) / k_cSignatures;
+		CHECK( x == 2*k_cSignatures );
+
+		printf( "\tVerify ed25519 signature, batches of %2d:\tsingle %f microseconds each\tbatch %f microseconds each\n", nBatch, dMicrosecSingle, dMicrosecBatch );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Performs specified # of symmetric encryptions
 //-----------------------------------------------------------------------------
@@ -724,6 +802,126 @@ void TestSymmetricAuthCryptoPerf()
 	printf( "\tSymmetric GCM decrypt (big):\t\t%f MB/sec (%d iterations)\n", dRateLargeDecrypt, k_cIterations );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Per-packet cost of the single-call path at typical packet sizes.
+// The context keeps the key schedule, so each call only sets a new IV.
+// Whatever is left at small sizes is the fixed per-call overhead.
+//-----------------------------------------------------------------------------
+void TestSymmetricAuthCryptoPacketSizePerf()
+{
+	const int k_cIterations = 50000;
+	const int k_arcubPkt[] = { 64, 256, 1200 };
+	const int k_cubMaxPkt = 1200;
+
+	uint8 rgubKey[k_nSymmetricKeyLen];
+	uint8 rgubIV[k_nSymmetricIVSize];
+	CCrypto::GenerateRandomBlock( rgubKey, V_ARRAYSIZE( rgubKey ) );
+	CCrypto::GenerateRandomBlock( rgubIV, V_ARRAYSIZE( rgubIV ) );
+
+	AES_GCM_EncryptContext ctxEnc;
+	AES_GCM_DecryptContext ctxDec;
+	CHECK( ctxEnc.Init( rgubKey, k_nSymmetricKeyLen, V_ARRAYSIZE(rgubIV), k_nSymmetricGCMTagSize ) );
+	CHECK( ctxDec.Init( rgubKey, k_nSymmetricKeyLen, V_ARRAYSIZE(rgubIV), k_nSymmetricGCMTagSize ) );
+
+	uint8 rgubData[ k_cubMaxPkt ];
+	for ( int i = 0 ; i < V_ARRAYSIZE( rgubData ) ; ++i )
+		rgubData[i] = (uint8)i;
+	uint8 rgubEncrypted[ k_cubMaxPkt + k_nSymmetricGCMTagSize ];
+	uint8 rgubDecrypted[ k_cubMaxPkt ];
+
+	for ( int cubPkt: k_arcubPkt )
+	{
+		// Encrypt, with a different IV each time, like we do when sending
+		uint64 usecStart = Plat_USTime();
+		uint32 cubEncrypted = 0;
+		for ( int i = 0 ; i < k_cIterations ; ++i )
+		{
+			*(uint32 *)rgubIV = (uint32)i;
+			cubEncrypted = sizeof(rgubEncrypted);
+			CHECK( ctxEnc.Encrypt( rgubData, cubPkt, rgubIV, rgubEncrypted, &cubEncrypted, nullptr, 0 ) );
+		}
+		double dNanosecPerEncrypt = double( Plat_USTime() - usecStart ) * 1000.0 / k_cIterations;
+
+		// Decrypt the last one over and over.  (The IV is the same, but
+		// the context doesn't know that, it sets it every time.)
+		usecStart = Plat_USTime();
+		for ( int i = 0 ; i < k_cIterations ; ++i )
+		{
+			uint32 cubDecrypted = sizeof(rgubDecrypted);
+			CHECK( ctxDec.Decrypt( rgubEncrypted, cubEncrypted, rgubIV, rgubDecrypted, &cubDecrypted, nullptr, 0 ) );
+		}
+		double dNanosecPerDecrypt = double( Plat_USTime() - usecStart ) * 1000.0 / k_cIterations;
+
+		printf( "\tSymmetric GCM %4d bytes:\tencrypt %6.0f ns (%7.1f MB/sec)\tdecrypt %6.0f ns (%7.1f MB/sec)\n",
+			cubPkt,
+			dNanosecPerEncrypt, cubPkt * 1000.0 / dNanosecPerEncrypt,
+			dNanosecPerDecrypt, cubPkt * 1000.0 / dNanosecPerDecrypt );
+	}
+}
+
+// Make sure encrypting plaintext that is split into pieces produces
+// exactly the same thing as encrypting it in one buffer
+void TestSymmetricAuthCryptoGather()
+{
+	const int k_cPkts = 32;
+	const int k_cubMaxPkt = 1200;
+
+	AES_GCM_EncryptContext ctxEnc;
+	AES_GCM_DecryptContext ctxDec;
+
+	uint8 rgubKey[k_nSymmetricKeyLen];
+	CCrypto::GenerateRandomBlock( rgubKey, V_ARRAYSIZE( rgubKey ) );
+	ctxEnc.Init( rgubKey, k_nSymmetricKeyLen, k_nSymmetricIVSize, k_nSymmetricGCMTagSize );
+	ctxDec.Init( rgubKey, k_nSymmetricKeyLen, k_nSymmetricIVSize, k_nSymmetricGCMTagSize );
+
+	static uint8 rgubIV[k_cPkts][k_nSymmetricIVSize];
+	static uint8 rgubPlain[k_cPkts][k_cubMaxPkt];
+	static uint8 rgubEncrypted[k_cubMaxPkt + 32];
+	static uint8 rgubEncryptedGather[k_cubMaxPkt + 32];
+	static uint8 rgubDecrypted[k_cubMaxPkt];
+	CCrypto::GenerateRandomBlock( rgubIV, sizeof( rgubIV ) );
+	CCrypto::GenerateRandomBlock( rgubPlain, sizeof( rgubPlain ) );
+
+	for ( int cubPkt: { 64, 256, k_cubMaxPkt } )
+	{
+		for ( int j = 0 ; j < k_cPkts ; ++j )
+		{
+			uint32 cubEncrypted = sizeof( rgubEncrypted );
+			CHECK( ctxEnc.Encrypt( rgubPlain[j], cubPkt, rgubIV[j], rgubEncrypted, &cubEncrypted, nullptr, 0 ) );
+
+			int cubSplit1 = j % cubPkt;
+			int cubSplit2 = cubSplit1 + ( cubPkt - cubSplit1 ) / 2;
+			SymmetricCryptGatherPiece_t pieces[3] = {
+				{ rgubPlain[j], (size_t)cubSplit1 },
+				{ rgubPlain[j] + cubSplit1, (size_t)( cubSplit2 - cubSplit1 ) },
+				{ rgubPlain[j] + cubSplit2, (size_t)( cubPkt - cubSplit2 ) },
+			};
+			uint32 cubEncryptedGather = sizeof( rgubEncryptedGather );
+			CHECK( ctxEnc.EncryptGather( pieces, 3, rgubIV[j], rgubEncryptedGather, &cubEncryptedGather, nullptr, 0 ) );
+			CHECK_EQUAL( cubEncryptedGather, cubEncrypted );
+			CHECK( memcmp( rgubEncrypted, rgubEncryptedGather, cubEncrypted ) == 0 );
+
+			// Same thing using the default implementation, which backends
+			// that can't encrypt incrementally use.  Try it with one piece
+			// and with several
+			for ( int nPieces: { 1, 3 } )
+			{
+				SymmetricCryptGatherPiece_t onePiece = { rgubPlain[j], (size_t)cubPkt };
+				uint32 cubEncryptedByCopy = sizeof( rgubEncryptedGather );
+				memset( rgubEncryptedGather, 0, sizeof( rgubEncryptedGather ) );
+				CHECK( ctxEnc.ISymmetricEncryptContext::EncryptGather( nPieces == 1 ? &onePiece : pieces, nPieces, rgubIV[j], rgubEncryptedGather, &cubEncryptedByCopy, nullptr, 0 ) );
+				CHECK_EQUAL( cubEncryptedByCopy, cubEncrypted );
+				CHECK( memcmp( rgubEncrypted, rgubEncryptedGather, cubEncrypted ) == 0 );
+			}
+
+			uint32 cubDecrypted = sizeof( rgubDecrypted );
+			CHECK( ctxDec.Decrypt( rgubEncryptedGather, cubEncryptedGather, rgubIV[j], rgubDecrypted, &cubDecrypted, nullptr, 0 ) );
+			CHECK_EQUAL( cubDecrypted, (uint32)cubPkt );
+			CHECK( memcmp( rgubDecrypted, rgubPlain[j], cubPkt ) == 0 );
+		}
+	}
+}
+
 bool chdir_to_bindir()
 {
 #ifdef LINUX
@@ -756,7 +954,10 @@ int main()
 	TestEllipticCrypto();
 	TestOpenSSHEd25519();
 	TestEllipticPerf();
+	TestEllipticBatchVerifyPerf();
 	TestSymmetricAuthCryptoPerf();
+	TestSymmetricAuthCryptoPacketSizePerf();
+	TestSymmetricAuthCryptoGather();
 
 	return g_failed ? 1 : 0;
 }
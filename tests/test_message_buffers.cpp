@@ -0,0 +1,115 @@
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include <steamnetworkingsockets/clientlib/steamnetworkingsockets_snp.h>
+#include <steam/steamnetworkingsockets.h>
+
+#include "test_check.h"
+
+using namespace SteamNetworkingSocketsLib;
+
+static int64 PoolBlocksInUse()
+{
+	SteamNetworkingGlobalStats_t stats;
+	SteamNetworkingSockets_GetGlobalStats( &stats, false );
+	return stats.m_nMessagePoolBlocksInUse;
+}
+
+// Make a message that points into a shared buffer, the way the receive
+// code does when a message is in a decrypted packet
+static CSteamNetworkingMessage *NewSharedMessage( uint8 *pBuf, int ofs, int cb )
+{
+	CSteamNetworkingMessage *pMsg = CSteamNetworkingMessage::New( 0 );
+	CHECK( pMsg != nullptr );
+	pMsg->SetSharedBufferData( pBuf, pBuf + ofs, cb );
+	return pMsg;
+}
+
+// Messages pointing into a reference counted packet buffer.  The buffer
+// must stay alive until the last reference is gone, no matter what order
+// (or which thread) they are released in, and then go back to the pool.
+void Test_message_shared_buffer()
+{
+	const int k_cbBuf = 1200;
+	const int64 nBlocksStart = PoolBlocksInUse();
+
+	// Several messages in one buffer.  The packet context drops its
+	// reference first, and then the messages are freed out of order.
+	{
+		uint8 *pBuf = (uint8 *)CSteamNetworkingMessage::AllocSharedBuffer( k_cbBuf );
+		CHECK( pBuf != nullptr );
+		for ( int i = 0 ; i < k_cbBuf ; ++i )
+			pBuf[i] = uint8( i*7 );
+
+		CSteamNetworkingMessage *pMsgs[3] = {
+			NewSharedMessage( pBuf, 0, 400 ),
+			NewSharedMessage( pBuf, 400, 600 ),
+			NewSharedMessage( pBuf, 1000, 200 ),
+		};
+		CHECK( PoolBlocksInUse() == nBlocksStart + 4 );
+		for ( CSteamNetworkingMessage *pMsg: pMsgs )
+		{
+			CHECK( pMsg->m_pSharedBuffer == pBuf );
+			CHECK( pMsg->m_pfnFreeData != CSteamNetworkingMessage::DefaultFreeData );
+		}
+
+		CSteamNetworkingMessage::ReleaseSharedBuffer( pBuf );
+		CHECK( PoolBlocksInUse() == nBlocksStart + 4 );
+
+		// Buffer is still there
+		for ( CSteamNetworkingMessage *pMsg: pMsgs )
+		{
+			const uint8 *pData = (const uint8 *)pMsg->m_pData;
+			int ofs = int( pData - pBuf );
+			for ( int i = 0 ; i < pMsg->m_cbSize ; ++i )
+				CHECK_EQUAL( pData[i], uint8( (ofs+i)*7 ) );
+		}
+
+		pMsgs[1]->Release();
+		pMsgs[0]->Release();
+		CHECK( PoolBlocksInUse() == nBlocksStart + 2 );
+		pMsgs[2]->Release();
+		CHECK( PoolBlocksInUse() == nBlocksStart );
+	}
+
+	// The buffer outlives the packet context only if a message took a reference
+	{
+		void *pBuf = CSteamNetworkingMessage::AllocSharedBuffer( k_cbBuf );
+		CHECK( PoolBlocksInUse() == nBlocksStart + 1 );
+		CSteamNetworkingMessage::AddRefSharedBuffer( pBuf );
+		CSteamNetworkingMessage::ReleaseSharedBuffer( pBuf );
+		CHECK( PoolBlocksInUse() == nBlocksStart + 1 );
+		CSteamNetworkingMessage::ReleaseSharedBuffer( pBuf );
+		CHECK( PoolBlocksInUse() == nBlocksStart );
+	}
+
+	// Apps may release messages on any thread.  Spread the messages for
+	// each buffer across several threads, and release them all at once.
+	{
+		const int k_nThreads = 4;
+		const int k_nBufs = 64;
+		const int k_nMsgsPerBuf = 16;
+		std::vector<CSteamNetworkingMessage *> vecMsgs[ k_nThreads ];
+		for ( int b = 0 ; b < k_nBufs ; ++b )
+		{
+			uint8 *pBuf = (uint8 *)CSteamNetworkingMessage::AllocSharedBuffer( k_cbBuf );
+			for ( int m = 0 ; m < k_nMsgsPerBuf ; ++m )
+				vecMsgs[ m % k_nThreads ].push_back( NewSharedMessage( pBuf, m*64, 64 ) );
+			CSteamNetworkingMessage::ReleaseSharedBuffer( pBuf );
+		}
+		CHECK( PoolBlocksInUse() == nBlocksStart + k_nBufs*( 1 + k_nMsgsPerBuf ) );
+
+		std::vector<std::thread> vecThreads;
+		for ( int t = 0 ; t < k_nThreads ; ++t )
+		{
+			vecThreads.emplace_back( [&vecMsgs, t]() {
+				for ( CSteamNetworkingMessage *pMsg: vecMsgs[t] )
+					pMsg->Release();
+			} );
+		}
+		for ( std::thread &t: vecThreads )
+			t.join();
+		CHECK( PoolBlocksInUse() == nBlocksStart );
+	}
+}
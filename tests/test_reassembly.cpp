@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <steamnetworkingsockets/clientlib/steamnetworkingsockets_snp.h>
+
+#include "test_check.h"
+
+using namespace SteamNetworkingSocketsLib;
+
+// Key for the model
+struct MapKey
+{
+	int64 m_nMsgNum;
+	int m_nOffset;
+	MapKey( int64 nMsgNum, int nOffset ) : m_nMsgNum( nMsgNum ), m_nOffset( nOffset ) {}
+	inline bool operator<( const MapKey &x ) const
+	{
+		if ( m_nMsgNum != x.m_nMsgNum )
+			return m_nMsgNum < x.m_nMsgNum;
+		return m_nOffset < x.m_nOffset;
+	}
+};
+
+// Check the slab operations against a simple model.  (Reassembly
+// through the real receive path is tested by unreliable_reassembly.)
+void Test_unreliable_segment_slab()
+{
+	const int nIterations = 1000000;
+	std::mt19937_64 rand( 12345 );
+	SSNPRecvUnreliableSegmentSlab segments;
+	std::map<MapKey,int> model;
+	for ( int i = 0 ; i < nIterations ; ++i )
+	{
+		int64 nMsgNum = int64( rand() % 8 ) + 1;
+		int nOffset = int( rand() % 6 ) - 1;
+		switch ( rand() % 4 )
+		{
+			case 0:
+			case 1:
+			{
+				SSNPRecvUnreliableSegmentData *pData = segments.Find( nMsgNum, nOffset );
+				CHECK_EQUAL( pData != nullptr, model.count( MapKey( nMsgNum, nOffset ) ) > 0 );
+				if ( pData )
+				{
+					CHECK_EQUAL( pData->m_cbSegSize, model[ MapKey( nMsgNum, nOffset ) ] );
+				}
+				else if ( !segments.Full() )
+				{
+					pData = segments.Insert( nMsgNum, nOffset );
+					pData->m_cbSegSize = int( rand() % 1000 );
+					model[ MapKey( nMsgNum, nOffset ) ] = pData->m_cbSegSize;
+				}
+				break;
+			}
+
+			case 2:
+				if ( segments.Count() > 0 )
+				{
+					int64 nOldest = segments.RemoveOldestMessage();
+					CHECK_EQUAL( nOldest, model.begin()->first.m_nMsgNum );
+					while ( !model.empty() && model.begin()->first.m_nMsgNum == nOldest )
+						model.erase( model.begin() );
+				}
+				break;
+
+			case 3:
+			{
+				SSNPRecvUnreliableSegmentSlab::Segment arSegs[ SSNPRecvUnreliableSegmentSlab::k_nCapacity ];
+				int nSegs = segments.GetMessageSegments( nMsgNum, arSegs );
+				auto it = model.lower_bound( MapKey( nMsgNum, INT_MIN ) );
+				for ( int j = 0 ; j < nSegs ; ++j, ++it )
+				{
+					CHECK( it != model.end() && it->first.m_nMsgNum == nMsgNum );
+					CHECK_EQUAL( arSegs[j].m_nOffset, it->first.m_nOffset );
+					CHECK_EQUAL( arSegs[j].m_pData->m_cbSegSize, it->second );
+				}
+				CHECK( it == model.end() || it->first.m_nMsgNum != nMsgNum );
+				if ( rand() % 2 )
+				{
+					segments.RemoveMessage( nMsgNum );
+					model.erase( model.lower_bound( MapKey( nMsgNum, INT_MIN ) ), model.lower_bound( MapKey( nMsgNum+1, INT_MIN ) ) );
+				}
+				break;
+			}
+		}
+		CHECK_EQUAL( segments.Count(), (int)model.size() );
+	}
+}
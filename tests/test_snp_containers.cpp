@@ -0,0 +1,274 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <random>
+
+#include <steamnetworkingsockets/clientlib/steamnetworkingsockets_snp.h>
+
+#include "test_check.h"
+
+using namespace SteamNetworkingSocketsLib;
+
+typedef std::map<int64,int> Model;
+
+// Walk the container forwards and backwards, and make sure
+// it has exactly what the model has, in order
+template <typename TContainer>
+static void CheckMatchesModel( TContainer &c, const Model &model )
+{
+	CHECK_EQUAL( c.size(), model.size() );
+	CHECK_EQUAL( c.empty(), model.empty() );
+
+	auto itModel = model.begin();
+	for ( auto it = c.begin() ; it != c.end() ; ++it, ++itModel )
+	{
+		CHECK( itModel != model.end() );
+		if ( itModel == model.end() )
+			return;
+		CHECK_EQUAL( it->first, itModel->first );
+		CHECK_EQUAL( it->second, itModel->second );
+	}
+	CHECK( itModel == model.end() );
+
+	auto it = c.end();
+	for ( auto itModelRev = model.rbegin() ; itModelRev != model.rend() ; ++itModelRev )
+	{
+		--it;
+		CHECK_EQUAL( it->first, itModelRev->first );
+	}
+	CHECK( it == c.begin() );
+}
+
+template <typename TContainer>
+static void CheckUpperBound( TContainer &c, const Model &model, int64 nKey )
+{
+	auto it = c.upper_bound( nKey );
+	auto itModel = model.upper_bound( nKey );
+	if ( itModel == model.end() )
+	{
+		CHECK( it == c.end() );
+	}
+	else
+	{
+		CHECK( it != c.end() );
+		if ( it != c.end() )
+			CHECK_EQUAL( it->first, itModel->first );
+	}
+}
+
+// Erase a random subset while iterating, the way we retire in flight
+// packets and packet gaps
+template <typename TContainer>
+static void EraseWhileIterating( std::mt19937_64 &rand, TContainer &c, Model &model, int nOneIn )
+{
+	for ( auto it = c.begin() ; it != c.end() ; )
+	{
+		if ( rand() % nOneIn == 0 )
+		{
+			int64 nKey = it->first;
+			auto itNext = model.upper_bound( nKey );
+			model.erase( nKey );
+			it = c.erase( it );
+			if ( itNext == model.end() )
+				CHECK( it == c.end() );
+			else
+				CHECK( it != c.end() && it->first == itNext->first );
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+// The in flight packet ring.  Use it like a send window sliding along:
+// packets get inserted at the end, and retired mostly from the front.
+// The window slides around the ring many times, and sometimes opens up
+// wide enough that the ring has to grow.
+static void TestPacketNumRing( std::mt19937_64 &rand )
+{
+	CSNPPacketNumRing<int> ring;
+	Model model;
+
+	// Sentinel, like the in flight list always has
+	ring.insert( std::make_pair( INT64_MIN, -1 ) );
+	model[ INT64_MIN ] = -1;
+	CheckMatchesModel( ring, model );
+
+	// Start up near where the ring will wrap
+	int64 nNextPktNum = 60;
+	int nMaxWindow = 32;
+	for ( int iStep = 0 ; iStep < 200000 ; ++iStep )
+	{
+		// Every now and then, open up or close down the window
+		if ( iStep % 5000 == 0 )
+			nMaxWindow = ( rand() % 3 == 0 ) ? 2000 : 1 + int( rand() % 60 );
+
+		// Send some packets
+		int nSend = int( rand() % 4 );
+		for ( int i = 0 ; i < nSend ; ++i )
+		{
+			int nValue = int( rand() );
+			auto result = ring.insert( std::make_pair( nNextPktNum, nValue ) );
+			CHECK( result.second );
+			CHECK_EQUAL( result.first->first, nNextPktNum );
+			model[ nNextPktNum ] = nValue;
+
+			// Sometimes we skip a packet number
+			nNextPktNum += ( rand() % 8 == 0 ) ? 2 : 1;
+		}
+
+		// Duplicate insert is rejected, and doesn't change anything
+		if ( model.size() > 1 && rand() % 16 == 0 )
+		{
+			auto itLast = model.rbegin();
+			auto result = ring.insert( std::make_pair( itLast->first, 12345 ) );
+			CHECK( !result.second );
+			CHECK_EQUAL( result.first->second, itLast->second );
+		}
+
+		// Retire old packets from the front
+		while ( model.size() > 1 && nNextPktNum - std::next( model.begin() )->first > nMaxWindow )
+		{
+			auto it = ring.lower_bound( std::next( model.begin() )->first );
+			CHECK_EQUAL( it->first, std::next( model.begin() )->first );
+			ring.erase( it );
+			model.erase( std::next( model.begin() ) );
+		}
+
+		// Acks for random packets in the middle
+		if ( rand() % 8 == 0 )
+			EraseWhileIterating( rand, ring, model, 8 );
+
+		// Search for random keys, including ones that are before, after,
+		// and in the middle of what we have
+		for ( int i = 0 ; i < 2 ; ++i )
+		{
+			int64 nKey = nNextPktNum - int64( rand() % ( nMaxWindow + 10 ) );
+			CheckUpperBound( ring, model, nKey );
+		}
+
+		if ( iStep % 97 == 0 )
+			CheckMatchesModel( ring, model );
+	}
+	CheckMatchesModel( ring, model );
+
+	// Iterators are just the packet number, so they survive growth
+	{
+		auto it = ring.lower_bound( nNextPktNum-1 );
+		if ( it == ring.end() )
+		{
+			ring.insert( std::make_pair( nNextPktNum, 7 ) );
+			model[ nNextPktNum ] = 7;
+			it = ring.lower_bound( nNextPktNum );
+			++nNextPktNum;
+		}
+		int64 nKey = it->first;
+		int nValue = it->second;
+		for ( int i = 0 ; i < 10000 ; ++i, ++nNextPktNum )
+		{
+			ring.insert( std::make_pair( nNextPktNum, i ) );
+			model[ nNextPktNum ] = i;
+		}
+		CHECK_EQUAL( it->first, nKey );
+		CHECK_EQUAL( it->second, nValue );
+		CheckMatchesModel( ring, model );
+	}
+
+	// Erase everything, including the sentinel, by iterating
+	EraseWhileIterating( rand, ring, model, 1 );
+	CHECK( ring.empty() );
+	CheckMatchesModel( ring, model );
+
+	// Should be able to start over way out somewhere else
+	ring.insert( std::make_pair( 1000000000000ll, 1 ) );
+	ring.insert( std::make_pair( 1000000000000ll + 63, 2 ) );
+	ring.insert( std::make_pair( 1000000000000ll + 64, 3 ) );
+	model[ 1000000000000ll ] = 1;
+	model[ 1000000000000ll + 63 ] = 2;
+	model[ 1000000000000ll + 64 ] = 3;
+	CheckMatchesModel( ring, model );
+
+	ring.clear();
+	CHECK( ring.empty() );
+}
+
+// The packet gap list.  Mostly items are added near the end, but they can
+// go anywhere
+static void TestPacketNumList( std::mt19937_64 &rand )
+{
+	CSNPPacketNumList<int> list;
+	Model model;
+
+	for ( int iStep = 0 ; iStep < 200000 ; ++iStep )
+	{
+		int64 nBase = iStep / 16;
+		switch ( rand() % 4 )
+		{
+			case 0:
+			case 1:
+			{
+				// Insert, usually near the end
+				int64 nKey = nBase + int64( rand() % 32 ) - ( rand() % 8 == 0 ? 64 : 0 );
+				int nValue = int( rand() );
+				auto result = list.insert( std::make_pair( nKey, nValue ) );
+				bool bNew = model.find( nKey ) == model.end();
+				CHECK_EQUAL( result.second, bNew );
+				CHECK_EQUAL( result.first->first, nKey );
+				if ( bNew )
+					model[ nKey ] = nValue;
+				CHECK_EQUAL( result.first->second, model[ nKey ] );
+				break;
+			}
+
+			case 2:
+				// Erase some, while iterating.  Keep the list from growing too
+				// big, so the free list gets used
+				EraseWhileIterating( rand, list, model, model.size() > 40 ? 2 : 8 );
+				break;
+
+			case 3:
+				CheckUpperBound( list, model, nBase + int64( rand() % 48 ) - 16 );
+				break;
+		}
+
+		if ( !model.empty() )
+			CHECK_EQUAL( list.back().first, model.rbegin()->first );
+		if ( iStep % 97 == 0 )
+			CheckMatchesModel( list, model );
+	}
+	CheckMatchesModel( list, model );
+
+	// Grow it a lot.  Iterators are the node index, so should survive
+	auto it = list.begin();
+	if ( it != list.end() )
+	{
+		int64 nKey = it->first;
+		for ( int i = 0 ; i < 5000 ; ++i )
+		{
+			list.insert( std::make_pair( 1000000 + i, i ) );
+			model[ 1000000 + i ] = i;
+		}
+		CHECK_EQUAL( it->first, nKey );
+		CheckMatchesModel( list, model );
+	}
+
+	EraseWhileIterating( rand, list, model, 1 );
+	CHECK( list.empty() );
+	CheckMatchesModel( list, model );
+
+	list.insert( std::make_pair( 5, 5 ) );
+	list.clear();
+	model.clear();
+	CheckMatchesModel( list, model );
+	list.insert( std::make_pair( 3, 3 ) );
+	model[ 3 ] = 3;
+	CheckMatchesModel( list, model );
+}
+
+void Test_snp_packetnum_containers()
+{
+	std::mt19937_64 rand( 12345 );
+	TestPacketNumRing( rand );
+	TestPacketNumList( rand );
+}
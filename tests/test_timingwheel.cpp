@@ -0,0 +1,257 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <tier0/platform.h>
+#include <tier1/utlpriorityqueue.h>
+#include <tier1/utltimingwheel.h>
+
+#include "test_check.h"
+
+// Something that looks like a thinker, that can be in either container
+struct BenchThinker
+{
+	int64 m_usecTime = 0;
+	int m_nIndex = 0;
+	int m_nTimesExpired = 0;
+	int m_queueIndex = -1;
+	CUtlTimingWheelLinks<BenchThinker> m_links;
+};
+
+struct BenchThinkerLess
+{
+	bool operator()( const BenchThinker *a, const BenchThinker *b ) const { return a->m_usecTime > b->m_usecTime; }
+};
+struct BenchThinkerSetIndex
+{
+	static void SetIndex( BenchThinker *p, int idx, void *pContext ) { p->m_queueIndex = idx; }
+};
+struct BenchThinkerTraits
+{
+	static CUtlTimingWheelLinks<BenchThinker> &Links( BenchThinker *p ) { return p->m_links; }
+	static int64 Time( const BenchThinker *p ) { return p->m_usecTime; }
+};
+
+typedef CUtlPriorityQueue<BenchThinker*,BenchThinkerLess,BenchThinkerSetIndex> BenchHeap;
+typedef CUtlTimingWheel<BenchThinker,BenchThinkerTraits,10> BenchWheel;
+
+// Cheap deterministic hash, so that the schedule doesn't depend
+// on the order that ties are processed in
+static uint32 Hash( uint32 x )
+{
+	x ^= x >> 16; x *= 0x7feb352d;
+	x ^= x >> 15; x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+// Next think time after a thinker fires.  Mostly short intervals
+// (like the retry and pacing timers on an active connection), with
+// occasional long ones (like keepalives)
+static int64 NextThinkInterval( const BenchThinker &t )
+{
+	uint32 h = Hash( t.m_nIndex * 7919u + t.m_nTimesExpired );
+	if ( h % 8 == 0 )
+		return 1000000 + h % 9000000;
+	return 1 + h % 100000;
+}
+
+struct SimResult_t
+{
+	int64 m_nExpired = 0;
+	int64 m_nRescheduled = 0;
+	int64 m_nTimeHash = 0;
+	int64 m_usecElapsed = 0;
+};
+
+// Simulate the service thread with nThinkers scheduled.  Every step, all
+// thinkers that are due fire and reschedule themselves, and some random
+// thinkers get rescheduled (like what happens when packets arrive).
+// bWheel selects which container to use.
+static SimResult_t RunSimulation( int nThinkers, int nSteps, bool bWheel )
+{
+	const int64 k_usecStep = 250;
+	int64 usecNow = 1000000000ll;
+
+	BenchThinker *pThinkers = new BenchThinker[ nThinkers ];
+	BenchHeap heap;
+	BenchWheel wheel;
+	SimResult_t result;
+
+	for ( int i = 0 ; i < nThinkers ; ++i )
+	{
+		pThinkers[i].m_nIndex = i;
+		pThinkers[i].m_usecTime = usecNow + NextThinkInterval( pThinkers[i] );
+		if ( bWheel )
+			wheel.Insert( &pThinkers[i] );
+		else
+			heap.Insert( &pThinkers[i] );
+	}
+
+	uint32 nRandSeed = 12345;
+	int nReschedulePerStep = nThinkers / 100 + 1;
+
+	int64 usecStart = Plat_USTime();
+	for ( int iStep = 0 ; iStep < nSteps ; ++iStep )
+	{
+		usecNow += k_usecStep;
+
+		// Process everybody who is due
+		if ( bWheel )
+		{
+			wheel.CollectExpired( usecNow );
+			while ( BenchThinker *p = wheel.GetExpiredHead() )
+			{
+				result.m_nTimeHash += p->m_usecTime;
+				++result.m_nExpired;
+				wheel.Remove( p );
+				++p->m_nTimesExpired;
+				p->m_usecTime = usecNow + NextThinkInterval( *p );
+				wheel.Insert( p );
+			}
+		}
+		else
+		{
+			while ( heap.Count() > 0 && heap.ElementAtHead()->m_usecTime < usecNow )
+			{
+				BenchThinker *p = heap.ElementAtHead();
+				result.m_nTimeHash += p->m_usecTime;
+				++result.m_nExpired;
+				heap.RemoveAtHead();
+				++p->m_nTimesExpired;
+				p->m_usecTime = usecNow + NextThinkInterval( *p );
+				heap.Insert( p );
+			}
+		}
+
+		// Packets arrived for some random connections, and
+		// they want to think a bit sooner
+		for ( int i = 0 ; i < nReschedulePerStep ; ++i )
+		{
+			nRandSeed = Hash( nRandSeed + i );
+			BenchThinker *p = &pThinkers[ nRandSeed % nThinkers ];
+			int64 usecNewTime = usecNow + 1 + ( nRandSeed >> 8 ) % 5000;
+			if ( usecNewTime >= p->m_usecTime )
+				continue;
+			++result.m_nRescheduled;
+			if ( bWheel )
+			{
+				wheel.Remove( p );
+				p->m_usecTime = usecNewTime;
+				wheel.Insert( p );
+			}
+			else
+			{
+				p->m_usecTime = usecNewTime;
+				heap.RevaluateElement( p->m_queueIndex );
+			}
+		}
+
+		// Service thread asks when it needs to wake up
+		if ( bWheel )
+		{
+			int64 usecWake = wheel.GetNextTime();
+			CHECK( usecWake >= usecNow );
+		}
+		else
+		{
+			int64 usecWake = heap.ElementAtHead()->m_usecTime;
+			CHECK( usecWake >= usecNow );
+		}
+	}
+	result.m_usecElapsed = Plat_USTime() - usecStart;
+
+	if ( bWheel )
+		wheel.RemoveAll();
+	delete[] pThinkers;
+	return result;
+}
+
+// Schedule a bunch of random times, including far future times, times
+// in the past, and ties, and make sure they come out of the wheel in order,
+// never early, and that the next time is exact.
+void Test_timingwheel()
+{
+	const int k_nThinkers = 5000;
+	BenchThinker *pThinkers = new BenchThinker[ k_nThinkers ];
+	BenchWheel wheel;
+
+	int64 usecNow = 5000000000ll;
+	wheel.CollectExpired( usecNow );
+	for ( int i = 0 ; i < k_nThinkers ; ++i )
+	{
+		uint32 h = Hash( i );
+		switch ( h % 5 )
+		{
+			case 0: pThinkers[i].m_usecTime = usecNow - h % 10000; break;
+			case 1: pThinkers[i].m_usecTime = usecNow + h % 1000; break;
+			case 2: pThinkers[i].m_usecTime = usecNow + h % 100000000; break;
+			case 3: pThinkers[i].m_usecTime = usecNow + ( (int64)h << 20 ); break; // Way out in the future
+			default: pThinkers[i].m_usecTime = usecNow + ( h % 100 ) * 1000; break; // Lots of ties
+		}
+		wheel.Insert( &pThinkers[i] );
+	}
+	CHECK_EQUAL( wheel.Count(), k_nThinkers );
+
+	// Remove some, to exercise unlinking from the middle of lists
+	for ( int i = 0 ; i < k_nThinkers ; i += 7 )
+		wheel.Remove( &pThinkers[i] );
+
+	int nExpected = wheel.Count();
+	int nExpired = 0;
+	int64 usecLastExpired = INT64_MIN;
+	while ( wheel.Count() > 0 )
+	{
+		int64 usecNext = wheel.GetNextTime();
+		int64 usecNextExpected = INT64_MAX;
+		for ( int i = 0 ; i < k_nThinkers ; ++i )
+		{
+			if ( BenchWheel::IsInWheel( &pThinkers[i] ) )
+				usecNextExpected = std::min( usecNextExpected, pThinkers[i].m_usecTime );
+		}
+		CHECK_EQUAL( usecNext, usecNextExpected );
+
+		// Jump ahead, sometimes by a lot
+		uint32 h = Hash( nExpired + (uint32)usecNow );
+		usecNow += ( h % 4 == 0 ) ? ( (int64)h << 12 ) : h % 3000;
+
+		wheel.CollectExpired( usecNow );
+		bool bFirst = true;
+		while ( BenchThinker *p = wheel.GetExpiredHead() )
+		{
+			CHECK( p->m_usecTime < usecNow );
+			CHECK( p->m_usecTime >= usecLastExpired );
+			if ( bFirst )
+				CHECK_EQUAL( p->m_usecTime, usecNext );
+			bFirst = false;
+			usecLastExpired = p->m_usecTime;
+			wheel.Remove( p );
+			++nExpired;
+		}
+		if ( wheel.Count() > 0 )
+			CHECK( wheel.GetNextTime() >= usecNow );
+	}
+	CHECK_EQUAL( nExpired, nExpected );
+
+	delete[] pThinkers;
+}
+
+// Compare the wheel against the heap for a thinker-like workload
+void Test_timingwheel_perf()
+{
+	const int k_nSteps = 4000; // One second of simulated time
+	for ( int nThinkers: { 1000, 10000, 100000 } )
+	{
+		SimResult_t heap = RunSimulation( nThinkers, k_nSteps, false );
+		SimResult_t wheel = RunSimulation( nThinkers, k_nSteps, true );
+
+		// Both should have done exactly the same work
+		CHECK_EQUAL( heap.m_nExpired, wheel.m_nExpired );
+		CHECK_EQUAL( heap.m_nRescheduled, wheel.m_nRescheduled );
+		CHECK_EQUAL( heap.m_nTimeHash, wheel.m_nTimeHash );
+
+		int64 nOps = heap.m_nExpired + heap.m_nRescheduled;
+		printf( "\t%6d thinkers, %lld expirations, %lld reschedules\n", nThinkers, (long long)heap.m_nExpired, (long long)heap.m_nRescheduled );
+		printf( "\t\tHeap:\t%8lld usec (%.1f nsec/op)\n", (long long)heap.m_usecElapsed, heap.m_usecElapsed * 1000.0 / nOps );
+		printf( "\t\tWheel:\t%8lld usec (%.1f nsec/op)\n", (long long)wheel.m_usecElapsed, wheel.m_usecElapsed * 1000.0 / nOps );
+	}
+}
@@ -0,0 +1,346 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <random>
+
+#include <steamnetworkingsockets/clientlib/steamnetworkingsockets_udp.h>
+#include <crypto.h>
+
+#include "test_check.h"
+
+using namespace SteamNetworkingSocketsLib;
+
+// Random value with a random number of significant bits, so that
+// we get all the different varint lengths
+static uint64 RandomValue( std::mt19937_64 &rand, int nMaxBits = 64 )
+{
+	int nBits = int( rand() % ( nMaxBits + 1 ) );
+	if ( nBits == 0 )
+		return 0;
+	uint64 x = rand();
+	if ( nBits < 64 )
+		x &= ( (uint64)1 << nBits ) - 1;
+	return x;
+}
+
+static void RandomChallengeRequest( std::mt19937_64 &rand, CMsgSteamSockets_UDP_ChallengeRequest &msg, bool bAllFields )
+{
+	if ( bAllFields || rand() & 1 ) msg.set_connection_id( uint32( RandomValue( rand, 32 ) ) );
+	if ( bAllFields || rand() & 1 ) msg.set_my_timestamp( RandomValue( rand ) );
+	if ( bAllFields || rand() & 1 ) msg.set_protocol_version( uint32( RandomValue( rand, 32 ) ) );
+}
+
+static void RandomChallengeReply( std::mt19937_64 &rand, CMsgSteamSockets_UDP_ChallengeReply &msg, bool bAllFields )
+{
+	if ( bAllFields || rand() & 1 ) msg.set_connection_id( uint32( RandomValue( rand, 32 ) ) );
+	if ( bAllFields || rand() & 1 ) msg.set_challenge( RandomValue( rand ) );
+	if ( bAllFields || rand() & 1 ) msg.set_your_timestamp( RandomValue( rand ) );
+	if ( bAllFields || rand() & 1 ) msg.set_protocol_version( uint32( RandomValue( rand, 32 ) ) );
+}
+
+static void RandomConnectRequest( std::mt19937_64 &rand, CMsgSteamSockets_UDP_ConnectRequest &msg )
+{
+	if ( rand() & 1 ) msg.set_client_connection_id( uint32( RandomValue( rand, 32 ) ) );
+	if ( rand() & 1 ) msg.set_challenge( RandomValue( rand ) );
+	if ( rand() & 1 ) msg.set_my_timestamp( RandomValue( rand ) );
+	if ( rand() & 1 ) msg.set_ping_est_ms( uint32( RandomValue( rand, 32 ) ) );
+	if ( rand() & 1 ) msg.set_legacy_client_steam_id( RandomValue( rand ) );
+	if ( rand() & 1 ) msg.set_identity_string( std::string( rand() % 300, 'x' ) );
+	if ( rand() & 1 ) msg.mutable_cert()->set_cert( std::string( rand() % 200, 'c' ) );
+	if ( rand() & 1 ) msg.mutable_crypt()->set_signature( std::string( 64, 's' ) );
+}
+
+// Append a field that none of the messages know about.  (Parsing one
+// message type as another gives us known fields with the wrong wire type.)
+static void AppendUnknownField( std::mt19937_64 &rand, std::string &s )
+{
+	byte buf[ 32 ];
+	byte *p = buf;
+	uint32 nField = 16 + uint32( rand() % 16 );
+	if ( rand() & 1 )
+		nField = 16 + uint32( RandomValue( rand, 28 ) % ( ( 1 << 29 ) - 16 ) );
+	switch ( rand() % 4 )
+	{
+		case 0:
+			p = SerializeVarInt( p, ( nField << 3 ) | 0 );
+			p = SerializeVarInt( p, RandomValue( rand ) );
+			break;
+		case 1:
+			p = SerializeVarInt( p, ( nField << 3 ) | 1 );
+			for ( int i = 0 ; i < 8 ; ++i ) *(p++) = byte( rand() );
+			break;
+		case 2:
+		{
+			p = SerializeVarInt( p, ( nField << 3 ) | 2 );
+			int cb = int( rand() % 16 );
+			p = SerializeVarInt( p, uint32( cb ) );
+			for ( int i = 0 ; i < cb ; ++i ) *(p++) = byte( rand() );
+			break;
+		}
+		default:
+			p = SerializeVarInt( p, ( nField << 3 ) | 5 );
+			for ( int i = 0 ; i < 4 ; ++i ) *(p++) = byte( rand() );
+			break;
+	}
+	s.append( (const char *)buf, p - buf );
+}
+
+// With all the fields set, we should produce exactly the same bytes
+// as protobuf does
+static void TestSerializeMatchesProtobuf( std::mt19937_64 &rand, int nIterations )
+{
+	for ( int i = 0 ; i < nIterations ; ++i )
+	{
+		CMsgSteamSockets_UDP_ChallengeRequest msgReq;
+		RandomChallengeRequest( rand, msgReq, true );
+		ChallengeRequestMsg_t req;
+		req.m_unConnectionID = msgReq.connection_id();
+		req.m_ulMyTimestamp = msgReq.my_timestamp();
+		req.m_nProtocolVersion = msgReq.protocol_version();
+		uint8 buf[ 64 ];
+		uint8 *pEnd = req.SerializeToArray( buf );
+		CHECK( pEnd - buf <= ChallengeRequestMsg_t::k_cbMaxSerializedSize );
+		CHECK( std::string( (const char *)buf, pEnd - buf ) == msgReq.SerializeAsString() );
+
+		CMsgSteamSockets_UDP_ChallengeReply msgReply;
+		RandomChallengeReply( rand, msgReply, true );
+		ChallengeReplyMsg_t reply;
+		reply.m_unConnectionID = msgReply.connection_id();
+		reply.m_ulChallenge = msgReply.challenge();
+		reply.m_ulYourTimestamp = msgReply.your_timestamp();
+		reply.m_nProtocolVersion = msgReply.protocol_version();
+		pEnd = reply.SerializeToArray( buf );
+		CHECK( pEnd - buf <= ChallengeReplyMsg_t::k_cbMaxSerializedSize );
+		CHECK( std::string( (const char *)buf, pEnd - buf ) == msgReply.SerializeAsString() );
+	}
+}
+
+// Parse messages serialized by protobuf, with random subsets of the fields,
+// unknown fields mixed in, and fields repeated.  Both parsers should get
+// the same values.
+static void TestParseMatchesProtobuf( std::mt19937_64 &rand, int nIterations )
+{
+	for ( int i = 0 ; i < nIterations ; ++i )
+	{
+		std::string s;
+		int nChunks = int( rand() % 4 );
+		for ( int j = 0 ; j <= nChunks ; ++j )
+		{
+			if ( rand() % 3 == 0 )
+				AppendUnknownField( rand, s );
+			switch ( i % 3 )
+			{
+				case 0: { CMsgSteamSockets_UDP_ChallengeRequest m; RandomChallengeRequest( rand, m, false ); s += m.SerializeAsString(); } break;
+				case 1: { CMsgSteamSockets_UDP_ChallengeReply m; RandomChallengeReply( rand, m, false ); s += m.SerializeAsString(); } break;
+				case 2: { CMsgSteamSockets_UDP_ConnectRequest m; RandomConnectRequest( rand, m ); s += m.SerializeAsString(); } break;
+			}
+		}
+
+		CMsgSteamSockets_UDP_ChallengeRequest msgReq;
+		ChallengeRequestMsg_t req;
+		CHECK( msgReq.ParseFromString( s ) );
+		CHECK( req.ParseFromArray( s.data(), int( s.length() ) ) );
+		CHECK_EQUAL( req.m_unConnectionID, msgReq.connection_id() );
+		CHECK_EQUAL( req.m_ulMyTimestamp, msgReq.my_timestamp() );
+		CHECK_EQUAL( req.m_nProtocolVersion, msgReq.protocol_version() );
+
+		CMsgSteamSockets_UDP_ChallengeReply msgReply;
+		ChallengeReplyMsg_t reply;
+		CHECK( msgReply.ParseFromString( s ) );
+		CHECK( reply.ParseFromArray( s.data(), int( s.length() ) ) );
+		CHECK_EQUAL( reply.m_unConnectionID, msgReply.connection_id() );
+		CHECK_EQUAL( reply.m_ulChallenge, msgReply.challenge() );
+		CHECK_EQUAL( reply.m_ulYourTimestamp, msgReply.your_timestamp() );
+		CHECK_EQUAL( reply.m_nProtocolVersion, msgReply.protocol_version() );
+
+		// Only check the connect request when it's really one of those.
+		// The other messages put a varint in field 4, which is the cert.
+		if ( i % 3 == 2 )
+		{
+			CMsgSteamSockets_UDP_ConnectRequest msgConnect;
+			ConnectRequestHeader_t hdr;
+			CHECK( msgConnect.ParseFromString( s ) );
+			CHECK( hdr.ParseFromArray( s.data(), int( s.length() ) ) );
+			CHECK_EQUAL( hdr.m_unClientConnectionID, msgConnect.client_connection_id() );
+			CHECK_EQUAL( hdr.m_ulChallenge, msgConnect.challenge() );
+		}
+	}
+}
+
+// Feed in garbage.  Mostly we are making sure we don't crash or read past
+// the end.  (Run with the sanitizers!)  If both parsers are happy, they
+// had better agree.
+static void TestParseGarbage( std::mt19937_64 &rand, int nIterations )
+{
+	int nBothOK = 0;
+	for ( int i = 0 ; i < nIterations ; ++i )
+	{
+		std::string s;
+		int nChunks = int( rand() % 6 );
+		for ( int j = 0 ; j < nChunks ; ++j )
+		{
+			switch ( rand() % 3 )
+			{
+				case 0: AppendUnknownField( rand, s ); break;
+				case 1: { CMsgSteamSockets_UDP_ChallengeReply m; RandomChallengeReply( rand, m, false ); s += m.SerializeAsString(); } break;
+				case 2:
+				{
+					int cb = int( rand() % 8 );
+					for ( int k = 0 ; k < cb ; ++k )
+						s += char( rand() );
+				}
+			}
+		}
+
+		// Chop it off somewhere, and maybe flip a bit
+		if ( !s.empty() )
+		{
+			if ( rand() & 1 )
+				s.resize( rand() % s.length() );
+			if ( !s.empty() && ( rand() & 1 ) )
+				s[ rand() % s.length() ] ^= char( 1 << ( rand() % 8 ) );
+		}
+
+		// Copy it into a buffer that is exactly the right size,
+		// so that the sanitizers can catch any overrun
+		std::vector<char> buf( s.begin(), s.end() );
+		const char *pData = buf.empty() ? nullptr : buf.data();
+		int cbData = int( buf.size() );
+
+		CMsgSteamSockets_UDP_ChallengeReply msgReply;
+		ChallengeReplyMsg_t reply;
+		bool bProtobufOK = msgReply.ParseFromArray( pData, cbData );
+		if ( reply.ParseFromArray( pData, cbData ) && bProtobufOK )
+		{
+			++nBothOK;
+			CHECK_EQUAL( reply.m_unConnectionID, msgReply.connection_id() );
+			CHECK_EQUAL( reply.m_ulChallenge, msgReply.challenge() );
+			CHECK_EQUAL( reply.m_ulYourTimestamp, msgReply.your_timestamp() );
+			CHECK_EQUAL( reply.m_nProtocolVersion, msgReply.protocol_version() );
+		}
+
+		ChallengeRequestMsg_t req;
+		req.ParseFromArray( pData, cbData );
+		ConnectRequestHeader_t hdr;
+		hdr.ParseFromArray( pData, cbData );
+	}
+	CHECK( nBothOK > 0 );
+}
+
+// What a listen socket does with a challenge request from an unknown
+// host, minus the system calls: parse the padded packet, compute the
+// challenge, and serialize the reply.  Returns the challenge, so the
+// compiler can't throw the work away.
+static const CCrypto::SipHashKey_t k_challengeSecret = { 0x0123456789abcdefull, 0xfedcba9876543210ull };
+
+static uint64 ComputeChallenge( uint32 nConnectionID )
+{
+	#pragma pack(push,1)
+	struct
+	{
+		uint16 nTime;
+		uint16 nPort;
+		uint8 ipv6[16];
+	} data;
+	#pragma pack(pop)
+	memset( &data, 0, sizeof(data) );
+	data.nTime = 1234;
+	data.nPort = 27015;
+	memcpy( data.ipv6, &nConnectionID, sizeof(nConnectionID) );
+	return CCrypto::SipHash( &data, sizeof(data), k_challengeSecret );
+}
+
+static uint64 ChallengeReplyProtobuf( const uint8 *pPkt, int cbPkt, uint8 *pReply, int &cbReply )
+{
+	const UDPPaddedMessageHdr *hdr = (const UDPPaddedMessageHdr *)pPkt;
+	CMsgSteamSockets_UDP_ChallengeRequest msg;
+	if ( !msg.ParseFromArray( hdr+1, LittleWord( hdr->m_nMsgLength ) ) )
+		return 0;
+	uint64 nChallenge = ComputeChallenge( msg.connection_id() );
+	CMsgSteamSockets_UDP_ChallengeReply msgReply;
+	msgReply.set_connection_id( msg.connection_id() );
+	msgReply.set_challenge( nChallenge );
+	msgReply.set_your_timestamp( msg.my_timestamp() );
+	msgReply.set_protocol_version( k_nCurrentProtocolVersion );
+	pReply[0] = k_ESteamNetworkingUDPMsg_ChallengeReply;
+	cbReply = ProtoMsgByteSize( msgReply )+1;
+	msgReply.SerializeWithCachedSizesToArray( pReply+1 );
+	return nChallenge;
+}
+
+static uint64 ChallengeReplyFast( const uint8 *pPkt, int cbPkt, uint8 *pReply, int &cbReply )
+{
+	const UDPPaddedMessageHdr *hdr = (const UDPPaddedMessageHdr *)pPkt;
+	ChallengeRequestMsg_t msg;
+	if ( !msg.ParseFromArray( hdr+1, LittleWord( hdr->m_nMsgLength ) ) )
+		return 0;
+	uint64 nChallenge = ComputeChallenge( msg.m_unConnectionID );
+	ChallengeReplyMsg_t msgReply;
+	msgReply.m_unConnectionID = msg.m_unConnectionID;
+	msgReply.m_ulChallenge = nChallenge;
+	msgReply.m_ulYourTimestamp = msg.m_ulMyTimestamp;
+	msgReply.m_nProtocolVersion = k_nCurrentProtocolVersion;
+	pReply[0] = k_ESteamNetworkingUDPMsg_ChallengeReply;
+	cbReply = int( msgReply.SerializeToArray( pReply+1 ) - pReply );
+	return nChallenge;
+}
+
+void Test_udp_handshake_perf()
+{
+	std::mt19937_64 rand( 12345 );
+
+	// A batch of padded challenge requests, like a client would send
+	const int k_nPackets = 64;
+	static uint8 packets[ k_nPackets ][ k_cbSteamNetworkingMinPaddedPacketSize ];
+	for ( int i = 0 ; i < k_nPackets ; ++i )
+	{
+		CMsgSteamSockets_UDP_ChallengeRequest msg;
+		RandomChallengeRequest( rand, msg, true );
+		UDPPaddedMessageHdr *hdr = (UDPPaddedMessageHdr *)packets[i];
+		hdr->m_nMsgID = k_ESteamNetworkingUDPMsg_ChallengeRequest;
+		hdr->m_nMsgLength = LittleWord( uint16( ProtoMsgByteSize( msg ) ) );
+		msg.SerializeWithCachedSizesToArray( (uint8 *)( hdr+1 ) );
+	}
+
+	// Make sure they produce the same thing
+	for ( int i = 0 ; i < k_nPackets ; ++i )
+	{
+		uint8 replyProtobuf[ 64 ], replyFast[ 64 ];
+		int cbProtobuf = 0, cbFast = 0;
+		ChallengeReplyProtobuf( packets[i], sizeof(packets[i]), replyProtobuf, cbProtobuf );
+		ChallengeReplyFast( packets[i], sizeof(packets[i]), replyFast, cbFast );
+		CHECK_EQUAL( cbProtobuf, cbFast );
+		CHECK( memcmp( replyProtobuf, replyFast, cbFast ) == 0 );
+	}
+
+	const int k_nIterations = 20000;
+	uint64 nCheckProtobuf = 0, nCheckFast = 0;
+	uint8 reply[ 64 ];
+	int cbReply;
+
+	uint64 usecStart = Plat_USTime();
+	for ( int i = 0 ; i < k_nIterations ; ++i )
+		for ( int j = 0 ; j < k_nPackets ; ++j )
+			nCheckProtobuf += ChallengeReplyProtobuf( packets[j], sizeof(packets[j]), reply, cbReply ) + reply[ cbReply-1 ];
+	uint64 usecProtobuf = Plat_USTime() - usecStart;
+
+	usecStart = Plat_USTime();
+	for ( int i = 0 ; i < k_nIterations ; ++i )
+		for ( int j = 0 ; j < k_nPackets ; ++j )
+			nCheckFast += ChallengeReplyFast( packets[j], sizeof(packets[j]), reply, cbReply ) + reply[ cbReply-1 ];
+	uint64 usecFast = Plat_USTime() - usecStart;
+	CHECK_EQUAL( nCheckProtobuf, nCheckFast );
+
+	double flOps = double( k_nPackets ) * k_nIterations;
+	printf( "\tChallenge reply:\tprotobuf %.2f nsec (%.0f/sec/core)\tfast %.2f nsec (%.0f/sec/core)\n",
+		usecProtobuf * 1000.0 / flOps, flOps * 1e6 / std::max<uint64>( usecProtobuf, 1 ),
+		usecFast * 1000.0 / flOps, flOps * 1e6 / std::max<uint64>( usecFast, 1 ) );
+}
+
+void Test_udp_handshake()
+{
+	std::mt19937_64 rand( 12345 );
+	TestSerializeMatchesProtobuf( rand, 100000 );
+	TestParseMatchesProtobuf( rand, 100000 );
+	TestParseGarbage( rand, 1000000 );
+}
@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <random>
+
+#include <steamnetworkingsockets/steamnetworkingsockets_internal.h>
+
+#include "test_check.h"
+
+using namespace SteamNetworkingSocketsLib;
+
+// Random value with a random number of significant bits, so that
+// we get all the different encoded lengths
+template <typename T>
+static T RandomValue( std::mt19937_64 &rand )
+{
+	int nBits = int( rand() % ( sizeof(T)*8 + 1 ) );
+	if ( nBits == 0 )
+		return 0;
+	uint64 x = rand();
+	if ( nBits < 64 )
+		x &= ( (uint64)1 << nBits ) - 1;
+	return T( x );
+}
+
+// Encode random values, with varying amounts of space left in the buffer,
+// and make sure that we produce exactly the same bytes as the scalar codec,
+// and that we decode them back exactly the same.
+template <typename T>
+static void TestVarIntEquivalence( std::mt19937_64 &rand, int nIterations )
+{
+	for ( int i = 0 ; i < nIterations ; ++i )
+	{
+		T x = RandomValue<T>( rand );
+		int cbRoom = int( rand() % 16 );
+
+		byte bufScalar[ 16 ], bufFast[ 16 ];
+		memset( bufScalar, 0xcc, sizeof(bufScalar) );
+		memset( bufFast, 0xcc, sizeof(bufFast) );
+		byte *pEndScalar = SerializeVarIntScalar( bufScalar, x, bufScalar + cbRoom );
+		byte *pEndFast = SerializeVarInt( bufFast, x, bufFast + cbRoom );
+
+		// Should either both fail, or both write the same bytes
+		CHECK_EQUAL( pEndScalar == nullptr, pEndFast == nullptr );
+		if ( !pEndScalar || !pEndFast )
+		{
+			CHECK( VarIntSerializedSize( (uint64)x ) > cbRoom );
+			continue;
+		}
+		int cbEncoded = int( pEndScalar - bufScalar );
+		CHECK_EQUAL( cbEncoded, int( pEndFast - bufFast ) );
+		CHECK_EQUAL( cbEncoded, VarIntSerializedSize( (uint64)x ) );
+		CHECK( memcmp( bufScalar, bufFast, cbEncoded ) == 0 );
+
+		// Decode it, with different amounts of trailing data
+		for ( const byte *pEnd: { (const byte *)pEndScalar, (const byte *)bufScalar + cbRoom, (const byte *)bufScalar + sizeof(bufScalar) } )
+		{
+			T xScalar = 0, xFast = 0;
+			const byte *pDecodeScalar = DeserializeVarIntScalar( (const byte *)bufScalar, pEnd, xScalar );
+			const byte *pDecodeFast = DeserializeVarInt( (const byte *)bufScalar, pEnd, xFast );
+			CHECK( pDecodeScalar == pEndScalar );
+			CHECK( pDecodeFast == pEndScalar );
+			CHECK_EQUAL( xScalar, x );
+			CHECK_EQUAL( xFast, x );
+		}
+	}
+}
+
+// Decode random garbage, including truncated varints.  Anything the scalar
+// decoder accepts, the fast one should decode to the same value, and it
+// should reject exactly the same inputs.
+static void TestVarIntDecodeGarbage( std::mt19937_64 &rand, int nIterations )
+{
+	for ( int i = 0 ; i < nIterations ; ++i )
+	{
+		byte buf[ 16 ];
+		int cbBuf = int( rand() % ( sizeof(buf) + 1 ) );
+		int nProbContinue = int( rand() % 8 ); // Out of 8
+		for ( byte &b: buf )
+			b = byte( ( rand() & 0x7f ) | ( int( rand() % 8 ) < nProbContinue ? 0x80 : 0 ) );
+
+		// The scalar decoder doesn't handle more than 64 bits, so
+		// don't bother comparing varints longer than that
+		uint64 xScalar = 0, xFast = 0;
+		const byte *pScalar = DeserializeVarIntScalar( (const byte *)buf, buf + cbBuf, xScalar );
+		const byte *pFast = DeserializeVarInt( (const byte *)buf, buf + cbBuf, xFast );
+		CHECK( pScalar == pFast );
+		if ( pScalar && pScalar - buf <= 9 )
+			CHECK_EQUAL( xScalar, xFast );
+	}
+}
+
+// Encode and decode ack/nack counts shaped like what we see in practice.
+// Compare the time spent by the scalar and fast codecs.
+void Test_varint_perf()
+{
+	std::mt19937_64 rand( 12345 );
+	const int k_nValues = 1024*1024;
+	const int k_nIterations = 8;
+	static uint32 arValues[ k_nValues ];
+	for ( uint32 &x: arValues )
+	{
+		// Mostly values that take 1-3 bytes
+		int nBits = 7 + int( rand() % 15 );
+		x = uint32( rand() & ( ( 1U << nBits ) - 1 ) ) | ( 1U << ( nBits - 1 ) );
+	}
+
+	static byte bufScalar[ k_nValues*5 + 8 ], bufFast[ k_nValues*5 + 8 ];
+	const byte *pEndScalar = nullptr, *pEndFast = nullptr;
+	uint32 nCheckScalar = 0, nCheckFast = 0;
+
+	uint64 usecStart = Plat_USTime();
+	for ( int i = 0 ; i < k_nIterations ; ++i )
+	{
+		byte *p = bufScalar;
+		for ( uint32 x: arValues )
+			p = SerializeVarIntScalar( p, x, bufScalar + sizeof(bufScalar) );
+		pEndScalar = p;
+	}
+	uint64 usecEncodeScalar = Plat_USTime() - usecStart;
+
+	usecStart = Plat_USTime();
+	for ( int i = 0 ; i < k_nIterations ; ++i )
+	{
+		byte *p = bufFast;
+		for ( uint32 x: arValues )
+			p = SerializeVarInt( p, x, bufFast + sizeof(bufFast) );
+		pEndFast = p;
+	}
+	uint64 usecEncodeFast = Plat_USTime() - usecStart;
+	CHECK_EQUAL( pEndScalar - bufScalar, pEndFast - bufFast );
+	CHECK( memcmp( bufScalar, bufFast, pEndScalar - bufScalar ) == 0 );
+
+	usecStart = Plat_USTime();
+	for ( int i = 0 ; i < k_nIterations ; ++i )
+	{
+		const byte *p = bufScalar;
+		for ( int j = 0 ; j < k_nValues ; ++j )
+		{
+			uint32 x;
+			p = DeserializeVarIntScalar( p, pEndScalar, x );
+			nCheckScalar += x;
+		}
+	}
+	uint64 usecDecodeScalar = Plat_USTime() - usecStart;
+
+	usecStart = Plat_USTime();
+	for ( int i = 0 ; i < k_nIterations ; ++i )
+	{
+		const byte *p = bufScalar;
+		for ( int j = 0 ; j < k_nValues ; ++j )
+		{
+			uint32 x;
+			p = DeserializeVarInt( p, pEndScalar, x );
+			nCheckFast += x;
+		}
+	}
+	uint64 usecDecodeFast = Plat_USTime() - usecStart;
+	CHECK_EQUAL( nCheckScalar, nCheckFast );
+
+	double flOps = double( k_nValues ) * k_nIterations;
+	printf( "\tVarint encode:\tscalar %.2f nsec\tfast %.2f nsec\n", usecEncodeScalar * 1000.0 / flOps, usecEncodeFast * 1000.0 / flOps );
+	printf( "\tVarint decode:\tscalar %.2f nsec\tfast %.2f nsec\n", usecDecodeScalar * 1000.0 / flOps, usecDecodeFast * 1000.0 / flOps );
+}
+
+void Test_varint()
+{
+	std::mt19937_64 rand( 12345 );
+	TestVarIntEquivalence<uint16>( rand, 100000 );
+	TestVarIntEquivalence<uint32>( rand, 1000000 );
+	TestVarIntEquivalence<uint64>( rand, 1000000 );
+	TestVarIntDecodeGarbage( rand, 1000000 );
+}